@@ -0,0 +1,7 @@
+@echo off
+
+pushd %~dp0
+call build-platform.bat %1
+echo:
+call modules\snapshot\build.bat %1
+popd
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "common.h"
+#include "core.h"
+#include "file_map.h"
+#include "ray.h"
+#include "vec3.h"
+#include "vector.h"
+
+namespace sim {
+  struct HitRecord;
+  struct Hittable;
+  struct PrimHit;
+
+  struct Aabb {
+    Point3 lo, hi;
+
+    // Empty box, growing it with anything yields that thing's bounds.
+    Aabb() : lo(F64_INF, F64_INF, F64_INF), hi(-F64_INF, -F64_INF, -F64_INF) {}
+    Aabb(const Point3& lo, const Point3& hi) : lo(lo), hi(hi) {}
+
+    void grow(const Point3& p) {
+      lo = Point3(min(lo.x, p.x), min(lo.y, p.y), min(lo.z, p.z));
+      hi = Point3(max(hi.x, p.x), max(hi.y, p.y), max(hi.z, p.z));
+    }
+
+    // Growing with an empty box leaves this one as it is.
+    void grow(const Aabb& b) {
+      if (b.lo.x > b.hi.x)
+        return;
+      grow(b.lo);
+      grow(b.hi);
+    }
+
+    Point3 center() const {
+      return 0.5 * (lo + hi);
+    }
+
+    f64 surface_area() const {
+      Vec3 d = hi - lo;
+      if (d.x < 0.0 || d.y < 0.0 || d.z < 0.0)
+        return 0.0;
+      return 2.0 * (d.x*d.y + d.y*d.z + d.z*d.x);
+    }
+  };
+
+  // Deepest a node gets below the root, which sizes the traversal stacks.
+  // build_bvh() stays within it whatever the input, and load_bvh() turns
+  // down trees that do not.
+  const u32 MAX_BVH_DEPTH = 64;
+
+  // Rays that Bvh::intersect_packet() takes at most.
+  const u32 RAY_PACKET_SIZE = 4;
+
+  // 32-byte node with single-precision bounds, rounded outwards. Interior
+  // nodes have `count` 0 and their two children at `offset` and `offset`+1,
+  // leaves hold prims [offset, offset + count).
+  struct BvhNode {
+    f32 lo[3];
+    u32 offset;
+    f32 hi[3];
+    u32 count;
+  };
+
+  struct Bvh {
+    const BvhNode* nodes;
+    u32 node_count;
+    // Prims in leaf order, and the index each one had before the build.
+    Vector<Hittable> prims;
+    const u32* prim_order;
+    // Backs `nodes` and `prim_order` when they come from a cache file.
+    MappedFile cache;
+    // Centers and radii of the prims as columns of `lane_stride`, in leaf
+    // order, so that wide kernels test a leaf's spheres side by side. Null
+    // unless every prim is a sphere.
+    f64* sphere_lanes;
+    usize lane_stride;
+
+    Bvh()
+        : nodes(nullptr), node_count(0), prims(), prim_order(nullptr), cache()
+        , sphere_lanes(nullptr), lane_stride(0) {}
+
+    bool intersect(const Ray& r, f64 tmin, f64 tmax, PrimHit* out) const;
+    // intersect() for up to RAY_PACKET_SIZE rays that go much the same
+    // way, walking the tree once for all of them. Each ray finds the same
+    // closest hit as on its own; `hits` tells which rays hit anything.
+    void intersect_packet(const Ray* rays, u32 count, f64 tmin, f64 tmax, PrimHit* out, bool* hits) const;
+    bool hit(const Ray& r, f64 tmin, f64 tmax, HitRecord* hr) const;
+    Aabb get_bounds() const;
+
+    void release();
+  };
+
+  struct BvhStats {
+    bool from_cache;
+    f64 build_time;
+    f64 save_time;
+    f64 load_time;
+    u32 node_count;
+
+    BvhStats() : from_cache(false), build_time(0.0), save_time(0.0), load_time(0.0), node_count(0) {}
+  };
+
+  // Binned SAH build. Large nodes are binned by all cores and subtrees are
+  // built in parallel. Takes ownership of `prims`.
+  void build_bvh(Vector<Hittable>* prims, Bvh* out);
+
+  // Recomputes every node's bounds, and the sphere lanes, from the prims as
+  // they are now, keeping the tree as built. Much cheaper than a build, but
+  // the tree gets worse the further prims move from where it was built for.
+  void refit_bvh(Bvh* bvh);
+
+  // SAH cost of the tree, as node visits plus prim tests expected of a ray
+  // through the root. Comparing it before and after a refit tells how much
+  // the tree has degraded.
+  f64 get_bvh_cost(const Bvh& bvh);
+
+  // Hash of everything that shapes the tree (primitive types and geometry),
+  // used to key cache files.
+  u64 hash_bvh_input(const Vector<Hittable>& prims);
+
+  bool save_bvh(const Bvh& bvh, u64 hash, const char* path);
+  // Maps a cache file written by save_bvh() and reorders `prims` to match.
+  // Fails without touching `prims` if the file is missing or stale.
+  bool load_bvh(const char* path, u64 hash, Vector<Hittable>* prims, Bvh* out);
+
+  // Loads the BVH for `prims` from `cache_dir` if an up-to-date one is
+  // there, otherwise builds it and writes it there. A null `cache_dir`
+  // always builds.
+  void build_or_load_bvh(Vector<Hittable>* prims, const char* cache_dir, Bvh* out, BvhStats* stats);
+}
@@ -13,6 +13,8 @@ namespace sim {
     Vec3 vertical;
     Vec3 u, v, w;
     f64 lens_radius;
+    // Height of the image plane at unit distance.
+    f64 viewport_h;
 
     Camera(
         const Point3& lookfrom,
@@ -24,7 +26,7 @@ namespace sim {
         f64 focus_dist) {
       f64 theta = radians(fovy);
       f64 h = tan(theta/2);
-      f64 viewport_h = 2.0*h;
+      viewport_h = 2.0*h;
       f64 viewport_w = viewport_h * aspect_ratio;
 
       w = normalize(lookfrom - lookat);
@@ -39,11 +41,43 @@ namespace sim {
       lens_radius = aperture/2;
     }
 
+    // Angle a pixel covers, as the spread of the primary ray cones.
+    f64 get_pixel_spread(u32 img_h) const {
+      return viewport_h / img_h;
+    }
+
+    // Pinhole cameras draw no random numbers for their lens.
     Ray cast_ray(f64 s, f64 t) const {
+      return lens_radius == 0.0 ? cast_pinhole_ray(s, t) : cast_lens_ray(s, t);
+    }
+
+    // The ray through a random point of the lens.
+    Ray cast_lens_ray(f64 s, f64 t) const {
       Vec3 o = lens_radius * random_vec3_in_unit_disk();
       Vec3 offset = u*o.x + v*o.y;
       Vec3 dir = lower_left + s*horizontal + t*vertical - origin - offset;
       return Ray(origin + offset, dir);
     }
+
+    // The ray through the center of the lens, which draws no random numbers.
+    Ray cast_pinhole_ray(f64 s, f64 t) const {
+      return Ray(origin, lower_left + s*horizontal + t*vertical - origin);
+    }
+
+    // Where `p` lands on the image, as the (s, t) of cast_pinhole_ray().
+    // False for points behind the camera.
+    bool project(const Point3& p, f64* s, f64* t) const {
+      Vec3 q = p - origin;
+      f64 z = -dot(q, w);
+      if (z <= 0.0)
+        return false;
+
+      // The image plane is at the focus distance.
+      f64 focus_dist = -dot(lower_left + horizontal/2 + vertical/2 - origin, w);
+      Vec3 on_plane = origin + (focus_dist / z) * q - lower_left;
+      *s = dot(on_plane, horizontal) / horizontal.sqmag();
+      *t = dot(on_plane, vertical) / vertical.sqmag();
+      return true;
+    }
   };
 }
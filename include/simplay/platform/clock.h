@@ -0,0 +1,10 @@
+#pragma once
+
+#include "core.h"
+
+namespace sim {
+  // Monotonic wall-clock time in seconds, from an unspecified origin.
+  f64 get_time_seconds();
+
+  void sleep_ms(u32 ms);
+}
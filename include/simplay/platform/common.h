@@ -23,6 +23,22 @@ namespace sim {
     return a > b ? a : b;
   }
 
+  inline i32 min(i32 a, i32 b) {
+    return a < b ? a : b;
+  }
+
+  inline i32 max(i32 a, i32 b) {
+    return a > b ? a : b;
+  }
+
+  inline u32 min(u32 a, u32 b) {
+    return a < b ? a : b;
+  }
+
+  inline u32 max(u32 a, u32 b) {
+    return a > b ? a : b;
+  }
+
   inline f64 clamp(f64 x, f64 a, f64 b) {
     return min(max(a, x), b);
   }
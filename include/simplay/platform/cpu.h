@@ -0,0 +1,44 @@
+#pragma once
+
+#include "core.h"
+
+namespace sim {
+  // Instruction sets with kernels of their own. Each one extends the ones
+  // before it.
+  enum Isa {
+    ISA_SSE2,
+    ISA_AVX2,
+    ISA_AVX512,
+    ISA_COUNT,
+  };
+
+  struct CpuFeatures {
+    bool sse2;
+    bool avx;
+    bool avx2;
+    bool fma;
+    bool avx512f;
+    // The OS saves the YMM and ZMM registers on context switches. Without
+    // it, AVX code faults even on CPUs that have it.
+    bool os_avx;
+    bool os_avx512;
+    // The widest of the kernels' instruction sets this machine runs.
+    Isa best_isa;
+  };
+
+  // CPUID and XGETBV, looked at once on first use.
+  const CpuFeatures& get_cpu_features();
+
+  // The instruction set dispatched kernels run on. The best one, unless the
+  // SIM_ISA environment variable names a narrower one, or set_isa() does.
+  Isa get_isa();
+
+  // For testing and benchmarking the narrower kernels. Must not race with
+  // kernels that are running. False, keeping the current one, when this
+  // machine does not support `isa`.
+  bool set_isa(Isa isa);
+
+  // "sse2", "avx2" or "avx512".
+  const char* get_isa_name(Isa isa);
+  bool parse_isa(const char* name, Isa* out);
+}
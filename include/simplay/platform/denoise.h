@@ -0,0 +1,25 @@
+#pragma once
+
+#include "core.h"
+#include "image.h"
+
+namespace sim {
+  // Edge-stopping parameters of the a-trous filter. Larger sigmas blur more
+  // across color and albedo edges, larger sharpnesses blur less across
+  // geometric edges.
+  struct DenoiseSettings {
+    u32 iterations;
+    f32 color_sigma;
+    f32 albedo_sigma;
+    f32 normal_sharpness;
+    f32 depth_sharpness;
+
+    DenoiseSettings()
+        : iterations(5), color_sigma(0.8f), albedo_sigma(0.1f)
+        , normal_sharpness(64.0f), depth_sharpness(16.0f) {}
+  };
+
+  // Edge-aware a-trous wavelet filter guided by the first-hit buffers. Color
+  // is divided by albedo before filtering so that texture detail survives.
+  void denoise(const FloatImage& color, const AovImages& aovs, const DenoiseSettings& settings, FloatImage* out);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "core.h"
+
+namespace sim {
+  // Read-only view of a whole file, paged in by the OS on demand.
+  struct MappedFile {
+    const u8* data;
+    usize size;
+    void* file;
+    void* mapping;
+
+    MappedFile() : data(nullptr), size(0), file(nullptr), mapping(nullptr) {}
+
+    bool open(const char* path);
+    void release();
+  };
+
+  // Writes a temporary file next to `path` and renames it over `path`, so
+  // that a crashed or concurrent writer never leaves a file cut short.
+  bool write_file(const char* path, const void* data, usize size);
+
+  // Succeeds when the directory already exists.
+  bool make_directory(const char* path);
+}
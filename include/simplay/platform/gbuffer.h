@@ -0,0 +1,47 @@
+#pragma once
+
+#include "camera.h"
+#include "core.h"
+#include "hittable.h"
+#include "ray.h"
+#include "vector.h"
+
+namespace sim {
+  // Sub-pixel positions shared by every pixel of a G-buffer. Every
+  // power-of-two prefix is stratified. Renders with more samples than this
+  // trace the rest from jittered camera rays.
+  const u32 MAX_GBUFFER_SUBSAMPLES = 16;
+  const u32 GBUFFER_NO_HIT = 0xFFFFFFFF;
+
+  void get_subsample_offset(u32 index, f64* dx, f64* dy);
+
+  // Primary visibility of a pinhole camera: the sphere seen by each
+  // subsample of each pixel, as an index into `prims`. Position, normal and
+  // material are recomputed from that one sphere when shading, which gives
+  // the exact hit record that tracing the camera ray would.
+  struct GBuffer {
+    u32* prim_ids;
+    u32 w, h;
+    u32 subsamples;
+    Vector<const Sphere*> prims;
+
+    GBuffer() : prim_ids(nullptr), w(0), h(0), subsamples(0), prims() {}
+
+    u32 get(u32 x, u32 y, u32 subsample) const {
+      return prim_ids[((usize)y*w + x)*subsamples + subsample];
+    }
+
+    // `r` must be the camera ray of the subsample. False on a miss.
+    bool get_hit(u32 x, u32 y, u32 subsample, const Ray& r, HitRecord* hr) const;
+
+    void release();
+  };
+
+  // Projects the bounds of every sphere in `world` to the screen and tests
+  // the first `subsamples` subsamples they cover, keeping the nearest hit.
+  // Fails for thin-lens cameras, whose primary rays do not share an origin
+  // and must be traced.
+  bool build_gbuffer(
+      const Camera& cam, const Hittable& world, u32 img_w, u32 img_h,
+      u32 subsamples, GBuffer* out);
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdlib.h>
+
+#include "bvh.h"
+#include "common.h"
 #include "core.h"
 #include "ray.h"
 #include "vec3.h"
@@ -14,13 +18,40 @@ namespace sim {
     Vec3 normal;
     bool front_face;
     Material* mat;
+    // How many uv units a unit of distance covers around the hit.
+    f64 uv_density;
+    // Width of the ray cone at the hit, for texture filtering. Set by the
+    // integrator, not by the shapes.
+    f64 cone_width;
 
-    HitRecord() : p(), t(0.0), normal(), front_face(false), mat(nullptr) {}
+    HitRecord()
+        : p(), t(0.0), normal(), front_face(false), mat(nullptr)
+        , uv_density(0.0), cone_width(0.0) {}
 
     void set_normal(const Ray& r, const Vec3& surface_normal) {
       front_face = (dot(r.dir, surface_normal) < 0);
       normal = front_face ? surface_normal : -surface_normal;
     }
+
+    // Only textured materials need the uvs, so they are derived on demand
+    // rather than for every hit. Every shape is a sphere so far: u is the
+    // longitude around y and v the latitude from the bottom pole.
+    void get_uv(f64* u, f64* v) const {
+      Vec3 outward = front_face ? normal : -normal;
+      *u = (atan2(-outward.z, outward.x) + PI) / (2.0*PI);
+      *v = acos(clamp(-outward.y, -1.0, 1.0)) / PI;
+    }
+  };
+
+  struct Sphere;
+
+  // All that traversal keeps of the closest hit so far. The rest of the
+  // HitRecord is worked out once, for the hit that is left at the end.
+  struct PrimHit {
+    f64 t;
+    const Sphere* prim;
+
+    PrimHit() : t(0.0), prim(nullptr) {}
   };
   
   struct Sphere {
@@ -32,7 +63,16 @@ namespace sim {
     Sphere(const Point3& center, f64 radius, Material* mat = nullptr)
         : center(center), radius(radius), mat(mat) {}
     
+    // The nearest root within [tmin, tmax].
+    bool intersect(const Ray& r, f64 tmin, f64 tmax, f64* t) const;
+    // The surface where `r` meets this sphere at `t`.
+    void get_surface(const Ray& r, f64 t, HitRecord* hr) const;
     bool hit(const Ray& r, f64 tmin, f64 tmax, HitRecord* hr) const;
+
+    Aabb get_bounds() const {
+      Vec3 extent(radius, radius, radius);
+      return Aabb(center - extent, center + extent);
+    }
   };
   
   struct Hittable {
@@ -40,12 +80,15 @@ namespace sim {
       NONE,
       SPHERE,
       SCENE,
+      BVH,
     };
     
     Type type;
     union {
       Sphere sphere;
       Vector<Hittable> scene;
+      // Boxed, so that it does not grow the prims it holds.
+      Bvh* bvh;
     };
     
     Hittable() : type(NONE) {}
@@ -64,11 +107,31 @@ namespace sim {
       return h;
     }
 
+    // Takes ownership of the BVH and its prims.
+    static Hittable make_bvh(const Bvh& bvh) {
+      Hittable h;
+      h.type = BVH;
+      h.bvh = (Bvh*)malloc(sizeof(Bvh));
+      *h.bvh = bvh;
+      return h;
+    }
+
     void release() {
-      if (type == SCENE)
+      if (type == SCENE) {
         scene.release();
+      } else if (type == BVH) {
+        bvh->release();
+        free(bvh);
+        type = NONE;
+      }
     }
 
+    // The closest hit, without its surface.
+    bool intersect(const Ray& r, f64 tmin, f64 tmax, PrimHit* out) const;
     bool hit(const Ray& r, f64 tmin, f64 tmax, HitRecord* hr) const;
+    Aabb get_bounds() const;
+    // Bit 1 << Material::Type for every type of material the shapes use,
+    // shapes without one counting as the default material.
+    u32 get_material_types() const;
   };
 }
@@ -16,5 +16,20 @@ namespace sim {
     void release();
 
     void save_png(const char* out_path);
+
+    // Little-endian RGB PFM, which keeps the full float range. Rows are
+    // stored bottom to top, as in memory.
+    bool save_pfm(const char* out_path) const;
+    bool load_pfm(const char* in_path);
+  };
+
+  // First-hit auxiliary buffers, rendered next to the color image.
+  struct AovImages {
+    FloatImage albedo;
+    FloatImage normal;
+    FloatImage depth; // Depth is replicated in every channel.
+
+    void init(u32 new_w, u32 new_h);
+    void release();
   };
 }
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "core.h"
+#include "image.h"
+
+namespace sim {
+  const u32 LIVE_MAGIC = 0x45564C53; // "SLVE"
+  const u32 LIVE_VERSION = 1;
+  const u32 DEFAULT_LIVE_BAND_HEIGHT = 8;
+
+  // The segment starts with a LiveHeader, followed by `band_count`
+  // LiveBands and then the image as RGB f32, row by row from the bottom,
+  // as in FloatImage. Integers and floats are in host order, since readers
+  // run on the same machine.
+  struct LiveHeader {
+    u32 magic;
+    u32 version;
+    u32 w, h;
+    u32 band_height;
+    u32 band_count;
+    // Samples per pixel the render is after.
+    u32 samples;
+    // Set once the render is over, whether it finished or not.
+    volatile i64 finished;
+    volatile i64 bands_done;
+  };
+
+  // Bands of `band_height` rows are written as a whole, each by one thread
+  // at a time. `seq` is odd while a band is being written and is bumped
+  // again once it is done, so a reader that sees the same even `seq` before
+  // and after copying a band got all of one version of it.
+  struct LiveBand {
+    volatile i64 seq;
+    // Samples per pixel in the band as it is now, 0 until first written.
+    u32 samples;
+    u32 padding;
+  };
+
+  // What a reader got out of read_snapshot().
+  struct LiveProgress {
+    u32 bands_done;
+    u32 band_count;
+    // Bands that kept changing while being copied, left as they were.
+    u32 torn_bands;
+    bool finished;
+
+    LiveProgress() : bands_done(0), band_count(0), torn_bands(0), finished(false) {}
+  };
+
+  // An image in named shared memory, which a render writes as it goes and
+  // other processes map to watch it. Writers never wait on readers: a
+  // reader that catches a band mid-write tries it again.
+  struct LiveFramebuffer {
+    void* mapping;
+    LiveHeader* header;
+    LiveBand* bands;
+    f32* pixels;
+
+    LiveFramebuffer() : mapping(nullptr), header(nullptr), bands(nullptr), pixels(nullptr) {}
+
+    // Creates the segment `name`, all black. It lives for as long as a
+    // process has it open.
+    bool create(const char* name, u32 w, u32 h, u32 samples, u32 band_height = DEFAULT_LIVE_BAND_HEIGHT);
+    // Maps a segment another process created, read-only.
+    bool open(const char* name);
+    void release();
+
+    u32 get_band_count() const { return header->band_count; }
+    void get_band_rows(u32 band, u32* y0, u32* y1) const;
+
+    // Writer side. Copies the band's rows from `img`, which has the size
+    // of the segment.
+    void publish_band(u32 band, const FloatImage& img, u32 samples);
+    void finish();
+
+    // Reader side. Copies every band that can be read whole into `out`,
+    // which is sized on the first call; bands that cannot keep what `out`
+    // had.
+    void read_snapshot(FloatImage* out, LiveProgress* progress) const;
+  };
+}
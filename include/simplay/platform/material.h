@@ -2,13 +2,17 @@
 
 #include "hittable.h"
 #include "ray.h"
+#include "texture.h"
 #include "vec3.h"
 
 namespace sim {
+  // Textured materials multiply their albedo with the texture.
   struct Lambertian {
     Color3 albedo;
+    TextureMap map;
 
-    explicit Lambertian(const Color3& albedo) : albedo(albedo) {}
+    explicit Lambertian(const Color3& albedo, const TextureMap& map = TextureMap())
+        : albedo(albedo), map(map) {}
 
     bool scatter(const Ray& in, const HitRecord& hr, Color3* attenuation, Ray* scattered) const;
   };
@@ -16,9 +20,10 @@ namespace sim {
   struct Metal {
     Color3 albedo;
     f64 fuzz;
+    TextureMap map;
 
-    explicit Metal(const Color3& albedo, f64 fuzz)
-        : albedo(albedo), fuzz(fuzz < 1.0 ? fuzz : 1.0) {}
+    explicit Metal(const Color3& albedo, f64 fuzz, const TextureMap& map = TextureMap())
+        : albedo(albedo), fuzz(fuzz < 1.0 ? fuzz : 1.0), map(map) {}
 
     bool scatter(const Ray& in, const HitRecord& hr, Color3* attenuation, Ray* scattered) const;
   };
@@ -53,17 +58,17 @@ namespace sim {
       return &default_mat;
     }
 
-    static Material make_lambertian(const Color3& albedo) {
+    static Material make_lambertian(const Color3& albedo, const TextureMap& map = TextureMap()) {
       Material m;
       m.type = LAMBERTIAN;
-      m.lambertian = Lambertian(albedo);
+      m.lambertian = Lambertian(albedo, map);
       return m;
     }
 
-    static Material make_metal(const Color3& albedo, f64 fuzz) {
+    static Material make_metal(const Color3& albedo, f64 fuzz, const TextureMap& map = TextureMap()) {
       Material m;
       m.type = METAL;
-      m.metal = Metal(albedo, fuzz);
+      m.metal = Metal(albedo, fuzz, map);
       return m;
     }
 
@@ -75,5 +80,8 @@ namespace sim {
     }
 
     bool scatter(const Ray& in, const HitRecord& hr, Color3* attenuation, Ray* scattered) const;
+
+    // Surface reflectance as seen by auxiliary buffers, not used for shading.
+    Color3 get_albedo(const Ray& in, const HitRecord& hr) const;
   };
 }
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "core.h"
+
+namespace sim {
+  // Byte stream between two processes. Only anonymous pipes for now, but
+  // nothing above this layer depends on the kind of transport.
+  struct Channel {
+    enum Type {
+      NONE,
+      PIPE,
+    };
+
+    Type type;
+    void* read_handle;
+    void* write_handle;
+
+    Channel() : type(NONE), read_handle(nullptr), write_handle(nullptr) {}
+
+    // The standard input and output of the current process.
+    static Channel make_std();
+
+    bool write_all(const void* data, usize size);
+    // Returns the number of bytes read, or -1 once the other end is gone.
+    // Non-blocking reads return 0 when nothing is available yet.
+    isize read_some(void* buf, usize capacity, bool block);
+
+    void release();
+  };
+
+  // Child process whose standard input and output are connected to `channel`.
+  // Its standard error is shared with ours.
+  struct Process {
+    void* handle;
+    Channel channel;
+
+    Process() : handle(nullptr), channel() {}
+
+    bool spawn(const char* cmdline);
+    bool is_running() const;
+    // Waits up to `timeout_ms` for the process to exit, then kills it.
+    void stop(u32 timeout_ms);
+    void release();
+  };
+
+  // Writes the path of the running executable, returns false if it does not fit.
+  bool get_executable_path(char* buf, u32 capacity);
+}
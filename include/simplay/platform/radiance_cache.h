@@ -0,0 +1,67 @@
+#pragma once
+
+#include "core.h"
+#include "vec3.h"
+
+namespace sim {
+  // Incoming light at a point of a diffuse surface, good for points within
+  // `radius` that face about the same way.
+  struct RadianceRecord {
+    Point3 p;
+    Vec3 normal;
+    // Mean incoming radiance over the cosine-weighted hemisphere, so that a
+    // Lambertian surface reflects albedo times this.
+    Color3 irradiance;
+    f64 radius;
+    // Bounces its gather rays had left. Light gathered with fewer is
+    // darker, so only paths with as many left reuse the record.
+    i32 depth;
+  };
+
+  struct RadianceCacheSettings {
+    // Records get the harmonic mean distance of their gather rays as their
+    // radius, within these bounds.
+    f64 min_radius, max_radius;
+    u32 gather_rays;
+    // Lookups only count as hits near a record: where the distance over
+    // the radius, plus the normals' disagreement, stays below this.
+    f64 max_error;
+
+    RadianceCacheSettings() : min_radius(0.1), max_radius(0.5), gather_rays(16), max_error(0.5) {}
+  };
+
+  struct RadianceCacheStats {
+    u64 lookups;
+    u64 hits;
+    u64 records;
+
+    RadianceCacheStats() : lookups(0), hits(0), records(0) {}
+
+    f64 get_hit_rate() const { return lookups ? (f64)hits / (f64)lookups : 0.0; }
+  };
+
+  struct RadianceCacheShard;
+
+  // World-space irradiance records in a hashed grid, filled as the render
+  // goes. Each record is filed under every cell its radius reaches, so that
+  // a lookup only reads the cell of its point. Any number of threads may
+  // look up at once; inserts only lock out lookups of the same shard.
+  struct RadianceCache {
+    RadianceCacheShard* shards;
+    RadianceCacheSettings settings;
+    f64 cell_size;
+
+    RadianceCache() : shards(nullptr), settings(), cell_size(0.0) {}
+
+    void init(const RadianceCacheSettings& new_settings);
+    void release();
+
+    // Blends the records around `p` that face like `normal` and were
+    // gathered with `depth`. False when none is close enough, and a new
+    // record should be gathered.
+    bool lookup(const Point3& p, const Vec3& normal, i32 depth, Color3* irradiance);
+    void insert(const RadianceRecord& record);
+
+    RadianceCacheStats get_stats() const;
+  };
+}
@@ -1,13 +1,31 @@
 #pragma once
 
-#include <stdlib.h>
-
 #include "core.h"
 #include "vec3.h"
 
 namespace sim {
+  // Each thread owns its generator, so that worker threads and processes
+  // produce the same numbers for the same seed.
+  inline u64& get_random_state() {
+    static thread_local u64 state = 0x853C49E6748FEA9Bull;
+    return state;
+  }
+
+  inline void seed_random(u64 seed) {
+    get_random_state() = seed;
+  }
+
+  // SplitMix64.
+  inline u64 random_u64() {
+    u64 z = (get_random_state() += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+  }
+
   inline f64 random_f64() {
-    return (f64)rand() / (RAND_MAX + 1);
+    // 53 random mantissa bits, in [0, 1).
+    return (f64)(random_u64() >> 11) * (1.0 / 9007199254740992.0);
   }
 
   inline f64 random_f64_in(f64 min, f64 max) {
@@ -15,4 +15,18 @@ namespace sim {
       return origin + t*dir;
     }
   };
+
+  // Footprint of a ray along a path, for texture filtering: `width` at the
+  // origin, growing by `spread` per unit of distance.
+  struct RayCone {
+    f64 width;
+    f64 spread;
+
+    RayCone() : width(0.0), spread(0.0) {}
+    RayCone(f64 width, f64 spread) : width(width), spread(spread) {}
+
+    f64 get_width_at(f64 dist) const {
+      return width + spread*dist;
+    }
+  };
 }
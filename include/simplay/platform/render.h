@@ -0,0 +1,176 @@
+#pragma once
+
+#include "camera.h"
+#include "core.h"
+#include "gbuffer.h"
+#include "hittable.h"
+#include "image.h"
+#include "live_framebuffer.h"
+#include "radiance_cache.h"
+#include "ray.h"
+#include "render_cost.h"
+#include "tiled_image.h"
+#include "vec3.h"
+
+namespace sim {
+  const u64 RENDER_SEED = 0x2E4DE25EEDull;
+
+  struct RenderSettings {
+    u32 img_w, img_h;
+    u32 samples;
+    u32 max_depth;
+    u64 seed;
+    bool show_progress;
+    // Finds primary hits with a G-buffer pass rather than camera rays, at
+    // its fixed subsample positions. Samples past MAX_GBUFFER_SUBSAMPLES
+    // trace their camera rays as usual. Only for pinhole cameras.
+    bool raster_primary;
+    // Diffuse hits past the first of a path take their light from this
+    // cache, and fill it where it has nothing yet. The result then depends
+    // on which thread got somewhere first.
+    RadianceCache* radiance_cache;
+    // Lets render() pick a path kernel compiled for the camera model, the
+    // material types in the scene and the depth, where one exists. Images
+    // come out the same either way.
+    bool specialize;
+    // render() publishes every band of rows here as soon as it is done,
+    // for other processes to watch. Must be the size of the image.
+    LiveFramebuffer* live;
+
+    RenderSettings()
+        : img_w(600), img_h(400), samples(1), max_depth(2)
+        , seed(RENDER_SEED), show_progress(true), raster_primary(false)
+        , radiance_cache(nullptr), specialize(true), live(nullptr) {}
+  };
+
+  // Attributes of the first diffuse hit of a camera ray, accumulated into the
+  // AOV images. Specular hits are looked through so that reflections and
+  // refractions get their own edges.
+  struct AovSample {
+    Color3 albedo;
+    Vec3 normal;
+    f64 depth;
+    Color3 throughput;
+
+    AovSample() : albedo(), normal(), depth(0.0), throughput(1.0, 1.0, 1.0) {}
+  };
+
+  // The surface a pixel sees, as the sample nearest its center hit it
+  // first, for what builds on a render like reprojection. `mat` is the
+  // default material for shapes that have none.
+  struct FirstHit {
+    Point3 p;
+    Vec3 normal;
+    const Material* mat;
+    bool hit;
+  };
+
+  // `cone` is the footprint of `r`, which selects texture mip levels along
+  // the path. The default is a thin ray, which samples the finest level.
+  // With a `cache`, diffuse hits past the first end the path with cached
+  // light.
+  Color3 ray_color(
+      const Ray& r, const Hittable& world, i32 depth,
+      AovSample* aov = nullptr, const RayCone& cone = RayCone(),
+      RadianceCache* cache = nullptr);
+
+  // Averages `samples` paths through pixel (x, y). When `aov` is given, it
+  // receives the averaged first-hit attributes. With a G-buffer, as many
+  // paths as it has subsamples start from its hits, the rest from random
+  // camera rays. When `cost` is given, it receives the work of all samples,
+  // which `by_material` splits up as well; only what happens while
+  // cost_counting is up gets counted. `first_hit` receives the pixel's
+  // FirstHit.
+  Color3 render_pixel(
+      const Camera& cam, const Hittable& world,
+      u32 x, u32 y, u32 img_w, u32 img_h,
+      u32 samples, u32 max_depth, AovSample* aov = nullptr,
+      const GBuffer* gbuffer = nullptr, RadianceCache* cache = nullptr,
+      RenderCost* cost = nullptr, MaterialCosts* by_material = nullptr,
+      FirstHit* first_hit = nullptr);
+
+  // Seed of row `y` in a pass seeded with `seed`, so that rows come out the
+  // same whichever thread renders them.
+  u64 get_row_seed(u64 seed, u32 y);
+
+  // When `aovs` is given, the first-hit buffers are filled as well. When
+  // `costs` is, so are the cost buffers, at the price of counting every
+  // hit() call for as long as the render runs. `first_hits`, of img_w *
+  // img_h, gets every pixel's FirstHit row by row, for free. The image comes
+  // out the same either way.
+  FloatImage render(
+      const Camera& cam, const Hittable& world, const RenderSettings& settings,
+      AovImages* aovs = nullptr, CostImages* costs = nullptr, FirstHit* first_hits = nullptr);
+
+  struct ImagePassState;
+
+  // The kernel and G-buffer render() would pick for a plain image, for
+  // callers that hand out pixels themselves, such as Renderer's tiles.
+  struct ImagePass {
+    ImagePassState* state;
+
+    ImagePass() : state(nullptr) {}
+
+    // Builds the G-buffer of `settings.raster_primary` here. `cam` and
+    // `world` must outlive the pass.
+    void init(const Camera& cam, const Hittable& world, const RenderSettings& settings);
+    void release();
+
+    // Pixel (x, y), drawing from the thread's random stream where the pixel
+    // before it left off, as along a row of render().
+    Color3 render_pixel(u32 x, u32 y) const;
+  };
+
+  // Renders `world` from each of `cams` into `out`, an array of
+  // `view_count` images, in one pass over the thread pool. Rows of all the
+  // views are handed out together, and groups of neighboring views trace
+  // each pixel side by side, their rays walking a BVH as one packet at
+  // every bounce. Each image is the one render() gives for its camera, but
+  // primary hits are always traced and nothing goes to `settings.live`.
+  // Renderer::submit_views() runs the same batch on a shared renderer.
+  void render_views(const Camera* cams, u32 view_count, const Hittable& world, const RenderSettings& settings, FloatImage* out);
+
+  struct ViewBatchState;
+
+  // render_views() cut into items that can run in any order on any thread,
+  // for pools of their own such as Renderer's.
+  struct ViewBatch {
+    ViewBatchState* state;
+
+    ViewBatch() : state(nullptr) {}
+
+    // Sizes `out` and picks the kernels of every view. `cams`, `world` and
+    // `out` must outlive the batch.
+    void init(const Camera* cams, u32 view_count, const Hittable& world, const RenderSettings& settings, FloatImage* out);
+    void release();
+
+    u32 get_item_count() const;
+    // Renders one row of a group of neighboring views.
+    void render_item(u32 item) const;
+  };
+
+  // Renders into `out` (already sized) a tile at a time, so that memory
+  // stays at one mapped tile per thread whatever the image size. Tiles are
+  // seeded on their own, so the noise differs from render(). Primary hits
+  // are always traced, since a G-buffer would be as big as the image.
+  bool render_tiled(const Camera& cam, const Hittable& world, const RenderSettings& settings, TiledImage* out);
+
+  struct BudgetReport {
+    u32 passes;
+    u32 min_spp;
+    u32 max_spp;
+    f64 avg_spp;
+    f64 elapsed;
+
+    BudgetReport() : passes(0), min_spp(0), max_spp(0), avg_spp(0.0), elapsed(0.0) {}
+  };
+
+  // Renders progressively until `budget` seconds have elapsed: first a few
+  // coarse passes, then full-resolution passes of doubling sample counts.
+  // The last pass is trimmed to what the remaining time allows, and stops
+  // mid-way if needed, so every pixel averages however many samples it got.
+  // `settings.samples` caps the samples per pixel.
+  FloatImage render_within_budget(
+      const Camera& cam, const Hittable& world, const RenderSettings& settings,
+      f64 budget, BudgetReport* report);
+}
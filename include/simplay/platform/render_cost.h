@@ -0,0 +1,117 @@
+#pragma once
+
+#include <intrin.h>
+
+#include "core.h"
+#include "image.h"
+#include "tone_map.h"
+#include "vector.h"
+
+namespace sim {
+  struct Material;
+
+  // Work spent on a pixel, or summed over many.
+  struct RenderCost {
+    u64 cycles; // Time stamp counter ticks.
+    u64 hit_calls; // Hittable::hit() calls, nested ones included.
+    u64 prim_tests; // Intersection tests against shapes.
+    u64 bounces; // Rays spawned off surfaces.
+
+    RenderCost() : cycles(0), hit_calls(0), prim_tests(0), bounces(0) {}
+
+    void add(const RenderCost& other) {
+      cycles += other.cycles;
+      hit_calls += other.hit_calls;
+      prim_tests += other.prim_tests;
+      bounces += other.bounces;
+    }
+  };
+
+  // Running totals of the calling thread. They are only kept up while
+  // cost_counting is above zero, which is all the hit() calls pay for
+  // otherwise.
+  struct CostCounters {
+    u64 hit_calls;
+    u64 prim_tests;
+    u64 bounces;
+  };
+
+  // Number of renders that want their cost counted.
+  extern volatile i64 cost_counting;
+
+  inline CostCounters& get_cost_counters() {
+    static thread_local CostCounters counters = {};
+    return counters;
+  }
+
+  // Everything the calling thread has done so far. The work in between two
+  // readings is their difference.
+  inline RenderCost read_cost() {
+    const CostCounters& counters = get_cost_counters();
+    RenderCost cost;
+    cost.cycles = __rdtsc();
+    cost.hit_calls = counters.hit_calls;
+    cost.prim_tests = counters.prim_tests;
+    cost.bounces = counters.bounces;
+    return cost;
+  }
+
+  inline RenderCost get_cost_since(const RenderCost& start) {
+    RenderCost now = read_cost();
+    RenderCost spent;
+    spent.cycles = now.cycles - start.cycles;
+    spent.hit_calls = now.hit_calls - start.hit_calls;
+    spent.prim_tests = now.prim_tests - start.prim_tests;
+    spent.bounces = now.bounces - start.bounces;
+    return spent;
+  }
+
+  struct MaterialCost {
+    const Material* mat; // Null for camera rays that hit nothing.
+    RenderCost cost;
+    u64 samples;
+  };
+
+  // Cost of samples, summed by the material their camera ray hit first, so
+  // that every path is billed to what it shows. Materials are told apart by
+  // address.
+  struct MaterialCosts {
+    Vector<MaterialCost> entries;
+    u32* slots;
+    u32 slot_count;
+
+    MaterialCosts() : entries(), slots(nullptr), slot_count(0) {}
+
+    void release();
+
+    MaterialCost& get(const Material* mat);
+    void add(const MaterialCosts& other);
+
+    // Entries from the most cycles down.
+    void sort_by_cycles();
+  };
+
+  // Per-pixel cost, summed over the samples of the pixel, next to the color
+  // image. Counts are replicated in every channel, like AovImages::depth.
+  struct CostImages {
+    FloatImage cycles;
+    FloatImage hit_calls;
+    FloatImage prim_tests;
+    FloatImage bounces;
+    MaterialCosts by_material;
+
+    void init(u32 new_w, u32 new_h);
+    void release();
+
+    RenderCost get_total() const;
+  };
+
+  // The value that `fraction` of the pixels of `cost` stay at or below.
+  // Heatmaps scaled to a high percentile rather than the maximum keep a few
+  // outliers from washing everything else out.
+  f64 get_cost_percentile(const FloatImage& cost, f64 fraction);
+
+  // False colors from black through blue, red and yellow to white at
+  // `max_value`, as 8-bit sRGB ready for PackedImage::write_ppm().
+  void make_heatmap(const FloatImage& cost, f64 max_value, PackedImage* out);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "camera.h"
+#include "core.h"
+#include "hittable.h"
+#include "image.h"
+#include "render.h"
+
+namespace sim {
+  // Small enough that a job of higher priority gets the cores within a
+  // tile's time, big enough that picking tiles costs nothing next to them.
+  const u32 DEFAULT_RENDER_TILE_SIZE = 32;
+
+  struct RenderJob;
+  struct RendererState;
+
+  // Called from a worker after every tile of `job` it finished, with the
+  // fraction of the job's tiles done. Several workers may call it for the
+  // same job at once, so the fractions can arrive out of order.
+  typedef void (*RenderProgressFn)(RenderJob* job, f64 progress, void* arg);
+
+  struct RenderRequest {
+    const Camera* cam;
+    const Hittable* world;
+    // Tiles take the kernel and G-buffer render() would, and show_progress
+    // prints as tiles finish. Jobs cannot publish to `live`, and submitting
+    // one that asks to fails.
+    RenderSettings settings;
+    // Every free tile goes to the highest priority job that has tiles left.
+    // Jobs of the same priority take turns a tile at a time.
+    i32 priority;
+    RenderProgressFn on_progress;
+    void* progress_arg;
+
+    RenderRequest()
+        : cam(nullptr), world(nullptr), settings(), priority(0)
+        , on_progress(nullptr), progress_arg(nullptr) {}
+  };
+
+  // Runs any number of render jobs at once on one set of worker threads, so
+  // that they share the cores rather than fight over them. Tiles are seeded
+  // by index, so a job comes out the same whatever else runs next to it.
+  struct Renderer {
+    RendererState* state;
+
+    Renderer() : state(nullptr) {}
+
+    // Starts `thread_count` workers, or one per core for 0.
+    bool init(u32 thread_count = 0, u32 tile_size = DEFAULT_RENDER_TILE_SIZE);
+    // Cancels the jobs still running, stops the workers and frees the jobs
+    // no one waited for.
+    void release();
+
+    // Queues a render into `out`, which is sized and cleared to black here,
+    // as is the G-buffer of `raster_primary` built. `out` and what `request`
+    // points to must outlive the job.
+    RenderJob* submit(const RenderRequest& request, FloatImage* out);
+    // Queues render_views() of `cams` into `out`, an array of `view_count`
+    // images, in place of `request.cam`. Its tiles are rows of a group of
+    // views, and the images come out as render_views() gives them. `cams`
+    // must outlive the job too.
+    RenderJob* submit_views(const RenderRequest& request, const Camera* cams, u32 view_count, FloatImage* out);
+
+    // Stops handing out the job's tiles. Tiles under way stop at their next
+    // row. Does not wait for them; wait() does.
+    void cancel(RenderJob* job);
+
+    f64 get_progress(const RenderJob* job) const;
+
+    // Blocks until no worker touches the job any more, then frees it. False
+    // when it was cancelled before every tile got done.
+    bool wait(RenderJob* job);
+  };
+}
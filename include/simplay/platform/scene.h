@@ -0,0 +1,45 @@
+#pragma once
+
+#include "bvh.h"
+#include "camera.h"
+#include "core.h"
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+#include "vector.h"
+
+namespace sim {
+  // The demo scene: a field of small random spheres around three big ones.
+  struct Scene {
+    Hittable objects;
+
+    Material ground_mat;
+    Material big1_mat;
+    Material big2_mat;
+    Material big3_mat;
+    Vector<Material> sphere_mats;
+
+    void release() {
+      objects.release();
+      sphere_mats.release();
+    }
+  };
+
+  const f64 ASPECT_RATIO = 3.0 / 2.0;
+  // Every process rendering the demo must build the exact same scene, so the
+  // random generator is seeded with this first.
+  const u64 SCENE_SEED = 0x5C3E5EEDull;
+
+  // Draws from the calling thread's random generator. The texture, if any,
+  // goes on the big diffuse sphere and leaves the rest of the scene as is.
+  void build_scene(Scene* world, const Texture* texture = nullptr);
+
+  // Replaces the flat object list of `world` with a BVH over it, taken from
+  // `cache_dir` when the geometry has not changed since it was written.
+  BvhStats accelerate_scene(Scene* world, const char* cache_dir);
+
+  const f64 DEFAULT_APERTURE = 0.1;
+
+  // An aperture of 0 makes a pinhole camera.
+  Camera make_camera(f64 aperture = DEFAULT_APERTURE);
+}
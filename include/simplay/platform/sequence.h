@@ -0,0 +1,86 @@
+#pragma once
+
+#include "camera.h"
+#include "core.h"
+#include "hittable.h"
+#include "image.h"
+#include "render.h"
+#include "vec3.h"
+#include "vector.h"
+
+namespace sim {
+  // Where things are at one frame of a sequence. `cam` starts out as the
+  // sequence's camera, and every offset at zero.
+  struct FrameState {
+    Camera* cam;
+    // How far each object has moved from its place in the rest scene, in
+    // the order of the rest scene. Only spheres move so far.
+    Vec3* offsets;
+    u32 object_count;
+  };
+
+  // Fills in frame `frame`. Runs on a thread of its own, while the frame
+  // before it renders.
+  typedef void (*AnimateFn)(u32 frame, FrameState* state, void* arg);
+
+  // Gets every frame as soon as it is done, in order. False stops the
+  // sequence there.
+  typedef bool (*FrameDoneFn)(u32 frame, const FloatImage& img, void* arg);
+
+  struct SequenceSettings {
+    // Samples of each frame on its own. The seed moves on every frame, so
+    // that reprojected pixels do not pile up the same samples.
+    RenderSettings render;
+    u32 frame_count;
+    // Starts each pixel from what the previous frame had where its surface
+    // was then, where the two agree.
+    bool reproject;
+    // Samples a pixel carries over at most, so that changes the rejection
+    // cannot see (moving shadows and reflections) fade within a few frames.
+    u32 max_history;
+    // The same for mirrors and glass, whose history only matches where
+    // nothing moved.
+    u32 max_specular_history;
+    // History is rejected where its surface lies further off the plane of
+    // the pixel's than this fraction of their distance to the camera. The
+    // plane rather than the point, since the two hits are wherever a
+    // sample went in their pixels...
+    f64 max_position_error;
+    // ...or their normals' cosine is below this.
+    f64 min_normal_cos;
+    // The BVH follows moving objects by refitting, and is only rebuilt
+    // once that makes it this much costlier than it was when built.
+    f64 rebuild_cost_ratio;
+
+    SequenceSettings()
+        : render(), frame_count(1), reproject(true), max_history(32)
+        , max_specular_history(2), max_position_error(0.01), min_normal_cos(0.9), rebuild_cost_ratio(1.5) {}
+  };
+
+  struct SequenceStats {
+    u32 frames;
+    u32 refits;
+    u32 rebuilds;
+    // Summed over the frames. Setup runs next to the rendering of the frame
+    // before, so most of it is hidden.
+    f64 setup_time;
+    f64 render_time;
+    f64 elapsed;
+    // Share of the pixels that kept their history, over the frames that
+    // had one to keep.
+    f64 reused;
+
+    SequenceStats()
+        : frames(0), refits(0), rebuilds(0), setup_time(0.0), render_time(0.0)
+        , elapsed(0.0), reused(0.0) {}
+  };
+
+  // Renders `settings.frame_count` frames of `objects`, a flat rest scene
+  // like build_scene() makes, as `animate` moves it. One BVH is built per
+  // frame in flight up front and refit from then on. The objects' materials
+  // must outlive the call. False when the sequence was stopped early.
+  bool render_sequence(
+      const Vector<Hittable>& objects, const Camera& cam, const SequenceSettings& settings,
+      AnimateFn animate, void* animate_arg, FrameDoneFn on_frame, void* frame_arg,
+      SequenceStats* stats);
+}
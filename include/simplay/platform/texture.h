@@ -0,0 +1,92 @@
+#pragma once
+
+#include "core.h"
+#include "image.h"
+#include "vec3.h"
+#include "vector.h"
+
+namespace sim {
+  // Texture files hold a whole mip pyramid cut into square tiles of RGBA8
+  // sRGB texels, so that a render only reads the tiles it actually touches.
+  const u32 TEXTURE_TILE_SIZE = 64;
+  const u32 MAX_TEXTURE_LEVELS = 32;
+
+  struct TextureCache;
+
+  struct TextureLevel {
+    u32 w, h;
+    u32 tiles_x, tiles_y;
+    // Index of the level's first tile among all tiles of the file.
+    u32 first_tile;
+  };
+
+  struct Texture {
+    TextureCache* cache;
+    void* file;
+    u32 id;
+    u32 level_count;
+    TextureLevel levels[MAX_TEXTURE_LEVELS];
+    u64 tiles_offset;
+
+    // Trilinear lookup with wrapping uvs. `footprint` is the width of the
+    // filtered area in uv units and selects the mip levels.
+    Color3 sample(f64 u, f64 v, f64 footprint) const;
+    bool read_tile(u32 tile, u8* out) const;
+
+    Color3 sample_level(u32 level, f64 u, f64 v) const;
+  };
+
+  struct TextureCacheStats {
+    u64 lookups;
+    u64 hits;
+    u64 loads;
+    u64 evictions;
+    u64 failed_loads;
+
+    TextureCacheStats() : lookups(0), hits(0), loads(0), evictions(0), failed_loads(0) {}
+
+    f64 get_hit_rate() const { return lookups ? (f64)hits / (f64)lookups : 0.0; }
+  };
+
+  struct TextureCacheShard;
+
+  // Keeps the most recently used tiles of every open texture within a fixed
+  // memory budget, whatever the size of the textures themselves. Tiles are
+  // read from disk the first time they are needed, and lookups from any
+  // number of threads only contend when they land in the same shard.
+  struct TextureCache {
+    TextureCacheShard* shards;
+    u32 slots_per_shard;
+    Vector<Texture*> textures;
+
+    TextureCache() : shards(nullptr), slots_per_shard(0), textures() {}
+
+    // Never holds more than `capacity` bytes of texels, but always at least
+    // one tile per shard.
+    void init(usize capacity);
+    void release();
+
+    // The texture lives as long as the cache.
+    Texture* open(const char* path);
+
+    // Copies `count` texels, given by their index within `tile`, into `out`.
+    bool read_texels(const Texture& tex, u32 tile, const u32* texels, u32 count, u32* out);
+
+    TextureCacheStats get_stats() const;
+  };
+
+  // How a material applies a texture: repeated over its surface's [0, 1) uv
+  // range, and multiplied with the material's own color.
+  struct TextureMap {
+    const Texture* texture;
+    f64 repeat_u, repeat_v;
+
+    TextureMap() : texture(nullptr), repeat_u(1.0), repeat_v(1.0) {}
+    TextureMap(const Texture* texture, f64 repeat_u = 1.0, f64 repeat_v = 1.0)
+        : texture(texture), repeat_u(repeat_u), repeat_v(repeat_v) {}
+  };
+
+  // Builds the mip pyramid of a linear image and writes it in tiles. Row 0
+  // of the image is at v = 0.
+  bool write_texture(const char* path, const FloatImage& img);
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <intrin.h>
+
+#include "core.h"
+
+namespace sim {
+  // Returns the value before the addition.
+  inline i64 atomic_fetch_add(volatile i64* p, i64 value) {
+    return _InterlockedExchangeAdd64(p, value);
+  }
+
+  // Lock for short critical sections, which readers may hold together.
+  // Zero-initialized is unlocked, so it needs no init() or release().
+  struct Mutex {
+    void* state;
+
+    Mutex() : state(nullptr) {}
+
+    void lock();
+    void unlock();
+    void lock_shared();
+    void unlock_shared();
+  };
+
+  // Zero-initialized like Mutex. wait() needs the mutex held exclusively,
+  // gives it up while asleep, and may return without a wake call, so
+  // callers check their condition in a loop.
+  struct ConditionVariable {
+    void* state;
+
+    ConditionVariable() : state(nullptr) {}
+
+    void wait(Mutex* mutex);
+    void wake_one();
+    void wake_all();
+  };
+
+  typedef void (*ThreadProc)(void* arg);
+
+  struct Thread {
+    void* handle;
+
+    Thread() : handle(nullptr) {}
+
+    bool spawn(ThreadProc proc, void* arg);
+    void join();
+  };
+
+  u32 get_cpu_count();
+
+  // Calls `fn(i, arg)` for every i in [0, count), spreading the indices over
+  // one thread per core. Returns once every index has been processed.
+  typedef void (*ParallelForFn)(u32 index, void* arg);
+  void parallel_for(u32 count, ParallelForFn fn, void* arg);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "core.h"
+#include "image.h"
+#include "process.h"
+#include "tile_protocol.h"
+
+namespace sim {
+  // Renders `job` into `pixels` (job.w*job.h RGB triplets, row by row, with
+  // row 0 at job.y0).
+  typedef void (*TileRenderFn)(const TileJob& job, f32* pixels, void* arg);
+
+  struct TileFarmSettings {
+    // Spawned `worker_count` times, each child must end up in serve_tiles().
+    const char* worker_cmdline;
+    u32 worker_count;
+    // At most MAX_TILE_SIZE.
+    u32 tile_size;
+    u32 samples;
+    u32 max_depth;
+    u64 seed;
+    // A tile is handed to a second worker once it has been running for
+    // `slow_factor` times the average tile time, and at least `min_timeout`.
+    f64 slow_factor;
+    f64 min_timeout;
+
+    TileFarmSettings()
+        : worker_cmdline(nullptr), worker_count(0), tile_size(32), samples(1)
+        , max_depth(1), seed(0), slow_factor(4.0), min_timeout(2.0) {}
+  };
+
+  // Coordinator side: splits `out` (already sized) into tiles and has worker
+  // processes render them. Tiles of workers that die are handed out again,
+  // and whatever is left once no worker remains is rendered locally with
+  // `local_fn`.
+  void farm_tiles(const TileFarmSettings& settings, TileRenderFn local_fn, void* arg, FloatImage* out);
+
+  // Worker side: renders the jobs received on `channel` until it is told to
+  // shut down or the coordinator goes away.
+  void serve_tiles(Channel* channel, TileRenderFn fn, void* arg);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "core.h"
+#include "process.h"
+#include "vector.h"
+
+namespace sim {
+  // Tiles are at most this wide and high, which bounds the size of every
+  // message. Anything bigger on the wire is a protocol error.
+  const u32 MAX_TILE_SIZE = 256;
+
+  // One rectangle of the frame, with everything a worker needs to render it.
+  // Samples are seeded from `seed` and `id` only, so any worker produces the
+  // same pixels for the same job.
+  struct TileJob {
+    u32 id;
+    u32 x0, y0;
+    u32 w, h;
+    u32 img_w, img_h;
+    u32 samples;
+    u32 max_depth;
+    u64 seed;
+
+    TileJob()
+        : id(0), x0(0), y0(0), w(0), h(0), img_w(0), img_h(0)
+        , samples(0), max_depth(0), seed(0) {}
+  };
+
+  // Messages are a fixed header followed by `size` payload bytes. Integers
+  // and floats are little-endian, which is also the host order on every
+  // platform we support, so they are copied as is.
+  struct Message {
+    enum Type : u32 {
+      NONE = 0,
+      TILE_JOB = 1,
+      TILE_RESULT = 2,
+      SHUTDOWN = 3,
+    };
+
+    Type type;
+    const u8* payload;
+    u32 size;
+
+    Message() : type(NONE), payload(nullptr), size(0) {}
+  };
+
+  void encode_tile_job(const TileJob& job, Vector<u8>* out);
+  // `pixels` holds job.w*job.h RGB triplets, row by row.
+  void encode_tile_result(const TileJob& job, const f32* pixels, Vector<u8>* out);
+  void encode_shutdown(Vector<u8>* out);
+
+  bool decode_tile_job(const Message& msg, TileJob* job);
+  // On success `pixels` points into the message payload.
+  bool decode_tile_result(const Message& msg, TileJob* job, const f32** pixels);
+
+  // Reassembles messages from a byte stream that may deliver them in pieces.
+  struct MessageReader {
+    Vector<u8> buffer;
+    usize consumed;
+    // Set once a header had no magic or a size past any message. Nothing
+    // after it can be trusted, so the stream counts as closed.
+    bool failed;
+
+    MessageReader() : buffer(), consumed(0), failed(false) {}
+
+    // Reads whatever the channel has, returns false once it is closed.
+    bool pump(Channel* channel, bool block);
+    // The returned message stays valid until the next call to pump(). A bad
+    // header comes out once as a NONE message and sets `failed`.
+    bool next(Message* msg);
+    // Also true for a bad header, for next() to report.
+    bool has_message() const;
+
+    void release();
+  };
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "core.h"
+
+namespace sim {
+  // 128x128 RGB f32 tiles are exactly three 64 KB mapping granules.
+  const u32 DEFAULT_IMAGE_TILE_SIZE = 128;
+
+  // Image kept in a file as square tiles of RGB f32, row by row within a
+  // tile, for images too big to hold in memory. Only the tiles that are
+  // mapped at the moment take up memory; the rest stay on disk. Row 0 is
+  // at the bottom, as in FloatImage.
+  struct TiledImage {
+    void* file;
+    void* mapping;
+    u32 w, h;
+    u32 tile_size;
+    u32 tiles_x, tiles_y;
+    // Bytes between tiles in the file, rounded up so that every tile can be
+    // mapped on its own.
+    u64 tile_stride;
+
+    TiledImage()
+        : file(nullptr), mapping(nullptr), w(0), h(0), tile_size(0)
+        , tiles_x(0), tiles_y(0), tile_stride(0) {}
+
+    // Creates or truncates the file at `path`, which is deleted again by
+    // release() unless `keep` is set.
+    bool init(const char* path, u32 new_w, u32 new_h, u32 new_tile_size = DEFAULT_IMAGE_TILE_SIZE, bool keep = false);
+    void release();
+
+    u32 get_tile_count() const { return tiles_x * tiles_y; }
+    void get_tile_bounds(u32 tile, u32* x0, u32* y0, u32* tile_w, u32* tile_h) const;
+
+    // Pixels of `tile`, tile_w*tile_h RGB triplets from its bottom row up.
+    // Any number of threads may map different tiles at once. Null when the
+    // address space or the file system gives out.
+    f32* map_tile(u32 tile) const;
+    // Writes the tile back to the file and drops it from memory.
+    void unmap_tile(f32* pixels) const;
+
+    // Hands the image to `fn` a whole row at a time, with only one row of
+    // tiles mapped at once. Stops at the first row `fn` rejects.
+    typedef bool (*RowFn)(u32 y, const f32* row, void* arg);
+    bool for_each_row(bool top_down, RowFn fn, void* arg) const;
+
+    // Same format as FloatImage::save_pfm(), written a row at a time.
+    bool save_pfm(const char* out_path) const;
+  };
+}
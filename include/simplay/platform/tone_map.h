@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "core.h"
+#include "image.h"
+
+namespace sim {
+  struct ToneMapSettings {
+    enum Curve {
+      CLAMP,
+      REINHARD,
+      // Narkowicz's fit of the ACES filmic curve.
+      ACES,
+    };
+
+    // Offsets added before rounding, at most half a step either way, so
+    // that smooth gradients do not band.
+    enum Dither {
+      NO_DITHER,
+      // 8x8 Bayer matrix.
+      ORDERED,
+      // Interleaved gradient noise, which has few low frequencies.
+      NOISE,
+    };
+
+    f32 exposure; // In stops.
+    Curve curve;
+    Dither dither;
+    u32 bits; // 8 or 16 per sample.
+
+    ToneMapSettings() : exposure(0.0f), curve(CLAMP), dither(NO_DITHER), bits(8) {}
+  };
+
+  // Packed RGB samples with rows top to bottom, as image files want them.
+  // 16-bit samples are big-endian, like PNG and binary PPM.
+  struct PackedImage {
+    u8* data;
+    u32 w, h;
+    u32 bytes_per_sample;
+
+    PackedImage() : data(nullptr), w(0), h(0), bytes_per_sample(0) {}
+
+    usize get_row_size() const { return (usize)w * 3 * bytes_per_sample; }
+    u8* get_row(u32 y) { return data + y * get_row_size(); }
+    const u8* get_row(u32 y) const { return data + y * get_row_size(); }
+
+    void init(u32 new_w, u32 new_h, u32 new_bytes_per_sample);
+    void release();
+
+    // Binary PPM, with a maximum value of 255 or 65535.
+    bool write_ppm(FILE* out) const;
+  };
+
+  // Linear radiance to display values: exposure, tone curve, sRGB encoding,
+  // then dithered rounding. Rows are spread over all cores.
+  void tone_map(const FloatImage& img, const ToneMapSettings& settings, PackedImage* out);
+
+  // One row of RGB f32 into w*3 packed samples, for images that are never
+  // whole in memory. `y` is the row's place in the image, counted from the
+  // bottom, and only moves the dither pattern.
+  void tone_map_row(const f32* rgb, u32 w, u32 y, const ToneMapSettings& settings, u8* out);
+}
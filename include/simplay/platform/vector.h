@@ -56,6 +56,14 @@ namespace sim {
       data[length++] = t;
     }
 
+    void append(const T* items, usize count) {
+      if (length + count > capacity)
+        reserve(length + count > capacity*2 ? length + count : capacity*2);
+
+      memcpy(data + length, items, count * sizeof(T));
+      length += count;
+    }
+
     void pop() {
       if (!length)
         return;
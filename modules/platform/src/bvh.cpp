@@ -0,0 +1,973 @@
+#include "simplay/platform/bvh.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simplay/platform/clock.h"
+#include "simplay/platform/cpu.h"
+#include "simplay/platform/hittable.h"
+#include "simplay/platform/render_cost.h"
+#include "simplay/platform/thread.h"
+
+namespace sim {
+  namespace {
+    const u32 BIN_COUNT = 16;
+    const u32 MAX_LEAF_SIZE = 4;
+    // Skewed inputs can have SAH split off a few prims per level. Past this
+    // depth nodes are halved instead, which takes at most 30 more levels
+    // down to leaves, however many prims there are: trees stay within
+    // MAX_BVH_DEPTH.
+    const u32 MAX_SAH_DEPTH = 32;
+    // Below these sizes, threads cost more than they save.
+    const u32 PARALLEL_SUBTREE_SIZE = 4096;
+    const u32 PARALLEL_BIN_SIZE = 1 << 16;
+    const u32 BIN_CHUNK_SIZE = 1 << 14;
+
+    struct BuildPrim {
+      Aabb bounds;
+      Point3 centroid;
+    };
+
+    struct Bin {
+      Aabb bounds;
+      u32 count;
+    };
+
+    // Bins of all three axes, for a range of prims.
+    struct BinSet {
+      Bin bins[3][BIN_COUNT];
+      Aabb bounds;
+
+      void clear() {
+        for (u32 axis = 0; axis < 3; ++axis) {
+          for (u32 i = 0; i < BIN_COUNT; ++i) {
+            bins[axis][i].bounds = Aabb();
+            bins[axis][i].count = 0;
+          }
+        }
+        bounds = Aabb();
+      }
+    };
+
+    struct Builder {
+      const BuildPrim* prims;
+      u32* indices;
+      BvhNode* nodes;
+      volatile i64 node_count;
+      u32 parallel_depth;
+    };
+
+    u32 get_bin(const Point3& c, u32 axis, const Aabb& centroid_bounds) {
+      f64 extent = centroid_bounds.hi[axis] - centroid_bounds.lo[axis];
+      f64 rel = (c[axis] - centroid_bounds.lo[axis]) / extent;
+      u32 bin = (u32)(rel * BIN_COUNT);
+      return bin < BIN_COUNT ? bin : BIN_COUNT - 1;
+    }
+
+    void bin_range(const Builder& b, u32 begin, u32 end, const Aabb& centroid_bounds, BinSet* set) {
+      set->clear();
+      for (u32 i = begin; i < end; ++i) {
+        const BuildPrim& prim = b.prims[b.indices[i]];
+        set->bounds.grow(prim.bounds);
+        for (u32 axis = 0; axis < 3; ++axis) {
+          if (centroid_bounds.hi[axis] <= centroid_bounds.lo[axis])
+            continue;
+          Bin& bin = set->bins[axis][get_bin(prim.centroid, axis, centroid_bounds)];
+          bin.bounds.grow(prim.bounds);
+          ++bin.count;
+        }
+      }
+    }
+
+    struct ParallelBinning {
+      const Builder* builder;
+      u32 begin, end;
+      const Aabb* centroid_bounds;
+      BinSet* chunks;
+    };
+
+    void bin_chunk(u32 chunk, void* arg) {
+      ParallelBinning& pb = *(ParallelBinning*)arg;
+      u32 begin = pb.begin + chunk*BIN_CHUNK_SIZE;
+      u32 end = min(begin + BIN_CHUNK_SIZE, pb.end);
+      bin_range(*pb.builder, begin, end, *pb.centroid_bounds, &pb.chunks[chunk]);
+    }
+
+    void bin_prims(const Builder& b, u32 begin, u32 end, const Aabb& centroid_bounds, BinSet* set) {
+      if (end - begin < PARALLEL_BIN_SIZE) {
+        bin_range(b, begin, end, centroid_bounds, set);
+        return;
+      }
+
+      u32 chunk_count = (end - begin + BIN_CHUNK_SIZE - 1) / BIN_CHUNK_SIZE;
+      ParallelBinning pb;
+      pb.builder = &b;
+      pb.begin = begin;
+      pb.end = end;
+      pb.centroid_bounds = &centroid_bounds;
+      pb.chunks = (BinSet*)malloc(chunk_count * sizeof(BinSet));
+      parallel_for(chunk_count, bin_chunk, &pb);
+
+      set->clear();
+      for (u32 c = 0; c < chunk_count; ++c) {
+        const BinSet& chunk = pb.chunks[c];
+        set->bounds.grow(chunk.bounds);
+        for (u32 axis = 0; axis < 3; ++axis) {
+          for (u32 i = 0; i < BIN_COUNT; ++i) {
+            set->bins[axis][i].bounds.grow(chunk.bins[axis][i].bounds);
+            set->bins[axis][i].count += chunk.bins[axis][i].count;
+          }
+        }
+      }
+      free(pb.chunks);
+    }
+
+    f32 round_down(f64 x) {
+      f32 f = (f32)x;
+      return (f64)f > x ? nextafterf(f, -INFINITY) : f;
+    }
+
+    f32 round_up(f64 x) {
+      f32 f = (f32)x;
+      return (f64)f < x ? nextafterf(f, INFINITY) : f;
+    }
+
+    void set_node_bounds(BvhNode* node, const Aabb& bounds) {
+      // Rays are tested against nodes in single precision, the margin covers
+      // the rounding of their origin.
+      for (u32 axis = 0; axis < 3; ++axis) {
+        f64 margin = 1e-6 * (fabs(bounds.lo[axis]) + fabs(bounds.hi[axis])) + 1e-9;
+        node->lo[axis] = round_down(bounds.lo[axis] - margin);
+        node->hi[axis] = round_up(bounds.hi[axis] + margin);
+      }
+    }
+
+    u32 get_longest_axis(const Aabb& bounds) {
+      Vec3 d = bounds.hi - bounds.lo;
+      return d.x >= d.y && d.x >= d.z ? 0 : (d.y >= d.z ? 1 : 2);
+    }
+
+    // Reorders the prims of [begin, end) so that the centroids before `mid`
+    // lie no further along `axis` than those from `mid` on.
+    void partition_at(Builder* b, u32 begin, u32 end, u32 mid, u32 axis) {
+      while (end - begin > 1) {
+        f64 pivot = b->prims[b->indices[begin + (end - begin)/2]].centroid[axis];
+        // Below the pivot, equal to it, unknown, above it.
+        u32 lt = begin, i = begin, gt = end;
+        while (i < gt) {
+          f64 c = b->prims[b->indices[i]].centroid[axis];
+          u32 swap_with = i;
+          if (c < pivot)
+            swap_with = lt++;
+          else if (c > pivot)
+            swap_with = --gt;
+          u32 tmp = b->indices[i];
+          b->indices[i] = b->indices[swap_with];
+          b->indices[swap_with] = tmp;
+          if (c <= pivot)
+            ++i;
+        }
+        if (mid < lt)
+          end = lt;
+        else if (mid >= gt)
+          begin = gt;
+        else
+          return;
+      }
+    }
+
+    void build_node(Builder* b, u32 node_index, u32 begin, u32 end, u32 depth);
+
+    struct SubtreeTask {
+      Builder* builder;
+      u32 node_index;
+      u32 begin, end;
+      u32 depth;
+    };
+
+    void build_subtree(void* arg) {
+      SubtreeTask& task = *(SubtreeTask*)arg;
+      build_node(task.builder, task.node_index, task.begin, task.end, task.depth);
+    }
+
+    void build_node(Builder* b, u32 node_index, u32 begin, u32 end, u32 depth) {
+      BvhNode* node = &b->nodes[node_index];
+      u32 count = end - begin;
+
+      Aabb centroid_bounds;
+      for (u32 i = begin; i < end; ++i)
+        centroid_bounds.grow(b->prims[b->indices[i]].centroid);
+
+      BinSet set;
+      bin_prims(*b, begin, end, centroid_bounds, &set);
+      set_node_bounds(node, set.bounds);
+
+      if (count <= MAX_LEAF_SIZE) {
+        node->offset = begin;
+        node->count = count;
+        return;
+      }
+
+      u32 mid = begin;
+      if (depth >= MAX_SAH_DEPTH) {
+        mid = begin + count/2;
+        partition_at(b, begin, end, mid, get_longest_axis(centroid_bounds));
+      } else {
+        // Sweep the bins of every axis for the cheapest split, costs are
+        // relative to the node's own surface area.
+        f64 best_cost = F64_INF;
+        u32 best_axis = 0;
+        u32 best_split = 0;
+        for (u32 axis = 0; axis < 3; ++axis) {
+          if (centroid_bounds.hi[axis] <= centroid_bounds.lo[axis])
+            continue;
+
+          const Bin* bins = set.bins[axis];
+          f64 right_cost[BIN_COUNT];
+          Aabb right;
+          u32 right_count = 0;
+          for (u32 i = BIN_COUNT - 1; i > 0; --i) {
+            right.grow(bins[i].bounds);
+            right_count += bins[i].count;
+            right_cost[i] = right.surface_area() * right_count;
+          }
+
+          Aabb left;
+          u32 left_count = 0;
+          for (u32 i = 1; i < BIN_COUNT; ++i) {
+            left.grow(bins[i - 1].bounds);
+            left_count += bins[i - 1].count;
+            f64 cost = left.surface_area()*left_count + right_cost[i];
+            if (left_count && left_count < count && cost < best_cost) {
+              best_cost = cost;
+              best_axis = axis;
+              best_split = i;
+            }
+          }
+        }
+
+        if (best_split) {
+          // A leaf is worth it when splitting does not pay for the traversal.
+          f64 leaf_cost = set.bounds.surface_area() * count;
+          if (count <= 4*MAX_LEAF_SIZE && leaf_cost <= best_cost) {
+            node->offset = begin;
+            node->count = count;
+            return;
+          }
+
+          u32 lo = begin, hi = end;
+          while (lo < hi) {
+            const BuildPrim& prim = b->prims[b->indices[lo]];
+            if (get_bin(prim.centroid, best_axis, centroid_bounds) < best_split) {
+              ++lo;
+            } else {
+              --hi;
+              u32 tmp = b->indices[lo];
+              b->indices[lo] = b->indices[hi];
+              b->indices[hi] = tmp;
+            }
+          }
+          mid = lo;
+        }
+      }
+      // All centroids coincide, any split is as good as another.
+      if (mid == begin || mid == end)
+        mid = begin + count/2;
+
+      u32 first_child = (u32)atomic_fetch_add(&b->node_count, 2);
+      node->offset = first_child;
+      node->count = 0;
+
+      if (depth < b->parallel_depth && count >= PARALLEL_SUBTREE_SIZE) {
+        SubtreeTask task;
+        task.builder = b;
+        task.node_index = first_child;
+        task.begin = begin;
+        task.end = mid;
+        task.depth = depth + 1;
+
+        Thread thread;
+        if (thread.spawn(build_subtree, &task)) {
+          build_node(b, first_child + 1, mid, end, depth + 1);
+          thread.join();
+          return;
+        }
+      }
+
+      build_node(b, first_child, begin, mid, depth + 1);
+      build_node(b, first_child + 1, mid, end, depth + 1);
+    }
+
+    // Reorders `prims` so that prim i becomes the one at index order[i].
+    void reorder_prims(Vector<Hittable>* prims, const u32* order) {
+      Vector<Hittable> reordered;
+      reordered.reserve(prims->length);
+      for (usize i = 0; i < prims->length; ++i)
+        reordered.push((*prims)[order[i]]);
+
+      // The prims now live in `reordered`, only the old storage goes away.
+      free(prims->data);
+      *prims = reordered;
+    }
+
+    bool intersect_node(const BvhNode& node, const f32* org, const f32* inv_dir, f32 tmax, f32* tnear) {
+      f32 t0 = 0.0f;
+      f32 t1 = tmax;
+      for (u32 axis = 0; axis < 3; ++axis) {
+        f32 ta = (node.lo[axis] - org[axis]) * inv_dir[axis];
+        f32 tb = (node.hi[axis] - org[axis]) * inv_dir[axis];
+        if (ta > tb) {
+          f32 tmp = ta;
+          ta = tb;
+          tb = tmp;
+        }
+        t0 = ta > t0 ? ta : t0;
+        t1 = tb < t1 ? tb : t1;
+        if (t0 > t1)
+          return false;
+      }
+      *tnear = t0;
+      return true;
+    }
+
+    // intersect_node() for four rays, taking the same steps lane by lane:
+    // max and min pick their second operand on ties and NaNs, as the
+    // comparisons there do. Bit i is set when ray i hits.
+    u32 intersect_node4(const BvhNode& node, const __m128* org, const __m128* inv_dir, __m128 tmax, __m128* tnear) {
+      __m128 t0 = _mm_setzero_ps();
+      __m128 t1 = tmax;
+      for (u32 axis = 0; axis < 3; ++axis) {
+        __m128 ta = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.lo[axis]), org[axis]), inv_dir[axis]);
+        __m128 tb = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.hi[axis]), org[axis]), inv_dir[axis]);
+        t0 = _mm_max_ps(_mm_min_ps(tb, ta), t0);
+        t1 = _mm_min_ps(_mm_max_ps(ta, tb), t1);
+      }
+      *tnear = t0;
+      return (u32)_mm_movemask_ps(_mm_cmple_ps(t0, t1));
+    }
+
+    // The widest kernel loads 8 lanes from the last prim on.
+    const usize LANE_PADDING = 8;
+
+    void update_sphere_lanes(Bvh* bvh) {
+      usize count = bvh->prims.length;
+      bool all_spheres = count > 0;
+      for (usize i = 0; i < count && all_spheres; ++i)
+        all_spheres = bvh->prims[i].type == Hittable::SPHERE;
+      if (!all_spheres) {
+        free(bvh->sphere_lanes);
+        bvh->sphere_lanes = nullptr;
+        bvh->lane_stride = 0;
+        return;
+      }
+
+      if (!bvh->sphere_lanes) {
+        bvh->lane_stride = count + LANE_PADDING;
+        bvh->sphere_lanes = (f64*)calloc(4 * bvh->lane_stride, sizeof(f64));
+      }
+      f64* lanes = bvh->sphere_lanes;
+      usize stride = bvh->lane_stride;
+      for (usize i = 0; i < count; ++i) {
+        const Sphere& sphere = bvh->prims[i].sphere;
+        lanes[i] = sphere.center.x;
+        lanes[stride + i] = sphere.center.y;
+        lanes[2*stride + i] = sphere.center.z;
+        lanes[3*stride + i] = sphere.radius;
+      }
+    }
+
+    // The closest of spheres [begin, end) within [tmin, tmax], or `end`.
+    // Every lane takes the steps of Sphere::hit() in the same order, and
+    // ties go to the later sphere, so this finds the same sphere at the
+    // same t as testing them one by one with a shrinking tmax.
+    u32 hit_spheres_avx2(const Bvh& bvh, u32 begin, u32 end, const Ray& r, f64 tmin, f64 tmax, f64* t) {
+      const f64* lanes = bvh.sphere_lanes;
+      usize stride = bvh.lane_stride;
+      const __m256d sign = _mm256_set1_pd(-0.0);
+      __m256d ox = _mm256_set1_pd(r.origin.x);
+      __m256d oy = _mm256_set1_pd(r.origin.y);
+      __m256d oz = _mm256_set1_pd(r.origin.z);
+      __m256d dx = _mm256_set1_pd(r.dir.x);
+      __m256d dy = _mm256_set1_pd(r.dir.y);
+      __m256d dz = _mm256_set1_pd(r.dir.z);
+      __m256d a = _mm256_set1_pd(dot(r.dir, r.dir));
+      __m256d lo = _mm256_set1_pd(tmin);
+      __m256d hi = _mm256_set1_pd(tmax);
+
+      u32 best = end;
+      f64 best_t = tmax;
+      for (u32 i = begin; i < end; i += 4) {
+        __m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(lanes + i));
+        __m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(lanes + stride + i));
+        __m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(lanes + 2*stride + i));
+        __m256d radius = _mm256_loadu_pd(lanes + 3*stride + i);
+        __m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, ocx), _mm256_mul_pd(dy, ocy)), _mm256_mul_pd(dz, ocz));
+        __m256d c = _mm256_sub_pd(
+            _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+            _mm256_mul_pd(radius, radius));
+        __m256d delta = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+        __m256d sqrtd = _mm256_sqrt_pd(delta);
+        __m256d neg_b = _mm256_xor_pd(half_b, sign);
+        __m256d near_root = _mm256_div_pd(_mm256_sub_pd(neg_b, sqrtd), a);
+        __m256d far_root = _mm256_div_pd(_mm256_add_pd(neg_b, sqrtd), a);
+        __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(near_root, lo, _CMP_GE_OQ), _mm256_cmp_pd(near_root, hi, _CMP_LE_OQ));
+        __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(far_root, lo, _CMP_GE_OQ), _mm256_cmp_pd(far_root, hi, _CMP_LE_OQ));
+        __m256d hit = _mm256_and_pd(_mm256_cmp_pd(delta, _mm256_setzero_pd(), _CMP_GE_OQ), _mm256_or_pd(near_ok, far_ok));
+        u32 mask = (u32)_mm256_movemask_pd(hit);
+        if (!mask)
+          continue;
+
+        f64 roots[4];
+        _mm256_storeu_pd(roots, _mm256_blendv_pd(far_root, near_root, near_ok));
+        for (u32 lane = 0; lane < 4 && i + lane < end; ++lane) {
+          if (((mask >> lane) & 1) && roots[lane] <= best_t) {
+            best_t = roots[lane];
+            best = i + lane;
+          }
+        }
+      }
+      *t = best_t;
+      return best;
+    }
+
+    u32 hit_spheres_avx512(const Bvh& bvh, u32 begin, u32 end, const Ray& r, f64 tmin, f64 tmax, f64* t) {
+      const f64* lanes = bvh.sphere_lanes;
+      usize stride = bvh.lane_stride;
+      // AVX-512F has no float xor.
+      const __m512i sign = _mm512_set1_epi64((i64)0x8000000000000000ull);
+      __m512d ox = _mm512_set1_pd(r.origin.x);
+      __m512d oy = _mm512_set1_pd(r.origin.y);
+      __m512d oz = _mm512_set1_pd(r.origin.z);
+      __m512d dx = _mm512_set1_pd(r.dir.x);
+      __m512d dy = _mm512_set1_pd(r.dir.y);
+      __m512d dz = _mm512_set1_pd(r.dir.z);
+      __m512d a = _mm512_set1_pd(dot(r.dir, r.dir));
+      __m512d lo = _mm512_set1_pd(tmin);
+      __m512d hi = _mm512_set1_pd(tmax);
+
+      u32 best = end;
+      f64 best_t = tmax;
+      for (u32 i = begin; i < end; i += 8) {
+        __mmask8 valid = (__mmask8)(end - i >= 8 ? 0xFF : (1u << (end - i)) - 1);
+        __m512d ocx = _mm512_sub_pd(ox, _mm512_loadu_pd(lanes + i));
+        __m512d ocy = _mm512_sub_pd(oy, _mm512_loadu_pd(lanes + stride + i));
+        __m512d ocz = _mm512_sub_pd(oz, _mm512_loadu_pd(lanes + 2*stride + i));
+        __m512d radius = _mm512_loadu_pd(lanes + 3*stride + i);
+        __m512d half_b = _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(dx, ocx), _mm512_mul_pd(dy, ocy)), _mm512_mul_pd(dz, ocz));
+        __m512d c = _mm512_sub_pd(
+            _mm512_add_pd(_mm512_add_pd(_mm512_mul_pd(ocx, ocx), _mm512_mul_pd(ocy, ocy)), _mm512_mul_pd(ocz, ocz)),
+            _mm512_mul_pd(radius, radius));
+        __m512d delta = _mm512_sub_pd(_mm512_mul_pd(half_b, half_b), _mm512_mul_pd(a, c));
+        __m512d sqrtd = _mm512_sqrt_pd(delta);
+        __m512d neg_b = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(half_b), sign));
+        __m512d near_root = _mm512_div_pd(_mm512_sub_pd(neg_b, sqrtd), a);
+        __m512d far_root = _mm512_div_pd(_mm512_add_pd(neg_b, sqrtd), a);
+        __mmask8 near_ok = _mm512_cmp_pd_mask(near_root, lo, _CMP_GE_OQ) & _mm512_cmp_pd_mask(near_root, hi, _CMP_LE_OQ);
+        __mmask8 far_ok = _mm512_cmp_pd_mask(far_root, lo, _CMP_GE_OQ) & _mm512_cmp_pd_mask(far_root, hi, _CMP_LE_OQ);
+        u32 mask = valid & _mm512_cmp_pd_mask(delta, _mm512_setzero_pd(), _CMP_GE_OQ) & (near_ok | far_ok);
+        if (!mask)
+          continue;
+
+        f64 roots[8];
+        _mm512_storeu_pd(roots, _mm512_mask_blend_pd(near_ok, far_root, near_root));
+        for (u32 lane = 0; lane < 8; ++lane) {
+          if (((mask >> lane) & 1) && roots[lane] <= best_t) {
+            best_t = roots[lane];
+            best = i + lane;
+          }
+        }
+      }
+      *t = best_t;
+      return best;
+    }
+
+    // Tests the prims of leaf `node` for hits closer than `closest`, and
+    // moves it up to the closest one. SSE2 tests the prims one by one.
+    bool intersect_leaf(const Bvh& bvh, const BvhNode& node, Isa isa, const Ray& r, f64 tmin, f64* closest, PrimHit* out) {
+      if (isa < ISA_AVX2) {
+        bool hit_anything = false;
+        for (u32 i = node.offset; i < node.offset + node.count; ++i) {
+          if (bvh.prims[i].intersect(r, tmin, *closest, out)) {
+            hit_anything = true;
+            *closest = out->t;
+          }
+        }
+        return hit_anything;
+      }
+
+      u32 end = node.offset + node.count;
+      f64 t;
+      u32 hit = isa >= ISA_AVX512
+          ? hit_spheres_avx512(bvh, node.offset, end, r, tmin, *closest, &t)
+          : hit_spheres_avx2(bvh, node.offset, end, r, tmin, *closest, &t);
+      if (cost_counting) {
+        // As many as testing them one by one counts.
+        CostCounters& counters = get_cost_counters();
+        counters.hit_calls += node.count;
+        counters.prim_tests += node.count;
+      }
+      if (hit == end)
+        return false;
+      *closest = t;
+      out->t = t;
+      out->prim = &bvh.prims[hit].sphere;
+      return true;
+    }
+  }
+
+  bool Bvh::intersect(const Ray& r, f64 tmin, f64 tmax, PrimHit* out) const {
+    if (!node_count)
+      return false;
+
+    f32 org[3], inv_dir[3];
+    for (u32 axis = 0; axis < 3; ++axis) {
+      org[axis] = (f32)r.origin[axis];
+      inv_dir[axis] = (f32)(1.0 / r.dir[axis]);
+    }
+
+    struct Entry {
+      u32 node;
+      f32 tnear;
+    };
+    Entry stack[MAX_BVH_DEPTH];
+    u32 stack_size = 0;
+
+    bool hit_anything = false;
+    f64 closest = tmax;
+    f32 closest_f32 = tmax < 3.0e38 ? round_up(tmax) : INFINITY;
+    Isa isa = sphere_lanes ? get_isa() : ISA_SSE2;
+    u32 current = 0;
+    f32 tnear = 0.0f;
+    if (!intersect_node(nodes[0], org, inv_dir, closest_f32, &tnear))
+      return false;
+
+    while (true) {
+      const BvhNode& node = nodes[current];
+      if (node.count) {
+        if (intersect_leaf(*this, node, isa, r, tmin, &closest, out)) {
+          hit_anything = true;
+          closest_f32 = round_up(closest);
+        }
+      } else {
+        f32 t_left, t_right;
+        bool hit_left = intersect_node(nodes[node.offset], org, inv_dir, closest_f32, &t_left);
+        bool hit_right = intersect_node(nodes[node.offset + 1], org, inv_dir, closest_f32, &t_right);
+        if (hit_left && hit_right) {
+          // Nearest child first, the other one waits on the stack.
+          bool left_first = t_left <= t_right;
+          stack[stack_size].node = left_first ? node.offset + 1 : node.offset;
+          stack[stack_size].tnear = left_first ? t_right : t_left;
+          ++stack_size;
+          current = left_first ? node.offset : node.offset + 1;
+          continue;
+        }
+        if (hit_left || hit_right) {
+          current = hit_left ? node.offset : node.offset + 1;
+          continue;
+        }
+      }
+
+      // Skip entries that lie beyond the closest hit found since.
+      while (stack_size && stack[stack_size - 1].tnear > closest_f32)
+        --stack_size;
+      if (!stack_size)
+        break;
+      current = stack[--stack_size].node;
+    }
+    return hit_anything;
+  }
+
+  void Bvh::intersect_packet(const Ray* rays, u32 count, f64 tmin, f64 tmax, PrimHit* out, bool* hits) const {
+    for (u32 i = 0; i < count; ++i)
+      hits[i] = false;
+    if (!node_count || !count)
+      return;
+
+    // Lanes past `count` repeat the first ray, and are masked off.
+    f32 org[3][RAY_PACKET_SIZE], inv_dir[3][RAY_PACKET_SIZE];
+    f64 closest[RAY_PACKET_SIZE];
+    f32 closest_f32[RAY_PACKET_SIZE];
+    for (u32 lane = 0; lane < RAY_PACKET_SIZE; ++lane) {
+      const Ray& r = rays[lane < count ? lane : 0];
+      for (u32 axis = 0; axis < 3; ++axis) {
+        org[axis][lane] = (f32)r.origin[axis];
+        inv_dir[axis][lane] = (f32)(1.0 / r.dir[axis]);
+      }
+      closest[lane] = tmax;
+      closest_f32[lane] = tmax < 3.0e38 ? round_up(tmax) : INFINITY;
+    }
+    __m128 org4[3], inv_dir4[3];
+    for (u32 axis = 0; axis < 3; ++axis) {
+      org4[axis] = _mm_loadu_ps(org[axis]);
+      inv_dir4[axis] = _mm_loadu_ps(inv_dir[axis]);
+    }
+
+    // Children are pushed with the rays that hit them, and where.
+    struct Entry {
+      u32 node;
+      u32 mask;
+      f32 tnear[RAY_PACKET_SIZE];
+    };
+    Entry stack[MAX_BVH_DEPTH];
+    u32 stack_size = 0;
+
+    Isa isa = sphere_lanes ? get_isa() : ISA_SSE2;
+    __m128 tnear;
+    u32 current = 0;
+    u32 mask = intersect_node4(nodes[0], org4, inv_dir4, _mm_loadu_ps(closest_f32), &tnear) & ((1u << count) - 1);
+    while (mask) {
+      const BvhNode& node = nodes[current];
+      if (node.count) {
+        for (u32 lane = 0; lane < count; ++lane) {
+          if (((mask >> lane) & 1) && intersect_leaf(*this, node, isa, rays[lane], tmin, &closest[lane], &out[lane])) {
+            hits[lane] = true;
+            closest_f32[lane] = round_up(closest[lane]);
+          }
+        }
+      } else {
+        __m128 tmax4 = _mm_loadu_ps(closest_f32);
+        __m128 t_left, t_right;
+        u32 left = intersect_node4(nodes[node.offset], org4, inv_dir4, tmax4, &t_left) & mask;
+        u32 right = intersect_node4(nodes[node.offset + 1], org4, inv_dir4, tmax4, &t_right) & mask;
+        if (left && right) {
+          // The rays go much the same way, so the first of them picks
+          // the order for all.
+          f32 tl[RAY_PACKET_SIZE], tr[RAY_PACKET_SIZE];
+          _mm_storeu_ps(tl, t_left);
+          _mm_storeu_ps(tr, t_right);
+          u32 lane = 0;
+          while (!(((left | right) >> lane) & 1))
+            ++lane;
+          bool in_left = ((left >> lane) & 1) != 0;
+          bool in_right = ((right >> lane) & 1) != 0;
+          bool left_first = !in_right || (in_left && tl[lane] <= tr[lane]);
+          Entry& e = stack[stack_size++];
+          e.node = left_first ? node.offset + 1 : node.offset;
+          e.mask = left_first ? right : left;
+          _mm_storeu_ps(e.tnear, left_first ? t_right : t_left);
+          current = left_first ? node.offset : node.offset + 1;
+          mask = left_first ? left : right;
+          continue;
+        }
+        if (left || right) {
+          current = left ? node.offset : node.offset + 1;
+          mask = left ? left : right;
+          continue;
+        }
+      }
+
+      // Entries go on with the rays that have not found a closer hit since.
+      mask = 0;
+      while (stack_size && !mask) {
+        const Entry& e = stack[--stack_size];
+        mask = e.mask & (u32)_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(e.tnear), _mm_loadu_ps(closest_f32)));
+        current = e.node;
+      }
+    }
+  }
+
+  bool Bvh::hit(const Ray& r, f64 tmin, f64 tmax, HitRecord* hr) const {
+    PrimHit closest;
+    if (!intersect(r, tmin, tmax, &closest))
+      return false;
+    if (hr)
+      closest.prim->get_surface(r, closest.t, hr);
+    return true;
+  }
+
+  Aabb Bvh::get_bounds() const {
+    if (!node_count)
+      return Aabb();
+
+    const BvhNode& root = nodes[0];
+    return Aabb(Point3(root.lo[0], root.lo[1], root.lo[2]), Point3(root.hi[0], root.hi[1], root.hi[2]));
+  }
+
+  void Bvh::release() {
+    for (usize i = 0; i < prims.length; ++i)
+      prims[i].release();
+    prims.release();
+
+    if (cache.data) {
+      cache.release();
+    } else {
+      free((void*)nodes);
+      free((void*)prim_order);
+    }
+    free(sphere_lanes);
+    nodes = nullptr;
+    node_count = 0;
+    prim_order = nullptr;
+    sphere_lanes = nullptr;
+    lane_stride = 0;
+  }
+
+  void build_bvh(Vector<Hittable>* prims, Bvh* out) {
+    u32 prim_count = (u32)prims->length;
+    *out = Bvh();
+    if (!prim_count) {
+      out->prims = *prims;
+      *prims = Vector<Hittable>();
+      return;
+    }
+
+    BuildPrim* build_prims = (BuildPrim*)malloc(prim_count * sizeof(BuildPrim));
+    u32* indices = (u32*)malloc(prim_count * sizeof(u32));
+    for (u32 i = 0; i < prim_count; ++i) {
+      build_prims[i].bounds = (*prims)[i].get_bounds();
+      build_prims[i].centroid = build_prims[i].bounds.center();
+      indices[i] = i;
+    }
+
+    // A binary tree with one prim per leaf is as large as it gets.
+    Builder b;
+    b.prims = build_prims;
+    b.indices = indices;
+    b.nodes = (BvhNode*)malloc((2*(usize)prim_count - 1) * sizeof(BvhNode));
+    b.node_count = 1;
+    b.parallel_depth = 0;
+    for (u32 threads = 1; threads < get_cpu_count(); threads *= 2)
+      ++b.parallel_depth;
+    build_node(&b, 0, 0, prim_count, 0);
+
+    reorder_prims(prims, indices);
+    out->prims = *prims;
+    *prims = Vector<Hittable>();
+    out->nodes = b.nodes;
+    out->node_count = (u32)b.node_count;
+    out->prim_order = indices;
+    update_sphere_lanes(out);
+    free(build_prims);
+  }
+
+  void refit_bvh(Bvh* bvh) {
+    if (!bvh->node_count)
+      return;
+
+    // Mapped cache files are read-only; the tree moves to memory of its own.
+    if (bvh->cache.data) {
+      usize nodes_size = (usize)bvh->node_count * sizeof(BvhNode);
+      usize order_size = bvh->prims.length * sizeof(u32);
+      BvhNode* nodes = (BvhNode*)malloc(nodes_size);
+      u32* order = (u32*)malloc(order_size);
+      memcpy(nodes, bvh->nodes, nodes_size);
+      memcpy(order, bvh->prim_order, order_size);
+      bvh->cache.release();
+      bvh->nodes = nodes;
+      bvh->prim_order = order;
+    }
+
+    // Children always come after their parent, so going backwards sees
+    // them first.
+    BvhNode* nodes = (BvhNode*)bvh->nodes;
+    for (u32 i = bvh->node_count; i > 0; --i) {
+      BvhNode& node = nodes[i - 1];
+      if (node.count) {
+        Aabb bounds;
+        for (u32 j = node.offset; j < node.offset + node.count; ++j)
+          bounds.grow(bvh->prims[j].get_bounds());
+        set_node_bounds(&node, bounds);
+        continue;
+      }
+
+      // Child bounds already have their margin and rounding.
+      const BvhNode& left = nodes[node.offset];
+      const BvhNode& right = nodes[node.offset + 1];
+      for (u32 axis = 0; axis < 3; ++axis) {
+        node.lo[axis] = left.lo[axis] < right.lo[axis] ? left.lo[axis] : right.lo[axis];
+        node.hi[axis] = left.hi[axis] > right.hi[axis] ? left.hi[axis] : right.hi[axis];
+      }
+    }
+    update_sphere_lanes(bvh);
+  }
+
+  namespace {
+    f64 get_node_area(const BvhNode& node) {
+      f64 dx = (f64)node.hi[0] - node.lo[0];
+      f64 dy = (f64)node.hi[1] - node.lo[1];
+      f64 dz = (f64)node.hi[2] - node.lo[2];
+      return 2.0 * (dx*dy + dy*dz + dz*dx);
+    }
+  }
+
+  f64 get_bvh_cost(const Bvh& bvh) {
+    if (!bvh.node_count)
+      return 0.0;
+
+    f64 root_area = get_node_area(bvh.nodes[0]);
+    if (root_area <= 0.0)
+      return 0.0;
+
+    // Same unit costs as the build uses.
+    f64 cost = 0.0;
+    for (u32 i = 0; i < bvh.node_count; ++i) {
+      const BvhNode& node = bvh.nodes[i];
+      cost += get_node_area(node) * (node.count ? node.count : 1);
+    }
+    return cost / root_area;
+  }
+
+  u64 hash_bvh_input(const Vector<Hittable>& prims) {
+    // FNV-1a.
+    u64 hash = 0xCBF29CE484222325ull;
+    for (usize i = 0; i < prims.length; ++i) {
+      Aabb bounds = prims[i].get_bounds();
+      u32 type = prims[i].type;
+      u8 bytes[sizeof(type) + sizeof(bounds)];
+      memcpy(bytes, &type, sizeof(type));
+      memcpy(bytes + sizeof(type), &bounds, sizeof(bounds));
+      for (usize j = 0; j < sizeof(bytes); ++j) {
+        hash ^= bytes[j];
+        hash *= 0x100000001B3ull;
+      }
+    }
+    return hash;
+  }
+
+  namespace {
+    const u32 BVH_FILE_MAGIC = 0x48564253; // "SBVH".
+    // 2: trees built since empty bins stopped hiding SAH splits.
+    const u32 BVH_FILE_VERSION = 2;
+
+    // Padded to the size of a node, so that the nodes after it stay aligned.
+    struct BvhFileHeader {
+      u32 magic;
+      u32 version;
+      u64 hash;
+      u32 prim_count;
+      u32 node_count;
+      u32 reserved[2];
+    };
+
+    // Whether traversal can walk the tree: children and prims in range,
+    // every node reached once, and no node deeper than MAX_BVH_DEPTH.
+    bool is_valid_tree(const BvhNode* nodes, u32 node_count, u32 prim_count) {
+      if (!node_count)
+        return !prim_count;
+
+      // A pending sibling per level, and both children of the deepest
+      // interior node.
+      struct Entry {
+        u32 node;
+        u32 depth;
+      };
+      Entry stack[MAX_BVH_DEPTH + 1];
+      u32 stack_size = 1;
+      stack[0].node = 0;
+      stack[0].depth = 0;
+      u32 visited = 0;
+      while (stack_size) {
+        Entry e = stack[--stack_size];
+        if (++visited > node_count)
+          return false;
+
+        const BvhNode& node = nodes[e.node];
+        if (node.count) {
+          if (node.offset > prim_count || node.count > prim_count - node.offset)
+            return false;
+          continue;
+        }
+        if (e.depth == MAX_BVH_DEPTH || node.offset >= node_count - 1)
+          return false;
+        for (u32 child = 0; child < 2; ++child) {
+          stack[stack_size].node = node.offset + child;
+          stack[stack_size].depth = e.depth + 1;
+          ++stack_size;
+        }
+      }
+      return true;
+    }
+  }
+
+  bool save_bvh(const Bvh& bvh, u64 hash, const char* path) {
+    BvhFileHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = BVH_FILE_MAGIC;
+    header.version = BVH_FILE_VERSION;
+    header.hash = hash;
+    header.prim_count = (u32)bvh.prims.length;
+    header.node_count = bvh.node_count;
+
+    usize nodes_size = (usize)bvh.node_count * sizeof(BvhNode);
+    usize order_size = bvh.prims.length * sizeof(u32);
+    usize size = sizeof(header) + nodes_size + order_size;
+    u8* data = (u8*)malloc(size);
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), bvh.nodes, nodes_size);
+    memcpy(data + sizeof(header) + nodes_size, bvh.prim_order, order_size);
+
+    bool ok = write_file(path, data, size);
+    free(data);
+    return ok;
+  }
+
+  bool load_bvh(const char* path, u64 hash, Vector<Hittable>* prims, Bvh* out) {
+    MappedFile file;
+    if (!file.open(path))
+      return false;
+
+    BvhFileHeader header;
+    bool valid = file.size >= sizeof(header);
+    if (valid) {
+      memcpy(&header, file.data, sizeof(header));
+      valid = header.magic == BVH_FILE_MAGIC
+          && header.version == BVH_FILE_VERSION
+          && header.hash == hash
+          && header.prim_count == prims->length
+          && file.size == sizeof(header) + (usize)header.node_count*sizeof(BvhNode) + (usize)header.prim_count*sizeof(u32);
+    }
+
+    const BvhNode* nodes = (const BvhNode*)(file.data + sizeof(header));
+    const u32* order = (const u32*)(nodes + (valid ? header.node_count : 0));
+    for (u32 i = 0; valid && i < header.prim_count; ++i)
+      valid = order[i] < header.prim_count;
+    valid = valid && is_valid_tree(nodes, header.node_count, header.prim_count);
+    if (!valid) {
+      file.release();
+      return false;
+    }
+
+    *out = Bvh();
+    reorder_prims(prims, order);
+    out->prims = *prims;
+    *prims = Vector<Hittable>();
+    out->nodes = nodes;
+    out->node_count = header.node_count;
+    out->prim_order = order;
+    out->cache = file;
+    update_sphere_lanes(out);
+    return true;
+  }
+
+  void build_or_load_bvh(Vector<Hittable>* prims, const char* cache_dir, Bvh* out, BvhStats* stats) {
+    u64 hash = hash_bvh_input(*prims);
+    char path[1024];
+    if (cache_dir) {
+      snprintf(path, sizeof(path), "%s/bvh-%016llx.bin", cache_dir, hash);
+
+      f64 start = get_time_seconds();
+      if (load_bvh(path, hash, prims, out)) {
+        stats->from_cache = true;
+        stats->load_time = get_time_seconds() - start;
+        stats->node_count = out->node_count;
+        return;
+      }
+    }
+
+    f64 start = get_time_seconds();
+    build_bvh(prims, out);
+    stats->from_cache = false;
+    stats->build_time = get_time_seconds() - start;
+    stats->node_count = out->node_count;
+
+    if (cache_dir) {
+      start = get_time_seconds();
+      if (make_directory(cache_dir))
+        save_bvh(*out, hash, path);
+      stats->save_time = get_time_seconds() - start;
+    }
+  }
+}
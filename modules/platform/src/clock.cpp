@@ -0,0 +1,22 @@
+#include "simplay/platform/clock.h"
+
+#include <windows.h>
+
+namespace sim {
+  f64 get_time_seconds() {
+    static f64 inv_frequency = 0.0;
+    if (inv_frequency == 0.0) {
+      LARGE_INTEGER frequency;
+      QueryPerformanceFrequency(&frequency);
+      inv_frequency = 1.0 / (f64)frequency.QuadPart;
+    }
+
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (f64)counter.QuadPart * inv_frequency;
+  }
+
+  void sleep_ms(u32 ms) {
+    Sleep(ms);
+  }
+}
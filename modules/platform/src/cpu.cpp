@@ -0,0 +1,111 @@
+#include "simplay/platform/cpu.h"
+
+#include <immintrin.h>
+#include <intrin.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+
+namespace sim {
+  namespace {
+    const char* ISA_NAMES[ISA_COUNT] = {"sse2", "avx2", "avx512"};
+
+    // XCR0 bits for the SSE, AVX and AVX-512 register state.
+    const u64 XCR0_AVX = 0x6;
+    const u64 XCR0_AVX512 = 0xE0;
+
+    bool has_bit(i32 reg, u32 bit) {
+      return (((u32)reg >> bit) & 1) != 0;
+    }
+
+    CpuFeatures detect_features() {
+      CpuFeatures f;
+      memset(&f, 0, sizeof(f));
+
+      i32 regs[4];
+      __cpuid(regs, 0);
+      i32 max_leaf = regs[0];
+
+      __cpuid(regs, 1);
+      f.sse2 = has_bit(regs[3], 26);
+      f.fma = has_bit(regs[2], 12);
+      f.avx = has_bit(regs[2], 28);
+      bool osxsave = has_bit(regs[2], 27);
+
+      if (max_leaf >= 7) {
+        __cpuidex(regs, 7, 0);
+        f.avx2 = has_bit(regs[1], 5);
+        f.avx512f = has_bit(regs[1], 16);
+      }
+
+      if (osxsave) {
+        u64 xcr0 = _xgetbv(0);
+        f.os_avx = (xcr0 & XCR0_AVX) == XCR0_AVX;
+        f.os_avx512 = f.os_avx && (xcr0 & XCR0_AVX512) == XCR0_AVX512;
+      }
+
+      f.best_isa = ISA_SSE2;
+      if (f.avx && f.avx2 && f.os_avx) {
+        f.best_isa = ISA_AVX2;
+        if (f.avx512f && f.os_avx512)
+          f.best_isa = ISA_AVX512;
+      }
+      return f;
+    }
+
+    Isa pick_isa() {
+      const CpuFeatures& features = get_cpu_features();
+      char name[32];
+      DWORD length = GetEnvironmentVariableA("SIM_ISA", name, sizeof(name));
+      if (!length || length >= sizeof(name))
+        return features.best_isa;
+
+      Isa isa;
+      if (!parse_isa(name, &isa)) {
+        fprintf(stderr, "Unknown SIM_ISA \"%s\", using %s\n", name, get_isa_name(features.best_isa));
+        return features.best_isa;
+      }
+      if (isa > features.best_isa) {
+        fprintf(stderr, "SIM_ISA %s is not supported here, using %s\n", name, get_isa_name(features.best_isa));
+        return features.best_isa;
+      }
+      return isa;
+    }
+
+    Isa& get_isa_slot() {
+      static Isa isa = pick_isa();
+      return isa;
+    }
+  }
+
+  const CpuFeatures& get_cpu_features() {
+    static const CpuFeatures features = detect_features();
+    return features;
+  }
+
+  Isa get_isa() {
+    return get_isa_slot();
+  }
+
+  bool set_isa(Isa isa) {
+    if (isa >= ISA_COUNT || isa > get_cpu_features().best_isa)
+      return false;
+    get_isa_slot() = isa;
+    return true;
+  }
+
+  const char* get_isa_name(Isa isa) {
+    return isa < ISA_COUNT ? ISA_NAMES[isa] : "unknown";
+  }
+
+  bool parse_isa(const char* name, Isa* out) {
+    for (u32 i = 0; i < ISA_COUNT; ++i) {
+      if (strcmp(name, ISA_NAMES[i]) == 0) {
+        *out = (Isa)i;
+        return true;
+      }
+    }
+    return false;
+  }
+}
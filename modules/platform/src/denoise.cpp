@@ -0,0 +1,266 @@
+#include "simplay/platform/denoise.h"
+
+#include <emmintrin.h>
+#include <stdlib.h>
+
+#include "simplay/platform/thread.h"
+
+namespace sim {
+  namespace {
+    // Single-precision planar copy of an image, so that four neighboring
+    // pixels of a channel are one SSE load away.
+    struct Planes {
+      f32* data;
+      u32 w, h;
+      u32 count;
+
+      Planes() : data(nullptr), w(0), h(0), count(0) {}
+
+      f32* get(u32 plane, u32 y) { return data + ((usize)plane*h + y)*w; }
+      const f32* get(u32 plane, u32 y) const { return data + ((usize)plane*h + y)*w; }
+
+      void init(u32 new_w, u32 new_h, u32 new_count) {
+        w = new_w;
+        h = new_h;
+        count = new_count;
+        data = (f32*)malloc((usize)w*h*count * sizeof(f32));
+      }
+
+      void release() {
+        free(data);
+        data = nullptr;
+      }
+    };
+
+    void copy_to_planes(const FloatImage& img, Planes* planes, u32 first_plane) {
+      for (u32 y = 0; y < img.h; ++y) {
+        for (u32 c = 0; c < 3; ++c) {
+          f32* row = planes->get(first_plane + c, y);
+          for (u32 x = 0; x < img.w; ++x)
+            row[x] = (f32)img.get(x, y)[c];
+        }
+      }
+    }
+
+    // exp(x) for x <= 0, accurate to about 1e-5 relative error.
+    __m128 exp_neg_ps(__m128 x) {
+      x = _mm_max_ps(x, _mm_set1_ps(-80.0f));
+      __m128 t = _mm_mul_ps(x, _mm_set1_ps(1.44269504f));
+      __m128i ti = _mm_cvttps_epi32(t);
+      __m128 fi = _mm_cvtepi32_ps(ti);
+      // Truncation rounds towards zero, we want floor.
+      __m128 adjust = _mm_and_ps(_mm_cmplt_ps(t, fi), _mm_set1_ps(1.0f));
+      fi = _mm_sub_ps(fi, adjust);
+      ti = _mm_cvttps_epi32(fi);
+      __m128 f = _mm_sub_ps(t, fi);
+
+      __m128 p = _mm_set1_ps(1.33336e-3f);
+      p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(9.61813e-3f));
+      p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(5.550411e-2f));
+      p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(2.4022650e-1f));
+      p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(6.9314718e-1f));
+      p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+
+      __m128i bits = _mm_slli_epi32(_mm_add_epi32(ti, _mm_set1_epi32(127)), 23);
+      return _mm_mul_ps(p, _mm_castsi128_ps(bits));
+    }
+
+    // Loads 4 consecutive pixels starting at x, clamping at the row edges.
+    __m128 load4(const f32* row, i32 x, i32 w) {
+      if (x >= 0 && x + 4 <= w)
+        return _mm_loadu_ps(row + x);
+
+      f32 v[4];
+      for (i32 i = 0; i < 4; ++i) {
+        i32 xi = x + i;
+        xi = xi < 0 ? 0 : (xi >= w ? w - 1 : xi);
+        v[i] = row[xi];
+      }
+      return _mm_loadu_ps(v);
+    }
+
+    // Plane layout of the guide buffer.
+    enum GuidePlane : u32 {
+      GUIDE_ALBEDO = 0,
+      GUIDE_NORMAL = 3,
+      GUIDE_DEPTH = 6,
+      GUIDE_PLANE_COUNT = 7,
+    };
+
+    struct Pass {
+      const Planes* guide;
+      const Planes* in;
+      Planes* out;
+      i32 step;
+      f32 inv_color_var;
+      f32 inv_albedo_var;
+      f32 normal_sharpness;
+      f32 depth_sharpness;
+    };
+
+    const f32 KERNEL[5] = {1.0f/16.0f, 1.0f/4.0f, 3.0f/8.0f, 1.0f/4.0f, 1.0f/16.0f};
+
+    void filter_row(u32 y, void* arg) {
+      const Pass& pass = *(const Pass*)arg;
+      const Planes& guide = *pass.guide;
+      const Planes& in = *pass.in;
+      i32 w = (i32)in.w;
+      i32 h = (i32)in.h;
+
+      const f32* p_rows[GUIDE_PLANE_COUNT];
+      for (u32 i = 0; i < GUIDE_PLANE_COUNT; ++i)
+        p_rows[i] = guide.get(i, y);
+      const f32* p_color[3] = {in.get(0, y), in.get(1, y), in.get(2, y)};
+
+      const __m128 one = _mm_set1_ps(1.0f);
+      const __m128 zero = _mm_setzero_ps();
+      const __m128 inv_color_var = _mm_set1_ps(pass.inv_color_var);
+      const __m128 inv_albedo_var = _mm_set1_ps(pass.inv_albedo_var);
+      const __m128 normal_sharpness = _mm_set1_ps(pass.normal_sharpness);
+      const __m128 depth_sharpness = _mm_set1_ps(pass.depth_sharpness);
+      const __m128 center_weight = _mm_set1_ps(KERNEL[2]*KERNEL[2]);
+
+      for (i32 x = 0; x < w; x += 4) {
+        __m128 pc[3], pa[3], pn[3];
+        for (u32 c = 0; c < 3; ++c) {
+          pc[c] = load4(p_color[c], x, w);
+          pa[c] = load4(p_rows[GUIDE_ALBEDO + c], x, w);
+          pn[c] = load4(p_rows[GUIDE_NORMAL + c], x, w);
+        }
+        __m128 pz = load4(p_rows[GUIDE_DEPTH], x, w);
+        __m128 depth_scale = _mm_div_ps(depth_sharpness, _mm_max_ps(pz, _mm_set1_ps(1e-4f)));
+
+        // The center tap is always trusted, so pixels without geometry (whose
+        // normal is zero) keep their own value.
+        __m128 sum_w = center_weight;
+        __m128 sum_c[3];
+        for (u32 c = 0; c < 3; ++c)
+          sum_c[c] = _mm_mul_ps(center_weight, pc[c]);
+
+        for (i32 dy = -2; dy <= 2; ++dy) {
+          i32 yy = (i32)y + dy*pass.step;
+          yy = yy < 0 ? 0 : (yy >= h ? h - 1 : yy);
+
+          const f32* q_rows[GUIDE_PLANE_COUNT];
+          for (u32 i = 0; i < GUIDE_PLANE_COUNT; ++i)
+            q_rows[i] = guide.get(i, (u32)yy);
+          const f32* q_color[3] = {in.get(0, (u32)yy), in.get(1, (u32)yy), in.get(2, (u32)yy)};
+
+          for (i32 dx = -2; dx <= 2; ++dx) {
+            if (dx == 0 && dy == 0)
+              continue;
+
+            i32 xx = x + dx*pass.step;
+            __m128 qc[3], dist_c = zero, dist_a = zero, ndot = zero;
+            for (u32 c = 0; c < 3; ++c) {
+              qc[c] = load4(q_color[c], xx, w);
+              __m128 dc = _mm_sub_ps(qc[c], pc[c]);
+              dist_c = _mm_add_ps(dist_c, _mm_mul_ps(dc, dc));
+              __m128 da = _mm_sub_ps(load4(q_rows[GUIDE_ALBEDO + c], xx, w), pa[c]);
+              dist_a = _mm_add_ps(dist_a, _mm_mul_ps(da, da));
+              ndot = _mm_add_ps(ndot, _mm_mul_ps(load4(q_rows[GUIDE_NORMAL + c], xx, w), pn[c]));
+            }
+            __m128 dz = _mm_sub_ps(load4(q_rows[GUIDE_DEPTH], xx, w), pz);
+            dz = _mm_max_ps(dz, _mm_sub_ps(zero, dz));
+
+            // All edge-stopping terms share a single exponential.
+            __m128 e = _mm_mul_ps(dist_c, inv_color_var);
+            e = _mm_add_ps(e, _mm_mul_ps(dist_a, inv_albedo_var));
+            e = _mm_add_ps(e, _mm_mul_ps(_mm_sub_ps(one, _mm_max_ps(ndot, zero)), normal_sharpness));
+            e = _mm_add_ps(e, _mm_mul_ps(dz, depth_scale));
+            __m128 wq = _mm_mul_ps(_mm_set1_ps(KERNEL[dy + 2]*KERNEL[dx + 2]), exp_neg_ps(_mm_sub_ps(zero, e)));
+
+            sum_w = _mm_add_ps(sum_w, wq);
+            for (u32 c = 0; c < 3; ++c)
+              sum_c[c] = _mm_add_ps(sum_c[c], _mm_mul_ps(wq, qc[c]));
+          }
+        }
+
+        __m128 inv_w = _mm_div_ps(one, sum_w);
+        for (u32 c = 0; c < 3; ++c) {
+          f32* out_row = pass.out->get(c, y);
+          __m128 res = _mm_mul_ps(sum_c[c], inv_w);
+          if (x + 4 <= w) {
+            _mm_storeu_ps(out_row + x, res);
+          } else {
+            f32 v[4];
+            _mm_storeu_ps(v, res);
+            for (i32 i = 0; x + i < w; ++i)
+              out_row[x + i] = v[i];
+          }
+        }
+      }
+    }
+  }
+
+  void denoise(const FloatImage& color, const AovImages& aovs, const DenoiseSettings& settings, FloatImage* out) {
+    if (!out)
+      return;
+
+    u32 w = color.w;
+    u32 h = color.h;
+
+    Planes guide;
+    guide.init(w, h, GUIDE_PLANE_COUNT);
+    copy_to_planes(aovs.albedo, &guide, GUIDE_ALBEDO);
+    copy_to_planes(aovs.normal, &guide, GUIDE_NORMAL);
+    for (u32 y = 0; y < h; ++y) {
+      f32* row = guide.get(GUIDE_DEPTH, y);
+      for (u32 x = 0; x < w; ++x)
+        row[x] = (f32)aovs.depth.get(x, y).x;
+    }
+
+    // Filter irradiance rather than radiance, albedo is multiplied back below.
+    Planes ping, pong;
+    ping.init(w, h, 3);
+    pong.init(w, h, 3);
+    for (u32 c = 0; c < 3; ++c) {
+      for (u32 y = 0; y < h; ++y) {
+        f32* row = ping.get(c, y);
+        const f32* albedo = guide.get(GUIDE_ALBEDO + c, y);
+        for (u32 x = 0; x < w; ++x) {
+          f32 a = albedo[x] > 1e-3f ? albedo[x] : 1e-3f;
+          row[x] = (f32)color.get(x, y)[c] / a;
+        }
+      }
+    }
+
+    Pass pass;
+    pass.guide = &guide;
+    pass.inv_albedo_var = 1.0f / (settings.albedo_sigma*settings.albedo_sigma);
+    pass.normal_sharpness = settings.normal_sharpness;
+    pass.depth_sharpness = settings.depth_sharpness;
+    Planes* src = &ping;
+    Planes* dst = &pong;
+    f32 color_sigma = settings.color_sigma;
+    for (u32 i = 0; i < settings.iterations; ++i) {
+      pass.in = src;
+      pass.out = dst;
+      pass.step = 1 << i;
+      pass.inv_color_var = 1.0f / (color_sigma*color_sigma);
+      parallel_for(h, filter_row, &pass);
+
+      Planes* filtered = dst;
+      dst = src;
+      src = filtered;
+      // Each level sees smoother input, so it can afford to be stricter.
+      color_sigma *= 0.5f;
+    }
+
+    out->init(w, h);
+    for (u32 y = 0; y < h; ++y) {
+      for (u32 c = 0; c < 3; ++c) {
+        const f32* row = src->get(c, y);
+        const f32* albedo = guide.get(GUIDE_ALBEDO + c, y);
+        for (u32 x = 0; x < w; ++x) {
+          f32 a = albedo[x] > 1e-3f ? albedo[x] : 1e-3f;
+          out->get(x, y)[c] = (f64)(row[x] * a);
+        }
+      }
+    }
+
+    ping.release();
+    pong.release();
+    guide.release();
+  }
+}
@@ -0,0 +1,87 @@
+#include "simplay/platform/file_map.h"
+
+#include <stdio.h>
+#include <windows.h>
+
+namespace sim {
+  bool MappedFile::open(const char* path) {
+    release();
+
+    HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (f == INVALID_HANDLE_VALUE)
+      return false;
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(f, &file_size) || file_size.QuadPart == 0) {
+      CloseHandle(f);
+      return false;
+    }
+
+    HANDLE m = CreateFileMappingA(f, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!m) {
+      CloseHandle(f);
+      return false;
+    }
+
+    void* view = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+      CloseHandle(m);
+      CloseHandle(f);
+      return false;
+    }
+
+    data = (const u8*)view;
+    size = (usize)file_size.QuadPart;
+    file = f;
+    mapping = m;
+    return true;
+  }
+
+  void MappedFile::release() {
+    if (data)
+      UnmapViewOfFile(data);
+    if (mapping)
+      CloseHandle(mapping);
+    if (file)
+      CloseHandle(file);
+
+    data = nullptr;
+    size = 0;
+    file = nullptr;
+    mapping = nullptr;
+  }
+
+  bool write_file(const char* path, const void* data, usize size) {
+    // Named after the process, so that writers of the same file at once
+    // each have their own.
+    char temp_path[MAX_PATH];
+    if (snprintf(temp_path, sizeof(temp_path), "%s.%lu.tmp", path, (unsigned long)GetCurrentProcessId()) >= (int)sizeof(temp_path)) {
+      fprintf(stderr, "Path too long: \"%s\"\n", path);
+      return false;
+    }
+
+    FILE* out = nullptr;
+    if (fopen_s(&out, temp_path, "wb")) {
+      fprintf(stderr, "Failed to open file: \"%s\"\n", temp_path);
+      return false;
+    }
+
+    bool ok = fwrite(data, 1, size, out) == size;
+    ok = fclose(out) == 0 && ok;
+    if (ok && !MoveFileExA(temp_path, path, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+      fprintf(stderr, "Failed to replace file: \"%s\"\n", path);
+      ok = false;
+    }
+    if (!ok)
+      DeleteFileA(temp_path);
+    return ok;
+  }
+
+  bool make_directory(const char* path) {
+    if (CreateDirectoryA(path, nullptr) || GetLastError() == ERROR_ALREADY_EXISTS)
+      return true;
+
+    fprintf(stderr, "Failed to create directory: \"%s\"\n", path);
+    return false;
+  }
+}
@@ -0,0 +1,202 @@
+#include "simplay/platform/gbuffer.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "simplay/platform/common.h"
+#include "simplay/platform/thread.h"
+
+namespace sim {
+  static_assert(MAX_GBUFFER_SUBSAMPLES == 16, "Subsample offsets are 4-bit Sobol points");
+
+  void get_subsample_offset(u32 index, f64* dx, f64* dy) {
+    // The first 16 points of the Sobol (0, 2)-sequence in sixteenths,
+    // moved off the pixel corner.
+    const u32 directions[4] = {8, 12, 10, 15};
+    u32 i = index % MAX_GBUFFER_SUBSAMPLES;
+    u32 x = 0;
+    u32 y = 0;
+    for (u32 bit = 0; bit < 4; ++bit) {
+      if (i & (1u << bit)) {
+        x ^= 8u >> bit;
+        y ^= directions[bit];
+      }
+    }
+    *dx = (x + 0.5) / 16.0;
+    *dy = (y + 0.5) / 16.0;
+  }
+
+  bool GBuffer::get_hit(u32 x, u32 y, u32 subsample, const Ray& r, HitRecord* hr) const {
+    u32 prim = get(x, y, subsample);
+    if (prim == GBUFFER_NO_HIT)
+      return false;
+    return prims[prim]->hit(r, 0.001, F64_INF, hr);
+  }
+
+  void GBuffer::release() {
+    free(prim_ids);
+    prim_ids = nullptr;
+    w = 0;
+    h = 0;
+    subsamples = 0;
+    prims.release();
+  }
+
+  namespace {
+    // Rows of pixels rasterized by one task, with their depth buffer.
+    const u32 BAND_HEIGHT = 8;
+
+    void collect_spheres(const Hittable& h, Vector<const Sphere*>* out) {
+      switch (h.type) {
+        case Hittable::NONE:
+        default:
+          break;
+        case Hittable::SPHERE:
+          out->push(&h.sphere);
+          break;
+        case Hittable::SCENE:
+          for (usize i = 0; i < h.scene.length; ++i)
+            collect_spheres(h.scene[i], out);
+          break;
+        case Hittable::BVH:
+          for (usize i = 0; i < h.bvh->prims.length; ++i)
+            collect_spheres(h.bvh->prims[i], out);
+          break;
+      }
+    }
+
+    // Inclusive pixel range, empty when x0 > x1.
+    struct ScreenBounds {
+      i32 x0, y0, x1, y1;
+    };
+
+    // Projects the corners of the sphere's box, which bound its projection
+    // as long as they are all in front of the camera.
+    ScreenBounds project_sphere(const Camera& cam, const Sphere& sphere, u32 img_w, u32 img_h) {
+      ScreenBounds full = {0, 0, (i32)img_w-1, (i32)img_h-1};
+      ScreenBounds empty = {0, 0, -1, -1};
+
+      Vec3 forward = -cam.w;
+      f64 plane_dist = dot(cam.lower_left - cam.origin, forward);
+      f64 h_sqmag = cam.horizontal.sqmag();
+      f64 v_sqmag = cam.vertical.sqmag();
+      Aabb box = sphere.get_bounds();
+
+      f64 s_lo = F64_INF, s_hi = -F64_INF;
+      f64 t_lo = F64_INF, t_hi = -F64_INF;
+      u32 in_front = 0;
+      for (u32 i = 0; i < 8; ++i) {
+        Point3 corner((i & 1) ? box.hi.x : box.lo.x, (i & 2) ? box.hi.y : box.lo.y, (i & 4) ? box.hi.z : box.lo.z);
+        Vec3 d = corner - cam.origin;
+        f64 depth = dot(d, forward);
+        if (depth <= 1e-9)
+          continue;
+
+        ++in_front;
+        f64 k = plane_dist / depth;
+        f64 s = 0.5 + dot(d, cam.horizontal) / h_sqmag * k;
+        f64 t = 0.5 + dot(d, cam.vertical) / v_sqmag * k;
+        s_lo = min(s_lo, s);
+        s_hi = max(s_hi, s);
+        t_lo = min(t_lo, t);
+        t_hi = max(t_hi, t);
+      }
+      if (!in_front)
+        return empty;
+      // Straddles the camera plane, so the corners say nothing.
+      if (in_front < 8)
+        return full;
+
+      // Subsample (x + dx) lands on s * (w-1); a pixel of margin on each
+      // side absorbs rounding.
+      f64 x_lo = ceil(s_lo * (img_w-1)) - 2.0;
+      f64 x_hi = floor(s_hi * (img_w-1)) + 1.0;
+      f64 y_lo = ceil(t_lo * (img_h-1)) - 2.0;
+      f64 y_hi = floor(t_hi * (img_h-1)) + 1.0;
+      if (x_hi < 0.0 || y_hi < 0.0 || x_lo > img_w-1 || y_lo > img_h-1)
+        return empty;
+
+      ScreenBounds b;
+      b.x0 = (i32)max(x_lo, 0.0);
+      b.y0 = (i32)max(y_lo, 0.0);
+      b.x1 = (i32)min(x_hi, (f64)(img_w-1));
+      b.y1 = (i32)min(y_hi, (f64)(img_h-1));
+      return b;
+    }
+
+    struct RasterBands {
+      const Camera* cam;
+      GBuffer* out;
+      const ScreenBounds* bounds;
+    };
+
+    void raster_band(u32 band, void* arg) {
+      RasterBands& bands = *(RasterBands*)arg;
+      GBuffer& out = *bands.out;
+      i32 y0 = (i32)(band * BAND_HEIGHT);
+      i32 y1 = (i32)min(band*BAND_HEIGHT + BAND_HEIGHT, out.h) - 1;
+
+      f64 dx[MAX_GBUFFER_SUBSAMPLES];
+      f64 dy[MAX_GBUFFER_SUBSAMPLES];
+      for (u32 i = 0; i < out.subsamples; ++i)
+        get_subsample_offset(i, &dx[i], &dy[i]);
+
+      usize band_samples = (usize)out.w * (u32)(y1 - y0 + 1) * out.subsamples;
+      u32* ids = out.prim_ids + (usize)y0 * out.w * out.subsamples;
+      f64* depths = (f64*)malloc(band_samples * sizeof(f64));
+      for (usize i = 0; i < band_samples; ++i) {
+        ids[i] = GBUFFER_NO_HIT;
+        depths[i] = F64_INF;
+      }
+
+      for (usize prim = 0; prim < out.prims.length; ++prim) {
+        const ScreenBounds& b = bands.bounds[prim];
+        if (b.x0 > b.x1 || b.y1 < y0 || b.y0 > y1)
+          continue;
+
+        const Sphere& sphere = *out.prims[prim];
+        for (i32 y = max(b.y0, y0); y <= min(b.y1, y1); ++y) {
+          for (i32 x = b.x0; x <= b.x1; ++x) {
+            usize base = ((usize)(y - y0)*out.w + (u32)x) * out.subsamples;
+            for (u32 i = 0; i < out.subsamples; ++i) {
+              // The same ray the integrator would trace, and the same test.
+              Ray r = bands.cam->cast_pinhole_ray(((f64)x + dx[i]) / (out.w-1), ((f64)y + dy[i]) / (out.h-1));
+              f64 t;
+              if (sphere.intersect(r, 0.001, depths[base + i], &t)) {
+                depths[base + i] = t;
+                ids[base + i] = (u32)prim;
+              }
+            }
+          }
+        }
+      }
+      free(depths);
+    }
+  }
+
+  bool build_gbuffer(
+      const Camera& cam, const Hittable& world, u32 img_w, u32 img_h,
+      u32 subsamples, GBuffer* out) {
+    out->release();
+    if (cam.lens_radius != 0.0)
+      return false;
+
+    out->w = img_w;
+    out->h = img_h;
+    out->subsamples = subsamples < MAX_GBUFFER_SUBSAMPLES ? (subsamples ? subsamples : 1) : MAX_GBUFFER_SUBSAMPLES;
+    out->prim_ids = (u32*)malloc((usize)img_w * img_h * out->subsamples * sizeof(u32));
+    collect_spheres(world, &out->prims);
+
+    ScreenBounds* bounds = (ScreenBounds*)malloc((out->prims.length + 1) * sizeof(ScreenBounds));
+    for (usize i = 0; i < out->prims.length; ++i)
+      bounds[i] = project_sphere(cam, *out->prims[i], img_w, img_h);
+
+    RasterBands bands;
+    bands.cam = &cam;
+    bands.out = out;
+    bands.bounds = bounds;
+    parallel_for((img_h + BAND_HEIGHT-1) / BAND_HEIGHT, raster_band, &bands);
+    free(bounds);
+    return true;
+  }
+}
@@ -1,35 +1,97 @@
 #include "simplay/platform/hittable.h"
 
+#include "simplay/platform/material.h"
+#include "simplay/platform/render_cost.h"
+
 namespace sim {
   namespace {
-    bool hit_scene(const Vector<Hittable>& scene, const Ray& r, f64 tmin, f64 tmax, HitRecord* hr) {
+    bool intersect_scene(const Vector<Hittable>& scene, const Ray& r, f64 tmin, f64 tmax, PrimHit* out) {
       bool hit_anything = false;
       f64 closest = tmax;
       for (usize i = 0; i < scene.length; ++i) {
-        HitRecord current;
-        if (scene[i].hit(r, tmin, closest, &current)) {
+        if (scene[i].intersect(r, tmin, closest, out)) {
           hit_anything = true;
-          closest = current.t;
-          *hr = current;
+          closest = out->t;
         }
       }
       return hit_anything;
     }
   }
 
-  bool Hittable::hit(const Ray& r, f64 tmin, f64 tmax, HitRecord* hr) const {
+  bool Hittable::intersect(const Ray& r, f64 tmin, f64 tmax, PrimHit* out) const {
+    if (cost_counting) {
+      CostCounters& counters = get_cost_counters();
+      ++counters.hit_calls;
+      if (type == SPHERE)
+        ++counters.prim_tests;
+    }
+
     switch (type) {
       case NONE:
       default:
         return false;
       case SPHERE:
-        return sphere.hit(r, tmin, tmax, hr);
+        if (!sphere.intersect(r, tmin, tmax, &out->t))
+          return false;
+        out->prim = &sphere;
+        return true;
       case SCENE:
-        return hit_scene(scene, r, tmin, tmax, hr);
+        return intersect_scene(scene, r, tmin, tmax, out);
+      case BVH:
+        return bvh->intersect(r, tmin, tmax, out);
     }
   }
 
-  bool Sphere::hit(const Ray& r, f64 tmin, f64 tmax, HitRecord* hr) const {
+  bool Hittable::hit(const Ray& r, f64 tmin, f64 tmax, HitRecord* hr) const {
+    PrimHit closest;
+    if (!intersect(r, tmin, tmax, &closest))
+      return false;
+    if (hr)
+      closest.prim->get_surface(r, closest.t, hr);
+    return true;
+  }
+
+  Aabb Hittable::get_bounds() const {
+    switch (type) {
+      case NONE:
+      default:
+        return Aabb();
+      case SPHERE:
+        return sphere.get_bounds();
+      case SCENE: {
+        Aabb bounds;
+        for (usize i = 0; i < scene.length; ++i)
+          bounds.grow(scene[i].get_bounds());
+        return bounds;
+      }
+      case BVH:
+        return bvh->get_bounds();
+    }
+  }
+
+  u32 Hittable::get_material_types() const {
+    switch (type) {
+      case NONE:
+      default:
+        return 0;
+      case SPHERE:
+        return 1u << (sphere.mat ? sphere.mat : Material::get_default())->type;
+      case SCENE: {
+        u32 types = 0;
+        for (usize i = 0; i < scene.length; ++i)
+          types |= scene[i].get_material_types();
+        return types;
+      }
+      case BVH: {
+        u32 types = 0;
+        for (usize i = 0; i < bvh->prims.length; ++i)
+          types |= bvh->prims[i].get_material_types();
+        return types;
+      }
+    }
+  }
+
+  bool Sphere::intersect(const Ray& r, f64 tmin, f64 tmax, f64* t) const {
     Vec3 oc = r.origin - center;
     f64 a = dot(r.dir, r.dir);
     f64 half_b = dot(r.dir, oc);
@@ -47,13 +109,25 @@ namespace sim {
       if (root < tmin || tmax < root)
         return false;
     }
-    
-    if (hr) {
-      hr->t = root;
-      hr->p = r.at(hr->t);
-      hr->set_normal(r, (hr->p - center) / radius);
-      hr->mat = mat;
-    }
+    *t = root;
+    return true;
+  }
+
+  void Sphere::get_surface(const Ray& r, f64 t, HitRecord* hr) const {
+    hr->t = t;
+    hr->p = r.at(t);
+    hr->set_normal(r, (hr->p - center) / radius);
+    hr->mat = mat;
+    // The latitude spans half a circumference.
+    hr->uv_density = 1.0 / (PI*radius);
+  }
+
+  bool Sphere::hit(const Ray& r, f64 tmin, f64 tmax, HitRecord* hr) const {
+    f64 t;
+    if (!intersect(r, tmin, tmax, &t))
+      return false;
+    if (hr)
+      get_surface(r, t, hr);
     return true;
   }
 }
@@ -18,6 +18,66 @@ namespace sim {
     h = 0;
   }
 
+  bool FloatImage::save_pfm(const char* out_path) const {
+    FILE* out = nullptr;
+    if (fopen_s(&out, out_path, "wb")) {
+      fprintf(stderr, "Failed to open file: \"%s\"\n", out_path);
+      return false;
+    }
+
+    fprintf(out, "PF\n%u %u\n-1.0\n", w, h);
+    bool ok = true;
+    for (u32 i = 0; i < w*h && ok; ++i) {
+      f32 rgb[3] = {(f32)pixels[i].x, (f32)pixels[i].y, (f32)pixels[i].z};
+      ok = fwrite(rgb, sizeof(f32), 3, out) == 3;
+    }
+    fclose(out);
+    return ok;
+  }
+
+  bool FloatImage::load_pfm(const char* in_path) {
+    FILE* in = nullptr;
+    if (fopen_s(&in, in_path, "rb"))
+      return false;
+
+    u32 new_w = 0;
+    u32 new_h = 0;
+    f64 scale = 0.0;
+    // Only little-endian color images, like save_pfm() writes.
+    if (fscanf_s(in, "PF %u %u %lf", &new_w, &new_h, &scale) != 3 || scale >= 0.0
+        || !new_w || !new_h || fgetc(in) != '\n') {
+      fprintf(stderr, "Unsupported PFM file: \"%s\"\n", in_path);
+      fclose(in);
+      return false;
+    }
+
+    init(new_w, new_h);
+    bool ok = true;
+    for (u32 i = 0; i < w*h && ok; ++i) {
+      f32 rgb[3];
+      ok = fread(rgb, sizeof(f32), 3, in) == 3;
+      pixels[i] = Color3(rgb[0], rgb[1], rgb[2]);
+    }
+    fclose(in);
+    if (!ok) {
+      fprintf(stderr, "Truncated PFM file: \"%s\"\n", in_path);
+      release();
+    }
+    return ok;
+  }
+
+  void AovImages::init(u32 new_w, u32 new_h) {
+    albedo.init(new_w, new_h);
+    normal.init(new_w, new_h);
+    depth.init(new_w, new_h);
+  }
+
+  void AovImages::release() {
+    albedo.release();
+    normal.release();
+    depth.release();
+  }
+
   namespace {
     struct IhdrChunkData {
       u32 width;
@@ -0,0 +1,194 @@
+#include "simplay/platform/live_framebuffer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "simplay/platform/common.h"
+#include "simplay/platform/thread.h"
+
+namespace sim {
+  namespace {
+    // A writer holds a band for a copy of a few rows, so a handful of
+    // tries gets almost any band.
+    const u32 READ_TRIES = 64;
+
+    // Session-local, so that renders in other sessions do not collide.
+    void get_segment_name(const char* name, char* out, usize size) {
+      snprintf(out, size, "Local\\simplay-live-%s", name);
+    }
+
+    usize get_pixels_offset(u32 band_count) {
+      return sizeof(LiveHeader) + band_count * sizeof(LiveBand);
+    }
+
+    // The band's rows are contiguous. Copies them to `scratch` as they
+    // were when `seq` was read, false if they changed meanwhile.
+    bool try_read_band(const LiveFramebuffer& live, u32 band, f32* scratch, u32* samples) {
+      const LiveBand& b = live.bands[band];
+      i64 seq = b.seq;
+      if (seq & 1)
+        return false;
+      // Loads stay in order on x64, the compiler must keep them so too.
+      _ReadWriteBarrier();
+      u32 y0, y1;
+      live.get_band_rows(band, &y0, &y1);
+      usize row_floats = (usize)live.header->w * 3;
+      memcpy(scratch, live.pixels + y0*row_floats, (y1 - y0) * row_floats * sizeof(f32));
+      *samples = b.samples;
+      _ReadWriteBarrier();
+      return b.seq == seq;
+    }
+  }
+
+  bool LiveFramebuffer::create(const char* name, u32 w, u32 h, u32 samples, u32 band_height) {
+    release();
+    if (!w || !h || !band_height)
+      return false;
+
+    u32 band_count = (h + band_height-1) / band_height;
+    u64 size = get_pixels_offset(band_count) + (u64)w * h * 3 * sizeof(f32);
+    char segment[256];
+    get_segment_name(name, segment, sizeof(segment));
+    HANDLE m = CreateFileMappingA(
+        INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), segment);
+    if (m && GetLastError() == ERROR_ALREADY_EXISTS) {
+      fprintf(stderr, "Live framebuffer \"%s\" is already in use\n", name);
+      CloseHandle(m);
+      return false;
+    }
+    void* view = m ? MapViewOfFile(m, FILE_MAP_ALL_ACCESS, 0, 0, (usize)size) : nullptr;
+    if (!view) {
+      fprintf(stderr, "Failed to create live framebuffer \"%s\" (%llu bytes)\n", name, (unsigned long long)size);
+      if (m)
+        CloseHandle(m);
+      return false;
+    }
+
+    // New segments are zeroed: every band unwritten, the image black.
+    mapping = m;
+    header = (LiveHeader*)view;
+    bands = (LiveBand*)(header + 1);
+    pixels = (f32*)((u8*)view + get_pixels_offset(band_count));
+    header->w = w;
+    header->h = h;
+    header->band_height = band_height;
+    header->band_count = band_count;
+    header->samples = samples;
+    header->version = LIVE_VERSION;
+    // Last, so that readers that see it see the rest.
+    _ReadWriteBarrier();
+    header->magic = LIVE_MAGIC;
+    return true;
+  }
+
+  bool LiveFramebuffer::open(const char* name) {
+    release();
+
+    char segment[256];
+    get_segment_name(name, segment, sizeof(segment));
+    HANDLE m = OpenFileMappingA(FILE_MAP_READ, FALSE, segment);
+    if (!m)
+      return false;
+    void* view = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+    if (!view) {
+      CloseHandle(m);
+      return false;
+    }
+
+    const LiveHeader* h = (const LiveHeader*)view;
+    if (h->magic != LIVE_MAGIC || h->version != LIVE_VERSION) {
+      fprintf(stderr, "Live framebuffer \"%s\" is not one this build reads\n", name);
+      UnmapViewOfFile(view);
+      CloseHandle(m);
+      return false;
+    }
+    mapping = m;
+    header = (LiveHeader*)view;
+    bands = (LiveBand*)(header + 1);
+    pixels = (f32*)((u8*)view + get_pixels_offset(header->band_count));
+    return true;
+  }
+
+  void LiveFramebuffer::release() {
+    if (header)
+      UnmapViewOfFile(header);
+    if (mapping)
+      CloseHandle(mapping);
+
+    mapping = nullptr;
+    header = nullptr;
+    bands = nullptr;
+    pixels = nullptr;
+  }
+
+  void LiveFramebuffer::get_band_rows(u32 band, u32* y0, u32* y1) const {
+    *y0 = band * header->band_height;
+    *y1 = min(*y0 + header->band_height, header->h);
+  }
+
+  void LiveFramebuffer::publish_band(u32 band, const FloatImage& img, u32 samples) {
+    LiveBand& b = bands[band];
+    bool first = !b.samples;
+    // Interlocked adds are full barriers, so the rows land in between.
+    atomic_fetch_add(&b.seq, 1);
+    u32 y0, y1;
+    get_band_rows(band, &y0, &y1);
+    u32 w = header->w;
+    for (u32 y = y0; y < y1; ++y) {
+      f32* row = pixels + (usize)y*w*3;
+      for (u32 x = 0; x < w; ++x) {
+        const Color3& c = img.get(x, y);
+        row[3*x] = (f32)c.x;
+        row[3*x + 1] = (f32)c.y;
+        row[3*x + 2] = (f32)c.z;
+      }
+    }
+    b.samples = samples;
+    atomic_fetch_add(&b.seq, 1);
+    if (first)
+      atomic_fetch_add(&header->bands_done, 1);
+  }
+
+  void LiveFramebuffer::finish() {
+    atomic_fetch_add(&header->finished, 1);
+  }
+
+  void LiveFramebuffer::read_snapshot(FloatImage* out, LiveProgress* progress) const {
+    if (!out->pixels) {
+      out->init(header->w, header->h);
+      for (usize i = 0; i < (usize)out->w * out->h; ++i)
+        out->pixels[i] = Color3(0.0, 0.0, 0.0);
+    }
+
+    // Read first, so that a finished render is read whole.
+    progress->finished = header->finished != 0;
+    progress->band_count = header->band_count;
+    progress->bands_done = 0;
+    progress->torn_bands = 0;
+    u32 w = header->w;
+    f32* scratch = (f32*)malloc((usize)w * header->band_height * 3 * sizeof(f32));
+    for (u32 band = 0; band < header->band_count; ++band) {
+      u32 samples = 0;
+      bool read = false;
+      for (u32 i = 0; i < READ_TRIES && !read; ++i)
+        read = try_read_band(*this, band, scratch, &samples);
+      if (!read) {
+        ++progress->torn_bands;
+        continue;
+      }
+      if (samples)
+        ++progress->bands_done;
+
+      u32 y0, y1;
+      get_band_rows(band, &y0, &y1);
+      const f32* p = scratch;
+      for (u32 y = y0; y < y1; ++y) {
+        for (u32 x = 0; x < w; ++x, p += 3)
+          out->get(x, y) = Color3(p[0], p[1], p[2]);
+      }
+    }
+    free(scratch);
+  }
+}
@@ -4,14 +4,28 @@
 #include "simplay/platform/random.h"
 
 namespace sim {
+  namespace {
+    // Textures are filtered over the ray cone's footprint, which grows as
+    // the surface turns away from the ray.
+    Color3 apply_texture(const Color3& albedo, const TextureMap& map, const Ray& in, const HitRecord& hr) {
+      if (!map.texture)
+        return albedo;
+
+      f64 u, v;
+      hr.get_uv(&u, &v);
+      f64 cos = fabs(dot(normalize(in.dir), hr.normal));
+      f64 footprint = hr.cone_width * hr.uv_density * max(map.repeat_u, map.repeat_v) / max(cos, 0.1);
+      return albedo * map.texture->sample(u * map.repeat_u, v * map.repeat_v, footprint);
+    }
+  }
+
   bool Lambertian::scatter(const Ray& in, const HitRecord& hr, Color3* attenuation, Ray* scattered) const {
-    (void)in;
     if (scattered) {
       Vec3 scatter_dir = hr.normal + random_dir();
       *scattered = Ray(hr.p, scatter_dir.is_near_zero() ? hr.normal : scatter_dir);
     }
     if (attenuation)
-      *attenuation = albedo;
+      *attenuation = apply_texture(albedo, map, in, hr);
     return true;
   }
 
@@ -20,7 +34,7 @@ namespace sim {
     if (scattered)
       *scattered = Ray(hr.p, reflected);
     if (attenuation)
-      *attenuation = albedo;
+      *attenuation = apply_texture(albedo, map, in, hr);
     return (dot(reflected, hr.normal) > 0.0);
   }
 
@@ -65,4 +79,18 @@ namespace sim {
         return dielectric.scatter(in, hr, attenuation, scattered);
     }
   }
+
+  Color3 Material::get_albedo(const Ray& in, const HitRecord& hr) const {
+    switch (type) {
+      case NONE:
+      default:
+        return Color3(0.0, 0.0, 0.0);
+      case LAMBERTIAN:
+        return apply_texture(lambertian.albedo, lambertian.map, in, hr);
+      case METAL:
+        return apply_texture(metal.albedo, metal.map, in, hr);
+      case DIELECTRIC:
+        return Color3(1.0, 1.0, 1.0);
+    }
+  }
 }
@@ -0,0 +1,146 @@
+#include "simplay/platform/process.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+namespace sim {
+  Channel Channel::make_std() {
+    Channel c;
+    c.type = PIPE;
+    c.read_handle = GetStdHandle(STD_INPUT_HANDLE);
+    c.write_handle = GetStdHandle(STD_OUTPUT_HANDLE);
+    return c;
+  }
+
+  bool Channel::write_all(const void* data, usize size) {
+    if (type != PIPE)
+      return false;
+
+    const u8* bytes = (const u8*)data;
+    while (size) {
+      DWORD chunk = size > 0x10000000 ? 0x10000000 : (DWORD)size;
+      DWORD written = 0;
+      if (!WriteFile(write_handle, bytes, chunk, &written, nullptr) || !written)
+        return false;
+      bytes += written;
+      size -= written;
+    }
+    return true;
+  }
+
+  isize Channel::read_some(void* buf, usize capacity, bool block) {
+    if (type != PIPE)
+      return -1;
+
+    DWORD to_read = capacity > 0x10000000 ? 0x10000000 : (DWORD)capacity;
+    if (!block) {
+      DWORD available = 0;
+      if (!PeekNamedPipe(read_handle, nullptr, 0, nullptr, &available, nullptr))
+        return -1;
+      if (!available)
+        return 0;
+      if (available < to_read)
+        to_read = available;
+    }
+
+    DWORD read = 0;
+    if (!ReadFile(read_handle, buf, to_read, &read, nullptr) || !read)
+      return -1;
+    return (isize)read;
+  }
+
+  void Channel::release() {
+    if (type == PIPE) {
+      CloseHandle(read_handle);
+      CloseHandle(write_handle);
+    }
+    type = NONE;
+    read_handle = nullptr;
+    write_handle = nullptr;
+  }
+
+  bool Process::spawn(const char* cmdline) {
+    SECURITY_ATTRIBUTES sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = TRUE;
+
+    // The child inherits one end of each pipe, we keep the other.
+    HANDLE child_in = nullptr, parent_out = nullptr;
+    HANDLE parent_in = nullptr, child_out = nullptr;
+    if (!CreatePipe(&child_in, &parent_out, &sa, 0))
+      return false;
+    if (!CreatePipe(&parent_in, &child_out, &sa, 0)) {
+      CloseHandle(child_in);
+      CloseHandle(parent_out);
+      return false;
+    }
+    SetHandleInformation(parent_out, HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation(parent_in, HANDLE_FLAG_INHERIT, 0);
+
+    STARTUPINFOA si;
+    memset(&si, 0, sizeof(si));
+    si.cb = sizeof(si);
+    si.dwFlags = STARTF_USESTDHANDLES;
+    si.hStdInput = child_in;
+    si.hStdOutput = child_out;
+    si.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+    // CreateProcessA may modify the command line in place.
+    usize cmdline_size = strlen(cmdline) + 1;
+    char* cmdline_copy = (char*)malloc(cmdline_size);
+    memcpy(cmdline_copy, cmdline, cmdline_size);
+
+    PROCESS_INFORMATION pi;
+    memset(&pi, 0, sizeof(pi));
+    BOOL created = CreateProcessA(nullptr, cmdline_copy, nullptr, nullptr, TRUE, 0, nullptr, nullptr, &si, &pi);
+    free(cmdline_copy);
+    CloseHandle(child_in);
+    CloseHandle(child_out);
+    if (!created) {
+      fprintf(stderr, "Failed to spawn process: \"%s\"\n", cmdline);
+      CloseHandle(parent_in);
+      CloseHandle(parent_out);
+      return false;
+    }
+    CloseHandle(pi.hThread);
+
+    handle = pi.hProcess;
+    channel.type = Channel::PIPE;
+    channel.read_handle = parent_in;
+    channel.write_handle = parent_out;
+    return true;
+  }
+
+  bool Process::is_running() const {
+    if (!handle)
+      return false;
+
+    DWORD code = 0;
+    return GetExitCodeProcess(handle, &code) && code == STILL_ACTIVE;
+  }
+
+  void Process::stop(u32 timeout_ms) {
+    if (!handle)
+      return;
+
+    if (WaitForSingleObject(handle, timeout_ms) != WAIT_OBJECT_0) {
+      TerminateProcess(handle, 1);
+      WaitForSingleObject(handle, INFINITE);
+    }
+  }
+
+  void Process::release() {
+    channel.release();
+    if (handle)
+      CloseHandle(handle);
+    handle = nullptr;
+  }
+
+  bool get_executable_path(char* buf, u32 capacity) {
+    DWORD length = GetModuleFileNameA(nullptr, buf, capacity);
+    return length > 0 && length < capacity;
+  }
+}
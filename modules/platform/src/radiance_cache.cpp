@@ -0,0 +1,182 @@
+#include "simplay/platform/radiance_cache.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "simplay/platform/common.h"
+#include "simplay/platform/thread.h"
+#include "simplay/platform/vector.h"
+
+namespace sim {
+  namespace {
+    const u32 SHARD_COUNT = 16;
+    const u32 BUCKETS_PER_SHARD = 4096;
+    const u32 NO_ENTRY = 0xFFFFFFFF;
+
+    struct GridCell {
+      i32 x, y, z;
+    };
+
+    bool operator==(const GridCell& a, const GridCell& b) {
+      return a.x == b.x && a.y == b.y && a.z == b.z;
+    }
+
+    u64 hash_cell(const GridCell& c) {
+      u64 h = (u64)(u32)c.x * 0x9E3779B97F4A7C15ull;
+      h ^= (u64)(u32)c.y * 0xC2B2AE3D27D4EB4Full;
+      h ^= (u64)(u32)c.z * 0x165667B19E3779F9ull;
+      return h ^ (h >> 29);
+    }
+
+    // The records a cell holds are kept together, so that a lookup reads
+    // one short run of memory.
+    struct RadianceCell {
+      GridCell key;
+      u32 next;
+      Vector<RadianceRecord> records;
+    };
+  }
+
+  struct RadianceCacheShard {
+    Mutex mutex;
+    Vector<RadianceCell> cells;
+    u32 buckets[BUCKETS_PER_SHARD];
+    volatile i64 lookups;
+    volatile i64 hits;
+    volatile i64 records;
+
+    RadianceCell* find(const GridCell& key, u64 hash) {
+      for (u32 i = buckets[(hash >> 32) % BUCKETS_PER_SHARD]; i != NO_ENTRY; i = cells[i].next) {
+        if (cells[i].key == key)
+          return &cells[i];
+      }
+      return nullptr;
+    }
+  };
+
+  void RadianceCache::init(const RadianceCacheSettings& new_settings) {
+    release();
+    settings = new_settings;
+    // Radii never exceed a cell, so a record reaches at most two cells
+    // along each axis.
+    cell_size = settings.max_radius;
+    shards = (RadianceCacheShard*)calloc(SHARD_COUNT, sizeof(RadianceCacheShard));
+    for (u32 i = 0; i < SHARD_COUNT; ++i) {
+      for (u32 j = 0; j < BUCKETS_PER_SHARD; ++j)
+        shards[i].buckets[j] = NO_ENTRY;
+    }
+  }
+
+  void RadianceCache::release() {
+    if (!shards)
+      return;
+    for (u32 i = 0; i < SHARD_COUNT; ++i) {
+      for (usize j = 0; j < shards[i].cells.length; ++j)
+        shards[i].cells[j].records.release();
+      shards[i].cells.release();
+    }
+    free(shards);
+    shards = nullptr;
+  }
+
+  bool RadianceCache::lookup(const Point3& p, const Vec3& normal, i32 depth, Color3* irradiance) {
+    GridCell cell = {(i32)floor(p.x / cell_size), (i32)floor(p.y / cell_size), (i32)floor(p.z / cell_size)};
+    u64 hash = hash_cell(cell);
+    RadianceCacheShard& shard = shards[hash % SHARD_COUNT];
+    atomic_fetch_add(&shard.lookups, 1);
+
+    // Records fade out towards the edge of their validity, so that the
+    // blend has no seams where records come and go.
+    Color3 sum(0.0, 0.0, 0.0);
+    f64 weight_sum = 0.0;
+    bool close = false;
+    shard.mutex.lock_shared();
+    RadianceCell* found = shard.find(cell, hash);
+    usize count = found ? found->records.length : 0;
+    for (usize i = 0; i < count; ++i) {
+      const RadianceRecord& rec = found->records[i];
+      if (rec.depth != depth)
+        continue;
+      Vec3 offset = p - rec.p;
+      f64 sqdist = offset.sqmag();
+      if (sqdist >= rec.radius * rec.radius)
+        continue;
+      f64 turn = 1.0 - dot(normal, rec.normal);
+      if (turn >= 1.0)
+        continue;
+      f64 error = sqrt(sqdist) / rec.radius + sqrt(max(turn, 0.0));
+      if (error >= 1.0)
+        continue;
+
+      close = close || error < settings.max_error;
+      sum += (1.0 - error) * rec.irradiance;
+      weight_sum += 1.0 - error;
+    }
+    shard.mutex.unlock_shared();
+
+    if (!close)
+      return false;
+    atomic_fetch_add(&shard.hits, 1);
+    *irradiance = sum / weight_sum;
+    return true;
+  }
+
+  void RadianceCache::insert(const RadianceRecord& record) {
+    RadianceRecord rec = record;
+    rec.radius = clamp(rec.radius, settings.min_radius, settings.max_radius);
+
+    GridCell lo = {
+      (i32)floor((rec.p.x - rec.radius) / cell_size),
+      (i32)floor((rec.p.y - rec.radius) / cell_size),
+      (i32)floor((rec.p.z - rec.radius) / cell_size),
+    };
+    GridCell hi = {
+      (i32)floor((rec.p.x + rec.radius) / cell_size),
+      (i32)floor((rec.p.y + rec.radius) / cell_size),
+      (i32)floor((rec.p.z + rec.radius) / cell_size),
+    };
+
+    bool counted = false;
+    for (i32 z = lo.z; z <= hi.z; ++z) {
+      for (i32 y = lo.y; y <= hi.y; ++y) {
+        for (i32 x = lo.x; x <= hi.x; ++x) {
+          GridCell key = {x, y, z};
+          u64 hash = hash_cell(key);
+          RadianceCacheShard& shard = shards[hash % SHARD_COUNT];
+
+          shard.mutex.lock();
+          RadianceCell* found = shard.find(key, hash);
+          if (!found) {
+            u32* bucket = &shard.buckets[(hash >> 32) % BUCKETS_PER_SHARD];
+            RadianceCell new_cell;
+            new_cell.key = key;
+            new_cell.next = *bucket;
+            *bucket = (u32)shard.cells.length;
+            shard.cells.push(new_cell);
+            found = &shard.cells.back();
+          }
+          found->records.push(rec);
+          shard.mutex.unlock();
+
+          // Counted once, in the shard of its first cell.
+          if (!counted) {
+            atomic_fetch_add(&shard.records, 1);
+            counted = true;
+          }
+        }
+      }
+    }
+  }
+
+  RadianceCacheStats RadianceCache::get_stats() const {
+    RadianceCacheStats stats;
+    if (!shards)
+      return stats;
+    for (u32 i = 0; i < SHARD_COUNT; ++i) {
+      stats.lookups += (u64)shards[i].lookups;
+      stats.hits += (u64)shards[i].hits;
+      stats.records += (u64)shards[i].records;
+    }
+    return stats;
+  }
+}
@@ -0,0 +1,1051 @@
+#include "simplay/platform/render.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "simplay/platform/clock.h"
+#include "simplay/platform/common.h"
+#include "simplay/platform/material.h"
+#include "simplay/platform/random.h"
+#include "simplay/platform/thread.h"
+
+namespace sim {
+  namespace {
+    // Diffuse bounces scatter over the whole hemisphere; past one, textures
+    // only need to be about this sharp.
+    const f64 DIFFUSE_CONE_SPREAD = 0.1;
+
+    // If no hit, return a background sky gradient.
+    Color3 get_miss_color(const Ray& r, AovSample* aov) {
+      Vec3 unit_dir = normalize(r.dir);
+      f64 t = 0.5 * (unit_dir.y + 1.0);
+      Color3 sky = (1.0-t)*Color3(1.0, 1.0, 1.0) + t*Color3(0.5, 0.7, 1.0);
+      if (aov)
+        aov->albedo = aov->throughput * sky;
+      return sky;
+    }
+
+    Color3 trace_bounce(const Ray& r, const Hittable& world, i32 depth, AovSample* aov, const RayCone& cone, RadianceCache* cache);
+
+    // Everything past finding the hit of `r`, which was cast with `depth`
+    // bounces left. `cache` serves the bounces that follow.
+    Color3 shade_hit(const Ray& r, HitRecord& hr, const Hittable& world, i32 depth, AovSample* aov, const RayCone& cone, RadianceCache* cache) {
+      Material* mat = hr.mat ? hr.mat : Material::get_default();
+      f64 dist = hr.t * r.dir.mag();
+      hr.cone_width = cone.get_width_at(dist);
+      if (aov) {
+        aov->normal = hr.normal;
+        aov->depth += dist;
+      }
+
+      Ray scattered;
+      Color3 attenuation;
+      if (!mat->scatter(r, hr, &attenuation, &scattered)) {
+        if (aov)
+          aov->albedo = Color3(0.0, 0.0, 0.0);
+        return Color3(0.0, 0.0, 0.0);
+      }
+
+      if (cost_counting)
+        ++get_cost_counters().bounces;
+
+      AovSample* next_aov = nullptr;
+      if (aov) {
+        if (mat->type == Material::LAMBERTIAN) {
+          aov->albedo = aov->throughput * mat->get_albedo(r, hr);
+        } else {
+          aov->throughput = aov->throughput * attenuation;
+          next_aov = aov;
+        }
+      }
+
+      RayCone next_cone(hr.cone_width, cone.spread);
+      if (mat->type == Material::LAMBERTIAN)
+        next_cone.spread = max(cone.spread, DIFFUSE_CONE_SPREAD);
+      return attenuation * trace_bounce(scattered, world, depth-1, next_aov, next_cone, cache);
+    }
+
+    // Traces `gather_rays` cosine-distributed paths from the hit, and sizes
+    // the record by how close the surroundings are.
+    RadianceRecord gather_record(const HitRecord& hr, const Hittable& world, i32 depth, const RayCone& cone, const RadianceCache& cache) {
+      u32 rays = cache.settings.gather_rays ? cache.settings.gather_rays : 1;
+      RayCone gather_cone(hr.cone_width, max(cone.spread, DIFFUSE_CONE_SPREAD));
+      Color3 sum(0.0, 0.0, 0.0);
+      f64 inv_dist_sum = 0.0;
+      if (cost_counting)
+        get_cost_counters().bounces += rays;
+      for (u32 i = 0; i < rays; ++i) {
+        Vec3 dir = hr.normal + random_dir();
+        Ray r(hr.p, dir.is_near_zero() ? hr.normal : dir);
+
+        HitRecord next;
+        if (!world.hit(r, 0.001, F64_INF, &next)) {
+          sum += get_miss_color(r, nullptr);
+          continue;
+        }
+        inv_dist_sum += 1.0 / (next.t * r.dir.mag());
+        sum += shade_hit(r, next, world, depth-1, nullptr, gather_cone, nullptr);
+      }
+
+      RadianceRecord rec;
+      rec.p = hr.p;
+      rec.normal = hr.normal;
+      rec.irradiance = sum / rays;
+      rec.radius = inv_dist_sum > 0.0 ? rays / inv_dist_sum : F64_INF;
+      rec.depth = depth;
+      return rec;
+    }
+
+    // Lights a diffuse hit from the cache, gathering a new record first if
+    // there is none close by.
+    Color3 shade_cached(const Ray& r, HitRecord& hr, const Hittable& world, i32 depth, AovSample* aov, const RayCone& cone, RadianceCache* cache) {
+      Material* mat = hr.mat ? hr.mat : Material::get_default();
+      f64 dist = hr.t * r.dir.mag();
+      hr.cone_width = cone.get_width_at(dist);
+      if (aov) {
+        aov->normal = hr.normal;
+        aov->depth += dist;
+        aov->albedo = aov->throughput * mat->get_albedo(r, hr);
+      }
+
+      Color3 attenuation;
+      mat->scatter(r, hr, &attenuation, nullptr);
+      Color3 irradiance;
+      if (!cache->lookup(hr.p, hr.normal, depth, &irradiance)) {
+        RadianceRecord rec = gather_record(hr, world, depth, cone, *cache);
+        cache->insert(rec);
+        irradiance = rec.irradiance;
+      }
+      return attenuation * irradiance;
+    }
+
+    // Past the first hit, diffuse surfaces with light left to gather are
+    // served by the cache.
+    Color3 trace_bounce(const Ray& r, const Hittable& world, i32 depth, AovSample* aov, const RayCone& cone, RadianceCache* cache) {
+      if (depth <= 0)
+        return Color3(0.0, 0.0, 0.0);
+
+      HitRecord hr;
+      if (!world.hit(r, 0.001, F64_INF, &hr))
+        return get_miss_color(r, aov);
+      Material* mat = hr.mat ? hr.mat : Material::get_default();
+      if (cache && depth > 1 && mat->type == Material::LAMBERTIAN)
+        return shade_cached(r, hr, world, depth, aov, cone, cache);
+      return shade_hit(r, hr, world, depth, aov, cone, cache);
+    }
+  }
+
+  namespace {
+    void set_first_hit(const HitRecord& hr, FirstHit* first) {
+      first->p = hr.p;
+      first->normal = hr.normal;
+      first->mat = hr.mat ? hr.mat : Material::get_default();
+      first->hit = true;
+    }
+
+    // ray_color(), also telling what `r` hit first.
+    Color3 trace_path(const Ray& r, const Hittable& world, i32 depth, AovSample* aov, const RayCone& cone, RadianceCache* cache, FirstHit* first) {
+      if (depth <= 0)
+        return Color3(0.0, 0.0, 0.0);
+
+      HitRecord hr;
+      if (!world.hit(r, 0.001, F64_INF, &hr))
+        return get_miss_color(r, aov);
+      if (first)
+        set_first_hit(hr, first);
+      return shade_hit(r, hr, world, depth, aov, cone, cache);
+    }
+  }
+
+  Color3 ray_color(const Ray& r, const Hittable& world, i32 depth, AovSample* aov, const RayCone& cone, RadianceCache* cache) {
+    return trace_path(r, world, depth, aov, cone, cache, nullptr);
+  }
+
+  Color3 render_pixel(
+      const Camera& cam, const Hittable& world,
+      u32 x, u32 y, u32 img_w, u32 img_h,
+      u32 samples, u32 max_depth, AovSample* aov, const GBuffer* gbuffer,
+      RadianceCache* cache, RenderCost* cost, MaterialCosts* by_material, FirstHit* first_hit) {
+    Color3 pixel(0.0, 0.0, 0.0);
+    AovSample aov_sum;
+    RayCone cone(0.0, cam.get_pixel_spread(img_h));
+    f64 first_dist = F64_INF;
+    for (u32 i = 0; i < samples; ++i) {
+      AovSample current;
+      AovSample* sample_aov = aov ? &current : nullptr;
+      FirstHit first;
+      first.hit = false;
+      RenderCost start;
+      if (cost)
+        start = read_cost();
+
+      f64 dx = 0.5, dy = 0.5;
+      if (gbuffer && max_depth && i < gbuffer->subsamples) {
+        // The first hit is already known; only its shading is left.
+        get_subsample_offset(i, &dx, &dy);
+        Ray r = cam.cast_pinhole_ray(((f64)x + dx) / (img_w-1), ((f64)y + dy) / (img_h-1));
+        HitRecord hr;
+        if (gbuffer->get_hit(x, y, i, r, &hr)) {
+          set_first_hit(hr, &first);
+          pixel += shade_hit(r, hr, world, (i32)max_depth, sample_aov, cone, cache);
+        } else {
+          pixel += get_miss_color(r, sample_aov);
+        }
+      } else if (!gbuffer || i >= gbuffer->subsamples) {
+        // Past the G-buffer's fixed positions, samples are jittered over the
+        // pixel again rather than landing on the same ones.
+        dx = random_f64();
+        dy = random_f64();
+        Ray r = cam.cast_ray(((f64)x + dx) / (img_w-1), ((f64)y + dy) / (img_h-1));
+        pixel += trace_path(r, world, (i32)max_depth, sample_aov, cone, cache, cost || first_hit ? &first : nullptr);
+      }
+      // The sample nearest the pixel's center stands for it.
+      f64 dist = (dx - 0.5)*(dx - 0.5) + (dy - 0.5)*(dy - 0.5);
+      if (first_hit && dist < first_dist) {
+        *first_hit = first;
+        first_dist = dist;
+      }
+
+      if (cost) {
+        RenderCost spent = get_cost_since(start);
+        cost->add(spent);
+        if (by_material) {
+          MaterialCost& entry = by_material->get(first.hit ? first.mat : nullptr);
+          entry.cost.add(spent);
+          ++entry.samples;
+        }
+      }
+
+      if (aov) {
+        aov_sum.albedo += current.albedo;
+        aov_sum.normal += current.normal;
+        aov_sum.depth += current.depth;
+      }
+    }
+
+    if (aov) {
+      aov->albedo = aov_sum.albedo / samples;
+      // Averaged normals are shorter across edges, which the denoiser
+      // already treats as a discontinuity, so they stay unnormalized.
+      aov->normal = aov_sum.normal / samples;
+      aov->depth = aov_sum.depth / samples;
+    }
+    return pixel / samples;
+  }
+
+  u64 get_row_seed(u64 seed, u32 y) {
+    return seed ^ ((u64)(y + 1) * 0xD1B54A32D192ED03ull);
+  }
+
+  namespace {
+    struct RenderRows {
+      const Camera* cam;
+      const Hittable* world;
+      const RenderSettings* settings;
+      FloatImage* result;
+      AovImages* aovs;
+      CostImages* costs;
+      // Guards costs->by_material, which rows add their own totals to.
+      Mutex cost_mutex;
+      const GBuffer* gbuffer;
+      FirstHit* first_hits;
+      volatile i64 rows_done;
+      // Renders one row; rows go to `live` a band at a time.
+      ParallelForFn row_fn;
+      LiveFramebuffer* live;
+    };
+
+    void finish_row(RenderRows& rows) {
+      i64 done = atomic_fetch_add(&rows.rows_done, 1) + 1;
+      if (rows.settings->show_progress) {
+        fprintf(stderr, "\rRendering %.2f%%", (f64)done / rows.settings->img_h * 100.0);
+        fflush(stderr);
+      }
+    }
+
+    void render_row(u32 y, void* arg) {
+      RenderRows& rows = *(RenderRows*)arg;
+      const RenderSettings& settings = *rows.settings;
+
+      // Rows are seeded independently of the thread that picks them up.
+      seed_random(get_row_seed(settings.seed, y));
+      MaterialCosts row_costs;
+      for (u32 x = 0; x < settings.img_w; ++x) {
+        FirstHit* first_hit = rows.first_hits ? &rows.first_hits[(usize)y*settings.img_w + x] : nullptr;
+        if (!rows.aovs && !rows.costs) {
+          rows.result->get(x, y) = render_pixel(
+              *rows.cam, *rows.world, x, y, settings.img_w, settings.img_h,
+              settings.samples, settings.max_depth, nullptr, rows.gbuffer, settings.radiance_cache,
+              nullptr, nullptr, first_hit);
+          continue;
+        }
+
+        AovSample aov;
+        RenderCost cost;
+        rows.result->get(x, y) = render_pixel(
+            *rows.cam, *rows.world, x, y, settings.img_w, settings.img_h,
+            settings.samples, settings.max_depth, rows.aovs ? &aov : nullptr, rows.gbuffer,
+            settings.radiance_cache, rows.costs ? &cost : nullptr, rows.costs ? &row_costs : nullptr, first_hit);
+        if (rows.aovs) {
+          rows.aovs->albedo.get(x, y) = aov.albedo;
+          rows.aovs->normal.get(x, y) = aov.normal;
+          rows.aovs->depth.get(x, y) = Vec3(aov.depth, aov.depth, aov.depth);
+        }
+        if (rows.costs) {
+          CostImages& costs = *rows.costs;
+          costs.cycles.get(x, y) = Vec3((f64)cost.cycles, (f64)cost.cycles, (f64)cost.cycles);
+          costs.hit_calls.get(x, y) = Vec3((f64)cost.hit_calls, (f64)cost.hit_calls, (f64)cost.hit_calls);
+          costs.prim_tests.get(x, y) = Vec3((f64)cost.prim_tests, (f64)cost.prim_tests, (f64)cost.prim_tests);
+          costs.bounces.get(x, y) = Vec3((f64)cost.bounces, (f64)cost.bounces, (f64)cost.bounces);
+        }
+      }
+      if (rows.costs) {
+        rows.cost_mutex.lock();
+        rows.costs->by_material.add(row_costs);
+        rows.cost_mutex.unlock();
+      }
+      row_costs.release();
+
+      finish_row(rows);
+    }
+
+    // Path kernels for plain renders, with the camera model, the material
+    // types in the scene and the depth fixed at compile time, so that what
+    // a render never does is not in its loop. They take the same steps as
+    // render_pixel() and give the same images.
+
+    struct PinholeModel {
+      static Ray cast(const Camera& cam, f64 s, f64 t) { return cam.cast_pinhole_ray(s, t); }
+    };
+
+    struct ThinLensModel {
+      static Ray cast(const Camera& cam, f64 s, f64 t) { return cam.cast_lens_ray(s, t); }
+    };
+
+    const u32 LAMBERTIAN_BIT = 1u << Material::LAMBERTIAN;
+    const u32 METAL_BIT = 1u << Material::METAL;
+    const u32 DIELECTRIC_BIT = 1u << Material::DIELECTRIC;
+
+    // A type that is the only one in the scene needs no check.
+    template <u32 MATERIALS, u32 BIT>
+    bool is_type(const Material& mat, Material::Type type) {
+      return MATERIALS == BIT || ((MATERIALS & BIT) && mat.type == type);
+    }
+
+    template <u32 MATERIALS>
+    bool scatter_as(const Material& mat, const Ray& in, const HitRecord& hr, Color3* attenuation, Ray* scattered) {
+      if (is_type<MATERIALS, LAMBERTIAN_BIT>(mat, Material::LAMBERTIAN))
+        return mat.lambertian.scatter(in, hr, attenuation, scattered);
+      if (is_type<MATERIALS, METAL_BIT>(mat, Material::METAL))
+        return mat.metal.scatter(in, hr, attenuation, scattered);
+      if (is_type<MATERIALS, DIELECTRIC_BIT>(mat, Material::DIELECTRIC))
+        return mat.dielectric.scatter(in, hr, attenuation, scattered);
+      return false;
+    }
+
+    // trace_path() as a loop. The recursion multiplies the attenuations
+    // from the last bounce back, so they are kept and multiplied in that
+    // order for the same rounding. `first` is where `r` hits when that is
+    // known already, a null prim for none. `first_hit` receives the hit.
+    template <u32 MATERIALS, i32 DEPTH>
+    Color3 trace_specialized(Ray r, const Hittable& world, RayCone cone, const PrimHit* first = nullptr, FirstHit* first_hit = nullptr) {
+      Color3 attenuations[DEPTH];
+      Color3 color(0.0, 0.0, 0.0);
+      i32 bounces = 0;
+      for (; bounces < DEPTH; ++bounces) {
+        HitRecord hr;
+        bool hit;
+        if (first && !bounces) {
+          hit = first->prim != nullptr;
+          if (hit)
+            first->prim->get_surface(r, first->t, &hr);
+        } else {
+          hit = world.type == Hittable::BVH ? world.bvh->hit(r, 0.001, F64_INF, &hr) : world.hit(r, 0.001, F64_INF, &hr);
+        }
+        if (!hit) {
+          color = get_miss_color(r, nullptr);
+          break;
+        }
+        if (first_hit && !bounces)
+          set_first_hit(hr, first_hit);
+
+        const Material& mat = hr.mat ? *hr.mat : *Material::get_default();
+        hr.cone_width = cone.get_width_at(hr.t * r.dir.mag());
+        Ray scattered;
+        if (!scatter_as<MATERIALS>(mat, r, hr, &attenuations[bounces], &scattered))
+          break;
+        if (cost_counting)
+          ++get_cost_counters().bounces;
+        cone.width = hr.cone_width;
+        if (is_type<MATERIALS, LAMBERTIAN_BIT>(mat, Material::LAMBERTIAN))
+          cone.spread = max(cone.spread, DIFFUSE_CONE_SPREAD);
+        r = scattered;
+      }
+      for (i32 i = bounces; i > 0; --i)
+        color = attenuations[i-1] * color;
+      return color;
+    }
+
+    // A pixel of a row, drawing from the row's random stream where the
+    // pixels before it left off. `first_hit` may be null.
+    typedef Color3 (*PixelFn)(const Camera& cam, const Hittable& world, u32 x, u32 y, const RenderSettings& settings, FirstHit* first_hit);
+
+    Color3 render_pixel_general(const Camera& cam, const Hittable& world, u32 x, u32 y, const RenderSettings& settings, FirstHit* first_hit) {
+      return render_pixel(
+          cam, world, x, y, settings.img_w, settings.img_h,
+          settings.samples, settings.max_depth, nullptr, nullptr, settings.radiance_cache,
+          nullptr, nullptr, first_hit);
+    }
+
+    template <typename Model, u32 MATERIALS, i32 DEPTH>
+    Color3 render_pixel_specialized(const Camera& cam, const Hittable& world, u32 x, u32 y, const RenderSettings& settings, FirstHit* first_hit) {
+      RayCone cone(0.0, cam.get_pixel_spread(settings.img_h));
+      Color3 pixel(0.0, 0.0, 0.0);
+      f64 first_dist = F64_INF;
+      for (u32 i = 0; i < settings.samples; ++i) {
+        f64 dx = random_f64();
+        f64 dy = random_f64();
+        Ray r = Model::cast(cam, ((f64)x + dx) / (settings.img_w-1), ((f64)y + dy) / (settings.img_h-1));
+        if (!first_hit) {
+          pixel += trace_specialized<MATERIALS, DEPTH>(r, world, cone);
+          continue;
+        }
+        FirstHit first;
+        first.hit = false;
+        pixel += trace_specialized<MATERIALS, DEPTH>(r, world, cone, nullptr, &first);
+        f64 dist = (dx - 0.5)*(dx - 0.5) + (dy - 0.5)*(dy - 0.5);
+        if (dist < first_dist) {
+          *first_hit = first;
+          first_dist = dist;
+        }
+      }
+      return pixel / settings.samples;
+    }
+
+    template <typename Model, u32 MATERIALS, i32 DEPTH>
+    void render_row_specialized(u32 y, void* arg) {
+      RenderRows& rows = *(RenderRows*)arg;
+      const RenderSettings& settings = *rows.settings;
+
+      seed_random(get_row_seed(settings.seed, y));
+      FirstHit* first_hits = rows.first_hits ? rows.first_hits + (usize)y*settings.img_w : nullptr;
+      for (u32 x = 0; x < settings.img_w; ++x) {
+        rows.result->get(x, y) = render_pixel_specialized<Model, MATERIALS, DEPTH>(
+            *rows.cam, *rows.world, x, y, settings, first_hits ? &first_hits[x] : nullptr);
+      }
+      finish_row(rows);
+    }
+
+    // trace_specialized() for up to RAY_PACKET_SIZE paths of a BVH at once,
+    // a bounce at a time: the rays of the paths still going walk the tree
+    // as one packet at every bounce, not just the first. `states` are the
+    // paths' random streams, each drawn from as its path alone would.
+    template <u32 MATERIALS, i32 DEPTH>
+    void trace_group_specialized(Ray* rays, u32 count, const Hittable& world, RayCone* cones, u64* states, Color3* out) {
+      Color3 attenuations[RAY_PACKET_SIZE][DEPTH];
+      i32 bounces[RAY_PACKET_SIZE];
+      bool going[RAY_PACKET_SIZE];
+      for (u32 v = 0; v < count; ++v) {
+        out[v] = Color3(0.0, 0.0, 0.0);
+        bounces[v] = 0;
+        going[v] = true;
+      }
+
+      for (i32 bounce = 0; bounce < DEPTH; ++bounce) {
+        Ray packet[RAY_PACKET_SIZE];
+        u32 lanes[RAY_PACKET_SIZE];
+        u32 live = 0;
+        for (u32 v = 0; v < count; ++v) {
+          if (going[v]) {
+            packet[live] = rays[v];
+            lanes[live++] = v;
+          }
+        }
+        if (!live)
+          break;
+
+        PrimHit found[RAY_PACKET_SIZE];
+        bool hits[RAY_PACKET_SIZE];
+        world.bvh->intersect_packet(packet, live, 0.001, F64_INF, found, hits);
+        for (u32 i = 0; i < live; ++i) {
+          u32 v = lanes[i];
+          const Ray& r = rays[v];
+          if (!hits[i]) {
+            out[v] = get_miss_color(r, nullptr);
+            going[v] = false;
+            continue;
+          }
+
+          HitRecord hr;
+          found[i].prim->get_surface(r, found[i].t, &hr);
+          const Material& mat = hr.mat ? *hr.mat : *Material::get_default();
+          hr.cone_width = cones[v].get_width_at(hr.t * r.dir.mag());
+          Ray scattered;
+          seed_random(states[v]);
+          bool scattered_on = scatter_as<MATERIALS>(mat, r, hr, &attenuations[v][bounce], &scattered);
+          states[v] = get_random_state();
+          if (!scattered_on) {
+            going[v] = false;
+            continue;
+          }
+          if (cost_counting)
+            ++get_cost_counters().bounces;
+          bounces[v] = bounce + 1;
+          cones[v].width = hr.cone_width;
+          if (is_type<MATERIALS, LAMBERTIAN_BIT>(mat, Material::LAMBERTIAN))
+            cones[v].spread = max(cones[v].spread, DIFFUSE_CONE_SPREAD);
+          rays[v] = scattered;
+        }
+      }
+
+      for (u32 v = 0; v < count; ++v) {
+        for (i32 i = bounces[v]; i > 0; --i)
+          out[v] = attenuations[v][i-1] * out[v];
+      }
+    }
+
+    // A pixel of up to RAY_PACKET_SIZE views of a BVH, taking the same
+    // steps as the pixel kernel of each, except that their paths walk the
+    // tree as one packet. `states` are the views' random streams, left
+    // where their pixels leave off.
+    typedef void (*GroupPixelFn)(
+        const Camera* cams, u32 count, const Hittable& world, u32 x, u32 y,
+        const RenderSettings& settings, u64* states, Color3* out);
+
+    template <typename Model, u32 MATERIALS, i32 DEPTH>
+    void render_group_specialized(
+        const Camera* cams, u32 count, const Hittable& world, u32 x, u32 y,
+        const RenderSettings& settings, u64* states, Color3* out) {
+      f64 spreads[RAY_PACKET_SIZE];
+      for (u32 v = 0; v < count; ++v) {
+        spreads[v] = cams[v].get_pixel_spread(settings.img_h);
+        out[v] = Color3(0.0, 0.0, 0.0);
+      }
+      for (u32 i = 0; i < settings.samples; ++i) {
+        Ray rays[RAY_PACKET_SIZE];
+        RayCone cones[RAY_PACKET_SIZE];
+        for (u32 v = 0; v < count; ++v) {
+          seed_random(states[v]);
+          f64 s = ((f64)x + random_f64()) / (settings.img_w-1);
+          f64 t = ((f64)y + random_f64()) / (settings.img_h-1);
+          rays[v] = Model::cast(cams[v], s, t);
+          states[v] = get_random_state();
+          cones[v] = RayCone(0.0, spreads[v]);
+        }
+        Color3 colors[RAY_PACKET_SIZE];
+        trace_group_specialized<MATERIALS, DEPTH>(rays, count, world, cones, states, colors);
+        for (u32 v = 0; v < count; ++v)
+          out[v] += colors[v];
+      }
+      for (u32 v = 0; v < count; ++v)
+        out[v] = out[v] / settings.samples;
+    }
+
+    // Null when there is no kernel for the case.
+    struct Kernels {
+      ParallelForFn row;
+      PixelFn pixel;
+      GroupPixelFn group;
+
+      Kernels() : row(nullptr), pixel(nullptr), group(nullptr) {}
+      Kernels(ParallelForFn row, PixelFn pixel, GroupPixelFn group) : row(row), pixel(pixel), group(group) {}
+    };
+
+    template <typename Model, u32 MATERIALS, i32 DEPTH>
+    Kernels get_kernels() {
+      return Kernels(
+          render_row_specialized<Model, MATERIALS, DEPTH>,
+          render_pixel_specialized<Model, MATERIALS, DEPTH>,
+          render_group_specialized<Model, MATERIALS, DEPTH>);
+    }
+
+    // Depths people render at. Others take the general path.
+    template <typename Model, u32 MATERIALS>
+    Kernels pick_depth(u32 depth) {
+      switch (depth) {
+        case 2: return get_kernels<Model, MATERIALS, 2>();
+        case 4: return get_kernels<Model, MATERIALS, 4>();
+        case 8: return get_kernels<Model, MATERIALS, 8>();
+        case 16: return get_kernels<Model, MATERIALS, 16>();
+        case 32: return get_kernels<Model, MATERIALS, 32>();
+        default: return Kernels();
+      }
+    }
+
+    template <typename Model>
+    Kernels pick_materials(u32 materials, u32 depth) {
+      switch (materials) {
+        case LAMBERTIAN_BIT: return pick_depth<Model, LAMBERTIAN_BIT>(depth);
+        case METAL_BIT: return pick_depth<Model, METAL_BIT>(depth);
+        case DIELECTRIC_BIT: return pick_depth<Model, DIELECTRIC_BIT>(depth);
+        case LAMBERTIAN_BIT | METAL_BIT: return pick_depth<Model, LAMBERTIAN_BIT | METAL_BIT>(depth);
+        case LAMBERTIAN_BIT | DIELECTRIC_BIT: return pick_depth<Model, LAMBERTIAN_BIT | DIELECTRIC_BIT>(depth);
+        case METAL_BIT | DIELECTRIC_BIT: return pick_depth<Model, METAL_BIT | DIELECTRIC_BIT>(depth);
+        case LAMBERTIAN_BIT | METAL_BIT | DIELECTRIC_BIT:
+          return pick_depth<Model, LAMBERTIAN_BIT | METAL_BIT | DIELECTRIC_BIT>(depth);
+        default:
+          return Kernels();
+      }
+    }
+
+    // The general path is left for a radiance cache, materials of no
+    // type, or other depths. `materials` is from get_material_types().
+    Kernels pick_kernels(const Camera& cam, u32 materials, const RenderSettings& settings) {
+      if (!settings.specialize || settings.radiance_cache)
+        return Kernels();
+      if (cam.lens_radius == 0.0)
+        return pick_materials<PinholeModel>(materials, settings.max_depth);
+      return pick_materials<ThinLensModel>(materials, settings.max_depth);
+    }
+
+    void render_live_band(u32 band, void* arg) {
+      RenderRows& rows = *(RenderRows*)arg;
+      u32 y0, y1;
+      rows.live->get_band_rows(band, &y0, &y1);
+      for (u32 y = y0; y < y1; ++y)
+        rows.row_fn(y, arg);
+      rows.live->publish_band(band, *rows.result, rows.settings->samples);
+    }
+  }
+
+  FloatImage render(const Camera& cam, const Hittable& world, const RenderSettings& settings, AovImages* aovs, CostImages* costs, FirstHit* first_hits) {
+    FloatImage result;
+    result.init(settings.img_w, settings.img_h);
+    if (aovs)
+      aovs->init(settings.img_w, settings.img_h);
+    if (costs) {
+      costs->init(settings.img_w, settings.img_h);
+      atomic_fetch_add(&cost_counting, 1);
+    }
+
+    RenderRows rows;
+    rows.cam = &cam;
+    rows.world = &world;
+    rows.settings = &settings;
+    rows.result = &result;
+    rows.aovs = aovs;
+    rows.costs = costs;
+    rows.gbuffer = nullptr;
+    rows.first_hits = first_hits;
+    rows.rows_done = 0;
+
+    // Thin-lens cameras keep tracing their primary rays.
+    GBuffer gbuffer;
+    if (settings.raster_primary && build_gbuffer(cam, world, settings.img_w, settings.img_h, settings.samples, &gbuffer))
+      rows.gbuffer = &gbuffer;
+    // AOVs, costs and G-buffers take the general path too.
+    Kernels kernels;
+    if (!aovs && !costs && !rows.gbuffer)
+      kernels = pick_kernels(cam, world.get_material_types(), settings);
+    rows.row_fn = kernels.row ? kernels.row : render_row;
+    rows.live = settings.live;
+    if (rows.live && (rows.live->header->w != settings.img_w || rows.live->header->h != settings.img_h)) {
+      fprintf(stderr, "Live framebuffer is %ux%u, not %ux%u; not publishing\n",
+          rows.live->header->w, rows.live->header->h, settings.img_w, settings.img_h);
+      rows.live = nullptr;
+    }
+    if (rows.live)
+      parallel_for(rows.live->get_band_count(), render_live_band, &rows);
+    else
+      parallel_for(settings.img_h, rows.row_fn, &rows);
+    gbuffer.release();
+    if (costs) {
+      atomic_fetch_add(&cost_counting, -1);
+      costs->by_material.sort_by_cycles();
+    }
+    if (settings.show_progress)
+      fprintf(stderr, "\n");
+    return result;
+  }
+
+  struct ImagePassState {
+    const Camera* cam;
+    const Hittable* world;
+    RenderSettings settings;
+    GBuffer gbuffer;
+    bool has_gbuffer;
+    PixelFn pixel_fn;
+  };
+
+  void ImagePass::init(const Camera& cam, const Hittable& world, const RenderSettings& settings) {
+    release();
+    state = (ImagePassState*)malloc(sizeof(ImagePassState));
+    state->cam = &cam;
+    state->world = &world;
+    state->settings = settings;
+    state->gbuffer = GBuffer();
+    state->has_gbuffer = settings.raster_primary
+        && build_gbuffer(cam, world, settings.img_w, settings.img_h, settings.samples, &state->gbuffer);
+    Kernels kernels;
+    if (!state->has_gbuffer)
+      kernels = pick_kernels(cam, world.get_material_types(), settings);
+    state->pixel_fn = kernels.pixel ? kernels.pixel : render_pixel_general;
+  }
+
+  void ImagePass::release() {
+    if (!state)
+      return;
+    state->gbuffer.release();
+    free(state);
+    state = nullptr;
+  }
+
+  Color3 ImagePass::render_pixel(u32 x, u32 y) const {
+    const RenderSettings& settings = state->settings;
+    if (!state->has_gbuffer)
+      return state->pixel_fn(*state->cam, *state->world, x, y, settings, nullptr);
+    return sim::render_pixel(
+        *state->cam, *state->world, x, y, settings.img_w, settings.img_h,
+        settings.samples, settings.max_depth, nullptr, &state->gbuffer, settings.radiance_cache);
+  }
+
+  namespace {
+    // Views traced pixel by pixel side by side. Neighboring views see
+    // much the same, so their primary rays go as one packet.
+    const u32 VIEW_GROUP_SIZE = RAY_PACKET_SIZE;
+  }
+
+  struct ViewBatchState {
+    const Camera* cams;
+    const Hittable* world;
+    RenderSettings settings;
+    FloatImage* out;
+    PixelFn* pixel_fns;
+    // Per group, null when its views do not share a kernel or the world
+    // is no BVH.
+    GroupPixelFn* group_fns;
+    u32 view_count;
+    u32 group_count;
+    volatile i64 items_done;
+  };
+
+  void ViewBatch::init(const Camera* cams, u32 view_count, const Hittable& world, const RenderSettings& settings, FloatImage* out) {
+    release();
+    u32 materials = world.get_material_types();
+    u32 group_count = (view_count + VIEW_GROUP_SIZE-1) / VIEW_GROUP_SIZE;
+    state = (ViewBatchState*)malloc(sizeof(ViewBatchState));
+    state->cams = cams;
+    state->world = &world;
+    state->settings = settings;
+    state->out = out;
+    state->pixel_fns = (PixelFn*)malloc(view_count * sizeof(PixelFn));
+    state->group_fns = (GroupPixelFn*)malloc(group_count * sizeof(GroupPixelFn));
+    state->view_count = view_count;
+    state->group_count = group_count;
+    state->items_done = 0;
+    for (u32 g = 0; g < group_count; ++g)
+      state->group_fns[g] = nullptr;
+    for (u32 v = 0; v < view_count; ++v) {
+      out[v].init(settings.img_w, settings.img_h);
+      Kernels kernels = pick_kernels(cams[v], materials, settings);
+      state->pixel_fns[v] = kernels.pixel ? kernels.pixel : render_pixel_general;
+
+      // Kernels differ only in the camera model between views.
+      u32 g = v / VIEW_GROUP_SIZE;
+      if (world.type != Hittable::BVH || !kernels.group)
+        state->group_fns[g] = nullptr;
+      else if (v % VIEW_GROUP_SIZE == 0)
+        state->group_fns[g] = kernels.group;
+      else if (state->group_fns[g] != kernels.group)
+        state->group_fns[g] = nullptr;
+    }
+  }
+
+  void ViewBatch::release() {
+    if (!state)
+      return;
+    free(state->group_fns);
+    free(state->pixel_fns);
+    free(state);
+    state = nullptr;
+  }
+
+  u32 ViewBatch::get_item_count() const {
+    return state->settings.img_h * state->group_count;
+  }
+
+  // Items go row by row, a group of views at a time, so that all views
+  // move down the image together.
+  void ViewBatch::render_item(u32 item) const {
+    ViewBatchState& views = *state;
+    const RenderSettings& settings = views.settings;
+    u32 y = item / views.group_count;
+    u32 first = item % views.group_count * VIEW_GROUP_SIZE;
+    u32 count = min(VIEW_GROUP_SIZE, views.view_count - first);
+
+    // Every view draws from the stream render() would give the row.
+    u64 states[VIEW_GROUP_SIZE];
+    for (u32 v = 0; v < count; ++v)
+      states[v] = get_row_seed(settings.seed, y);
+    GroupPixelFn group_fn = views.group_fns[first / VIEW_GROUP_SIZE];
+    for (u32 x = 0; x < settings.img_w; ++x) {
+      if (group_fn) {
+        Color3 pixels[VIEW_GROUP_SIZE];
+        group_fn(views.cams + first, count, *views.world, x, y, settings, states, pixels);
+        for (u32 v = 0; v < count; ++v)
+          views.out[first + v].get(x, y) = pixels[v];
+        continue;
+      }
+      for (u32 v = 0; v < count; ++v) {
+        u32 view = first + v;
+        seed_random(states[v]);
+        views.out[view].get(x, y) = views.pixel_fns[view](views.cams[view], *views.world, x, y, settings, nullptr);
+        states[v] = get_random_state();
+      }
+    }
+
+    i64 done = atomic_fetch_add(&views.items_done, 1) + 1;
+    if (settings.show_progress) {
+      fprintf(stderr, "\rRendering %.2f%%", (f64)done / get_item_count() * 100.0);
+      fflush(stderr);
+    }
+  }
+
+  namespace {
+    void render_view_item(u32 item, void* arg) {
+      ((const ViewBatch*)arg)->render_item(item);
+    }
+  }
+
+  void render_views(const Camera* cams, u32 view_count, const Hittable& world, const RenderSettings& settings, FloatImage* out) {
+    if (!view_count)
+      return;
+
+    ViewBatch batch;
+    batch.init(cams, view_count, world, settings, out);
+    parallel_for(batch.get_item_count(), render_view_item, &batch);
+    batch.release();
+    if (settings.show_progress)
+      fprintf(stderr, "\n");
+  }
+
+  namespace {
+    struct RenderTiles {
+      const Camera* cam;
+      const Hittable* world;
+      const RenderSettings* settings;
+      TiledImage* out;
+      volatile i64 tiles_done;
+      volatile i64 failed;
+    };
+
+    void render_tile(u32 tile, void* arg) {
+      RenderTiles& tiles = *(RenderTiles*)arg;
+      const RenderSettings& settings = *tiles.settings;
+      f32* pixels = tiles.out->map_tile(tile);
+      if (!pixels) {
+        atomic_fetch_add(&tiles.failed, 1);
+        return;
+      }
+
+      u32 x0, y0, w, h;
+      tiles.out->get_tile_bounds(tile, &x0, &y0, &w, &h);
+      // Seeded by index like rows, whichever thread takes the tile.
+      seed_random(get_row_seed(settings.seed, tile));
+      for (u32 y = 0; y < h; ++y) {
+        for (u32 x = 0; x < w; ++x) {
+          Color3 c = render_pixel(
+              *tiles.cam, *tiles.world, x0 + x, y0 + y, settings.img_w, settings.img_h,
+              settings.samples, settings.max_depth, nullptr, nullptr, settings.radiance_cache);
+          f32* out = pixels + ((usize)y*w + x) * 3;
+          out[0] = (f32)c.x;
+          out[1] = (f32)c.y;
+          out[2] = (f32)c.z;
+        }
+      }
+      tiles.out->unmap_tile(pixels);
+
+      i64 done = atomic_fetch_add(&tiles.tiles_done, 1) + 1;
+      if (settings.show_progress) {
+        fprintf(stderr, "\rRendering %.2f%%", (f64)done / tiles.out->get_tile_count() * 100.0);
+        fflush(stderr);
+      }
+    }
+  }
+
+  bool render_tiled(const Camera& cam, const Hittable& world, const RenderSettings& settings, TiledImage* out) {
+    RenderTiles tiles;
+    tiles.cam = &cam;
+    tiles.world = &world;
+    tiles.settings = &settings;
+    tiles.out = out;
+    tiles.tiles_done = 0;
+    tiles.failed = 0;
+    parallel_for(out->get_tile_count(), render_tile, &tiles);
+    if (settings.show_progress)
+      fprintf(stderr, "\n");
+    if (tiles.failed)
+      fprintf(stderr, "Failed to map %lld tiles of the image\n", (long long)tiles.failed);
+    return !tiles.failed;
+  }
+
+  namespace {
+    // Samples accumulated so far by render_within_budget(). Pixels that have
+    // no sample of their own yet show the coarse preview of their block.
+    struct Accumulation {
+      FloatImage sum;
+      FloatImage preview;
+      u32* counts;
+    };
+
+    // One pass adds `samples` samples to every `block` x `block` square, in
+    // rows of blocks taken from `order`.
+    struct BudgetPass {
+      const Camera* cam;
+      const Hittable* world;
+      const RenderSettings* settings;
+      Accumulation* accum;
+      const u32* order;
+      u32 block;
+      u32 samples;
+      u64 seed;
+      f64 deadline;
+      volatile i64 stopped;
+    };
+
+    void render_block_row(u32 index, void* arg) {
+      BudgetPass& pass = *(BudgetPass*)arg;
+      if (pass.stopped)
+        return;
+
+      const RenderSettings& settings = *pass.settings;
+      Accumulation& accum = *pass.accum;
+      u32 y0 = pass.order[index] * pass.block;
+      u32 h = min(pass.block, settings.img_h - y0);
+
+      RayCone cone(0.0, pass.cam->get_pixel_spread(settings.img_h));
+      seed_random(get_row_seed(pass.seed, y0));
+      for (u32 x0 = 0; x0 < settings.img_w; x0 += pass.block) {
+        // Checking the clock is cheap next to tracing even a single sample.
+        if (get_time_seconds() > pass.deadline) {
+          pass.stopped = 1;
+          return;
+        }
+
+        u32 w = min(pass.block, settings.img_w - x0);
+        Color3 block_sum(0.0, 0.0, 0.0);
+        for (u32 i = 0; i < pass.samples; ++i) {
+          // Coarse samples land on one pixel of the block and count for it.
+          u32 x = x0 + min((u32)(random_f64() * w), w - 1);
+          u32 y = y0 + min((u32)(random_f64() * h), h - 1);
+          f64 u = ((f64)x + random_f64()) / (settings.img_w-1);
+          f64 v = ((f64)y + random_f64()) / (settings.img_h-1);
+          Color3 c = ray_color(pass.cam->cast_ray(u, v), *pass.world, (i32)settings.max_depth, nullptr, cone, settings.radiance_cache);
+          accum.sum.get(x, y) += c;
+          ++accum.counts[(usize)y*settings.img_w + x];
+          block_sum += c;
+        }
+
+        if (pass.block > 1) {
+          Color3 block_avg = block_sum / pass.samples;
+          for (u32 y = y0; y < y0 + h; ++y) {
+            for (u32 x = x0; x < x0 + w; ++x)
+              accum.preview.get(x, y) = block_avg;
+          }
+        }
+      }
+    }
+  }
+
+  FloatImage render_within_budget(
+      const Camera& cam, const Hittable& world, const RenderSettings& settings,
+      f64 budget, BudgetReport* report) {
+    f64 start = get_time_seconds();
+    f64 deadline = start + budget;
+    u32 w = settings.img_w;
+    u32 h = settings.img_h;
+    usize pixel_count = (usize)w*h;
+
+    Accumulation accum;
+    accum.sum.init(w, h);
+    accum.preview.init(w, h);
+    accum.counts = (u32*)malloc(pixel_count * sizeof(u32));
+    for (usize i = 0; i < pixel_count; ++i) {
+      accum.sum.pixels[i] = Color3(0.0, 0.0, 0.0);
+      accum.preview.pixels[i] = Color3(0.0, 0.0, 0.0);
+      accum.counts[i] = 0;
+    }
+
+    BudgetPass pass;
+    pass.cam = &cam;
+    pass.world = &world;
+    pass.settings = &settings;
+    pass.accum = &accum;
+    pass.deadline = deadline;
+    pass.stopped = 0;
+
+    // Interleaved row order, so that a pass cut short still covers the
+    // whole frame evenly.
+    u32* order = (u32*)malloc(h * sizeof(u32));
+    pass.order = order;
+
+    const u32 coarse_blocks[] = {8, 4, 2};
+    u32 pass_index = 0;
+    u32 full_spp = 0;
+    f64 full_sample_cost = 0.0; // Seconds per full-resolution sample per pixel.
+    while (!pass.stopped && full_spp < settings.samples) {
+      bool coarse = pass_index < sizeof(coarse_blocks)/sizeof(coarse_blocks[0]);
+      pass.block = coarse ? coarse_blocks[pass_index] : 1;
+      pass.samples = 1;
+      if (!coarse) {
+        // Double the sample count every pass, within the cap and the time
+        // we have left.
+        pass.samples = full_spp ? full_spp : 1;
+        if (full_spp + pass.samples > settings.samples)
+          pass.samples = settings.samples - full_spp;
+        if (full_sample_cost > 0.0) {
+          f64 affordable = (deadline - get_time_seconds()) / full_sample_cost;
+          if (affordable < pass.samples)
+            pass.samples = affordable >= 1.0 ? (u32)affordable : 1;
+        }
+      }
+      pass.seed = settings.seed + pass_index;
+
+      u32 block_rows = (h + pass.block - 1) / pass.block;
+      u32 order_length = 0;
+      for (u32 phase = 0; phase < 8; ++phase) {
+        for (u32 row = phase; row < block_rows; row += 8)
+          order[order_length++] = row;
+      }
+
+      f64 pass_start = get_time_seconds();
+      parallel_for(block_rows, render_block_row, &pass);
+      if (!pass.stopped) {
+        ++report->passes;
+        if (!coarse) {
+          full_spp += pass.samples;
+          full_sample_cost = (get_time_seconds() - pass_start) / pass.samples;
+        }
+      }
+      ++pass_index;
+
+      if (settings.show_progress) {
+        fprintf(stderr, "\rRendering %u spp", full_spp);
+        fflush(stderr);
+      }
+    }
+    if (settings.show_progress)
+      fprintf(stderr, "\n");
+
+    FloatImage result;
+    result.init(w, h);
+    u64 total_spp = 0;
+    report->min_spp = accum.counts[0];
+    report->max_spp = 0;
+    for (usize i = 0; i < pixel_count; ++i) {
+      u32 count = accum.counts[i];
+      result.pixels[i] = count ? accum.sum.pixels[i] / count : accum.preview.pixels[i];
+      total_spp += count;
+      report->min_spp = min(report->min_spp, count);
+      report->max_spp = count > report->max_spp ? count : report->max_spp;
+    }
+    report->avg_spp = (f64)total_spp / (f64)pixel_count;
+    report->elapsed = get_time_seconds() - start;
+
+    free(order);
+    free(accum.counts);
+    accum.preview.release();
+    accum.sum.release();
+    return result;
+  }
+}
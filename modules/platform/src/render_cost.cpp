@@ -0,0 +1,159 @@
+#include "simplay/platform/render_cost.h"
+
+#include <stdlib.h>
+
+#include "simplay/platform/common.h"
+
+namespace sim {
+  volatile i64 cost_counting = 0;
+
+  namespace {
+    const u32 NO_ENTRY = 0xFFFFFFFF;
+
+    u64 hash_material(const Material* mat) {
+      u64 key = (u64)(usize)mat * 0x9E3779B97F4A7C15ull;
+      return key ^ (key >> 29);
+    }
+
+    // Open addressing over entry indices, kept at most half full.
+    void rebuild_slots(MaterialCosts* costs, u32 new_slot_count) {
+      free(costs->slots);
+      costs->slots = (u32*)malloc(new_slot_count * sizeof(u32));
+      costs->slot_count = new_slot_count;
+      for (u32 i = 0; i < new_slot_count; ++i)
+        costs->slots[i] = NO_ENTRY;
+
+      for (usize i = 0; i < costs->entries.length; ++i) {
+        u32 slot = (u32)(hash_material(costs->entries[i].mat) & (new_slot_count - 1));
+        while (costs->slots[slot] != NO_ENTRY)
+          slot = (slot + 1) & (new_slot_count - 1);
+        costs->slots[slot] = (u32)i;
+      }
+    }
+  }
+
+  void MaterialCosts::release() {
+    entries.release();
+    free(slots);
+    slots = nullptr;
+    slot_count = 0;
+  }
+
+  MaterialCost& MaterialCosts::get(const Material* mat) {
+    if ((entries.length + 1) * 2 > slot_count)
+      rebuild_slots(this, slot_count ? slot_count * 2 : 64);
+
+    u32 slot = (u32)(hash_material(mat) & (slot_count - 1));
+    while (slots[slot] != NO_ENTRY) {
+      MaterialCost& entry = entries[slots[slot]];
+      if (entry.mat == mat)
+        return entry;
+      slot = (slot + 1) & (slot_count - 1);
+    }
+
+    MaterialCost entry;
+    entry.mat = mat;
+    entry.cost = RenderCost();
+    entry.samples = 0;
+    slots[slot] = (u32)entries.length;
+    entries.push(entry);
+    return entries.back();
+  }
+
+  void MaterialCosts::add(const MaterialCosts& other) {
+    for (usize i = 0; i < other.entries.length; ++i) {
+      MaterialCost& entry = get(other.entries[i].mat);
+      entry.cost.add(other.entries[i].cost);
+      entry.samples += other.entries[i].samples;
+    }
+  }
+
+  void MaterialCosts::sort_by_cycles() {
+    // There are rarely more than a few hundred materials.
+    for (usize i = 1; i < entries.length; ++i) {
+      MaterialCost entry = entries[i];
+      usize j = i;
+      for (; j > 0 && entries[j-1].cost.cycles < entry.cost.cycles; --j)
+        entries[j] = entries[j-1];
+      entries[j] = entry;
+    }
+    if (slot_count)
+      rebuild_slots(this, slot_count);
+  }
+
+  void CostImages::init(u32 new_w, u32 new_h) {
+    cycles.init(new_w, new_h);
+    hit_calls.init(new_w, new_h);
+    prim_tests.init(new_w, new_h);
+    bounces.init(new_w, new_h);
+    by_material.release();
+  }
+
+  void CostImages::release() {
+    cycles.release();
+    hit_calls.release();
+    prim_tests.release();
+    bounces.release();
+    by_material.release();
+  }
+
+  RenderCost CostImages::get_total() const {
+    RenderCost total;
+    for (usize i = 0; i < by_material.entries.length; ++i)
+      total.add(by_material.entries[i].cost);
+    return total;
+  }
+
+  f64 get_cost_percentile(const FloatImage& cost, f64 fraction) {
+    usize pixel_count = (usize)cost.w * cost.h;
+    f64 max_value = 0.0;
+    for (usize i = 0; i < pixel_count; ++i)
+      max_value = max(max_value, cost.pixels[i].x);
+    if (max_value <= 0.0)
+      return 0.0;
+
+    // A histogram is fine enough for a color scale, and needs no sorting.
+    const u32 BINS = 4096;
+    u32* counts = (u32*)calloc(BINS, sizeof(u32));
+    for (usize i = 0; i < pixel_count; ++i)
+      ++counts[min((u32)(cost.pixels[i].x / max_value * BINS), BINS - 1)];
+
+    usize target = (usize)(clamp(fraction, 0.0, 1.0) * (f64)pixel_count);
+    usize seen = 0;
+    u32 bin = 0;
+    for (; bin < BINS - 1; ++bin) {
+      seen += counts[bin];
+      if (seen >= target)
+        break;
+    }
+    free(counts);
+    return (f64)(bin + 1) / BINS * max_value;
+  }
+
+  void make_heatmap(const FloatImage& cost, f64 max_value, PackedImage* out) {
+    const u8 STOPS[][3] = {
+      {0, 0, 0},
+      {32, 48, 192},
+      {224, 32, 48},
+      {255, 208, 32},
+      {255, 255, 255},
+    };
+    const u32 STOP_COUNT = sizeof(STOPS) / sizeof(STOPS[0]);
+
+    out->init(cost.w, cost.h, 1);
+    f64 scale = max_value > 0.0 ? (STOP_COUNT - 1) / max_value : 0.0;
+    for (u32 y = 0; y < cost.h; ++y) {
+      // Packed rows run top to bottom.
+      u8* row = out->get_row(cost.h-1 - y);
+      for (u32 x = 0; x < cost.w; ++x) {
+        f64 t = clamp(cost.get(x, y).x * scale, 0.0, (f64)(STOP_COUNT - 1));
+        u32 stop = min((u32)t, STOP_COUNT - 2);
+        f64 frac = t - stop;
+        for (u32 c = 0; c < 3; ++c) {
+          f64 value = STOPS[stop][c] + frac * (STOPS[stop+1][c] - STOPS[stop][c]);
+          row[x*3 + c] = (u8)(value + 0.5);
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,277 @@
+#include "simplay/platform/renderer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "simplay/platform/common.h"
+#include "simplay/platform/random.h"
+#include "simplay/platform/thread.h"
+#include "simplay/platform/vector.h"
+
+namespace sim {
+  struct RenderJob {
+    RenderRequest request;
+    FloatImage* out;
+    // Set for submit(), with the kernel and G-buffer render() would use.
+    ImagePass pass;
+    // Set for submit_views(), whose tiles are its items.
+    ViewBatch views;
+    u32 tiles_x;
+    u32 tile_count;
+    // The fields below are guarded by the renderer's mutex, but for the
+    // ones workers read or bump while rendering.
+    u32 next_tile;
+    u32 active_tiles;
+    // When the job last got a tile, to take turns with its peers.
+    u64 last_served;
+    volatile i64 tiles_done;
+    volatile i64 cancelled;
+    bool finished;
+  };
+
+  struct RendererState {
+    Mutex mutex;
+    // Signalled when a job is queued, and when the workers should stop.
+    ConditionVariable work_ready;
+    // Signalled when a job finishes.
+    ConditionVariable job_finished;
+    Vector<RenderJob*> jobs;
+    Thread* threads;
+    u32 thread_count;
+    u32 tile_size;
+    u64 served;
+    bool stopping;
+  };
+
+  namespace {
+    RenderJob* pick_job(RendererState& state) {
+      RenderJob* best = nullptr;
+      for (usize i = 0; i < state.jobs.length; ++i) {
+        RenderJob* job = state.jobs[i];
+        if (job->cancelled || job->next_tile == job->tile_count)
+          continue;
+        if (!best || job->request.priority > best->request.priority
+            || (job->request.priority == best->request.priority && job->last_served < best->last_served))
+          best = job;
+      }
+      return best;
+    }
+
+    // False when the job was cancelled before the tile was done.
+    bool render_job_tile(const RendererState& state, RenderJob& job, u32 tile) {
+      if (job.views.state) {
+        job.views.render_item(tile);
+        return true;
+      }
+
+      const RenderSettings& settings = job.request.settings;
+      u32 x0 = (tile % job.tiles_x) * state.tile_size;
+      u32 y0 = (tile / job.tiles_x) * state.tile_size;
+      u32 x1 = min(x0 + state.tile_size, settings.img_w);
+      u32 y1 = min(y0 + state.tile_size, settings.img_h);
+
+      seed_random(get_row_seed(settings.seed, tile));
+      for (u32 y = y0; y < y1; ++y) {
+        if (job.cancelled)
+          return false;
+        for (u32 x = x0; x < x1; ++x)
+          job.out->get(x, y) = job.pass.render_pixel(x, y);
+      }
+      return true;
+    }
+
+    void worker_main(void* arg) {
+      RendererState& state = *(RendererState*)arg;
+      state.mutex.lock();
+      while (true) {
+        RenderJob* job = pick_job(state);
+        if (!job) {
+          if (state.stopping)
+            break;
+          state.work_ready.wait(&state.mutex);
+          continue;
+        }
+
+        u32 tile = job->next_tile++;
+        ++job->active_tiles;
+        job->last_served = ++state.served;
+        state.mutex.unlock();
+
+        // The job cannot finish, and be freed, while this tile is active.
+        if (render_job_tile(state, *job, tile)) {
+          i64 done = atomic_fetch_add(&job->tiles_done, 1) + 1;
+          if (job->request.on_progress)
+            job->request.on_progress(job, (f64)done / job->tile_count, job->request.progress_arg);
+          if (job->request.settings.show_progress) {
+            fprintf(stderr, "\rRendering %.2f%%", (f64)done / job->tile_count * 100.0);
+            fflush(stderr);
+          }
+        }
+
+        state.mutex.lock();
+        --job->active_tiles;
+        if (!job->active_tiles && (job->cancelled || job->next_tile == job->tile_count)) {
+          job->finished = true;
+          state.job_finished.wake_all();
+        }
+      }
+      state.mutex.unlock();
+    }
+
+    void queue_job(RendererState& state, RenderJob* job) {
+      job->next_tile = 0;
+      job->active_tiles = 0;
+      job->tiles_done = 0;
+      job->cancelled = 0;
+      job->finished = false;
+
+      state.mutex.lock();
+      // New jobs take their turn after the ones already running.
+      job->last_served = state.served;
+      state.jobs.push(job);
+      state.work_ready.wake_all();
+      state.mutex.unlock();
+    }
+  }
+
+  bool Renderer::init(u32 thread_count, u32 tile_size) {
+    release();
+    if (!tile_size)
+      return false;
+
+    state = (RendererState*)malloc(sizeof(RendererState));
+    state->mutex = Mutex();
+    state->work_ready = ConditionVariable();
+    state->job_finished = ConditionVariable();
+    state->jobs = Vector<RenderJob*>();
+    state->thread_count = thread_count ? thread_count : get_cpu_count();
+    state->tile_size = tile_size;
+    state->served = 0;
+    state->stopping = false;
+
+    state->threads = (Thread*)malloc(state->thread_count * sizeof(Thread));
+    for (u32 i = 0; i < state->thread_count; ++i) {
+      state->threads[i] = Thread();
+      if (!state->threads[i].spawn(worker_main, state)) {
+        fprintf(stderr, "Failed to start render worker %u\n", i);
+        state->thread_count = i;
+        release();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void Renderer::release() {
+    if (!state)
+      return;
+
+    state->mutex.lock();
+    state->stopping = true;
+    for (usize i = 0; i < state->jobs.length; ++i)
+      state->jobs[i]->cancelled = 1;
+    state->work_ready.wake_all();
+    state->mutex.unlock();
+    for (u32 i = 0; i < state->thread_count; ++i)
+      state->threads[i].join();
+    free(state->threads);
+
+    for (usize i = 0; i < state->jobs.length; ++i) {
+      state->jobs[i]->pass.release();
+      state->jobs[i]->views.release();
+      free(state->jobs[i]);
+    }
+    state->jobs.release();
+    free(state);
+    state = nullptr;
+  }
+
+  RenderJob* Renderer::submit(const RenderRequest& request, FloatImage* out) {
+    const RenderSettings& settings = request.settings;
+    if (!state || !request.cam || !request.world || !settings.img_w || !settings.img_h || !settings.samples)
+      return nullptr;
+    if (settings.live) {
+      fprintf(stderr, "Renderer jobs cannot publish to a live framebuffer\n");
+      return nullptr;
+    }
+
+    out->init(settings.img_w, settings.img_h);
+    for (usize i = 0; i < (usize)out->w * out->h; ++i)
+      out->pixels[i] = Color3(0.0, 0.0, 0.0);
+
+    RenderJob* job = (RenderJob*)malloc(sizeof(RenderJob));
+    job->request = request;
+    job->out = out;
+    job->pass = ImagePass();
+    job->pass.init(*request.cam, *request.world, settings);
+    job->views = ViewBatch();
+    job->tiles_x = (settings.img_w + state->tile_size-1) / state->tile_size;
+    job->tile_count = job->tiles_x * ((settings.img_h + state->tile_size-1) / state->tile_size);
+    queue_job(*state, job);
+    return job;
+  }
+
+  RenderJob* Renderer::submit_views(const RenderRequest& request, const Camera* cams, u32 view_count, FloatImage* out) {
+    const RenderSettings& settings = request.settings;
+    if (!state || !cams || !view_count || !request.world || !settings.img_w || !settings.img_h || !settings.samples)
+      return nullptr;
+    if (settings.live) {
+      fprintf(stderr, "Renderer jobs cannot publish to a live framebuffer\n");
+      return nullptr;
+    }
+
+    RenderJob* job = (RenderJob*)malloc(sizeof(RenderJob));
+    job->request = request;
+    job->request.cam = nullptr;
+    job->out = out;
+    job->pass = ImagePass();
+    job->views = ViewBatch();
+    // Workers report the job's progress, not the batch.
+    RenderSettings batch_settings = settings;
+    batch_settings.show_progress = false;
+    job->views.init(cams, view_count, *request.world, batch_settings, out);
+    for (u32 v = 0; v < view_count; ++v) {
+      for (usize i = 0; i < (usize)out[v].w * out[v].h; ++i)
+        out[v].pixels[i] = Color3(0.0, 0.0, 0.0);
+    }
+    job->tiles_x = 0;
+    job->tile_count = job->views.get_item_count();
+    queue_job(*state, job);
+    return job;
+  }
+
+  void Renderer::cancel(RenderJob* job) {
+    state->mutex.lock();
+    job->cancelled = 1;
+    // With no tile under way, no worker would come round to finish it.
+    if (!job->active_tiles && !job->finished) {
+      job->finished = true;
+      state->job_finished.wake_all();
+    }
+    state->mutex.unlock();
+  }
+
+  f64 Renderer::get_progress(const RenderJob* job) const {
+    return (f64)job->tiles_done / job->tile_count;
+  }
+
+  bool Renderer::wait(RenderJob* job) {
+    state->mutex.lock();
+    while (!job->finished)
+      state->job_finished.wait(&state->mutex);
+    for (usize i = 0; i < state->jobs.length; ++i) {
+      if (state->jobs[i] == job) {
+        state->jobs[i] = state->jobs.back();
+        state->jobs.pop();
+        break;
+      }
+    }
+    state->mutex.unlock();
+
+    bool complete = job->tiles_done == job->tile_count;
+    job->pass.release();
+    job->views.release();
+    free(job);
+    return complete;
+  }
+}
@@ -0,0 +1,73 @@
+#include "simplay/platform/scene.h"
+
+#include "simplay/platform/random.h"
+
+namespace sim {
+  void build_scene(Scene* world, const Texture* texture) {
+    if (!world)
+      return;
+
+    world->release();
+    world->objects = Hittable::make_scene();
+
+    // Ground.
+    world->ground_mat = Material::make_lambertian(Color3(0.5, 0.5, 0.5));
+    world->objects.scene.push(Hittable::make_sphere(Point3(0.0, -1000.0, 0.0), 1000.0, &world->ground_mat));
+
+    // Small spheres.
+    // We need to pre-allocate to prevent material pointer invalidation.
+    world->sphere_mats.reserve(22 * 22);
+    for (i32 a = -11; a < 11; ++a) {
+      for (i32 b = -11; b < 11; ++b) {
+        Point3 center((f64)a + 0.9*random_f64(), 0.2, (f64)b + 0.9*random_f64());
+        if ((center - Point3(4.0, 0.2, 0.0)).mag() > 0.9) {
+          Material sphere_mat;
+
+          f64 choose_mat = random_f64();
+          if (choose_mat < 0.8) {
+            Color3 albedo = random_vec3() * random_vec3();
+            sphere_mat = Material::make_lambertian(albedo);
+          } else if (choose_mat < 0.95) {
+            Color3 albedo = random_vec3_in(0.5, 1.0);
+            f64 fuzz = random_f64_in(0.0, 0.5);
+            sphere_mat = Material::make_metal(albedo, fuzz);
+          } else {
+            sphere_mat = Material::make_dielectric(1.5);
+          }
+
+          world->sphere_mats.push(sphere_mat);
+          world->objects.scene.push(Hittable::make_sphere(center, 0.2, &world->sphere_mats.back()));
+        }
+      }
+    }
+
+    // Big spheres.
+    world->big1_mat = Material::make_dielectric(1.5);
+    if (texture)
+      world->big2_mat = Material::make_lambertian(Color3(1.0, 1.0, 1.0), TextureMap(texture));
+    else
+      world->big2_mat = Material::make_lambertian(Color3(0.4, 0.2, 0.1));
+    world->big3_mat = Material::make_metal(Color3(0.7, 0.6, 0.5), 0.0);
+    world->objects.scene.push(Hittable::make_sphere(Point3(0.0, 1.0, 0.0), 1.0, &world->big1_mat));
+    world->objects.scene.push(Hittable::make_sphere(Point3(-4.0, 1.0, 0.0), 1.0, &world->big2_mat));
+    world->objects.scene.push(Hittable::make_sphere(Point3(4.0, 1.0, 0.0), 1.0, &world->big3_mat));
+  }
+
+  BvhStats accelerate_scene(Scene* world, const char* cache_dir) {
+    Bvh bvh;
+    BvhStats stats;
+    build_or_load_bvh(&world->objects.scene, cache_dir, &bvh, &stats);
+    world->objects.release();
+    world->objects = Hittable::make_bvh(bvh);
+    return stats;
+  }
+
+  Camera make_camera(f64 aperture) {
+    Vec3 up(0.0, 1.0, 0.0);
+    Vec3 lookfrom(13.0, 2.0, 3.0);
+    Vec3 lookat(0.0, 0.0, 0.0);
+
+    f64 focus_dist = 10.0;
+    return Camera(lookfrom, lookat, up, 20.0, ASPECT_RATIO, aperture, focus_dist);
+  }
+}
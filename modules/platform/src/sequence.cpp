@@ -0,0 +1,283 @@
+#include "simplay/platform/sequence.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "simplay/platform/bvh.h"
+#include "simplay/platform/clock.h"
+#include "simplay/platform/common.h"
+#include "simplay/platform/material.h"
+#include "simplay/platform/thread.h"
+
+namespace sim {
+  namespace {
+    // Metals rougher than this blur what they reflect enough to pass for
+    // diffuse.
+    const f64 SPECULAR_FUZZ = 0.3;
+
+    // Scene and camera of one frame. There are two, so that the next frame
+    // can be set up while this one renders.
+    struct FrameWorld {
+      Hittable world;
+      Camera cam;
+      f64 built_cost;
+
+      FrameWorld(const Camera& cam) : world(), cam(cam), built_cost(0.0) {}
+    };
+
+    // A fresh tree over the rest scene moved by `offsets`. Its prim order
+    // then maps straight back to the rest scene.
+    void build_world(const Vector<Hittable>& objects, const Vec3* offsets, FrameWorld* fw) {
+      Vector<Hittable> prims;
+      prims.reserve(objects.length);
+      for (usize i = 0; i < objects.length; ++i) {
+        Hittable prim = objects[i];
+        if (prim.type == Hittable::SPHERE)
+          prim.sphere.center += offsets[i];
+        prims.push(prim);
+      }
+
+      Bvh bvh;
+      build_bvh(&prims, &bvh);
+      fw->world.release();
+      fw->world = Hittable::make_bvh(bvh);
+      fw->built_cost = get_bvh_cost(bvh);
+    }
+
+    struct FrameSetup {
+      const Vector<Hittable>* objects;
+      const Camera* cam;
+      const SequenceSettings* settings;
+      AnimateFn animate;
+      void* animate_arg;
+      Vec3* offsets;
+      u32 frame;
+      FrameWorld* target;
+      bool rebuilt;
+      f64 time;
+    };
+
+    void setup_frame(void* arg) {
+      FrameSetup& setup = *(FrameSetup*)arg;
+      f64 start = get_time_seconds();
+      const Vector<Hittable>& objects = *setup.objects;
+      FrameWorld& fw = *setup.target;
+
+      fw.cam = *setup.cam;
+      for (usize i = 0; i < objects.length; ++i)
+        setup.offsets[i] = Vec3(0.0, 0.0, 0.0);
+      FrameState state;
+      state.cam = &fw.cam;
+      state.offsets = setup.offsets;
+      state.object_count = (u32)objects.length;
+      if (setup.animate)
+        setup.animate(setup.frame, &state, setup.animate_arg);
+
+      Bvh& bvh = *fw.world.bvh;
+      for (usize i = 0; i < bvh.prims.length; ++i) {
+        u32 index = bvh.prim_order[i];
+        if (bvh.prims[i].type == Hittable::SPHERE)
+          bvh.prims[i].sphere.center = objects[index].sphere.center + setup.offsets[index];
+      }
+      refit_bvh(&bvh);
+      setup.rebuilt = get_bvh_cost(bvh) > fw.built_cost * setup.settings->rebuild_cost_ratio;
+      if (setup.rebuilt)
+        build_world(objects, setup.offsets, &fw);
+      setup.time = get_time_seconds() - start;
+    }
+
+    // What mirrors and glass show moves apart from their surface, so their
+    // history goes stale however well the surface itself reprojects.
+    bool is_specular(const Material* mat) {
+      return mat->type == Material::DIELECTRIC || (mat->type == Material::METAL && mat->metal.fuzz < SPECULAR_FUZZ);
+    }
+
+    // What a frame leaves for the next one, `guides` from its render.
+    struct History {
+      FloatImage color;
+      u32* samples;
+      FirstHit* guides;
+    };
+
+    struct Reprojection {
+      const FrameWorld* current;
+      // Null when there is nothing to reproject.
+      const Camera* prev_cam;
+      const SequenceSettings* settings;
+      const FloatImage* fresh;
+      const History* prev;
+      History* next;
+      volatile i64 reused;
+    };
+
+    void reproject_row(u32 y, void* arg) {
+      Reprojection& rp = *(Reprojection*)arg;
+      const SequenceSettings& settings = *rp.settings;
+      u32 w = settings.render.img_w;
+      u32 h = settings.render.img_h;
+      i64 reused = 0;
+      for (u32 x = 0; x < w; ++x) {
+        usize i = (usize)y*w + x;
+        const FirstHit& guide = rp.next->guides[i];
+        Color3 color = rp.fresh->get(x, y);
+        u32 samples = settings.render.samples;
+        f64 s, t, s_now, t_now;
+        if (rp.prev_cam && guide.hit && rp.prev_cam->project(guide.p, &s, &t)
+            && rp.current->cam.project(guide.p, &s_now, &t_now)) {
+          // Pixel x covers [x, x+1) / (w-1), as render_pixel() samples it.
+          // The guide is wherever the sample nearest its center went, and
+          // the center is taken to move as far as the guide did.
+          // Nearest taps would shift the image a little every frame,
+          // bilinear ones only blur it a little.
+          f64 fx = (s - s_now) * (w-1) + x;
+          f64 fy = (t - t_now) * (h-1) + y;
+          f64 x0 = floor(fx);
+          f64 y0 = floor(fy);
+          f64 tolerance = settings.max_position_error * (guide.p - rp.current->cam.origin).mag();
+          Color3 sum(0.0, 0.0, 0.0);
+          f64 weight_sum = 0.0;
+          f64 sample_sum = 0.0;
+          for (u32 tap = 0; tap < 4; ++tap) {
+            f64 tx = x0 + (tap & 1);
+            f64 ty = y0 + (tap >> 1);
+            f64 weight = (1.0 - fabs(fx - tx)) * (1.0 - fabs(fy - ty));
+            if (tx < 0.0 || tx >= w || ty < 0.0 || ty >= h || weight <= 0.0)
+              continue;
+
+            usize j = (usize)ty*w + (usize)tx;
+            const FirstHit& old = rp.prev->guides[j];
+            if (!old.hit || old.mat != guide.mat || fabs(dot(old.p - guide.p, guide.normal)) >= tolerance
+                || dot(old.normal, guide.normal) <= settings.min_normal_cos)
+              continue;
+            sum += weight * rp.prev->color.pixels[j];
+            sample_sum += weight * rp.prev->samples[j];
+            weight_sum += weight;
+          }
+
+          // Taps that disagree drop out, and the history counts for less.
+          u32 max_history = is_specular(guide.mat) ? settings.max_specular_history : settings.max_history;
+          if (weight_sum > 0.0 && max_history) {
+            Color3 history = sum / weight_sum;
+            f64 carried = min(sample_sum / weight_sum, (f64)max_history) * min(weight_sum * 2.0, 1.0);
+            color = (carried * history + samples * color) / (carried + samples);
+            samples += (u32)(carried + 0.5);
+            ++reused;
+          }
+        }
+        rp.next->color.pixels[i] = color;
+        rp.next->samples[i] = samples;
+      }
+      atomic_fetch_add(&rp.reused, reused);
+    }
+  }
+
+  bool render_sequence(
+      const Vector<Hittable>& objects, const Camera& cam, const SequenceSettings& settings,
+      AnimateFn animate, void* animate_arg, FrameDoneFn on_frame, void* frame_arg,
+      SequenceStats* stats) {
+    *stats = SequenceStats();
+    f64 start = get_time_seconds();
+    const RenderSettings& render_settings = settings.render;
+    usize pixel_count = (usize)render_settings.img_w * render_settings.img_h;
+
+    FrameWorld worlds[2] = {FrameWorld(cam), FrameWorld(cam)};
+    FrameSetup setups[2];
+    History histories[2];
+    for (u32 k = 0; k < 2; ++k) {
+      Vec3* offsets = (Vec3*)malloc((objects.length ? objects.length : 1) * sizeof(Vec3));
+      for (usize i = 0; i < objects.length; ++i)
+        offsets[i] = Vec3(0.0, 0.0, 0.0);
+      build_world(objects, offsets, &worlds[k]);
+
+      setups[k].objects = &objects;
+      setups[k].cam = &cam;
+      setups[k].settings = &settings;
+      setups[k].animate = animate;
+      setups[k].animate_arg = animate_arg;
+      setups[k].offsets = offsets;
+      setups[k].target = &worlds[k];
+
+      histories[k].color.init(render_settings.img_w, render_settings.img_h);
+      histories[k].samples = (u32*)malloc(pixel_count * sizeof(u32));
+      histories[k].guides = (FirstHit*)malloc(pixel_count * sizeof(FirstHit));
+    }
+
+    if (settings.frame_count) {
+      setups[0].frame = 0;
+      setup_frame(&setups[0]);
+      stats->setup_time += setups[0].time;
+      if (setups[0].rebuilt)
+        ++stats->rebuilds;
+      else
+        ++stats->refits;
+    }
+
+    // Kept apart from the worlds, since the previous frame's one is being
+    // set up for the next frame by the time this one reprojects.
+    Camera prev_cam = cam;
+    u32 reuse_frames = 0;
+    bool ok = true;
+    for (u32 f = 0; f < settings.frame_count && ok; ++f) {
+      FrameWorld& current = worlds[f % 2];
+      FrameSetup& next_setup = setups[(f+1) % 2];
+      bool has_next = f+1 < settings.frame_count;
+      Thread setup_thread;
+      bool pipelined = false;
+      if (has_next) {
+        next_setup.frame = f+1;
+        pipelined = setup_thread.spawn(setup_frame, &next_setup);
+        if (!pipelined)
+          setup_frame(&next_setup);
+      }
+
+      f64 render_start = get_time_seconds();
+      RenderSettings frame_settings = render_settings;
+      frame_settings.seed = render_settings.seed + f;
+      History& next = histories[f % 2];
+      FloatImage fresh = render(current.cam, current.world, frame_settings, nullptr, nullptr, settings.reproject ? next.guides : nullptr);
+
+      Reprojection rp;
+      rp.current = &current;
+      rp.prev_cam = settings.reproject && f ? &prev_cam : nullptr;
+      rp.settings = &settings;
+      rp.fresh = &fresh;
+      rp.prev = &histories[(f+1) % 2];
+      rp.next = &next;
+      rp.reused = 0;
+      parallel_for(render_settings.img_h, reproject_row, &rp);
+      fresh.release();
+      stats->render_time += get_time_seconds() - render_start;
+      if (rp.prev_cam) {
+        stats->reused += (f64)rp.reused / (f64)pixel_count;
+        ++reuse_frames;
+      }
+
+      if (pipelined)
+        setup_thread.join();
+      if (has_next) {
+        stats->setup_time += next_setup.time;
+        if (next_setup.rebuilt)
+          ++stats->rebuilds;
+        else
+          ++stats->refits;
+      }
+
+      ++stats->frames;
+      prev_cam = current.cam;
+      if (on_frame)
+        ok = on_frame(f, next.color, frame_arg);
+    }
+    if (reuse_frames)
+      stats->reused /= reuse_frames;
+
+    for (u32 k = 0; k < 2; ++k) {
+      worlds[k].world.release();
+      free(setups[k].offsets);
+      histories[k].color.release();
+      free(histories[k].samples);
+      free(histories[k].guides);
+    }
+    stats->elapsed = get_time_seconds() - start;
+    return ok;
+  }
+}
@@ -0,0 +1,461 @@
+#include "simplay/platform/texture.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "simplay/platform/common.h"
+#include "simplay/platform/thread.h"
+
+namespace sim {
+  namespace {
+    const char TEXTURE_MAGIC[4] = {'S', 'I', 'M', 'X'};
+    const u32 TEXTURE_VERSION = 1;
+    const u32 TILE_TEXELS = TEXTURE_TILE_SIZE * TEXTURE_TILE_SIZE;
+    const u32 TILE_BYTES = TILE_TEXELS * 4;
+    // Tiles start on a page boundary, after the header and level table.
+    const u64 TILES_ALIGNMENT = 4096;
+
+    const u32 SHARD_COUNT = 16;
+    const u32 NO_SLOT = 0xFFFFFFFF;
+
+    struct TextureFileHeader {
+      char magic[4];
+      u32 version;
+      u32 w, h;
+      u32 tile_size;
+      u32 level_count;
+      u64 tiles_offset;
+    };
+
+    struct SrgbTable {
+      f32 to_linear[256];
+
+      SrgbTable() {
+        for (u32 i = 0; i < 256; ++i) {
+          f64 c = i / 255.0;
+          to_linear[i] = (f32)(c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+        }
+      }
+    };
+
+    const SrgbTable SRGB_TABLE;
+
+    u8 encode_srgb(f64 c) {
+      c = clamp(c, 0.0, 1.0);
+      c = c <= 0.0031308 ? 12.92 * c : 1.055 * pow(c, 1.0 / 2.4) - 0.055;
+      return (u8)(c * 255.0 + 0.5);
+    }
+
+    u64 make_tile_key(u32 texture_id, u32 tile) {
+      return ((u64)texture_id << 32) | tile;
+    }
+
+    u64 hash_tile_key(u64 key) {
+      key *= 0x9E3779B97F4A7C15ull;
+      return key ^ (key >> 29);
+    }
+
+    struct TileSlot {
+      u64 key;
+      // Neighbours in the LRU list, most recently used first.
+      u32 prev, next;
+      u32 hash_next;
+    };
+  }
+
+  struct TextureCacheShard {
+    Mutex mutex;
+    TileSlot* slots;
+    u32* buckets;
+    u8* texels;
+    u32 bucket_count;
+    u32 used;
+    u32 head, tail;
+    TextureCacheStats stats;
+
+    void init(u32 slot_count) {
+      slots = (TileSlot*)malloc(slot_count * sizeof(TileSlot));
+      bucket_count = slot_count * 2;
+      buckets = (u32*)malloc(bucket_count * sizeof(u32));
+      for (u32 i = 0; i < bucket_count; ++i)
+        buckets[i] = NO_SLOT;
+      texels = (u8*)malloc((usize)slot_count * TILE_BYTES);
+      used = 0;
+      head = NO_SLOT;
+      tail = NO_SLOT;
+    }
+
+    void release() {
+      free(slots);
+      free(buckets);
+      free(texels);
+    }
+
+    u32* get_bucket(u64 key) {
+      return &buckets[(hash_tile_key(key) >> 32) % bucket_count];
+    }
+
+    u32 find(u64 key) {
+      for (u32 slot = *get_bucket(key); slot != NO_SLOT; slot = slots[slot].hash_next) {
+        if (slots[slot].key == key)
+          return slot;
+      }
+      return NO_SLOT;
+    }
+
+    void unlink(u32 slot) {
+      TileSlot& s = slots[slot];
+      if (s.prev != NO_SLOT)
+        slots[s.prev].next = s.next;
+      else
+        head = s.next;
+      if (s.next != NO_SLOT)
+        slots[s.next].prev = s.prev;
+      else
+        tail = s.prev;
+    }
+
+    void push_front(u32 slot) {
+      slots[slot].prev = NO_SLOT;
+      slots[slot].next = head;
+      if (head != NO_SLOT)
+        slots[head].prev = slot;
+      head = slot;
+      if (tail == NO_SLOT)
+        tail = slot;
+    }
+
+    void remove_key(u32 slot) {
+      u32* link = get_bucket(slots[slot].key);
+      while (*link != slot)
+        link = &slots[*link].hash_next;
+      *link = slots[slot].hash_next;
+    }
+
+    // Takes a free slot while there is one, then the least recently used.
+    u32 claim(u64 key, u32 slot_count) {
+      u32 slot;
+      if (used < slot_count) {
+        slot = used++;
+      } else {
+        slot = tail;
+        unlink(slot);
+        remove_key(slot);
+        ++stats.evictions;
+      }
+
+      u32* bucket = get_bucket(key);
+      slots[slot].key = key;
+      slots[slot].hash_next = *bucket;
+      *bucket = slot;
+      push_front(slot);
+      return slot;
+    }
+  };
+
+  void TextureCache::init(usize capacity) {
+    release();
+    usize tiles = capacity / TILE_BYTES;
+    slots_per_shard = (u32)(tiles / SHARD_COUNT);
+    if (!slots_per_shard)
+      slots_per_shard = 1;
+    shards = (TextureCacheShard*)calloc(SHARD_COUNT, sizeof(TextureCacheShard));
+    for (u32 i = 0; i < SHARD_COUNT; ++i)
+      shards[i].init(slots_per_shard);
+  }
+
+  void TextureCache::release() {
+    if (shards) {
+      for (u32 i = 0; i < SHARD_COUNT; ++i)
+        shards[i].release();
+      free(shards);
+      shards = nullptr;
+    }
+    for (usize i = 0; i < textures.length; ++i) {
+      CloseHandle(textures[i]->file);
+      free(textures[i]);
+    }
+    textures.release();
+    slots_per_shard = 0;
+  }
+
+  namespace {
+    bool read_at(HANDLE file, u64 offset, void* out, u32 size) {
+      // Positioned reads, so that threads never race on a file pointer.
+      OVERLAPPED ov = {};
+      ov.Offset = (DWORD)(offset & 0xFFFFFFFF);
+      ov.OffsetHigh = (DWORD)(offset >> 32);
+      DWORD read = 0;
+      return ReadFile(file, out, size, &read, &ov) && read == size;
+    }
+  }
+
+  Texture* TextureCache::open(const char* path) {
+    HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (f == INVALID_HANDLE_VALUE) {
+      fprintf(stderr, "Failed to open texture: \"%s\"\n", path);
+      return nullptr;
+    }
+
+    TextureFileHeader header;
+    u32 sizes[MAX_TEXTURE_LEVELS * 2];
+    if (!read_at(f, 0, &header, sizeof(header))
+        || memcmp(header.magic, TEXTURE_MAGIC, sizeof(TEXTURE_MAGIC)) != 0
+        || header.version != TEXTURE_VERSION || header.tile_size != TEXTURE_TILE_SIZE
+        || !header.level_count || header.level_count > MAX_TEXTURE_LEVELS
+        || !read_at(f, sizeof(header), sizes, header.level_count * 2 * sizeof(u32))
+        || sizes[0] != header.w || sizes[1] != header.h || !header.w || !header.h) {
+      fprintf(stderr, "Invalid texture: \"%s\"\n", path);
+      CloseHandle(f);
+      return nullptr;
+    }
+
+    Texture* tex = (Texture*)malloc(sizeof(Texture));
+    tex->cache = this;
+    tex->file = f;
+    tex->id = (u32)textures.length;
+    tex->level_count = header.level_count;
+    tex->tiles_offset = header.tiles_offset;
+    u32 tile_count = 0;
+    for (u32 i = 0; i < header.level_count; ++i) {
+      TextureLevel& level = tex->levels[i];
+      level.w = sizes[i*2];
+      level.h = sizes[i*2 + 1];
+      level.tiles_x = (level.w + TEXTURE_TILE_SIZE-1) / TEXTURE_TILE_SIZE;
+      level.tiles_y = (level.h + TEXTURE_TILE_SIZE-1) / TEXTURE_TILE_SIZE;
+      level.first_tile = tile_count;
+      tile_count += level.tiles_x * level.tiles_y;
+    }
+    textures.push(tex);
+    return tex;
+  }
+
+  bool Texture::read_tile(u32 tile, u8* out) const {
+    return read_at(file, tiles_offset + (u64)tile * TILE_BYTES, out, TILE_BYTES);
+  }
+
+  bool TextureCache::read_texels(const Texture& tex, u32 tile, const u32* texels, u32 count, u32* out) {
+    u64 key = make_tile_key(tex.id, tile);
+    TextureCacheShard& shard = shards[hash_tile_key(key) % SHARD_COUNT];
+
+    shard.mutex.lock();
+    ++shard.stats.lookups;
+    u32 slot = shard.find(key);
+    if (slot != NO_SLOT) {
+      ++shard.stats.hits;
+      shard.unlink(slot);
+      shard.push_front(slot);
+    } else {
+      // The read happens outside of the lock, so other lookups in the shard
+      // do not wait on the disk.
+      shard.mutex.unlock();
+      u8* loaded = (u8*)malloc(TILE_BYTES);
+      bool ok = tex.read_tile(tile, loaded);
+      shard.mutex.lock();
+      if (!ok) {
+        ++shard.stats.failed_loads;
+        shard.mutex.unlock();
+        free(loaded);
+        return false;
+      }
+
+      // Another thread may have loaded the same tile in the meantime.
+      slot = shard.find(key);
+      if (slot == NO_SLOT) {
+        slot = shard.claim(key, slots_per_shard);
+        memcpy(shard.texels + (usize)slot * TILE_BYTES, loaded, TILE_BYTES);
+        ++shard.stats.loads;
+      } else {
+        shard.unlink(slot);
+        shard.push_front(slot);
+      }
+      free(loaded);
+    }
+
+    const u32* tile_texels = (const u32*)(shard.texels + (usize)slot * TILE_BYTES);
+    for (u32 i = 0; i < count; ++i)
+      out[i] = tile_texels[texels[i]];
+    shard.mutex.unlock();
+    return true;
+  }
+
+  TextureCacheStats TextureCache::get_stats() const {
+    TextureCacheStats total;
+    for (u32 i = 0; i < SHARD_COUNT && shards; ++i) {
+      shards[i].mutex.lock();
+      const TextureCacheStats& stats = shards[i].stats;
+      total.lookups += stats.lookups;
+      total.hits += stats.hits;
+      total.loads += stats.loads;
+      total.evictions += stats.evictions;
+      total.failed_loads += stats.failed_loads;
+      shards[i].mutex.unlock();
+    }
+    return total;
+  }
+
+  namespace {
+    u32 wrap_texel(i32 i, u32 n) {
+      if (i < 0)
+        return (u32)(i + (i32)n);
+      return (u32)i >= n ? (u32)i - n : (u32)i;
+    }
+  }
+
+  Color3 Texture::sample_level(u32 level, f64 u, f64 v) const {
+    const TextureLevel& l = levels[level];
+    f64 x = (u - floor(u)) * l.w - 0.5;
+    f64 y = (v - floor(v)) * l.h - 0.5;
+    f64 x_floor = floor(x);
+    f64 y_floor = floor(y);
+    f64 fx = x - x_floor;
+    f64 fy = y - y_floor;
+
+    // The four texels of the bilinear footprint, in up to four tiles.
+    u32 tiles[4];
+    u32 texels[4];
+    for (u32 i = 0; i < 4; ++i) {
+      u32 tx = wrap_texel((i32)x_floor + (i32)(i & 1), l.w);
+      u32 ty = wrap_texel((i32)y_floor + (i32)(i >> 1), l.h);
+      tiles[i] = l.first_tile + (ty / TEXTURE_TILE_SIZE)*l.tiles_x + tx / TEXTURE_TILE_SIZE;
+      texels[i] = (ty % TEXTURE_TILE_SIZE)*TEXTURE_TILE_SIZE + tx % TEXTURE_TILE_SIZE;
+    }
+
+    u32 rgba[4] = {};
+    bool done[4] = {};
+    for (u32 i = 0; i < 4; ++i) {
+      if (done[i])
+        continue;
+
+      // One cache lookup per distinct tile.
+      u32 group[4];
+      u32 group_texels[4];
+      u32 group_rgba[4];
+      u32 n = 0;
+      for (u32 j = i; j < 4; ++j) {
+        if (!done[j] && tiles[j] == tiles[i]) {
+          group[n] = j;
+          group_texels[n++] = texels[j];
+          done[j] = true;
+        }
+      }
+      if (!cache->read_texels(*this, tiles[i], group_texels, n, group_rgba))
+        continue;
+      for (u32 j = 0; j < n; ++j)
+        rgba[group[j]] = group_rgba[j];
+    }
+
+    f64 weights[4] = {(1.0-fx)*(1.0-fy), fx*(1.0-fy), (1.0-fx)*fy, fx*fy};
+    Color3 c(0.0, 0.0, 0.0);
+    for (u32 i = 0; i < 4; ++i) {
+      const u8* texel = (const u8*)&rgba[i];
+      c += weights[i] * Color3(
+          SRGB_TABLE.to_linear[texel[0]],
+          SRGB_TABLE.to_linear[texel[1]],
+          SRGB_TABLE.to_linear[texel[2]]);
+    }
+    return c;
+  }
+
+  Color3 Texture::sample(f64 u, f64 v, f64 footprint) const {
+    f64 texels = footprint * max(levels[0].w, levels[0].h);
+    if (!(texels > 1.0) || level_count == 1)
+      return sample_level(0, u, v);
+
+    f64 lod = min(log2(texels), (f64)(level_count - 1));
+    u32 lo = (u32)lod;
+    f64 t = lod - lo;
+    Color3 c = sample_level(lo, u, v);
+    if (t > 0.0 && lo+1 < level_count)
+      c = (1.0-t)*c + t*sample_level(lo+1, u, v);
+    return c;
+  }
+
+  namespace {
+    // 2x2 box filter. Odd edges reuse their last row or column.
+    void downsample(const FloatImage& src, FloatImage* dst) {
+      dst->init(max(src.w / 2, 1u), max(src.h / 2, 1u));
+      for (u32 y = 0; y < dst->h; ++y) {
+        u32 y0 = min(y*2, src.h-1);
+        u32 y1 = min(y*2 + 1, src.h-1);
+        for (u32 x = 0; x < dst->w; ++x) {
+          u32 x0 = min(x*2, src.w-1);
+          u32 x1 = min(x*2 + 1, src.w-1);
+          dst->get(x, y) = 0.25 * (src.get(x0, y0) + src.get(x1, y0) + src.get(x0, y1) + src.get(x1, y1));
+        }
+      }
+    }
+  }
+
+  bool write_texture(const char* path, const FloatImage& img) {
+    if (!img.w || !img.h)
+      return false;
+
+    FloatImage levels[MAX_TEXTURE_LEVELS];
+    u32 level_count = 1;
+    const FloatImage* last = &img;
+    while ((last->w > 1 || last->h > 1) && level_count < MAX_TEXTURE_LEVELS) {
+      downsample(*last, &levels[level_count]);
+      last = &levels[level_count++];
+    }
+
+    TextureFileHeader header;
+    memcpy(header.magic, TEXTURE_MAGIC, sizeof(TEXTURE_MAGIC));
+    header.version = TEXTURE_VERSION;
+    header.w = img.w;
+    header.h = img.h;
+    header.tile_size = TEXTURE_TILE_SIZE;
+    header.level_count = level_count;
+    u64 table_end = sizeof(header) + level_count * 2 * sizeof(u32);
+    header.tiles_offset = (table_end + TILES_ALIGNMENT-1) / TILES_ALIGNMENT * TILES_ALIGNMENT;
+
+    FILE* out = nullptr;
+    if (fopen_s(&out, path, "wb")) {
+      fprintf(stderr, "Failed to open file: \"%s\"\n", path);
+      for (u32 i = 1; i < level_count; ++i)
+        levels[i].release();
+      return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    for (u32 i = 0; i < level_count && ok; ++i) {
+      const FloatImage& level = i ? levels[i] : img;
+      u32 size[2] = {level.w, level.h};
+      ok = fwrite(size, sizeof(u32), 2, out) == 2;
+    }
+    for (u64 i = table_end; i < header.tiles_offset && ok; ++i)
+      ok = fputc(0, out) != EOF;
+
+    // Edge tiles are padded by repeating the last row and column.
+    u8* tile = (u8*)malloc(TILE_BYTES);
+    for (u32 i = 0; i < level_count && ok; ++i) {
+      const FloatImage& level = i ? levels[i] : img;
+      for (u32 ty = 0; ty < level.h && ok; ty += TEXTURE_TILE_SIZE) {
+        for (u32 tx = 0; tx < level.w && ok; tx += TEXTURE_TILE_SIZE) {
+          for (u32 y = 0; y < TEXTURE_TILE_SIZE; ++y) {
+            for (u32 x = 0; x < TEXTURE_TILE_SIZE; ++x) {
+              const Color3& c = level.get(min(tx + x, level.w-1), min(ty + y, level.h-1));
+              u8* texel = tile + (y*TEXTURE_TILE_SIZE + x)*4;
+              texel[0] = encode_srgb(c.x);
+              texel[1] = encode_srgb(c.y);
+              texel[2] = encode_srgb(c.z);
+              texel[3] = 255;
+            }
+          }
+          ok = fwrite(tile, 1, TILE_BYTES, out) == TILE_BYTES;
+        }
+      }
+    }
+    free(tile);
+    fclose(out);
+
+    for (u32 i = 1; i < level_count; ++i)
+      levels[i].release();
+    if (!ok)
+      fprintf(stderr, "Failed to write texture: \"%s\"\n", path);
+    return ok;
+  }
+}
@@ -0,0 +1,119 @@
+#include "simplay/platform/thread.h"
+
+#include <stdlib.h>
+#include <windows.h>
+
+namespace sim {
+  namespace {
+    struct ThreadStart {
+      ThreadProc proc;
+      void* arg;
+    };
+
+    DWORD WINAPI thread_main(LPVOID param) {
+      ThreadStart start = *(ThreadStart*)param;
+      free(param);
+      start.proc(start.arg);
+      return 0;
+    }
+  }
+
+  static_assert(sizeof(SRWLOCK) == sizeof(void*), "Mutex state must fit a SRWLOCK");
+  static_assert(sizeof(CONDITION_VARIABLE) == sizeof(void*), "ConditionVariable state must fit a CONDITION_VARIABLE");
+
+  void Mutex::lock() {
+    AcquireSRWLockExclusive((PSRWLOCK)&state);
+  }
+
+  void Mutex::unlock() {
+    ReleaseSRWLockExclusive((PSRWLOCK)&state);
+  }
+
+  void Mutex::lock_shared() {
+    AcquireSRWLockShared((PSRWLOCK)&state);
+  }
+
+  void Mutex::unlock_shared() {
+    ReleaseSRWLockShared((PSRWLOCK)&state);
+  }
+
+  void ConditionVariable::wait(Mutex* mutex) {
+    SleepConditionVariableSRW((PCONDITION_VARIABLE)&state, (PSRWLOCK)&mutex->state, INFINITE, 0);
+  }
+
+  void ConditionVariable::wake_one() {
+    WakeConditionVariable((PCONDITION_VARIABLE)&state);
+  }
+
+  void ConditionVariable::wake_all() {
+    WakeAllConditionVariable((PCONDITION_VARIABLE)&state);
+  }
+
+  bool Thread::spawn(ThreadProc proc, void* arg) {
+    ThreadStart* start = (ThreadStart*)malloc(sizeof(ThreadStart));
+    start->proc = proc;
+    start->arg = arg;
+
+    handle = CreateThread(nullptr, 0, thread_main, start, 0, nullptr);
+    if (!handle) {
+      free(start);
+      return false;
+    }
+    return true;
+  }
+
+  void Thread::join() {
+    if (!handle)
+      return;
+
+    WaitForSingleObject(handle, INFINITE);
+    CloseHandle(handle);
+    handle = nullptr;
+  }
+
+  u32 get_cpu_count() {
+    DWORD count = GetActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    return count ? (u32)count : 1;
+  }
+
+  namespace {
+    struct ParallelFor {
+      volatile i64 next;
+      i64 count;
+      ParallelForFn fn;
+      void* arg;
+    };
+
+    void parallel_for_worker(void* arg) {
+      ParallelFor* pf = (ParallelFor*)arg;
+      while (true) {
+        i64 i = atomic_fetch_add(&pf->next, 1);
+        if (i >= pf->count)
+          break;
+        pf->fn((u32)i, pf->arg);
+      }
+    }
+  }
+
+  void parallel_for(u32 count, ParallelForFn fn, void* arg) {
+    ParallelFor pf;
+    pf.next = 0;
+    pf.count = count;
+    pf.fn = fn;
+    pf.arg = arg;
+
+    // The calling thread takes part in the work, so we spawn one less.
+    u32 worker_count = get_cpu_count();
+    if (worker_count > count)
+      worker_count = count;
+    Thread* workers = (Thread*)malloc(worker_count * sizeof(Thread));
+    for (u32 i = 1; i < worker_count; ++i) {
+      workers[i] = Thread();
+      workers[i].spawn(parallel_for_worker, &pf);
+    }
+    parallel_for_worker(&pf);
+    for (u32 i = 1; i < worker_count; ++i)
+      workers[i].join();
+    free(workers);
+  }
+}
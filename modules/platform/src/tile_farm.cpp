@@ -0,0 +1,265 @@
+#include "simplay/platform/tile_farm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "simplay/platform/clock.h"
+#include "simplay/platform/common.h"
+
+namespace sim {
+  namespace {
+    struct TileState {
+      enum Status {
+        PENDING,
+        RUNNING,
+        DONE,
+      };
+
+      TileJob job;
+      Status status;
+      u32 runner_count;
+      f64 start_time;
+    };
+
+    struct WorkerState {
+      Process process;
+      MessageReader reader;
+      bool alive;
+      i64 tile; // -1 when idle.
+      f64 start_time;
+    };
+
+    void merge_tile(const TileJob& job, const f32* pixels, FloatImage* out) {
+      for (u32 y = 0; y < job.h; ++y) {
+        for (u32 x = 0; x < job.w; ++x) {
+          const f32* p = pixels + ((usize)y*job.w + x)*3;
+          out->get(job.x0 + x, job.y0 + y) = Color3(p[0], p[1], p[2]);
+        }
+      }
+    }
+
+    // Workers must send back the very tile they were given.
+    bool is_assigned_tile(const TileJob& job, const WorkerState& worker, const TileState* tiles) {
+      if ((i64)job.id != worker.tile)
+        return false;
+      const TileJob& assigned = tiles[job.id].job;
+      return job.x0 == assigned.x0 && job.y0 == assigned.y0 && job.w == assigned.w && job.h == assigned.h
+          && job.img_w == assigned.img_w && job.img_h == assigned.img_h && job.seed == assigned.seed;
+    }
+
+    void drop_worker(WorkerState* worker, TileState* tiles) {
+      worker->alive = false;
+      if (worker->tile < 0)
+        return;
+
+      TileState& tile = tiles[worker->tile];
+      if (--tile.runner_count == 0 && tile.status == TileState::RUNNING)
+        tile.status = TileState::PENDING;
+      worker->tile = -1;
+    }
+
+    // Prefers tiles nobody works on, then tiles that are taking too long.
+    i64 pick_tile(TileState* tiles, u32 tile_count, f64 now, f64 timeout) {
+      for (u32 i = 0; i < tile_count; ++i) {
+        if (tiles[i].status == TileState::PENDING)
+          return i;
+      }
+      for (u32 i = 0; i < tile_count; ++i) {
+        TileState& tile = tiles[i];
+        if (tile.status == TileState::RUNNING && tile.runner_count < 2 && now - tile.start_time > timeout)
+          return i;
+      }
+      return -1;
+    }
+  }
+
+  void farm_tiles(const TileFarmSettings& settings, TileRenderFn local_fn, void* arg, FloatImage* out) {
+    u32 tile_size = settings.tile_size ? min(settings.tile_size, MAX_TILE_SIZE) : 32;
+    u32 tiles_x = (out->w + tile_size - 1) / tile_size;
+    u32 tiles_y = (out->h + tile_size - 1) / tile_size;
+    u32 tile_count = tiles_x * tiles_y;
+
+    TileState* tiles = (TileState*)malloc(tile_count * sizeof(TileState));
+    for (u32 i = 0; i < tile_count; ++i) {
+      TileState& tile = tiles[i];
+      tile.job = TileJob();
+      tile.job.id = i;
+      tile.job.x0 = (i % tiles_x) * tile_size;
+      tile.job.y0 = (i / tiles_x) * tile_size;
+      tile.job.w = out->w - tile.job.x0 < tile_size ? out->w - tile.job.x0 : tile_size;
+      tile.job.h = out->h - tile.job.y0 < tile_size ? out->h - tile.job.y0 : tile_size;
+      tile.job.img_w = out->w;
+      tile.job.img_h = out->h;
+      tile.job.samples = settings.samples;
+      tile.job.max_depth = settings.max_depth;
+      tile.job.seed = settings.seed;
+      tile.status = TileState::PENDING;
+      tile.runner_count = 0;
+      tile.start_time = 0.0;
+    }
+
+    u32 worker_count = settings.worker_count;
+    WorkerState* workers = (WorkerState*)malloc(worker_count * sizeof(WorkerState));
+    for (u32 i = 0; i < worker_count; ++i) {
+      WorkerState& worker = workers[i];
+      worker.process = Process();
+      worker.reader = MessageReader();
+      worker.alive = settings.worker_cmdline && worker.process.spawn(settings.worker_cmdline);
+      worker.tile = -1;
+      worker.start_time = 0.0;
+    }
+
+    Vector<u8> send_buf;
+    u32 done_count = 0;
+    f64 busy_time = 0.0;
+    while (done_count < tile_count) {
+      bool progress = false;
+      u32 alive_count = 0;
+      f64 now = get_time_seconds();
+      f64 avg_time = done_count ? busy_time / done_count : 0.0;
+      f64 timeout = max(settings.min_timeout, settings.slow_factor * avg_time);
+
+      for (u32 i = 0; i < worker_count; ++i) {
+        WorkerState& worker = workers[i];
+        if (!worker.alive)
+          continue;
+
+        bool connected = worker.reader.pump(&worker.process.channel, false);
+        Message msg;
+        while (worker.reader.next(&msg)) {
+          TileJob job;
+          const f32* pixels = nullptr;
+          if (!decode_tile_result(msg, &job, &pixels) || !is_assigned_tile(job, worker, tiles)) {
+            fprintf(stderr, "Worker %u sent an invalid message\n", i);
+            connected = false;
+            break;
+          }
+
+          TileState& tile = tiles[job.id];
+          if (tile.status != TileState::DONE) {
+            merge_tile(tile.job, pixels, out);
+            tile.status = TileState::DONE;
+            ++done_count;
+            busy_time += now - worker.start_time;
+          }
+          --tile.runner_count;
+          worker.tile = -1;
+          progress = true;
+        }
+
+        if (!connected || !worker.process.is_running()) {
+          fprintf(stderr, "\nWorker %u is gone, its tile will be rendered again\n", i);
+          drop_worker(&worker, tiles);
+          worker.process.stop(0);
+          continue;
+        }
+
+        if (worker.tile < 0) {
+          i64 next = pick_tile(tiles, tile_count, now, timeout);
+          if (next >= 0) {
+            TileState& tile = tiles[next];
+            send_buf.length = 0;
+            encode_tile_job(tile.job, &send_buf);
+            if (!worker.process.channel.write_all(send_buf.data, send_buf.length)) {
+              drop_worker(&worker, tiles);
+              worker.process.stop(0);
+              continue;
+            }
+
+            if (tile.status == TileState::PENDING) {
+              tile.status = TileState::RUNNING;
+              tile.start_time = now;
+            }
+            ++tile.runner_count;
+            worker.tile = next;
+            worker.start_time = now;
+            progress = true;
+          }
+        }
+        ++alive_count;
+      }
+
+      if (!alive_count)
+        break;
+      if (progress) {
+        fprintf(stderr, "\rRendering %.2f%%", (f64)done_count / tile_count * 100.0);
+        fflush(stderr);
+      } else {
+        sleep_ms(1);
+      }
+    }
+
+    // Without any worker left, we finish the frame ourselves.
+    if (done_count < tile_count) {
+      f32* pixels = (f32*)malloc((usize)tile_size*tile_size*3 * sizeof(f32));
+      for (u32 i = 0; i < tile_count; ++i) {
+        TileState& tile = tiles[i];
+        if (tile.status == TileState::DONE)
+          continue;
+
+        local_fn(tile.job, pixels, arg);
+        merge_tile(tile.job, pixels, out);
+        tile.status = TileState::DONE;
+        ++done_count;
+        fprintf(stderr, "\rRendering %.2f%%", (f64)done_count / tile_count * 100.0);
+        fflush(stderr);
+      }
+      free(pixels);
+    }
+    fprintf(stderr, "\n");
+
+    send_buf.length = 0;
+    encode_shutdown(&send_buf);
+    for (u32 i = 0; i < worker_count; ++i) {
+      WorkerState& worker = workers[i];
+      if (worker.alive)
+        worker.process.channel.write_all(send_buf.data, send_buf.length);
+    }
+    for (u32 i = 0; i < worker_count; ++i) {
+      WorkerState& worker = workers[i];
+      worker.process.stop(1000);
+      worker.process.release();
+      worker.reader.release();
+    }
+
+    send_buf.release();
+    free(workers);
+    free(tiles);
+  }
+
+  void serve_tiles(Channel* channel, TileRenderFn fn, void* arg) {
+    MessageReader reader;
+    Vector<u8> send_buf;
+    f32* pixels = nullptr;
+    usize pixels_capacity = 0;
+
+    bool running = true;
+    while (running && reader.pump(channel, true)) {
+      Message msg;
+      while (running && reader.next(&msg)) {
+        TileJob job;
+        if (msg.type == Message::SHUTDOWN || !decode_tile_job(msg, &job)) {
+          running = false;
+          break;
+        }
+
+        usize pixel_count = (usize)job.w*job.h*3;
+        if (pixel_count > pixels_capacity) {
+          free(pixels);
+          pixels = (f32*)malloc(pixel_count * sizeof(f32));
+          pixels_capacity = pixel_count;
+        }
+        fn(job, pixels, arg);
+
+        send_buf.length = 0;
+        encode_tile_result(job, pixels, &send_buf);
+        if (!channel->write_all(send_buf.data, send_buf.length))
+          running = false;
+      }
+    }
+
+    free(pixels);
+    send_buf.release();
+    reader.release();
+  }
+}
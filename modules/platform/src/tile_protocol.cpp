@@ -0,0 +1,169 @@
+#include "simplay/platform/tile_protocol.h"
+
+#include <string.h>
+
+namespace sim {
+  namespace {
+    const u32 MESSAGE_MAGIC = 0x544D4953; // "SIMT".
+    const u32 HEADER_SIZE = 3*sizeof(u32);
+    const u32 TILE_JOB_SIZE = 9*sizeof(u32) + sizeof(u64);
+    const u32 MAX_MESSAGE_SIZE = TILE_JOB_SIZE + MAX_TILE_SIZE*MAX_TILE_SIZE*3 * sizeof(f32);
+
+    void put_u32(Vector<u8>* out, u32 value) {
+      out->append((const u8*)&value, sizeof(value));
+    }
+
+    void put_u64(Vector<u8>* out, u64 value) {
+      out->append((const u8*)&value, sizeof(value));
+    }
+
+    u32 get_u32(const u8* in) {
+      u32 value;
+      memcpy(&value, in, sizeof(value));
+      return value;
+    }
+
+    u64 get_u64(const u8* in) {
+      u64 value;
+      memcpy(&value, in, sizeof(value));
+      return value;
+    }
+
+    void put_header(Vector<u8>* out, Message::Type type, u32 size) {
+      put_u32(out, MESSAGE_MAGIC);
+      put_u32(out, type);
+      put_u32(out, size);
+    }
+
+    void put_tile_job(Vector<u8>* out, const TileJob& job) {
+      put_u32(out, job.id);
+      put_u32(out, job.x0);
+      put_u32(out, job.y0);
+      put_u32(out, job.w);
+      put_u32(out, job.h);
+      put_u32(out, job.img_w);
+      put_u32(out, job.img_h);
+      put_u32(out, job.samples);
+      put_u32(out, job.max_depth);
+      put_u64(out, job.seed);
+    }
+
+    void get_tile_job(const u8* in, TileJob* job) {
+      job->id = get_u32(in + 0);
+      job->x0 = get_u32(in + 4);
+      job->y0 = get_u32(in + 8);
+      job->w = get_u32(in + 12);
+      job->h = get_u32(in + 16);
+      job->img_w = get_u32(in + 20);
+      job->img_h = get_u32(in + 24);
+      job->samples = get_u32(in + 28);
+      job->max_depth = get_u32(in + 32);
+      job->seed = get_u64(in + 36);
+    }
+
+    bool is_tile_size_valid(const TileJob& job) {
+      return job.w <= MAX_TILE_SIZE && job.h <= MAX_TILE_SIZE;
+    }
+
+    bool is_header_valid(const u8* header) {
+      return get_u32(header) == MESSAGE_MAGIC && get_u32(header + 8) <= MAX_MESSAGE_SIZE;
+    }
+  }
+
+  void encode_tile_job(const TileJob& job, Vector<u8>* out) {
+    put_header(out, Message::TILE_JOB, TILE_JOB_SIZE);
+    put_tile_job(out, job);
+  }
+
+  void encode_tile_result(const TileJob& job, const f32* pixels, Vector<u8>* out) {
+    u32 pixels_size = job.w*job.h*3 * sizeof(f32);
+    put_header(out, Message::TILE_RESULT, TILE_JOB_SIZE + pixels_size);
+    put_tile_job(out, job);
+    out->append((const u8*)pixels, pixels_size);
+  }
+
+  void encode_shutdown(Vector<u8>* out) {
+    put_header(out, Message::SHUTDOWN, 0);
+  }
+
+  bool decode_tile_job(const Message& msg, TileJob* job) {
+    if (msg.type != Message::TILE_JOB || msg.size != TILE_JOB_SIZE)
+      return false;
+
+    get_tile_job(msg.payload, job);
+    return is_tile_size_valid(*job);
+  }
+
+  bool decode_tile_result(const Message& msg, TileJob* job, const f32** pixels) {
+    if (msg.type != Message::TILE_RESULT || msg.size < TILE_JOB_SIZE)
+      return false;
+
+    get_tile_job(msg.payload, job);
+    if (!is_tile_size_valid(*job) || msg.size != TILE_JOB_SIZE + (u64)job->w*job->h*3 * sizeof(f32))
+      return false;
+
+    // Every message size is a multiple of 4, so the floats stay aligned.
+    *pixels = (const f32*)(msg.payload + TILE_JOB_SIZE);
+    return true;
+  }
+
+  bool MessageReader::pump(Channel* channel, bool block) {
+    if (failed)
+      return false;
+
+    // Drop the messages handed out so far before reading more.
+    if (consumed) {
+      memmove(buffer.data, buffer.data + consumed, buffer.length - consumed);
+      buffer.length -= consumed;
+      consumed = 0;
+    }
+
+    while (!(block && has_message())) {
+      if (buffer.capacity - buffer.length < 0x10000)
+        buffer.reserve(buffer.capacity + 0x10000);
+
+      isize read = channel->read_some(buffer.data + buffer.length, buffer.capacity - buffer.length, block);
+      if (read < 0)
+        return false;
+      if (!read)
+        break;
+      buffer.length += (usize)read;
+    }
+    return true;
+  }
+
+  bool MessageReader::has_message() const {
+    usize available = buffer.length - consumed;
+    if (failed || available < HEADER_SIZE)
+      return false;
+
+    const u8* header = buffer.data + consumed;
+    return !is_header_valid(header) || available >= HEADER_SIZE + (usize)get_u32(header + 8);
+  }
+
+  bool MessageReader::next(Message* msg) {
+    if (!has_message())
+      return false;
+
+    const u8* header = buffer.data + consumed;
+    if (!is_header_valid(header)) {
+      failed = true;
+      consumed = buffer.length;
+      *msg = Message();
+      return true;
+    }
+
+    u32 size = get_u32(header + 8);
+    msg->type = (Message::Type)get_u32(header + 4);
+    msg->payload = header + HEADER_SIZE;
+    msg->size = size;
+    consumed += HEADER_SIZE + (usize)size;
+    return true;
+  }
+
+  void MessageReader::release() {
+    buffer.release();
+    consumed = 0;
+    failed = false;
+  }
+}
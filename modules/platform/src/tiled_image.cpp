@@ -0,0 +1,152 @@
+#include "simplay/platform/tiled_image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+
+#include "simplay/platform/common.h"
+
+namespace sim {
+  bool TiledImage::init(const char* path, u32 new_w, u32 new_h, u32 new_tile_size, bool keep) {
+    release();
+    if (!new_w || !new_h || !new_tile_size)
+      return false;
+
+    DWORD flags = FILE_ATTRIBUTE_NORMAL | (keep ? 0 : FILE_FLAG_DELETE_ON_CLOSE);
+    HANDLE f = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, flags, nullptr);
+    if (f == INVALID_HANDLE_VALUE) {
+      fprintf(stderr, "Failed to create image file: \"%s\"\n", path);
+      return false;
+    }
+
+    // Views must start on an allocation granule.
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    u64 granule = info.dwAllocationGranularity;
+    u64 tile_bytes = (u64)new_tile_size * new_tile_size * 3 * sizeof(f32);
+    u32 new_tiles_x = (new_w + new_tile_size-1) / new_tile_size;
+    u32 new_tiles_y = (new_h + new_tile_size-1) / new_tile_size;
+    u64 stride = (tile_bytes + granule-1) / granule * granule;
+    u64 size = stride * new_tiles_x * new_tiles_y;
+
+    // The file grows to the size of the mapping, without being written.
+    HANDLE m = CreateFileMappingA(f, nullptr, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)(size & 0xFFFFFFFF), nullptr);
+    if (!m) {
+      fprintf(stderr, "Failed to map image file: \"%s\" (%llu bytes)\n", path, (unsigned long long)size);
+      CloseHandle(f);
+      return false;
+    }
+
+    file = f;
+    mapping = m;
+    w = new_w;
+    h = new_h;
+    tile_size = new_tile_size;
+    tiles_x = new_tiles_x;
+    tiles_y = new_tiles_y;
+    tile_stride = stride;
+    return true;
+  }
+
+  void TiledImage::release() {
+    if (mapping)
+      CloseHandle(mapping);
+    if (file)
+      CloseHandle(file);
+
+    file = nullptr;
+    mapping = nullptr;
+    w = 0;
+    h = 0;
+    tile_size = 0;
+    tiles_x = 0;
+    tiles_y = 0;
+    tile_stride = 0;
+  }
+
+  void TiledImage::get_tile_bounds(u32 tile, u32* x0, u32* y0, u32* tile_w, u32* tile_h) const {
+    *x0 = (tile % tiles_x) * tile_size;
+    *y0 = (tile / tiles_x) * tile_size;
+    *tile_w = min(tile_size, w - *x0);
+    *tile_h = min(tile_size, h - *y0);
+  }
+
+  namespace {
+    void* map_range(HANDLE mapping, u64 offset, usize size) {
+      return MapViewOfFile(mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)(offset & 0xFFFFFFFF), size);
+    }
+  }
+
+  f32* TiledImage::map_tile(u32 tile) const {
+    u32 x0, y0, tile_w, tile_h;
+    get_tile_bounds(tile, &x0, &y0, &tile_w, &tile_h);
+    return (f32*)map_range(mapping, tile * tile_stride, (usize)tile_w * tile_h * 3 * sizeof(f32));
+  }
+
+  void TiledImage::unmap_tile(f32* pixels) const {
+    // Starts writing the tile out now, rather than leaving dirty pages to
+    // pile up until the system runs short.
+    FlushViewOfFile(pixels, 0);
+    UnmapViewOfFile(pixels);
+  }
+
+  bool TiledImage::for_each_row(bool top_down, RowFn fn, void* arg) const {
+    f32* row = (f32*)malloc((usize)w * 3 * sizeof(f32));
+    bool ok = true;
+    for (u32 i = 0; i < tiles_y && ok; ++i) {
+      u32 ty = top_down ? tiles_y-1 - i : i;
+      // A row of tiles is contiguous in the file.
+      u8* strip = (u8*)map_range(mapping, (u64)ty * tiles_x * tile_stride, (usize)(tiles_x * tile_stride));
+      if (!strip) {
+        fprintf(stderr, "Failed to map image rows %u to %u\n", ty * tile_size, min((ty+1) * tile_size, h) - 1);
+        ok = false;
+        break;
+      }
+
+      u32 y0 = ty * tile_size;
+      u32 strip_h = min(tile_size, h - y0);
+      for (u32 j = 0; j < strip_h && ok; ++j) {
+        u32 y = top_down ? strip_h-1 - j : j;
+        for (u32 tx = 0; tx < tiles_x; ++tx) {
+          u32 x0 = tx * tile_size;
+          u32 tile_w = min(tile_size, w - x0);
+          const f32* src = (const f32*)(strip + tx * tile_stride) + (usize)y * tile_w * 3;
+          memcpy(row + (usize)x0 * 3, src, (usize)tile_w * 3 * sizeof(f32));
+        }
+        ok = fn(y0 + y, row, arg);
+      }
+      UnmapViewOfFile(strip);
+    }
+    free(row);
+    return ok;
+  }
+
+  namespace {
+    struct PfmRows {
+      FILE* out;
+      usize floats_per_row;
+    };
+
+    bool write_pfm_row(u32, const f32* row, void* arg) {
+      PfmRows& rows = *(PfmRows*)arg;
+      return fwrite(row, sizeof(f32), rows.floats_per_row, rows.out) == rows.floats_per_row;
+    }
+  }
+
+  bool TiledImage::save_pfm(const char* out_path) const {
+    FILE* out = nullptr;
+    if (fopen_s(&out, out_path, "wb")) {
+      fprintf(stderr, "Failed to open file: \"%s\"\n", out_path);
+      return false;
+    }
+
+    fprintf(out, "PF\n%u %u\n-1.0\n", w, h);
+    PfmRows rows;
+    rows.out = out;
+    rows.floats_per_row = (usize)w * 3;
+    bool ok = for_each_row(false, write_pfm_row, &rows);
+    fclose(out);
+    return ok;
+  }
+}
@@ -0,0 +1,482 @@
+#include "simplay/platform/tone_map.h"
+
+#include <immintrin.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "simplay/platform/common.h"
+#include "simplay/platform/cpu.h"
+#include "simplay/platform/thread.h"
+
+namespace sim {
+  void PackedImage::init(u32 new_w, u32 new_h, u32 new_bytes_per_sample) {
+    release();
+    w = new_w;
+    h = new_h;
+    bytes_per_sample = new_bytes_per_sample;
+    data = (u8*)malloc(get_row_size() * h);
+  }
+
+  void PackedImage::release() {
+    free(data);
+    data = nullptr;
+    w = 0;
+    h = 0;
+    bytes_per_sample = 0;
+  }
+
+  bool PackedImage::write_ppm(FILE* out) const {
+    fprintf(out, "P6\n%u %u\n%u\n", w, h, bytes_per_sample == 2 ? 65535u : 255u);
+    return fwrite(data, get_row_size(), h, out) == h;
+  }
+
+  namespace {
+    // sRGB is looked up by the top bits of the float, which split every
+    // octave from 2^-9 up to 1 into 128 linear steps. Interpolating within
+    // a step is exact to well under a 16-bit step. Below 2^-9 the curve is
+    // linear anyway.
+    const u32 SRGB_OCTAVES = 9;
+    const u32 SRGB_STEP_BITS = 7;
+    const u32 SRGB_STEPS = SRGB_OCTAVES << SRGB_STEP_BITS;
+    const u32 SRGB_FRACTION_BITS = 23 - SRGB_STEP_BITS;
+    const u32 SRGB_FIRST_BITS = (127 - SRGB_OCTAVES) << 23;
+    // The largest float below 1.
+    const u32 SRGB_LAST_BITS = 0x3F7FFFFF;
+    const f32 SRGB_LINEAR_END = 0.0031308f;
+
+    f32 from_bits(u32 bits) {
+      f32 f;
+      memcpy(&f, &bits, sizeof(f));
+      return f;
+    }
+
+    f64 encode_srgb(f64 c) {
+      return c <= 0.0031308 ? 12.92 * c : 1.055 * pow(c, 1.0 / 2.4) - 0.055;
+    }
+
+    // Value and slope of every step side by side, so that a lane needs a
+    // single 64-bit load.
+    struct SrgbTable {
+      f32 steps[SRGB_STEPS * 2];
+
+      SrgbTable() {
+        for (u32 i = 0; i < SRGB_STEPS; ++i) {
+          f64 lo = encode_srgb(from_bits(SRGB_FIRST_BITS + (i << SRGB_FRACTION_BITS)));
+          f64 hi = encode_srgb(from_bits(SRGB_FIRST_BITS + ((i+1) << SRGB_FRACTION_BITS)));
+          steps[i*2] = (f32)lo;
+          steps[i*2 + 1] = (f32)(hi - lo);
+        }
+      }
+    };
+
+    const SrgbTable SRGB_TABLE;
+
+    // Offsets in steps, centered on zero.
+    struct BayerTable {
+      f32 rows[8][8];
+
+      BayerTable() {
+        for (u32 y = 0; y < 8; ++y) {
+          for (u32 x = 0; x < 8; ++x) {
+            // Interleaving the bits of (x ^ y, y), lowest first, builds the
+            // recursive 2x2 pattern.
+            u32 rank = 0;
+            for (u32 bit = 0; bit < 3; ++bit)
+              rank = (rank << 2) | ((((x ^ y) >> bit) & 1) << 1) | ((y >> bit) & 1);
+            rows[y][x] = ((f32)rank + 0.5f) / 64.0f - 0.5f;
+          }
+        }
+      }
+    };
+
+    const BayerTable BAYER_TABLE;
+
+    struct Kernel {
+      f32 scale;
+      f32 max_code;
+      ToneMapSettings::Curve curve;
+      ToneMapSettings::Dither dither;
+      bool wide;
+    };
+
+    Kernel make_kernel(const ToneMapSettings& settings) {
+      Kernel k;
+      k.scale = (f32)pow(2.0, (f64)settings.exposure);
+      k.wide = settings.bits > 8;
+      k.max_code = k.wide ? 65535.0f : 255.0f;
+      k.curve = settings.curve;
+      k.dither = settings.dither;
+      return k;
+    }
+
+    __m128 apply_curve(__m128 v, ToneMapSettings::Curve curve) {
+      const __m128 one = _mm_set1_ps(1.0f);
+      switch (curve) {
+        case ToneMapSettings::CLAMP:
+        default:
+          return _mm_min_ps(v, one);
+        case ToneMapSettings::REINHARD:
+          return _mm_div_ps(v, _mm_add_ps(one, v));
+        case ToneMapSettings::ACES: {
+          __m128 num = _mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(2.51f)), _mm_set1_ps(0.03f)));
+          __m128 den = _mm_add_ps(_mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(2.43f)), _mm_set1_ps(0.59f))), _mm_set1_ps(0.14f));
+          return _mm_min_ps(_mm_div_ps(num, den), one);
+        }
+      }
+    }
+
+    // For v in [0, 1].
+    __m128 encode_srgb_ps(__m128 v) {
+      __m128 x = _mm_min_ps(_mm_max_ps(v, _mm_set1_ps(from_bits(SRGB_FIRST_BITS))), _mm_set1_ps(from_bits(SRGB_LAST_BITS)));
+      __m128i offset = _mm_sub_epi32(_mm_castps_si128(x), _mm_set1_epi32((i32)SRGB_FIRST_BITS));
+      __m128i step = _mm_srli_epi32(offset, SRGB_FRACTION_BITS);
+      __m128 frac = _mm_mul_ps(
+          _mm_cvtepi32_ps(_mm_and_si128(offset, _mm_set1_epi32((1 << SRGB_FRACTION_BITS) - 1))),
+          _mm_set1_ps(1.0f / (f32)(1 << SRGB_FRACTION_BITS)));
+
+      // SSE2 has no gather.
+      i32 steps[4];
+      _mm_storeu_si128((__m128i*)steps, step);
+      const f32* table = SRGB_TABLE.steps;
+      __m128 pair01 = _mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(table + steps[0]*2));
+      pair01 = _mm_loadh_pi(pair01, (const __m64*)(table + steps[1]*2));
+      __m128 pair23 = _mm_loadl_pi(_mm_setzero_ps(), (const __m64*)(table + steps[2]*2));
+      pair23 = _mm_loadh_pi(pair23, (const __m64*)(table + steps[3]*2));
+      __m128 value = _mm_shuffle_ps(pair01, pair23, _MM_SHUFFLE(2, 0, 2, 0));
+      __m128 slope = _mm_shuffle_ps(pair01, pair23, _MM_SHUFFLE(3, 1, 3, 1));
+      __m128 curve = _mm_add_ps(value, _mm_mul_ps(slope, frac));
+
+      __m128 linear = _mm_mul_ps(v, _mm_set1_ps(12.92f));
+      __m128 is_linear = _mm_cmple_ps(v, _mm_set1_ps(SRGB_LINEAR_END));
+      return _mm_or_ps(_mm_and_ps(is_linear, linear), _mm_andnot_ps(is_linear, curve));
+    }
+
+    __m128 fract_ps(__m128 v) {
+      // Only for v >= 0, where truncation is floor.
+      return _mm_sub_ps(v, _mm_cvtepi32_ps(_mm_cvttps_epi32(v)));
+    }
+
+    // Offsets of pixels x to x+3 of row y.
+    __m128 get_dither(ToneMapSettings::Dither dither, u32 x, u32 y) {
+      switch (dither) {
+        case ToneMapSettings::NO_DITHER:
+        default:
+          return _mm_setzero_ps();
+        case ToneMapSettings::ORDERED:
+          // x is a multiple of 4, so this stays within the row.
+          return _mm_loadu_ps(BAYER_TABLE.rows[y & 7] + (x & 7));
+        case ToneMapSettings::NOISE: {
+          __m128 xs = _mm_add_ps(_mm_set1_ps((f32)x), _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f));
+          __m128 a = _mm_add_ps(_mm_mul_ps(xs, _mm_set1_ps(0.06711056f)), _mm_set1_ps((f32)y * 0.00583715f));
+          __m128 n = fract_ps(_mm_mul_ps(fract_ps(a), _mm_set1_ps(52.9829189f)));
+          return _mm_sub_ps(n, _mm_set1_ps(0.5f));
+        }
+      }
+    }
+
+    __m128i quantize(const Kernel& k, __m128 v, __m128 dither) {
+      const __m128 max_code = _mm_set1_ps(k.max_code);
+      // Also turns NaNs into zeros.
+      v = _mm_max_ps(_mm_mul_ps(v, _mm_set1_ps(k.scale)), _mm_setzero_ps());
+      v = encode_srgb_ps(apply_curve(v, k.curve));
+      __m128 code = _mm_add_ps(_mm_add_ps(_mm_mul_ps(v, max_code), dither), _mm_set1_ps(0.5f));
+      code = _mm_min_ps(_mm_max_ps(code, _mm_setzero_ps()), max_code);
+      return _mm_cvttps_epi32(code);
+    }
+
+    // Packs four pixels (12 samples) into 16 or 32 bytes, of which only
+    // the first 12 or 24 belong to them.
+    void map_block(const Kernel& k, const f32* rgb, u32 x, u32 y, __m128i* out) {
+      __m128 d = get_dither(k.dither, x, y);
+      __m128i c0 = quantize(k, _mm_loadu_ps(rgb), _mm_shuffle_ps(d, d, _MM_SHUFFLE(1, 0, 0, 0)));
+      __m128i c1 = quantize(k, _mm_loadu_ps(rgb + 4), _mm_shuffle_ps(d, d, _MM_SHUFFLE(2, 2, 1, 1)));
+      __m128i c2 = quantize(k, _mm_loadu_ps(rgb + 8), _mm_shuffle_ps(d, d, _MM_SHUFFLE(3, 3, 3, 2)));
+
+      if (!k.wide) {
+        out[0] = _mm_packus_epi16(_mm_packs_epi32(c0, c1), _mm_packs_epi32(c2, c2));
+        return;
+      }
+
+      // SSE2 only packs to signed 16 bits, so pack around the midpoint,
+      // then swap the bytes to big-endian.
+      const __m128i half = _mm_set1_epi32(0x8000);
+      const __m128i flip = _mm_set1_epi16((i16)0x8000);
+      __m128i lo = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(c0, half), _mm_sub_epi32(c1, half)), flip);
+      __m128i hi = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(c2, half), _mm_sub_epi32(c2, half)), flip);
+      out[0] = _mm_or_si128(_mm_slli_epi16(lo, 8), _mm_srli_epi16(lo, 8));
+      out[1] = _mm_or_si128(_mm_slli_epi16(hi, 8), _mm_srli_epi16(hi, 8));
+    }
+
+    // Pixels x and up, for x a multiple of 4.
+    void map_blocks_sse2(const Kernel& k, const f32* rgb, u32 w, u32 y, u32 x, u8* out) {
+      usize sample_size = k.wide ? 2 : 1;
+      usize row_samples = (usize)w * 3;
+      __m128i packed[2];
+      // Blocks store 16 samples; all but the last ones can spill into the
+      // next block, which overwrites them.
+      for (; x + 4 <= w && (usize)x*3 + 16 <= row_samples; x += 4) {
+        map_block(k, rgb + (usize)x*3, x, y, packed);
+        _mm_storeu_si128((__m128i*)(out + (usize)x*3*sample_size), packed[0]);
+        if (k.wide)
+          _mm_storeu_si128((__m128i*)(out + (usize)x*3*sample_size + 16), packed[1]);
+      }
+      for (; x < w; x += 4) {
+        f32 tail[12] = {};
+        u32 count = min(4u, w - x);
+        memcpy(tail, rgb + (usize)x*3, (usize)count * 3 * sizeof(f32));
+        map_block(k, tail, x, y, packed);
+        memcpy(out + (usize)x*3*sample_size, packed, (usize)count * 3 * sample_size);
+      }
+    }
+
+    // The AVX2 and AVX-512 kernels below take the same steps as the SSE2
+    // one, on 8 and 16 pixels at a time. Every lane does the same float
+    // operations in the same order, so they all give the same codes.
+
+    __m256 apply_curve_avx2(__m256 v, ToneMapSettings::Curve curve) {
+      const __m256 one = _mm256_set1_ps(1.0f);
+      switch (curve) {
+        case ToneMapSettings::CLAMP:
+        default:
+          return _mm256_min_ps(v, one);
+        case ToneMapSettings::REINHARD:
+          return _mm256_div_ps(v, _mm256_add_ps(one, v));
+        case ToneMapSettings::ACES: {
+          __m256 num = _mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(2.51f)), _mm256_set1_ps(0.03f)));
+          __m256 den = _mm256_add_ps(_mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(2.43f)), _mm256_set1_ps(0.59f))), _mm256_set1_ps(0.14f));
+          return _mm256_min_ps(_mm256_div_ps(num, den), one);
+        }
+      }
+    }
+
+    __m256 encode_srgb_avx2(__m256 v) {
+      __m256 x = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(from_bits(SRGB_FIRST_BITS))), _mm256_set1_ps(from_bits(SRGB_LAST_BITS)));
+      __m256i offset = _mm256_sub_epi32(_mm256_castps_si256(x), _mm256_set1_epi32((i32)SRGB_FIRST_BITS));
+      __m256i index = _mm256_slli_epi32(_mm256_srli_epi32(offset, SRGB_FRACTION_BITS), 1);
+      __m256 frac = _mm256_mul_ps(
+          _mm256_cvtepi32_ps(_mm256_and_si256(offset, _mm256_set1_epi32((1 << SRGB_FRACTION_BITS) - 1))),
+          _mm256_set1_ps(1.0f / (f32)(1 << SRGB_FRACTION_BITS)));
+      __m256 value = _mm256_i32gather_ps(SRGB_TABLE.steps, index, 4);
+      __m256 slope = _mm256_i32gather_ps(SRGB_TABLE.steps + 1, index, 4);
+      __m256 curve = _mm256_add_ps(value, _mm256_mul_ps(slope, frac));
+
+      __m256 linear = _mm256_mul_ps(v, _mm256_set1_ps(12.92f));
+      __m256 is_linear = _mm256_cmp_ps(v, _mm256_set1_ps(SRGB_LINEAR_END), _CMP_LE_OQ);
+      return _mm256_blendv_ps(curve, linear, is_linear);
+    }
+
+    __m256 fract_avx2(__m256 v) {
+      return _mm256_sub_ps(v, _mm256_cvtepi32_ps(_mm256_cvttps_epi32(v)));
+    }
+
+    // Offsets of pixels x to x+7 of row y, for x a multiple of 8.
+    __m256 get_dither_avx2(ToneMapSettings::Dither dither, u32 x, u32 y) {
+      switch (dither) {
+        case ToneMapSettings::NO_DITHER:
+        default:
+          return _mm256_setzero_ps();
+        case ToneMapSettings::ORDERED:
+          return _mm256_loadu_ps(BAYER_TABLE.rows[y & 7]);
+        case ToneMapSettings::NOISE: {
+          __m256 xs = _mm256_add_ps(_mm256_set1_ps((f32)x), _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f));
+          __m256 a = _mm256_add_ps(_mm256_mul_ps(xs, _mm256_set1_ps(0.06711056f)), _mm256_set1_ps((f32)y * 0.00583715f));
+          __m256 n = fract_avx2(_mm256_mul_ps(fract_avx2(a), _mm256_set1_ps(52.9829189f)));
+          return _mm256_sub_ps(n, _mm256_set1_ps(0.5f));
+        }
+      }
+    }
+
+    __m256i quantize_avx2(const Kernel& k, __m256 v, __m256 dither) {
+      const __m256 max_code = _mm256_set1_ps(k.max_code);
+      v = _mm256_max_ps(_mm256_mul_ps(v, _mm256_set1_ps(k.scale)), _mm256_setzero_ps());
+      v = encode_srgb_avx2(apply_curve_avx2(v, k.curve));
+      __m256 code = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v, max_code), dither), _mm256_set1_ps(0.5f));
+      code = _mm256_min_ps(_mm256_max_ps(code, _mm256_setzero_ps()), max_code);
+      return _mm256_cvttps_epi32(code);
+    }
+
+    __m256i swap_bytes_avx2(__m256i v) {
+      return _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+    }
+
+    // Blocks store 32 or 64 bytes, of which 24 or 48 are theirs, so they
+    // stop where that would run past the row. Returns the first pixel left.
+    u32 map_blocks_avx2(const Kernel& k, const f32* rgb, u32 w, u32 y, u32 x, u8* out) {
+      usize sample_size = k.wide ? 2 : 1;
+      usize row_samples = (usize)w * 3;
+      // Which pixel's offset each of the 24 samples gets.
+      const __m256i spread0 = _mm256_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2);
+      const __m256i spread1 = _mm256_setr_epi32(2, 3, 3, 3, 4, 4, 4, 5);
+      const __m256i spread2 = _mm256_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7);
+      const __m256i half = _mm256_set1_epi32(0x8000);
+      const __m256i flip = _mm256_set1_epi16((i16)0x8000);
+      for (; (usize)x*3 + 32 <= row_samples; x += 8) {
+        const f32* src = rgb + (usize)x*3;
+        u8* dst = out + (usize)x*3*sample_size;
+        __m256 d = get_dither_avx2(k.dither, x, y);
+        __m256i c0 = quantize_avx2(k, _mm256_loadu_ps(src), _mm256_permutevar8x32_ps(d, spread0));
+        __m256i c1 = quantize_avx2(k, _mm256_loadu_ps(src + 8), _mm256_permutevar8x32_ps(d, spread1));
+        __m256i c2 = quantize_avx2(k, _mm256_loadu_ps(src + 16), _mm256_permutevar8x32_ps(d, spread2));
+
+        // Packing works within 128-bit lanes, so the results come out
+        // interleaved and get put back in order.
+        if (!k.wide) {
+          __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(c0, c1), _mm256_packs_epi32(c2, c2));
+          packed = _mm256_permutevar8x32_epi32(packed, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+          _mm256_storeu_si256((__m256i*)dst, packed);
+          continue;
+        }
+
+        __m256i lo = _mm256_xor_si256(_mm256_packs_epi32(_mm256_sub_epi32(c0, half), _mm256_sub_epi32(c1, half)), flip);
+        __m256i hi = _mm256_xor_si256(_mm256_packs_epi32(_mm256_sub_epi32(c2, half), _mm256_sub_epi32(c2, half)), flip);
+        lo = _mm256_permute4x64_epi64(lo, _MM_SHUFFLE(3, 1, 2, 0));
+        hi = _mm256_permute4x64_epi64(hi, _MM_SHUFFLE(3, 1, 2, 0));
+        _mm256_storeu_si256((__m256i*)dst, swap_bytes_avx2(lo));
+        _mm256_storeu_si256((__m256i*)(dst + 32), swap_bytes_avx2(hi));
+      }
+      return x;
+    }
+
+    __m512 apply_curve_avx512(__m512 v, ToneMapSettings::Curve curve) {
+      const __m512 one = _mm512_set1_ps(1.0f);
+      switch (curve) {
+        case ToneMapSettings::CLAMP:
+        default:
+          return _mm512_min_ps(v, one);
+        case ToneMapSettings::REINHARD:
+          return _mm512_div_ps(v, _mm512_add_ps(one, v));
+        case ToneMapSettings::ACES: {
+          __m512 num = _mm512_mul_ps(v, _mm512_add_ps(_mm512_mul_ps(v, _mm512_set1_ps(2.51f)), _mm512_set1_ps(0.03f)));
+          __m512 den = _mm512_add_ps(_mm512_mul_ps(v, _mm512_add_ps(_mm512_mul_ps(v, _mm512_set1_ps(2.43f)), _mm512_set1_ps(0.59f))), _mm512_set1_ps(0.14f));
+          return _mm512_min_ps(_mm512_div_ps(num, den), one);
+        }
+      }
+    }
+
+    __m512 encode_srgb_avx512(__m512 v) {
+      __m512 x = _mm512_min_ps(_mm512_max_ps(v, _mm512_set1_ps(from_bits(SRGB_FIRST_BITS))), _mm512_set1_ps(from_bits(SRGB_LAST_BITS)));
+      __m512i offset = _mm512_sub_epi32(_mm512_castps_si512(x), _mm512_set1_epi32((i32)SRGB_FIRST_BITS));
+      __m512i index = _mm512_slli_epi32(_mm512_srli_epi32(offset, SRGB_FRACTION_BITS), 1);
+      __m512 frac = _mm512_mul_ps(
+          _mm512_cvtepi32_ps(_mm512_and_si512(offset, _mm512_set1_epi32((1 << SRGB_FRACTION_BITS) - 1))),
+          _mm512_set1_ps(1.0f / (f32)(1 << SRGB_FRACTION_BITS)));
+      __m512 value = _mm512_i32gather_ps(index, SRGB_TABLE.steps, 4);
+      __m512 slope = _mm512_i32gather_ps(index, SRGB_TABLE.steps + 1, 4);
+      __m512 curve = _mm512_add_ps(value, _mm512_mul_ps(slope, frac));
+
+      __m512 linear = _mm512_mul_ps(v, _mm512_set1_ps(12.92f));
+      __mmask16 is_linear = _mm512_cmp_ps_mask(v, _mm512_set1_ps(SRGB_LINEAR_END), _CMP_LE_OQ);
+      return _mm512_mask_blend_ps(is_linear, curve, linear);
+    }
+
+    __m512 fract_avx512(__m512 v) {
+      return _mm512_sub_ps(v, _mm512_cvtepi32_ps(_mm512_cvttps_epi32(v)));
+    }
+
+    // Offsets of pixels x to x+15 of row y, for x a multiple of 16.
+    __m512 get_dither_avx512(ToneMapSettings::Dither dither, u32 x, u32 y) {
+      switch (dither) {
+        case ToneMapSettings::NO_DITHER:
+        default:
+          return _mm512_setzero_ps();
+        case ToneMapSettings::ORDERED: {
+          // The row of the pattern, twice.
+          __m512 row = _mm512_maskz_loadu_ps(0xFF, BAYER_TABLE.rows[y & 7]);
+          return _mm512_permutexvar_ps(_mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 0, 1, 2, 3, 4, 5, 6, 7), row);
+        }
+        case ToneMapSettings::NOISE: {
+          __m512 xs = _mm512_add_ps(_mm512_set1_ps((f32)x), _mm512_setr_ps(
+              0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f, 7.0f, 8.0f, 9.0f, 10.0f, 11.0f, 12.0f, 13.0f, 14.0f, 15.0f));
+          __m512 a = _mm512_add_ps(_mm512_mul_ps(xs, _mm512_set1_ps(0.06711056f)), _mm512_set1_ps((f32)y * 0.00583715f));
+          __m512 n = fract_avx512(_mm512_mul_ps(fract_avx512(a), _mm512_set1_ps(52.9829189f)));
+          return _mm512_sub_ps(n, _mm512_set1_ps(0.5f));
+        }
+      }
+    }
+
+    __m512i quantize_avx512(const Kernel& k, __m512 v, __m512 dither) {
+      const __m512 max_code = _mm512_set1_ps(k.max_code);
+      v = _mm512_max_ps(_mm512_mul_ps(v, _mm512_set1_ps(k.scale)), _mm512_setzero_ps());
+      v = encode_srgb_avx512(apply_curve_avx512(v, k.curve));
+      __m512 code = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(v, max_code), dither), _mm512_set1_ps(0.5f));
+      code = _mm512_min_ps(_mm512_max_ps(code, _mm512_setzero_ps()), max_code);
+      return _mm512_cvttps_epi32(code);
+    }
+
+    // Narrows straight to the samples, so blocks store only their own.
+    u32 map_blocks_avx512(const Kernel& k, const f32* rgb, u32 w, u32 y, u32 x, u8* out) {
+      usize sample_size = k.wide ? 2 : 1;
+      const __m512i spread[3] = {
+        _mm512_setr_epi32(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5),
+        _mm512_setr_epi32(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10),
+        _mm512_setr_epi32(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15),
+      };
+      for (; x + 16 <= w; x += 16) {
+        const f32* src = rgb + (usize)x*3;
+        u8* dst = out + (usize)x*3*sample_size;
+        __m512 d = get_dither_avx512(k.dither, x, y);
+        for (u32 i = 0; i < 3; ++i) {
+          __m512i code = quantize_avx512(k, _mm512_loadu_ps(src + i*16), _mm512_permutexvar_ps(spread[i], d));
+          if (k.wide)
+            _mm256_storeu_si256((__m256i*)(dst + i*32), swap_bytes_avx2(_mm512_cvtepi32_epi16(code)));
+          else
+            _mm_storeu_si128((__m128i*)(dst + i*16), _mm512_cvtepi32_epi8(code));
+        }
+      }
+      return x;
+    }
+
+    void map_row(const Kernel& k, const f32* rgb, u32 w, u32 y, u8* out) {
+      Isa isa = get_isa();
+      u32 x = 0;
+      if (isa >= ISA_AVX512)
+        x = map_blocks_avx512(k, rgb, w, y, x, out);
+      if (isa >= ISA_AVX2)
+        x = map_blocks_avx2(k, rgb, w, y, x, out);
+      map_blocks_sse2(k, rgb, w, y, x, out);
+    }
+
+    const u32 BAND_HEIGHT = 16;
+
+    struct ToneMapBands {
+      const FloatImage* img;
+      const Kernel* kernel;
+      PackedImage* out;
+    };
+
+    void tone_map_band(u32 band, void* arg) {
+      const ToneMapBands& bands = *(const ToneMapBands*)arg;
+      const FloatImage& img = *bands.img;
+      usize row_samples = (usize)img.w * 3;
+      f32* rgb = (f32*)malloc(row_samples * sizeof(f32));
+      u32 y_end = min(band*BAND_HEIGHT + BAND_HEIGHT, img.h);
+      for (u32 y = band*BAND_HEIGHT; y < y_end; ++y) {
+        // Color3 is three packed doubles.
+        const f64* src = &img.get(0, y).x;
+        usize i = 0;
+        for (; i + 4 <= row_samples; i += 4)
+          _mm_storeu_ps(rgb + i, _mm_movelh_ps(_mm_cvtpd_ps(_mm_loadu_pd(src + i)), _mm_cvtpd_ps(_mm_loadu_pd(src + i + 2))));
+        for (; i < row_samples; ++i)
+          rgb[i] = (f32)src[i];
+        map_row(*bands.kernel, rgb, img.w, y, bands.out->get_row(img.h-1 - y));
+      }
+      free(rgb);
+    }
+  }
+
+  void tone_map(const FloatImage& img, const ToneMapSettings& settings, PackedImage* out) {
+    out->init(img.w, img.h, settings.bits > 8 ? 2 : 1);
+    Kernel kernel = make_kernel(settings);
+    ToneMapBands bands;
+    bands.img = &img;
+    bands.kernel = &kernel;
+    bands.out = out;
+    parallel_for((img.h + BAND_HEIGHT-1) / BAND_HEIGHT, tone_map_band, &bands);
+  }
+
+  void tone_map_row(const f32* rgb, u32 w, u32 y, const ToneMapSettings& settings, u8* out) {
+    Kernel kernel = make_kernel(settings);
+    map_row(kernel, rgb, w, y, out);
+  }
+}
@@ -1,3 +1,1911 @@
-int main() {
-  return 0;
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <simplay/platform/bvh.h>
+#include <simplay/platform/camera.h>
+#include <simplay/platform/clock.h>
+#include <simplay/platform/cpu.h>
+#include <simplay/platform/denoise.h>
+#include <simplay/platform/core.h>
+#include <simplay/platform/file_map.h>
+#include <simplay/platform/gbuffer.h>
+#include <simplay/platform/hittable.h>
+#include <simplay/platform/image.h>
+#include <simplay/platform/live_framebuffer.h>
+#include <simplay/platform/material.h>
+#include <simplay/platform/radiance_cache.h>
+#include <simplay/platform/random.h>
+#include <simplay/platform/render.h>
+#include <simplay/platform/render_cost.h>
+#include <simplay/platform/renderer.h>
+#include <simplay/platform/scene.h>
+#include <simplay/platform/sequence.h>
+#include <simplay/platform/texture.h>
+#include <simplay/platform/thread.h>
+#include <simplay/platform/tile_farm.h>
+#include <simplay/platform/tiled_image.h>
+#include <simplay/platform/tone_map.h>
+#include <simplay/platform/vec3.h>
+
+// Convergence harness: renders fixed scenes at growing sample counts, compares
+// them against a high-spp reference cached in out/, and prints the results as
+// JSON. Efficiency is 1 / (relMSE * seconds), so a change that halves the
+// noise for the same time doubles it, and so does one that halves the time.
+// Fails when the error does not go down with more samples.
+
+namespace sim {
+  const u32 SAMPLE_COUNTS[] = {1, 4, 16, 64};
+  const u32 REFERENCE_SAMPLES = 1024;
+  // The reference must not share its samples with the renders it judges.
+  const u64 REFERENCE_SEED = RENDER_SEED ^ 0xF00DFACEull;
+  // Keeps dark pixels from dominating relMSE.
+  const f64 RELMSE_EPSILON = 1e-2;
+  const char* REFERENCE_DIR = "out";
+
+  struct TestScene {
+    const char* name;
+    const Hittable* world;
+    // Of the shapes and their materials, see hash_scene_input().
+    u64 input_hash;
+    Camera cam;
+    RenderSettings settings;
+
+    TestScene(
+        const char* name, const Hittable* world, u64 input_hash,
+        const Camera& cam, const RenderSettings& settings)
+        : name(name), world(world), input_hash(input_hash)
+        , cam(cam), settings(settings) {}
+  };
+
+  struct ImageError {
+    f64 rmse;
+    f64 relmse;
+
+    ImageError() : rmse(0.0), relmse(0.0) {}
+  };
+
+  ImageError compare_images(const FloatImage& img, const FloatImage& ref) {
+    f64 se = 0.0;
+    f64 rel_se = 0.0;
+    for (u32 i = 0; i < img.w*img.h; ++i) {
+      const Color3& a = img.pixels[i];
+      const Color3& b = ref.pixels[i];
+      for (usize c = 0; c < 3; ++c) {
+        f64 d = a[c] - b[c];
+        se += d*d;
+        rel_se += d*d / (b[c]*b[c] + RELMSE_EPSILON);
+      }
+    }
+
+    f64 n = (f64)img.w * img.h * 3;
+    ImageError err;
+    err.rmse = sqrt(se / n);
+    err.relmse = rel_se / n;
+    return err;
+  }
+
+  // FNV-1a, going on from `hash`.
+  u64 hash_bytes(u64 hash, const void* data, usize size) {
+    const u8* bytes = (const u8*)data;
+    for (usize i = 0; i < size; ++i) {
+      hash ^= bytes[i];
+      hash *= 0x100000001B3ull;
+    }
+    return hash;
+  }
+
+  // Textures are told apart only by being there: the one test texture is
+  // generated, not loaded.
+  u64 hash_texture_map(u64 hash, const TextureMap& map) {
+    u8 textured = map.texture != nullptr;
+    hash = hash_bytes(hash, &textured, sizeof(textured));
+    hash = hash_bytes(hash, &map.repeat_u, sizeof(map.repeat_u));
+    return hash_bytes(hash, &map.repeat_v, sizeof(map.repeat_v));
+  }
+
+  // Field by field, as the union leaves bytes of the other materials behind.
+  u64 hash_material(u64 hash, const Material& mat) {
+    hash = hash_bytes(hash, &mat.type, sizeof(mat.type));
+    switch (mat.type) {
+      case Material::NONE:
+      default:
+        return hash;
+      case Material::LAMBERTIAN:
+        hash = hash_bytes(hash, &mat.lambertian.albedo, sizeof(mat.lambertian.albedo));
+        return hash_texture_map(hash, mat.lambertian.map);
+      case Material::METAL:
+        hash = hash_bytes(hash, &mat.metal.albedo, sizeof(mat.metal.albedo));
+        hash = hash_bytes(hash, &mat.metal.fuzz, sizeof(mat.metal.fuzz));
+        return hash_texture_map(hash, mat.metal.map);
+      case Material::DIELECTRIC:
+        return hash_bytes(hash, &mat.dielectric.ior, sizeof(mat.dielectric.ior));
+    }
+  }
+
+  // hash_bvh_input() of the shapes, and the materials they are made of.
+  u64 hash_scene_input(const Vector<Hittable>& prims) {
+    u64 hash = hash_bvh_input(prims);
+    for (usize i = 0; i < prims.length; ++i) {
+      const Material* mat = prims[i].type == Hittable::SPHERE ? prims[i].sphere.mat : nullptr;
+      hash = hash_material(hash, mat ? *mat : *Material::get_default());
+    }
+    return hash;
+  }
+
+  // What of the camera decides the rays it casts.
+  u64 hash_camera(u64 hash, const Camera& cam) {
+    hash = hash_bytes(hash, &cam.origin, sizeof(cam.origin));
+    hash = hash_bytes(hash, &cam.lower_left, sizeof(cam.lower_left));
+    hash = hash_bytes(hash, &cam.horizontal, sizeof(cam.horizontal));
+    hash = hash_bytes(hash, &cam.vertical, sizeof(cam.vertical));
+    hash = hash_bytes(hash, &cam.u, sizeof(cam.u));
+    hash = hash_bytes(hash, &cam.v, sizeof(cam.v));
+    return hash_bytes(hash, &cam.lens_radius, sizeof(cam.lens_radius));
+  }
+
+  // Renders the reference only when it is not cached yet. The file name
+  // covers everything the image depends on but the renderer itself (the
+  // shapes, their materials, the camera, the size and the depth), so the
+  // reference outlives the changes it is meant to judge.
+  bool get_reference(const TestScene& scene, FloatImage* ref) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s/reference-%s-%016llx-%ux%u-d%u-s%u.pfm",
+        REFERENCE_DIR, scene.name, (unsigned long long)hash_camera(scene.input_hash, scene.cam),
+        scene.settings.img_w, scene.settings.img_h, scene.settings.max_depth, REFERENCE_SAMPLES);
+    if (ref->load_pfm(path))
+      return true;
+
+    RenderSettings settings = scene.settings;
+    settings.samples = REFERENCE_SAMPLES;
+    settings.seed = REFERENCE_SEED;
+    fprintf(stderr, "Rendering reference \"%s\"\n", path);
+    f64 start = get_time_seconds();
+    *ref = render(scene.cam, *scene.world, settings);
+    fprintf(stderr, "Reference done in %.1f s\n", get_time_seconds() - start);
+    return make_directory(REFERENCE_DIR) && ref->save_pfm(path);
+  }
+
+  bool run_scene(const TestScene& scene, bool last) {
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", scene.name);
+
+    FloatImage ref;
+    if (!get_reference(scene, &ref)) {
+      printf("      \"error\": \"no reference\"\n");
+      printf("    }%s\n", last ? "" : ",");
+      ref.release();
+      return false;
+    }
+
+    printf("      \"width\": %u,\n", scene.settings.img_w);
+    printf("      \"height\": %u,\n", scene.settings.img_h);
+    printf("      \"max_depth\": %u,\n", scene.settings.max_depth);
+    printf("      \"runs\": [\n");
+
+    bool converging = true;
+    f64 prev_relmse = 0.0;
+    u32 run_count = sizeof(SAMPLE_COUNTS) / sizeof(SAMPLE_COUNTS[0]);
+    for (u32 i = 0; i < run_count; ++i) {
+      RenderSettings settings = scene.settings;
+      settings.samples = SAMPLE_COUNTS[i];
+
+      f64 start = get_time_seconds();
+      FloatImage img = render(scene.cam, *scene.world, settings);
+      f64 time = get_time_seconds() - start;
+      ImageError err = compare_images(img, ref);
+      img.release();
+
+      if (i > 0 && !(err.relmse < prev_relmse)) {
+        fprintf(stderr, "%s: relMSE went from %g to %g at %u spp\n",
+            scene.name, prev_relmse, err.relmse, settings.samples);
+        converging = false;
+      }
+      prev_relmse = err.relmse;
+
+      printf("        {\"samples\": %u, \"time\": %.6f, \"rmse\": %.6g, \"relmse\": %.6g, \"efficiency\": %.6g}%s\n",
+          settings.samples, time, err.rmse, err.relmse, 1.0 / (err.relmse * time),
+          i+1 < run_count ? "," : "");
+    }
+
+    printf("      ],\n");
+    printf("      \"converging\": %s\n", converging ? "true" : "false");
+    printf("    }%s\n", last ? "" : ",");
+    ref.release();
+    return converging;
+  }
+
+  // A few big spheres, one of each material, under a pinhole camera. With a
+  // texture, it goes on the diffuse and metal spheres.
+  struct MaterialsScene {
+    Hittable objects;
+
+    Material ground_mat;
+    Material diffuse_mat;
+    Material glass_mat;
+    Material metal_mat;
+
+    void build(const Texture* texture = nullptr) {
+      objects = Hittable::make_scene();
+      ground_mat = Material::make_lambertian(Color3(0.8, 0.8, 0.0));
+      if (texture) {
+        diffuse_mat = Material::make_lambertian(Color3(1.0, 1.0, 1.0), TextureMap(texture, 2.0, 1.0));
+        metal_mat = Material::make_metal(Color3(1.0, 1.0, 1.0), 0.3, TextureMap(texture));
+      } else {
+        diffuse_mat = Material::make_lambertian(Color3(0.1, 0.2, 0.5));
+        metal_mat = Material::make_metal(Color3(0.8, 0.6, 0.2), 0.3);
+      }
+      glass_mat = Material::make_dielectric(1.5);
+      objects.scene.push(Hittable::make_sphere(Point3(0.0, -100.5, -1.0), 100.0, &ground_mat));
+      objects.scene.push(Hittable::make_sphere(Point3(0.0, 0.0, -1.0), 0.5, &diffuse_mat));
+      objects.scene.push(Hittable::make_sphere(Point3(-1.0, 0.0, -1.0), 0.5, &glass_mat));
+      objects.scene.push(Hittable::make_sphere(Point3(1.0, 0.0, -1.0), 0.5, &metal_mat));
+    }
+  };
+
+  const char* TEST_TEXTURE_PATH = "out/test-texture.tex";
+  // Small enough to evict all the time, as production scenes would.
+  const usize SMALL_TEXTURE_CACHE = 256 << 10;
+  const usize LARGE_TEXTURE_CACHE = 64 << 20;
+
+  // Fine checkers and grid lines, which alias without mip mapping.
+  bool write_test_texture() {
+    FloatImage img;
+    img.init(1024, 512);
+    for (u32 y = 0; y < img.h; ++y) {
+      for (u32 x = 0; x < img.w; ++x) {
+        bool checker = ((x / 16) + (y / 16)) % 2 == 0;
+        bool line = x % 128 < 2 || y % 128 < 2;
+        Color3 c = checker ? Color3(0.9, 0.85, 0.7) : Color3(0.15, 0.3, 0.6);
+        img.get(x, y) = line ? Color3(0.8, 0.1, 0.1) : c;
+      }
+    }
+    bool ok = make_directory(REFERENCE_DIR) && write_texture(TEST_TEXTURE_PATH, img);
+    img.release();
+    return ok;
+  }
+
+  // Renders the textured scene through a cache that keeps evicting and
+  // through one that holds every tile, which must agree to the bit. The
+  // camera is close enough for the finest levels to be used.
+  bool check_texture_cache(const TestScene& scene, TextureCache* small_cache) {
+    TextureCache large_cache;
+    large_cache.init(LARGE_TEXTURE_CACHE);
+    Texture* texture = large_cache.open(TEST_TEXTURE_PATH);
+    MaterialsScene materials;
+    materials.build(texture);
+
+    Camera cam(
+        Point3(0.1, 0.1, -0.2), Point3(0.0, 0.0, -1.0), Vec3(0.0, 1.0, 0.0),
+        40.0, ASPECT_RATIO, 0.0, 1.0);
+    RenderSettings settings = scene.settings;
+    settings.img_w = 240;
+    settings.img_h = (u32)(settings.img_w / ASPECT_RATIO);
+    settings.samples = 4;
+    FloatImage small_img = render(cam, *scene.world, settings);
+    FloatImage large_img = render(cam, materials.objects, settings);
+    bool same = texture && small_img.w == large_img.w && small_img.h == large_img.h;
+    for (u32 i = 0; same && i < small_img.w*small_img.h; ++i) {
+      const Color3& a = small_img.pixels[i];
+      const Color3& b = large_img.pixels[i];
+      same = a.x == b.x && a.y == b.y && a.z == b.z;
+    }
+    if (!same)
+      fprintf(stderr, "%s: texture cache size changed the image\n", scene.name);
+
+    TextureCacheStats stats = small_cache->get_stats();
+    printf("  \"texture_cache\": {\"capacity\": %llu, \"lookups\": %llu, \"hit_rate\": %.6f, "
+        "\"loads\": %llu, \"evictions\": %llu, \"consistent\": %s},\n",
+        (unsigned long long)SMALL_TEXTURE_CACHE, (unsigned long long)stats.lookups, stats.get_hit_rate(),
+        (unsigned long long)stats.loads, (unsigned long long)stats.evictions, same ? "true" : "false");
+
+    small_img.release();
+    large_img.release();
+    materials.objects.release();
+    large_cache.release();
+    return same && !stats.failed_loads;
+  }
+
+  const u32 DENOISE_SAMPLES = 4;
+  // Diffuse surfaces come out close to the reference, while glass and
+  // glossy metal keep much of their noise, whose albedo varies from sample
+  // to sample. Over the demo that leaves about 0.7 of the noisy error.
+  const f64 DENOISE_MAX_ERROR_RATIO = 0.8;
+
+  // Every AOV value is finite, and each buffer holds more than one value:
+  // some albedo, unit normals where there was a hit, depths in front of
+  // the camera.
+  bool check_aovs(const AovImages& aovs) {
+    bool finite = true;
+    bool has_albedo = false;
+    bool has_normal = false;
+    bool unit_normals = true;
+    f64 min_depth = F64_INF;
+    f64 max_depth = 0.0;
+    for (u32 i = 0; i < aovs.albedo.w * aovs.albedo.h; ++i) {
+      const Color3& a = aovs.albedo.pixels[i];
+      const Vec3& n = aovs.normal.pixels[i];
+      f64 d = aovs.depth.pixels[i].x;
+      for (usize c = 0; c < 3; ++c)
+        finite = finite && isfinite(a[c]) && isfinite(n[c]) && isfinite(aovs.depth.pixels[i][c]);
+      has_albedo = has_albedo || a.sqmag() > 0.0;
+      if (d > 0.0) {
+        // Normals are averaged over the pixel's samples, so edges are shorter.
+        has_normal = has_normal || fabs(n.sqmag() - 1.0) < 1e-6;
+        unit_normals = unit_normals && n.sqmag() <= 1.0 + 1e-6;
+      }
+      min_depth = min(min_depth, d);
+      max_depth = max(max_depth, d);
+    }
+    return finite && has_albedo && has_normal && unit_normals && min_depth >= 0.0 && max_depth > min_depth;
+  }
+
+  // A low-spp render with its AOVs, denoised, against the reference: the
+  // filter must take out a good part of the noise without adding as much
+  // bias.
+  bool check_denoiser(const TestScene& scene) {
+    FloatImage ref;
+    if (!get_reference(scene, &ref)) {
+      ref.release();
+      return false;
+    }
+
+    RenderSettings settings = scene.settings;
+    settings.samples = DENOISE_SAMPLES;
+    AovImages aovs;
+    FloatImage noisy = render(scene.cam, *scene.world, settings, &aovs);
+    bool aovs_ok = check_aovs(aovs);
+
+    FloatImage denoised;
+    f64 start = get_time_seconds();
+    denoise(noisy, aovs, DenoiseSettings(), &denoised);
+    f64 denoise_time = get_time_seconds() - start;
+    ImageError noisy_err = compare_images(noisy, ref);
+    ImageError denoised_err = compare_images(denoised, ref);
+    noisy.release();
+    denoised.release();
+    aovs.release();
+    ref.release();
+
+    bool better = denoised_err.relmse < noisy_err.relmse * DENOISE_MAX_ERROR_RATIO;
+    if (!aovs_ok)
+      fprintf(stderr, "%s: AOVs are empty or not finite\n", scene.name);
+    if (!better)
+      fprintf(stderr, "%s: denoised relMSE %g against %g noisy\n", scene.name, denoised_err.relmse, noisy_err.relmse);
+    printf("  \"denoise\": {\"scene\": \"%s\", \"samples\": %u, \"time\": %.6f, \"noisy_relmse\": %.6g, \"denoised_relmse\": %.6g, \"aovs\": %s},\n",
+        scene.name, settings.samples, denoise_time, noisy_err.relmse, denoised_err.relmse, aovs_ok ? "true" : "false");
+    return aovs_ok && better;
+  }
+
+  const f64 BUDGETS[] = {0.25, 1.0};
+  // Of the budget, plus a few milliseconds for the pass that runs over.
+  const f64 BUDGET_TOLERANCE = 0.05;
+  const f64 BUDGET_SLACK = 0.005;
+
+  // Budgeted renders must end within a few percent of their budget, with
+  // every pixel sampled. The sample cap is out of reach.
+  bool check_budget(const TestScene& scene) {
+    RenderSettings settings = scene.settings;
+    settings.samples = 1u << 20;
+    bool ok = true;
+    printf("  \"budget\": [\n");
+    u32 budget_count = sizeof(BUDGETS) / sizeof(BUDGETS[0]);
+    for (u32 i = 0; i < budget_count; ++i) {
+      BudgetReport report;
+      f64 start = get_time_seconds();
+      FloatImage img = render_within_budget(scene.cam, *scene.world, settings, BUDGETS[i], &report);
+      f64 elapsed = get_time_seconds() - start;
+      img.release();
+
+      bool on_time = fabs(elapsed - BUDGETS[i]) <= BUDGETS[i] * BUDGET_TOLERANCE + BUDGET_SLACK;
+      if (!on_time)
+        fprintf(stderr, "%s: budget of %.3f s took %.3f s\n", scene.name, BUDGETS[i], elapsed);
+      if (!report.min_spp)
+        fprintf(stderr, "%s: budget of %.3f s left pixels without samples\n", scene.name, BUDGETS[i]);
+      ok = on_time && report.min_spp && ok;
+      printf("    {\"budget\": %.3f, \"elapsed\": %.6f, \"passes\": %u, \"min_spp\": %u, \"max_spp\": %u, \"avg_spp\": %.3f}%s\n",
+          BUDGETS[i], elapsed, report.passes, report.min_spp, report.max_spp, report.avg_spp,
+          i+1 < budget_count ? "," : "");
+    }
+    printf("  ],\n");
+    return ok;
+  }
+
+  bool same_job(const TileJob& a, const TileJob& b) {
+    return a.id == b.id && a.x0 == b.x0 && a.y0 == b.y0 && a.w == b.w && a.h == b.h && a.img_w == b.img_w
+        && a.img_h == b.img_h && a.samples == b.samples && a.max_depth == b.max_depth && a.seed == b.seed;
+  }
+
+  // Messages fed to a reader a byte at a time must come out whole, only
+  // once their last byte is in, and back to back messages one by one.
+  bool check_tile_protocol() {
+    TileJob job;
+    job.id = 7;
+    job.x0 = 32;
+    job.y0 = 16;
+    job.w = 5;
+    job.h = 3;
+    job.img_w = 100;
+    job.img_h = 60;
+    job.samples = 9;
+    job.max_depth = 4;
+    job.seed = 0x0123456789ABCDEFull;
+    f32 pixels[5*3*3];
+    for (u32 i = 0; i < 5*3*3; ++i)
+      pixels[i] = (f32)i * 0.25f;
+
+    Vector<u8> bytes;
+    encode_tile_job(job, &bytes);
+    encode_tile_result(job, pixels, &bytes);
+    encode_shutdown(&bytes);
+
+    u32 failures = 0;
+    MessageReader reader;
+    Message msg;
+    u32 message_index = 0;
+    for (usize i = 0; i < bytes.length; ++i) {
+      reader.buffer.append(bytes.data + i, 1);
+      if (!reader.next(&msg))
+        continue;
+
+      TileJob decoded;
+      const f32* decoded_pixels = nullptr;
+      if (message_index == 0) {
+        failures += !decode_tile_job(msg, &decoded) || !same_job(job, decoded);
+      } else if (message_index == 1) {
+        failures += !decode_tile_result(msg, &decoded, &decoded_pixels) || !same_job(job, decoded)
+            || memcmp(decoded_pixels, pixels, sizeof(pixels)) != 0;
+        // A job is not a result, and the other way around.
+        failures += decode_tile_job(msg, &decoded);
+      } else {
+        failures += msg.type != Message::SHUTDOWN;
+      }
+      // Nothing comes out before the next message is whole.
+      failures += reader.next(&msg);
+      ++message_index;
+    }
+    failures += message_index != 3;
+    reader.release();
+
+    // A result cut short, and a header without the magic.
+    bytes.length = 0;
+    encode_tile_result(job, pixels, &bytes);
+    u32 size;
+    memcpy(&size, bytes.data + 8, sizeof(size));
+    size -= 4;
+    memcpy(bytes.data + 8, &size, sizeof(size));
+    bytes.data[0] ^= 0xFF;
+    reader.buffer.append(bytes.data, bytes.length - 4);
+    TileJob decoded;
+    const f32* decoded_pixels = nullptr;
+    failures += !reader.next(&msg) || msg.type != Message::NONE;
+    msg.type = Message::TILE_RESULT;
+    failures += decode_tile_result(msg, &decoded, &decoded_pixels);
+    failures += !reader.failed || reader.next(&msg);
+    reader.release();
+
+    // Sizes that wrap around, or are merely huge, are errors right away
+    // rather than something to wait for.
+    const u32 BAD_SIZES[] = {0xFFFFFFF8u, 0x7FFFFFFFu};
+    for (u32 i = 0; i < sizeof(BAD_SIZES) / sizeof(BAD_SIZES[0]); ++i) {
+      bytes.length = 0;
+      encode_tile_result(job, pixels, &bytes);
+      memcpy(bytes.data + 8, &BAD_SIZES[i], sizeof(u32));
+      reader.buffer.append(bytes.data, bytes.length);
+      failures += !reader.has_message() || !reader.next(&msg) || msg.type != Message::NONE || msg.size;
+      failures += !reader.failed || reader.has_message() || reader.next(&msg);
+      reader.release();
+    }
+
+    // A result whose pixel count wraps around in 32 bits, with a payload
+    // of the wrapped size.
+    TileJob forged = job;
+    forged.w = 0x10000;
+    forged.h = 0x5556;
+    Vector<u8> payload;
+    encode_tile_job(forged, &payload);
+    usize wrapped_size = (usize)(u32)(forged.w*forged.h*3) * sizeof(f32);
+    Vector<u8> forged_bytes;
+    forged_bytes.append(payload.data + 12, payload.length - 12);
+    while (forged_bytes.length < payload.length - 12 + wrapped_size)
+      forged_bytes.push(0);
+    msg.type = Message::TILE_RESULT;
+    msg.payload = forged_bytes.data;
+    msg.size = (u32)forged_bytes.length;
+    failures += decode_tile_result(msg, &decoded, &decoded_pixels);
+    forged_bytes.release();
+    payload.release();
+    bytes.release();
+
+    bool ok = !failures;
+    if (!ok)
+      fprintf(stderr, "Tile protocol: %u checks failed\n", failures);
+    printf("  \"tile_protocol\": {\"failures\": %u},\n", failures);
+    return ok;
+  }
+
+  const char* FARM_WORKER_ARG = "--farm-worker";
+  const u32 FARM_IMAGE_W = 72;
+  const u32 FARM_IMAGE_H = 40;
+  const u32 FARM_TILE_SIZE = 16;
+  // A stalled worker sleeps much longer than the farm takes without it.
+  const u32 FARM_STALL_MS = 4000;
+
+  // Pixels that only depend on the job and their position, cheap enough for
+  // workers that start and stop many times over.
+  void render_farm_tile(const TileJob& job, f32* pixels, void*) {
+    for (u32 y = 0; y < job.h; ++y) {
+      for (u32 x = 0; x < job.w; ++x) {
+        u64 h = (job.seed ^ ((u64)(job.y0 + y) * job.img_w + job.x0 + x)) * 0x9E3779B97F4A7C15ull;
+        f32* p = pixels + ((usize)y*job.w + x)*3;
+        p[0] = (f32)(h >> 40) / (f32)(1 << 24);
+        p[1] = (f32)((h >> 16) & 0xFFFFFF) / (f32)(1 << 24);
+        p[2] = (f32)job.samples;
+      }
+    }
+  }
+
+  struct FarmWorker {
+    const char* mode;
+    u32 jobs;
+
+    FarmWorker() : mode(""), jobs(0) {}
+  };
+
+  // "die" exits on its third job without answering, as if killed. "stall"
+  // sleeps through its first job when that is tile 0. "trickle" sends its
+  // results in pieces, so that they arrive cut in the middle.
+  void render_worker_tile(const TileJob& job, f32* pixels, void* arg) {
+    FarmWorker& worker = *(FarmWorker*)arg;
+    if (++worker.jobs == 3 && strcmp(worker.mode, "die") == 0)
+      exit(1);
+    if (worker.jobs == 1 && job.id == 0 && strcmp(worker.mode, "stall") == 0)
+      sleep_ms(FARM_STALL_MS);
+    render_farm_tile(job, pixels, nullptr);
+  }
+
+  int run_farm_worker(const char* mode) {
+    FarmWorker worker;
+    worker.mode = mode;
+    Channel channel = Channel::make_std();
+    if (strcmp(mode, "trickle") != 0) {
+      serve_tiles(&channel, render_worker_tile, &worker);
+      return 0;
+    }
+
+    MessageReader reader;
+    Vector<u8> send_buf;
+    f32 pixels[FARM_TILE_SIZE*FARM_TILE_SIZE*3];
+    bool running = true;
+    while (running && reader.pump(&channel, true)) {
+      Message msg;
+      TileJob job;
+      while (running && reader.next(&msg)) {
+        if (!decode_tile_job(msg, &job)) {
+          running = false;
+          break;
+        }
+        render_worker_tile(job, pixels, &worker);
+        send_buf.length = 0;
+        encode_tile_result(job, pixels, &send_buf);
+        usize half = send_buf.length / 2;
+        running = channel.write_all(send_buf.data, 5);
+        sleep_ms(2);
+        running = running && channel.write_all(send_buf.data + 5, half - 5);
+        sleep_ms(2);
+        running = running && channel.write_all(send_buf.data + half, send_buf.length - half);
+      }
+    }
+    send_buf.release();
+    reader.release();
+    return 0;
+  }
+
+  struct FarmRun {
+    f64 time;
+    u32 mismatches;
+  };
+
+  FarmRun run_farm(const char* mode, u32 worker_count, const FloatImage& expected) {
+    char exe_path[1024];
+    char cmdline[1200];
+    FarmRun run;
+    run.time = 0.0;
+    run.mismatches = expected.w * expected.h;
+    if (!get_executable_path(exe_path, sizeof(exe_path)))
+      return run;
+    snprintf(cmdline, sizeof(cmdline), "\"%s\" %s %s", exe_path, FARM_WORKER_ARG, mode);
+
+    TileFarmSettings settings;
+    settings.worker_cmdline = cmdline;
+    settings.worker_count = worker_count;
+    settings.tile_size = FARM_TILE_SIZE;
+    settings.samples = 3;
+    settings.seed = RENDER_SEED;
+    settings.min_timeout = 0.2;
+    FloatImage out;
+    out.init(expected.w, expected.h);
+    f64 start = get_time_seconds();
+    farm_tiles(settings, render_farm_tile, nullptr, &out);
+    run.time = get_time_seconds() - start;
+
+    run.mismatches = 0;
+    for (u32 i = 0; i < out.w * out.h; ++i) {
+      const Color3& a = out.pixels[i];
+      const Color3& b = expected.pixels[i];
+      run.mismatches += a.x != b.x || a.y != b.y || a.z != b.z;
+    }
+    out.release();
+    return run;
+  }
+
+  // A coordinator and local worker processes, which are this executable
+  // run with FARM_WORKER_ARG: healthy ones sending their results in
+  // pieces, ones that all die partway, leaving the rest to the coordinator,
+  // and one that stalls on a tile another worker must take over.
+  bool check_tile_farm() {
+    FloatImage expected;
+    expected.init(FARM_IMAGE_W, FARM_IMAGE_H);
+    TileJob job;
+    job.w = FARM_IMAGE_W;
+    job.h = FARM_IMAGE_H;
+    job.img_w = FARM_IMAGE_W;
+    job.img_h = FARM_IMAGE_H;
+    job.samples = 3;
+    job.seed = RENDER_SEED;
+    f32* pixels = (f32*)malloc((usize)FARM_IMAGE_W*FARM_IMAGE_H*3 * sizeof(f32));
+    render_farm_tile(job, pixels, nullptr);
+    for (u32 i = 0; i < FARM_IMAGE_W*FARM_IMAGE_H; ++i)
+      expected.pixels[i] = Color3(pixels[3*i], pixels[3*i + 1], pixels[3*i + 2]);
+    free(pixels);
+
+    FarmRun trickle = run_farm("trickle", 3, expected);
+    FarmRun die = run_farm("die", 3, expected);
+    FarmRun stall = run_farm("stall", 2, expected);
+    expected.release();
+
+    bool stall_ok = stall.time * 1000.0 < FARM_STALL_MS;
+    bool ok = !trickle.mismatches && !die.mismatches && !stall.mismatches && stall_ok;
+    if (trickle.mismatches || die.mismatches || stall.mismatches) {
+      fprintf(stderr, "Tile farm: %u, %u and %u pixels differ with trickling, dying and stalling workers\n",
+          trickle.mismatches, die.mismatches, stall.mismatches);
+    }
+    if (!stall_ok)
+      fprintf(stderr, "Tile farm: waited %.3f s for a stalled worker\n", stall.time);
+    printf("  \"tile_farm\": {\"trickle\": {\"time\": %.6f, \"mismatches\": %u}, \"die\": {\"time\": %.6f, \"mismatches\": %u}, "
+        "\"stall\": {\"time\": %.6f, \"mismatches\": %u}},\n",
+        trickle.time, trickle.mismatches, die.time, die.mismatches, stall.time, stall.mismatches);
+    return ok;
+  }
+
+  const u32 RADIANCE_CACHE_SAMPLES = 16;
+  // A broken cache, rather than its interpolation, would be well past this.
+  const f64 RADIANCE_CACHE_MAX_ERROR_RATIO = 4.0;
+
+  ImageError render_with_error(const TestScene& scene, const RenderSettings& settings, const FloatImage& ref, f64* time) {
+    f64 start = get_time_seconds();
+    FloatImage img = render(scene.cam, *scene.world, settings);
+    *time = get_time_seconds() - start;
+    ImageError err = compare_images(img, ref);
+    img.release();
+    return err;
+  }
+
+  // Plain path tracing against paths cut short by the radiance cache, at
+  // the same sample count. The cache trades noise for bias, so its error
+  // stops going down with samples; what matters is efficiency at low counts.
+  bool check_radiance_cache(const TestScene& scene) {
+    FloatImage ref;
+    if (!get_reference(scene, &ref)) {
+      ref.release();
+      return false;
+    }
+
+    RenderSettings settings = scene.settings;
+    settings.samples = RADIANCE_CACHE_SAMPLES;
+    f64 plain_time;
+    ImageError plain = render_with_error(scene, settings, ref, &plain_time);
+
+    RadianceCache cache;
+    cache.init(RadianceCacheSettings());
+    settings.radiance_cache = &cache;
+    f64 cached_time;
+    ImageError cached = render_with_error(scene, settings, ref, &cached_time);
+    RadianceCacheStats stats = cache.get_stats();
+    cache.release();
+    ref.release();
+
+    bool ok = stats.records && cached.relmse < plain.relmse * RADIANCE_CACHE_MAX_ERROR_RATIO;
+    if (!ok)
+      fprintf(stderr, "%s: radiance cache relMSE %g against %g without\n", scene.name, cached.relmse, plain.relmse);
+
+    printf("  \"radiance_cache\": {\"scene\": \"%s\", \"samples\": %u,\n", scene.name, settings.samples);
+    printf("    \"plain\": {\"time\": %.6f, \"relmse\": %.6g, \"efficiency\": %.6g},\n",
+        plain_time, plain.relmse, 1.0 / (plain.relmse * plain_time));
+    printf("    \"cached\": {\"time\": %.6f, \"relmse\": %.6g, \"efficiency\": %.6g, \"records\": %llu, \"hit_rate\": %.6f}},\n",
+        cached_time, cached.relmse, 1.0 / (cached.relmse * cached_time),
+        (unsigned long long)stats.records, stats.get_hit_rate());
+    return ok;
+  }
+
+  const char* TILED_IMAGE_PATH = "out/tiled-image.tmp";
+  const char* TILED_PFM_PATH = "out/tiled-image.pfm";
+  // Does not divide the test images, so edge tiles are partial.
+  const u32 TEST_TILE_SIZE = 48;
+  const u32 TILED_SAMPLES = 16;
+
+  // Renders a tile at a time into a file, streams it out as a PFM, and
+  // reads that back. Only the noise may differ from an in-memory render.
+  bool check_tiled_image(const TestScene& scene) {
+    FloatImage ref;
+    if (!get_reference(scene, &ref)) {
+      ref.release();
+      return false;
+    }
+
+    RenderSettings settings = scene.settings;
+    settings.samples = TILED_SAMPLES;
+    f64 plain_time;
+    ImageError plain = render_with_error(scene, settings, ref, &plain_time);
+
+    TiledImage tiled;
+    f64 start = get_time_seconds();
+    bool ok = tiled.init(TILED_IMAGE_PATH, settings.img_w, settings.img_h, TEST_TILE_SIZE)
+        && render_tiled(scene.cam, *scene.world, settings, &tiled);
+    f64 render_time = get_time_seconds() - start;
+    start = get_time_seconds();
+    ok = ok && tiled.save_pfm(TILED_PFM_PATH);
+    f64 save_time = get_time_seconds() - start;
+    u32 tile_count = tiled.get_tile_count();
+    tiled.release();
+
+    FloatImage img;
+    ok = ok && img.load_pfm(TILED_PFM_PATH) && img.w == settings.img_w && img.h == settings.img_h;
+    ImageError err;
+    if (ok)
+      err = compare_images(img, ref);
+    img.release();
+    ref.release();
+
+    ok = ok && err.relmse < plain.relmse * 2.0;
+    if (!ok)
+      fprintf(stderr, "%s: tiled render relMSE %g against %g in memory\n", scene.name, err.relmse, plain.relmse);
+    printf("  \"tiled_image\": {\"scene\": \"%s\", \"tiles\": %u, \"render_time\": %.6f, \"save_time\": %.6f, "
+        "\"relmse\": %.6g, \"in_memory_relmse\": %.6g},\n",
+        scene.name, tile_count, render_time, save_time, err.relmse, plain.relmse);
+    return ok;
+  }
+
+  const u32 TONE_MAP_WIDTH = 1920;
+  const u32 TONE_MAP_HEIGHT = 1080;
+  const u32 TONE_MAP_REPEATS = 10;
+
+  // What the tone mapper should output for a sample, in double precision
+  // and without any table.
+  u32 get_exact_code(f32 sample, const ToneMapSettings& settings) {
+    f64 v = max((f64)sample * pow(2.0, (f64)settings.exposure), 0.0);
+    switch (settings.curve) {
+      case ToneMapSettings::CLAMP:
+        v = min(v, 1.0);
+        break;
+      case ToneMapSettings::REINHARD:
+        v = v / (1.0 + v);
+        break;
+      case ToneMapSettings::ACES:
+        v = min((v * (2.51*v + 0.03)) / (v * (2.43*v + 0.59) + 0.14), 1.0);
+        break;
+    }
+    v = v <= 0.0031308 ? 12.92 * v : 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+    f64 max_code = settings.bits > 8 ? 65535.0 : 255.0;
+    return (u32)min(floor(v * max_code + 0.5), max_code);
+  }
+
+  // Every curve at both depths must stay within one step of the exact
+  // codes, over a range from deep shadows to highlights.
+  bool check_tone_map() {
+    FloatImage img;
+    img.init(TONE_MAP_WIDTH, TONE_MAP_HEIGHT);
+    for (u32 y = 0; y < img.h; ++y) {
+      for (u32 x = 0; x < img.w; ++x) {
+        f64 t = ((f64)y * img.w + x) / ((f64)img.w * img.h);
+        img.get(x, y) = Color3(pow(2.0, -14.0 + 16.0*t), t, (x % 7) * 0.2);
+      }
+    }
+
+    const ToneMapSettings::Curve curves[] = {ToneMapSettings::CLAMP, ToneMapSettings::REINHARD, ToneMapSettings::ACES};
+    const u32 depths[] = {8, 16};
+    u32 max_diff = 0;
+    u64 mismatches = 0;
+    PackedImage packed;
+    for (u32 c = 0; c < 3; ++c) {
+      for (u32 d = 0; d < 2; ++d) {
+        ToneMapSettings settings;
+        settings.curve = curves[c];
+        settings.bits = depths[d];
+        settings.exposure = 0.5f;
+        tone_map(img, settings, &packed);
+        for (u32 y = 0; y < img.h; ++y) {
+          const u8* row = packed.get_row(img.h-1 - y);
+          for (u32 i = 0; i < img.w*3; ++i) {
+            u32 code = settings.bits > 8 ? ((u32)row[i*2] << 8) | row[i*2 + 1] : row[i];
+            u32 exact = get_exact_code((f32)img.get(i / 3, y)[i % 3], settings);
+            u32 diff = code > exact ? code - exact : exact - code;
+            max_diff = max(max_diff, diff);
+            mismatches += diff ? 1 : 0;
+          }
+        }
+      }
+    }
+
+    ToneMapSettings settings;
+    settings.curve = ToneMapSettings::ACES;
+    settings.dither = ToneMapSettings::NOISE;
+    f64 start = get_time_seconds();
+    for (u32 i = 0; i < TONE_MAP_REPEATS; ++i)
+      tone_map(img, settings, &packed);
+    f64 time = (get_time_seconds() - start) / TONE_MAP_REPEATS;
+    f64 pixels = (f64)img.w * img.h;
+    packed.release();
+    img.release();
+
+    bool ok = max_diff <= 1;
+    if (!ok)
+      fprintf(stderr, "Tone mapping is %u steps off the exact codes\n", max_diff);
+    printf("  \"tone_map\": {\"max_diff\": %u, \"mismatches\": %llu, \"time\": %.6f, "
+        "\"megapixels_per_second\": %.6g, \"output_gb_per_second\": %.6g},\n",
+        max_diff, (unsigned long long)mismatches, time, pixels / time * 1e-6, pixels * 3.0 / time * 1e-9);
+    return ok;
+  }
+
+  const u32 RENDER_COST_SAMPLES = 16;
+
+  // Renders with and without the cost buffers. Counting must not change the
+  // image, and the per-material totals must add up to the pixels.
+  bool check_render_cost(const TestScene& scene) {
+    RenderSettings settings = scene.settings;
+    settings.samples = RENDER_COST_SAMPLES;
+    f64 start = get_time_seconds();
+    FloatImage plain = render(scene.cam, *scene.world, settings);
+    f64 plain_time = get_time_seconds() - start;
+
+    CostImages costs;
+    start = get_time_seconds();
+    FloatImage counted = render(scene.cam, *scene.world, settings, nullptr, &costs);
+    f64 counted_time = get_time_seconds() - start;
+
+    usize pixel_count = (usize)settings.img_w * settings.img_h;
+    bool same = true;
+    bool sane = true;
+    RenderCost pixel_total;
+    for (usize i = 0; i < pixel_count; ++i) {
+      const Color3& a = plain.pixels[i];
+      const Color3& b = counted.pixels[i];
+      same = same && a.x == b.x && a.y == b.y && a.z == b.z;
+      pixel_total.cycles += (u64)costs.cycles.pixels[i].x;
+      pixel_total.hit_calls += (u64)costs.hit_calls.pixels[i].x;
+      pixel_total.prim_tests += (u64)costs.prim_tests.pixels[i].x;
+      pixel_total.bounces += (u64)costs.bounces.pixels[i].x;
+      // Every camera ray is tested against the world at least once.
+      sane = sane && costs.hit_calls.pixels[i].x >= settings.samples
+          && costs.prim_tests.pixels[i].x <= costs.hit_calls.pixels[i].x;
+    }
+
+    RenderCost material_total = costs.get_total();
+    u64 material_samples = 0;
+    for (usize i = 0; i < costs.by_material.entries.length; ++i)
+      material_samples += costs.by_material.entries[i].samples;
+    bool adds_up = material_total.cycles == pixel_total.cycles
+        && material_total.hit_calls == pixel_total.hit_calls
+        && material_total.prim_tests == pixel_total.prim_tests
+        && material_total.bounces == pixel_total.bounces
+        && material_samples == (u64)pixel_count * settings.samples;
+
+    // Nothing is counted once the render is over.
+    RenderCost before = read_cost();
+    HitRecord hr;
+    scene.world->hit(Ray(scene.cam.origin, Vec3(0.0, 0.0, -1.0)), 0.001, F64_INF, &hr);
+    bool stopped = get_cost_since(before).hit_calls == 0;
+
+    bool ok = same && sane && adds_up && stopped;
+    if (!ok) {
+      fprintf(stderr, "%s: cost buffers: same image %d, sane counts %d, totals add up %d, counting stopped %d\n",
+          scene.name, same, sane, adds_up, stopped);
+    }
+    printf("  \"render_cost\": {\"scene\": \"%s\", \"samples\": %u, \"plain_time\": %.6f, \"counted_time\": %.6f, "
+        "\"cycles_per_sample\": %.1f, \"hit_calls_per_sample\": %.3f, \"prim_tests_per_sample\": %.3f, "
+        "\"bounces_per_sample\": %.3f, \"materials\": %llu},\n",
+        scene.name, settings.samples, plain_time, counted_time,
+        (f64)pixel_total.cycles / (f64)material_samples, (f64)pixel_total.hit_calls / (f64)material_samples,
+        (f64)pixel_total.prim_tests / (f64)material_samples, (f64)pixel_total.bounces / (f64)material_samples,
+        (unsigned long long)costs.by_material.entries.length);
+    costs.release();
+    counted.release();
+    plain.release();
+    return ok;
+  }
+
+  const u32 RENDERER_BATCH_SAMPLES = 64;
+  const u32 RENDERER_INTERACTIVE_SAMPLES = 1;
+
+  struct ProgressLog {
+    volatile i64 calls;
+    volatile i64 completions;
+  };
+
+  // Workers report at once, so the calls are only counted.
+  void log_progress(RenderJob*, f64 progress, void* arg) {
+    ProgressLog& log = *(ProgressLog*)arg;
+    atomic_fetch_add(&log.calls, 1);
+    if (progress == 1.0)
+      atomic_fetch_add(&log.completions, 1);
+  }
+
+  bool same_image(const FloatImage& a, const FloatImage& b) {
+    if (a.w != b.w || a.h != b.h)
+      return false;
+    for (usize i = 0; i < (usize)a.w * a.h; ++i) {
+      if (a.pixels[i].x != b.pixels[i].x || a.pixels[i].y != b.pixels[i].y || a.pixels[i].z != b.pixels[i].z)
+        return false;
+    }
+    return true;
+  }
+
+  // A long batch job, then an interactive one of higher priority submitted
+  // while it runs. The interactive job must get done first, come out as it
+  // does on its own, and cancelling must stop the batch job short.
+  bool check_renderer(const TestScene& scene) {
+    Renderer renderer;
+    if (!renderer.init()) {
+      fprintf(stderr, "Failed to start the renderer\n");
+      return false;
+    }
+
+    RenderRequest batch;
+    batch.cam = &scene.cam;
+    batch.world = scene.world;
+    batch.settings = scene.settings;
+    batch.settings.samples = RENDERER_BATCH_SAMPLES;
+    RenderRequest interactive = batch;
+    interactive.settings.samples = RENDERER_INTERACTIVE_SAMPLES;
+    interactive.priority = 1;
+    ProgressLog log;
+    log.calls = 0;
+    log.completions = 0;
+    interactive.on_progress = log_progress;
+    interactive.progress_arg = &log;
+
+    FloatImage batch_img;
+    FloatImage interactive_img;
+    f64 start = get_time_seconds();
+    RenderJob* batch_job = renderer.submit(batch, &batch_img);
+    RenderJob* interactive_job = renderer.submit(interactive, &interactive_img);
+    bool interactive_done = renderer.wait(interactive_job);
+    f64 interactive_time = get_time_seconds() - start;
+    f64 batch_progress = renderer.get_progress(batch_job);
+    bool preempted = batch_progress < 1.0;
+
+    renderer.cancel(batch_job);
+    start = get_time_seconds();
+    bool batch_done = renderer.wait(batch_job);
+    f64 cancel_time = get_time_seconds() - start;
+
+    FloatImage alone_img;
+    start = get_time_seconds();
+    bool alone_done = renderer.wait(renderer.submit(interactive, &alone_img));
+    f64 alone_time = get_time_seconds() - start;
+    bool same = same_image(interactive_img, alone_img);
+
+    // Tiles take render()'s kernels, which give what the general path does.
+    RenderRequest general = interactive;
+    general.settings.specialize = false;
+    general.on_progress = nullptr;
+    FloatImage general_img;
+    start = get_time_seconds();
+    bool general_done = renderer.wait(renderer.submit(general, &general_img));
+    f64 general_time = get_time_seconds() - start;
+    bool same_general = same_image(alone_img, general_img);
+    renderer.release();
+
+    bool ok = interactive_done && alone_done && general_done && preempted && !batch_done && same && same_general
+        && log.completions == 2;
+    if (!ok) {
+      fprintf(stderr, "%s: renderer: interactive done %d, batch preempted %d (%.3f), batch cancelled %d, "
+          "same image alone %d, same image on the general path %d, completions reported %lld\n",
+          scene.name, interactive_done && alone_done && general_done, preempted, batch_progress, !batch_done, same,
+          same_general, (long long)log.completions);
+    }
+    printf("  \"renderer\": {\"scene\": \"%s\", \"interactive_time\": %.6f, \"batch_progress\": %.6f, "
+        "\"cancel_time\": %.6f, \"progress_calls\": %lld, \"kernel_time\": %.6f, \"general_time\": %.6f},\n",
+        scene.name, interactive_time, batch_progress, cancel_time, (long long)log.calls, alone_time, general_time);
+    general_img.release();
+    alone_img.release();
+    interactive_img.release();
+    batch_img.release();
+    return ok;
+  }
+
+  const u32 REFIT_RAYS = 20000;
+  const f64 REFIT_MOTION = 0.3;
+
+  // Moves every sphere of the demo a little and refits its BVH. The refit
+  // tree must find exactly the hits a brute-force search does.
+  bool check_bvh_refit() {
+    Scene rest;
+    seed_random(SCENE_SEED);
+    build_scene(&rest);
+    Vector<Hittable>& objects = rest.objects.scene;
+
+    Vector<Hittable> prims;
+    prims.append(objects.data, objects.length);
+    Bvh bvh;
+    build_bvh(&prims, &bvh);
+    f64 built_cost = get_bvh_cost(bvh);
+
+    // Not the ground, which would move everything's shadows.
+    seed_random(1);
+    for (usize i = 1; i < objects.length; ++i)
+      objects[i].sphere.center += random_vec3_in(-REFIT_MOTION, REFIT_MOTION);
+    for (usize i = 0; i < bvh.prims.length; ++i)
+      bvh.prims[i].sphere.center = objects[bvh.prim_order[i]].sphere.center;
+    f64 start = get_time_seconds();
+    refit_bvh(&bvh);
+    f64 refit_time = get_time_seconds() - start;
+    f64 refit_cost = get_bvh_cost(bvh);
+
+    u32 mismatches = 0;
+    for (u32 i = 0; i < REFIT_RAYS; ++i) {
+      Ray r(Point3(random_f64_in(-12.0, 12.0), random_f64_in(0.1, 3.0), random_f64_in(-12.0, 12.0)), random_dir());
+      HitRecord expected, got;
+      bool expected_hit = rest.objects.hit(r, 0.001, F64_INF, &expected);
+      bool got_hit = bvh.hit(r, 0.001, F64_INF, &got);
+      if (expected_hit != got_hit || (expected_hit && expected.t != got.t))
+        ++mismatches;
+    }
+    bvh.release();
+    rest.release();
+
+    bool ok = !mismatches;
+    if (!ok)
+      fprintf(stderr, "BVH refit: %u of %u rays hit differently than brute force\n", mismatches, REFIT_RAYS);
+    printf("  \"bvh_refit\": {\"refit_time\": %.6f, \"built_cost\": %.3f, \"refit_cost\": %.3f, \"mismatches\": %u},\n",
+        refit_time, built_cost, refit_cost, mismatches);
+    return ok;
+  }
+
+  const u32 SKEWED_PRIMS = 84;
+  const f64 SKEWED_RATIO = 20.0;
+  const u32 SKEWED_RAYS = 20000;
+  const char* SKEWED_CACHE_PATH = "out/bvh-skewed.bin";
+  const char* CORRUPT_CACHE_PATH = "out/bvh-corrupt.bin";
+
+  // Spheres on the three axes in turn, each one further out on its axis
+  // than all before it, so far that SAH takes them off one at a time:
+  // uncapped, the tree gets about as deep as there are spheres.
+  void build_skewed_scene(Material* mat, Vector<Hittable>* out) {
+    f64 x = 1.0;
+    for (u32 i = 0; i < SKEWED_PRIMS; ++i) {
+      Point3 center;
+      center[i % 3] = x;
+      out->push(Hittable::make_sphere(center, 0.01*x, mat));
+      if (i % 3 == 2)
+        x *= SKEWED_RATIO;
+    }
+  }
+
+  u32 get_tree_depth(const Bvh& bvh, u32 node) {
+    const BvhNode& n = bvh.nodes[node];
+    if (n.count)
+      return 0;
+    return 1 + max(get_tree_depth(bvh, n.offset), get_tree_depth(bvh, n.offset + 1));
+  }
+
+  u32 count_mismatches(const Hittable& flat, const Bvh& bvh, const Ray* rays) {
+    u32 mismatches = 0;
+    for (u32 i = 0; i < SKEWED_RAYS; ++i) {
+      HitRecord expected, got;
+      bool expected_hit = flat.hit(rays[i], 0.001, F64_INF, &expected);
+      bool got_hit = bvh.hit(rays[i], 0.001, F64_INF, &got);
+      if (expected_hit != got_hit || (expected_hit && expected.t != got.t))
+        ++mismatches;
+    }
+    return mismatches;
+  }
+
+  // Writes `bvh` to CORRUPT_CACHE_PATH with one node changed by `corrupt`,
+  // and tells whether load_bvh() still takes it.
+  bool loads_corrupt_cache(const Bvh& bvh, u64 hash, const Hittable& flat, void (*corrupt)(BvhNode*, const Bvh&)) {
+    MappedFile file;
+    if (!file.open(SKEWED_CACHE_PATH))
+      return true;
+    u8* data = (u8*)malloc(file.size);
+    memcpy(data, file.data, file.size);
+    usize nodes_start = file.size - bvh.prims.length*sizeof(u32) - bvh.node_count*sizeof(BvhNode);
+    corrupt((BvhNode*)(data + nodes_start), bvh);
+    file.release();
+    bool written = write_file(CORRUPT_CACHE_PATH, data, file.size);
+    free(data);
+
+    Vector<Hittable> prims;
+    prims.append(flat.scene.data, flat.scene.length);
+    Bvh loaded;
+    bool ok = written && load_bvh(CORRUPT_CACHE_PATH, hash, &prims, &loaded);
+    if (ok)
+      loaded.release();
+    else
+      prims.release();
+    return ok;
+  }
+
+  void corrupt_child(BvhNode* nodes, const Bvh& bvh) {
+    nodes[0].offset = bvh.node_count - 1;
+  }
+
+  void corrupt_leaf(BvhNode* nodes, const Bvh& bvh) {
+    u32 i = 0;
+    while (!nodes[i].count)
+      ++i;
+    nodes[i].count += (u32)bvh.prims.length;
+  }
+
+  void corrupt_cycle(BvhNode* nodes, const Bvh& bvh) {
+    (void)bvh;
+    nodes[nodes[0].offset].count = 0;
+    nodes[nodes[0].offset].offset = 0;
+  }
+
+  // A scene SAH would turn into a chain of a node per prim must still get
+  // a tree shallow enough for the traversal stacks, and find the hits a
+  // brute-force search does. Cache files whose nodes point out of the tree
+  // or its prims must not load.
+  bool check_skewed_bvh() {
+    Material mat = Material::make_lambertian(Color3(0.5, 0.5, 0.5));
+    Hittable flat = Hittable::make_scene();
+    build_skewed_scene(&mat, &flat.scene);
+    Vector<Hittable> prims;
+    prims.append(flat.scene.data, flat.scene.length);
+    u64 hash = hash_bvh_input(prims);
+    Bvh bvh;
+    build_bvh(&prims, &bvh);
+    u32 depth = get_tree_depth(bvh, 0);
+
+    // At the spheres from near by, some passing beside them.
+    Ray* rays = (Ray*)malloc(SKEWED_RAYS * sizeof(Ray));
+    seed_random(SCENE_SEED);
+    for (u32 i = 0; i < SKEWED_RAYS; ++i) {
+      const Sphere& s = flat.scene[random_u64() % SKEWED_PRIMS].sphere;
+      Point3 origin = s.center + s.radius*random_vec3_in(-20.0, 20.0);
+      Vec3 target = s.center + s.radius*random_vec3_in(-2.0, 2.0);
+      rays[i] = Ray(origin, target - origin);
+    }
+    u32 mismatches = count_mismatches(flat, bvh, rays);
+
+    bool saved = make_directory(REFERENCE_DIR) && save_bvh(bvh, hash, SKEWED_CACHE_PATH);
+    Vector<Hittable> cached_prims;
+    cached_prims.append(flat.scene.data, flat.scene.length);
+    Bvh cached;
+    bool loaded = saved && load_bvh(SKEWED_CACHE_PATH, hash, &cached_prims, &cached);
+    u32 cached_mismatches = loaded ? count_mismatches(flat, cached, rays) : 0;
+    bool corrupt_loaded = loads_corrupt_cache(bvh, hash, flat, corrupt_child)
+        || loads_corrupt_cache(bvh, hash, flat, corrupt_leaf)
+        || loads_corrupt_cache(bvh, hash, flat, corrupt_cycle);
+    if (loaded)
+      cached.release();
+    else
+      cached_prims.release();
+    free(rays);
+    bvh.release();
+    flat.release();
+
+    bool ok = depth <= MAX_BVH_DEPTH && !mismatches && loaded && !cached_mismatches && !corrupt_loaded;
+    if (depth > MAX_BVH_DEPTH)
+      fprintf(stderr, "Skewed BVH: depth %u is over %u\n", depth, MAX_BVH_DEPTH);
+    if (mismatches || cached_mismatches)
+      fprintf(stderr, "Skewed BVH: %u built and %u cached of %u rays hit differently than brute force\n",
+          mismatches, cached_mismatches, SKEWED_RAYS);
+    if (!loaded)
+      fprintf(stderr, "Skewed BVH: the cache file did not load\n");
+    if (corrupt_loaded)
+      fprintf(stderr, "Skewed BVH: a corrupt cache file loaded\n");
+    printf("  \"skewed_bvh\": {\"prims\": %u, \"depth\": %u, \"mismatches\": %u, \"cached_mismatches\": %u, \"corrupt_loaded\": %s},\n",
+        SKEWED_PRIMS, depth, mismatches, cached_mismatches, corrupt_loaded ? "true" : "false");
+    return ok;
+  }
+
+  const u32 SEQUENCE_FRAMES = 8;
+  const u32 SEQUENCE_SAMPLES = 4;
+  const u32 SEQUENCE_REFERENCE_SAMPLES = 256;
+  const f64 SEQUENCE_ORBIT = 0.01; // Radians per frame.
+  const f64 SEQUENCE_RISE = 0.05; // Of the metal sphere, per frame.
+
+  // A slow orbit around the demo, with the big metal sphere rising.
+  void animate_test_sequence(u32 frame, FrameState* state, void* arg) {
+    const Camera& start = *(const Camera*)arg;
+    f64 angle = frame * SEQUENCE_ORBIT;
+    Point3 from = start.origin;
+    Point3 orbit(from.x*cos(angle) - from.z*sin(angle), from.y, from.x*sin(angle) + from.z*cos(angle));
+    *state->cam = Camera(orbit, Point3(0.0, 0.0, 0.0), Vec3(0.0, 1.0, 0.0), 20.0, ASPECT_RATIO, 0.0, 10.0);
+    // The metal sphere is the last object of the demo.
+    state->offsets[state->object_count - 1] = Vec3(0.0, frame * SEQUENCE_RISE, 0.0);
+  }
+
+  struct LastFrame {
+    FloatImage img;
+  };
+
+  bool keep_last_frame(u32, const FloatImage& img, void* arg) {
+    LastFrame& last = *(LastFrame*)arg;
+    if (!last.img.pixels)
+      last.img.init(img.w, img.h);
+    for (u32 i = 0; i < img.w*img.h; ++i)
+      last.img.pixels[i] = img.pixels[i];
+    return true;
+  }
+
+  // The same sequence with and without reprojection, judged on its last
+  // frame. Reprojection must cut the error well below what that frame's own
+  // samples give, without the moving sphere leaving a trail.
+  bool check_sequence(const RenderSettings& base) {
+    Scene rest;
+    seed_random(SCENE_SEED);
+    build_scene(&rest);
+    Camera cam = make_camera(0.0);
+
+    SequenceSettings settings;
+    settings.render = base;
+    settings.render.samples = SEQUENCE_SAMPLES;
+    settings.frame_count = SEQUENCE_FRAMES;
+
+    LastFrame reprojected;
+    SequenceStats stats;
+    bool ok = render_sequence(rest.objects.scene, cam, settings, animate_test_sequence, &cam, keep_last_frame, &reprojected, &stats);
+    settings.reproject = false;
+    LastFrame plain;
+    SequenceStats plain_stats;
+    ok = render_sequence(rest.objects.scene, cam, settings, animate_test_sequence, &cam, keep_last_frame, &plain, &plain_stats) && ok;
+
+    // The last frame's scene, rendered on its own.
+    Camera last_cam = cam;
+    usize object_count = rest.objects.scene.length;
+    Vec3* offsets = (Vec3*)calloc(object_count, sizeof(Vec3));
+    FrameState state;
+    state.cam = &last_cam;
+    state.offsets = offsets;
+    state.object_count = (u32)object_count;
+    animate_test_sequence(SEQUENCE_FRAMES - 1, &state, &cam);
+    Vector<Hittable> prims;
+    prims.append(rest.objects.scene.data, object_count);
+    for (usize i = 0; i < object_count; ++i)
+      prims[i].sphere.center += offsets[i];
+    free(offsets);
+    Bvh bvh;
+    build_bvh(&prims, &bvh);
+    Hittable world = Hittable::make_bvh(bvh);
+    RenderSettings ref_settings = base;
+    ref_settings.samples = SEQUENCE_REFERENCE_SAMPLES;
+    ref_settings.seed = REFERENCE_SEED;
+    FloatImage ref = render(last_cam, world, ref_settings);
+    world.release();
+
+    ImageError reprojected_err = compare_images(reprojected.img, ref);
+    ImageError plain_err = compare_images(plain.img, ref);
+    ok = ok && reprojected_err.relmse < plain_err.relmse * 0.6 && stats.refits > 0;
+    if (!ok) {
+      fprintf(stderr, "Sequence: last frame relMSE %g reprojected against %g on its own, %u refits\n",
+          reprojected_err.relmse, plain_err.relmse, stats.refits);
+    }
+    printf("  \"sequence\": {\"frames\": %u, \"samples\": %u, \"refits\": %u, \"rebuilds\": %u, "
+        "\"setup_time\": %.6f, \"render_time\": %.6f, \"elapsed\": %.6f, \"reused\": %.4f,\n",
+        stats.frames, settings.render.samples, stats.refits, stats.rebuilds,
+        stats.setup_time, stats.render_time, stats.elapsed, stats.reused);
+    printf("    \"reprojected_relmse\": %.6g, \"plain_relmse\": %.6g, \"plain_elapsed\": %.6f},\n",
+        reprojected_err.relmse, plain_err.relmse, plain_stats.elapsed);
+    ref.release();
+    plain.img.release();
+    reprojected.img.release();
+    rest.release();
+    return ok;
+  }
+  const u32 SEQUENCE_LONG_FRAMES = 64;
+
+  // What reprojection adds to every frame of a long sequence, over
+  // rendering the frames on their own.
+  bool check_sequence_cost(const RenderSettings& base) {
+    Scene rest;
+    seed_random(SCENE_SEED);
+    build_scene(&rest);
+    Camera cam = make_camera(0.0);
+
+    SequenceSettings settings;
+    settings.render = base;
+    settings.render.samples = SEQUENCE_SAMPLES;
+    settings.frame_count = SEQUENCE_LONG_FRAMES;
+    SequenceStats reprojected;
+    bool ok = render_sequence(rest.objects.scene, cam, settings, animate_test_sequence, &cam, nullptr, nullptr, &reprojected);
+    settings.reproject = false;
+    SequenceStats plain;
+    ok = render_sequence(rest.objects.scene, cam, settings, animate_test_sequence, &cam, nullptr, nullptr, &plain) && ok;
+    rest.release();
+
+    f64 reprojected_frame_time = reprojected.render_time / SEQUENCE_LONG_FRAMES;
+    f64 plain_frame_time = plain.render_time / SEQUENCE_LONG_FRAMES;
+    if (!ok)
+      fprintf(stderr, "Long sequence: stopped early\n");
+    printf("  \"sequence_cost\": {\"frames\": %u, \"reprojected_frame_time\": %.6f, \"plain_frame_time\": %.6f, "
+        "\"overhead\": %.4f, \"reused\": %.4f},\n",
+        SEQUENCE_LONG_FRAMES, reprojected_frame_time, plain_frame_time,
+        reprojected_frame_time / plain_frame_time - 1.0, reprojected.reused);
+    return ok;
+  }
+
+
+  // Not a multiple of any kernel's width, so that every row ends in a tail.
+  const u32 ISA_TONE_MAP_WIDTH = 1917;
+  const u32 ISA_TONE_MAP_HEIGHT = 256;
+  const u32 ISA_RENDER_SAMPLES = 16;
+
+  // Every tone mapping, curve by dither by depth, one after the other.
+  void tone_map_all(const FloatImage& img, u8* out) {
+    const ToneMapSettings::Curve curves[] = {ToneMapSettings::CLAMP, ToneMapSettings::REINHARD, ToneMapSettings::ACES};
+    const ToneMapSettings::Dither dithers[] = {ToneMapSettings::NO_DITHER, ToneMapSettings::ORDERED, ToneMapSettings::NOISE};
+    const u32 depths[] = {8, 16};
+    PackedImage packed;
+    for (u32 c = 0; c < 3; ++c) {
+      for (u32 d = 0; d < 3; ++d) {
+        for (u32 b = 0; b < 2; ++b) {
+          ToneMapSettings settings;
+          settings.curve = curves[c];
+          settings.dither = dithers[d];
+          settings.bits = depths[b];
+          settings.exposure = 0.5f;
+          tone_map(img, settings, &packed);
+          usize size = packed.get_row_size() * packed.h;
+          memcpy(out, packed.data, size);
+          out += size;
+        }
+      }
+    }
+    packed.release();
+  }
+
+  // Every kernel variant this machine runs must give the SSE2 ones' output
+  // to the bit, for tone mapping and for whole renders.
+  bool check_isa_kernels(const TestScene& scene) {
+    const CpuFeatures& features = get_cpu_features();
+    Isa active = get_isa();
+
+    FloatImage img;
+    img.init(ISA_TONE_MAP_WIDTH, ISA_TONE_MAP_HEIGHT);
+    for (u32 y = 0; y < img.h; ++y) {
+      for (u32 x = 0; x < img.w; ++x) {
+        f64 t = ((f64)y * img.w + x) / ((f64)img.w * img.h);
+        img.get(x, y) = Color3(pow(2.0, -14.0 + 16.0*t), t, (x % 7) * 0.2);
+      }
+    }
+    // 18 settings, at most 2 bytes a sample.
+    usize tone_map_size = (usize)img.w * img.h * 3 * 2 * 18;
+    u8* tone_mapped[ISA_COUNT];
+    FloatImage renders[ISA_COUNT];
+    f64 tone_map_times[ISA_COUNT];
+    f64 render_times[ISA_COUNT];
+    RenderSettings settings = scene.settings;
+    settings.samples = ISA_RENDER_SAMPLES;
+
+    bool ok = true;
+    printf("  \"isa\": {\"best\": \"%s\", \"active\": \"%s\", \"variants\": [\n",
+        get_isa_name(features.best_isa), get_isa_name(active));
+    for (u32 i = 0; i <= (u32)features.best_isa; ++i) {
+      Isa isa = (Isa)i;
+      set_isa(isa);
+      tone_mapped[i] = (u8*)calloc(tone_map_size, 1);
+      f64 start = get_time_seconds();
+      tone_map_all(img, tone_mapped[i]);
+      tone_map_times[i] = get_time_seconds() - start;
+
+      start = get_time_seconds();
+      renders[i] = render(scene.cam, *scene.world, settings);
+      render_times[i] = get_time_seconds() - start;
+
+      bool same_tone_map = !memcmp(tone_mapped[i], tone_mapped[0], tone_map_size);
+      bool same_render = same_image(renders[i], renders[0]);
+      if (!same_tone_map || !same_render) {
+        fprintf(stderr, "%s kernels differ from SSE2:%s%s\n", get_isa_name(isa),
+            same_tone_map ? "" : " tone mapping", same_render ? "" : " render");
+        ok = false;
+      }
+      printf("    {\"isa\": \"%s\", \"tone_map_time\": %.6f, \"render_time\": %.6f, "
+          "\"same_tone_map\": %s, \"same_render\": %s}%s\n",
+          get_isa_name(isa), tone_map_times[i], render_times[i],
+          same_tone_map ? "true" : "false", same_render ? "true" : "false",
+          i < (u32)features.best_isa ? "," : "");
+    }
+    printf("  ]},\n");
+
+    for (u32 i = 0; i <= (u32)features.best_isa; ++i) {
+      free(tone_mapped[i]);
+      renders[i].release();
+    }
+    img.release();
+    set_isa(active);
+    return ok;
+  }
+
+  const u32 DEEP_GRID = 8;
+  const u32 DEEP_LAYERS = 32;
+  const u32 DEEP_RAYS = 20000;
+
+  // Layers of overlapping spheres one behind the other, listed back to
+  // front, so that a flat scene finds a closer hit at almost every layer.
+  void build_deep_scene(Material* mat, Vector<Hittable>* out) {
+    for (u32 layer = DEEP_LAYERS; layer-- > 0;) {
+      for (u32 y = 0; y < DEEP_GRID; ++y) {
+        for (u32 x = 0; x < DEEP_GRID; ++x) {
+          Point3 center(x - 0.5*DEEP_GRID, y - 0.5*DEEP_GRID, -2.0 - 2.0*layer);
+          out->push(Hittable::make_sphere(center, 0.6, mat));
+        }
+      }
+    }
+  }
+
+  f64 time_hits(const Hittable& world, const Ray* rays, HitRecord* hits) {
+    f64 start = get_time_seconds();
+    for (u32 i = 0; i < DEEP_RAYS; ++i) {
+      if (!world.hit(rays[i], 0.001, F64_INF, &hits[i]))
+        hits[i].t = -1.0;
+    }
+    return get_time_seconds() - start;
+  }
+
+  // Hits through many surfaces, by brute force and through a BVH, which
+  // must agree on every hit and its surface.
+  bool check_deep_hits() {
+    Material mat = Material::make_lambertian(Color3(0.5, 0.5, 0.5));
+    Hittable flat = Hittable::make_scene();
+    build_deep_scene(&mat, &flat.scene);
+    Vector<Hittable> prims;
+    prims.append(flat.scene.data, flat.scene.length);
+    Bvh bvh;
+    build_bvh(&prims, &bvh);
+    Hittable tree = Hittable::make_bvh(bvh);
+
+    Ray* rays = (Ray*)malloc(DEEP_RAYS * sizeof(Ray));
+    seed_random(SCENE_SEED);
+    for (u32 i = 0; i < DEEP_RAYS; ++i) {
+      Vec3 target(random_f64_in(-0.5*DEEP_GRID, 0.5*DEEP_GRID), random_f64_in(-0.5*DEEP_GRID, 0.5*DEEP_GRID), -2.0);
+      rays[i] = Ray(Point3(0.0, 0.0, 4.0), target - Point3(0.0, 0.0, 4.0));
+    }
+    HitRecord* flat_hits = (HitRecord*)malloc(DEEP_RAYS * sizeof(HitRecord));
+    HitRecord* tree_hits = (HitRecord*)malloc(DEEP_RAYS * sizeof(HitRecord));
+    f64 flat_time = time_hits(flat, rays, flat_hits);
+    f64 tree_time = time_hits(tree, rays, tree_hits);
+
+    u32 mismatches = 0;
+    for (u32 i = 0; i < DEEP_RAYS; ++i) {
+      const HitRecord& a = flat_hits[i];
+      const HitRecord& b = tree_hits[i];
+      if (a.t != b.t || (a.t >= 0.0 && ((a.p - b.p).sqmag() != 0.0 || (a.normal - b.normal).sqmag() != 0.0
+          || a.front_face != b.front_face || a.mat != b.mat)))
+        ++mismatches;
+    }
+
+    // Packets of rays that go different ways, the worst case for them.
+    PrimHit* packet_hits = (PrimHit*)malloc(DEEP_RAYS * sizeof(PrimHit));
+    bool* packet_hit = (bool*)malloc(DEEP_RAYS * sizeof(bool));
+    f64 start = get_time_seconds();
+    for (u32 i = 0; i < DEEP_RAYS; i += RAY_PACKET_SIZE)
+      bvh.intersect_packet(rays + i, min(RAY_PACKET_SIZE, DEEP_RAYS - i), 0.001, F64_INF, packet_hits + i, packet_hit + i);
+    f64 packet_time = get_time_seconds() - start;
+    u32 packet_mismatches = 0;
+    for (u32 i = 0; i < DEEP_RAYS; ++i) {
+      PrimHit single;
+      bool single_hit = bvh.intersect(rays[i], 0.001, F64_INF, &single);
+      if (packet_hit[i] != single_hit || (single_hit && (packet_hits[i].t != single.t || packet_hits[i].prim != single.prim)))
+        ++packet_mismatches;
+    }
+    free(packet_hits);
+    free(packet_hit);
+    free(rays);
+    free(flat_hits);
+    free(tree_hits);
+    tree.release();
+    flat.release();
+
+    bool ok = !mismatches && !packet_mismatches;
+    if (mismatches)
+      fprintf(stderr, "Deep scene: %u of %u rays hit differently through the BVH\n", mismatches, DEEP_RAYS);
+    if (packet_mismatches)
+      fprintf(stderr, "Deep scene: %u of %u rays hit differently in packets\n", packet_mismatches, DEEP_RAYS);
+    printf("  \"deep_hits\": {\"prims\": %u, \"rays\": %u, \"flat_time\": %.6f, \"bvh_time\": %.6f, \"mismatches\": %u, "
+        "\"packet_time\": %.6f, \"packet_mismatches\": %u},\n",
+        DEEP_GRID*DEEP_GRID*DEEP_LAYERS, DEEP_RAYS, flat_time, tree_time, mismatches, packet_time, packet_mismatches);
+    return ok;
+  }
+
+  struct SpecializedRun {
+    f64 generic_time;
+    f64 specialized_time;
+    bool same;
+  };
+
+  SpecializedRun time_specialized(const Camera& cam, const Hittable& world, const RenderSettings& base) {
+    RenderSettings settings = base;
+    SpecializedRun run;
+    settings.specialize = false;
+    f64 start = get_time_seconds();
+    FloatImage generic = render(cam, world, settings);
+    run.generic_time = get_time_seconds() - start;
+    settings.specialize = true;
+    start = get_time_seconds();
+    FloatImage specialized = render(cam, world, settings);
+    run.specialized_time = get_time_seconds() - start;
+    run.same = same_image(generic, specialized);
+    generic.release();
+    specialized.release();
+    return run;
+  }
+
+  // The kernels render() compiles for one camera model, set of materials
+  // and depth must give the images of the general path: the demo through
+  // its thin lens with every material, and the demo in one gray diffuse
+  // through a pinhole.
+  bool check_specialized_kernels(const TestScene& scene) {
+    RenderSettings settings = scene.settings;
+    settings.samples = ISA_RENDER_SAMPLES;
+    SpecializedRun mixed = time_specialized(scene.cam, *scene.world, settings);
+
+    Scene rest;
+    seed_random(SCENE_SEED);
+    build_scene(&rest);
+    Material gray = Material::make_lambertian(Color3(0.5, 0.5, 0.5));
+    Vector<Hittable> prims;
+    prims.append(rest.objects.scene.data, rest.objects.scene.length);
+    for (usize i = 0; i < prims.length; ++i)
+      prims[i].sphere.mat = &gray;
+    Bvh bvh;
+    build_bvh(&prims, &bvh);
+    Hittable world = Hittable::make_bvh(bvh);
+    SpecializedRun diffuse = time_specialized(make_camera(0.0), world, settings);
+    world.release();
+    rest.release();
+
+    bool ok = mixed.same && diffuse.same;
+    if (!mixed.same)
+      fprintf(stderr, "Specialized kernel differs from the general path on the demo\n");
+    if (!diffuse.same)
+      fprintf(stderr, "Specialized kernel differs from the general path on the diffuse demo\n");
+    printf("  \"specialized\": {\"demo\": {\"generic_time\": %.6f, \"specialized_time\": %.6f, \"speedup\": %.3f}, "
+        "\"diffuse\": {\"generic_time\": %.6f, \"specialized_time\": %.6f, \"speedup\": %.3f}},\n",
+        mixed.generic_time, mixed.specialized_time, mixed.generic_time / mixed.specialized_time,
+        diffuse.generic_time, diffuse.specialized_time, diffuse.generic_time / diffuse.specialized_time);
+    return ok;
+  }
+
+  const char* LIVE_NAME = "tests";
+  const u32 LIVE_BAND_HEIGHT = 4;
+  const u32 MAX_LIVE_SNAPSHOTS = 64;
+
+  // Stands in for a viewer in another process: maps the framebuffer by
+  // name and snapshots it until the render is over.
+  struct LiveWatcher {
+    FloatImage snapshots[MAX_LIVE_SNAPSHOTS];
+    u32 snapshot_count;
+    u32 torn_bands;
+    bool opened;
+
+    LiveWatcher() : snapshot_count(0), torn_bands(0), opened(false) {}
+  };
+
+  void watch_live(void* arg) {
+    LiveWatcher& watcher = *(LiveWatcher*)arg;
+    LiveFramebuffer live;
+    watcher.opened = live.open(LIVE_NAME);
+    if (!watcher.opened)
+      return;
+
+    // Once out of slots, the last one keeps the latest snapshot, so that
+    // a slow render still ends on the finished image.
+    FloatImage img;
+    while (true) {
+      LiveProgress progress;
+      live.read_snapshot(&img, &progress);
+      if (watcher.snapshot_count < MAX_LIVE_SNAPSHOTS)
+        ++watcher.snapshot_count;
+      FloatImage& copy = watcher.snapshots[watcher.snapshot_count - 1];
+      copy.init(img.w, img.h);
+      memcpy(copy.pixels, img.pixels, (usize)img.w * img.h * sizeof(Color3));
+      watcher.torn_bands += progress.torn_bands;
+      if (progress.finished && !progress.torn_bands)
+        break;
+      sleep_ms(5);
+    }
+    img.release();
+    live.release();
+  }
+
+  // A row of a snapshot is either not written yet, or the row of the
+  // finished image: a band is never seen half written.
+  bool is_consistent_snapshot(const FloatImage& snapshot, const FloatImage& final) {
+    for (u32 y = 0; y < final.h; ++y) {
+      bool blank = true;
+      bool same = true;
+      for (u32 x = 0; x < final.w; ++x) {
+        const Color3& a = snapshot.get(x, y);
+        const Color3& b = final.get(x, y);
+        blank = blank && a.x == 0.0 && a.y == 0.0 && a.z == 0.0;
+        same = same && a.x == (f32)b.x && a.y == (f32)b.y && a.z == (f32)b.z;
+      }
+      if (!blank && !same)
+        return false;
+    }
+    return true;
+  }
+
+  bool check_live_framebuffer(const TestScene& scene) {
+    RenderSettings settings = scene.settings;
+    settings.samples = ISA_RENDER_SAMPLES;
+    FloatImage plain = render(scene.cam, *scene.world, settings);
+
+    LiveFramebuffer live;
+    if (!live.create(LIVE_NAME, settings.img_w, settings.img_h, settings.samples, LIVE_BAND_HEIGHT)) {
+      plain.release();
+      return false;
+    }
+    LiveWatcher watcher;
+    Thread thread;
+    bool watching = thread.spawn(watch_live, &watcher);
+    settings.live = &live;
+    f64 start = get_time_seconds();
+    FloatImage result = render(scene.cam, *scene.world, settings);
+    f64 render_time = get_time_seconds() - start;
+    live.finish();
+    if (watching)
+      thread.join();
+    live.release();
+
+    u32 inconsistent = 0;
+    for (u32 i = 0; i < watcher.snapshot_count; ++i) {
+      if (!is_consistent_snapshot(watcher.snapshots[i], result))
+        ++inconsistent;
+    }
+    const FloatImage* last = watcher.snapshot_count ? &watcher.snapshots[watcher.snapshot_count - 1] : nullptr;
+    bool complete = last && is_consistent_snapshot(*last, result);
+    for (usize i = 0; complete && i < (usize)result.w * result.h; ++i) {
+      const Color3& c = result.pixels[i];
+      complete = last->pixels[i].x == (f32)c.x && last->pixels[i].y == (f32)c.y && last->pixels[i].z == (f32)c.z;
+    }
+    bool same = same_image(plain, result);
+
+    bool ok = watcher.opened && !inconsistent && complete && same;
+    if (!watcher.opened)
+      fprintf(stderr, "Live framebuffer could not be opened by name\n");
+    if (inconsistent)
+      fprintf(stderr, "Live framebuffer: %u of %u snapshots had half-written bands\n", inconsistent, watcher.snapshot_count);
+    if (!complete)
+      fprintf(stderr, "Live framebuffer: the last snapshot is not the finished image\n");
+    if (!same)
+      fprintf(stderr, "Live framebuffer: publishing changed the image\n");
+    printf("  \"live_framebuffer\": {\"snapshots\": %u, \"torn_bands\": %u, \"render_time\": %.6f, \"inconsistent\": %u},\n",
+        watcher.snapshot_count, watcher.torn_bands, render_time, inconsistent);
+
+    for (u32 i = 0; i < watcher.snapshot_count; ++i)
+      watcher.snapshots[i].release();
+    plain.release();
+    result.release();
+    return ok;
+  }
+
+  const u32 VIEW_COUNT = 8;
+  const f64 VIEW_STEP = 2.0 * PI / 64.0;
+
+  // Views a few degrees apart around the demo, as a turntable would take
+  // them, each compared with rendering it on its own.
+  bool check_multi_view(const TestScene& scene) {
+    RenderSettings settings = scene.settings;
+    settings.samples = ISA_RENDER_SAMPLES;
+    Vector<Camera> cams;
+    for (u32 v = 0; v < VIEW_COUNT; ++v) {
+      f64 angle = v * VIEW_STEP;
+      Point3 from = scene.cam.origin;
+      Point3 orbit(from.x*cos(angle) - from.z*sin(angle), from.y, from.x*sin(angle) + from.z*cos(angle));
+      cams.push(Camera(orbit, Point3(0.0, 0.0, 0.0), Vec3(0.0, 1.0, 0.0), 20.0, ASPECT_RATIO, 0.1, 10.0));
+    }
+
+    FloatImage singles[VIEW_COUNT];
+    f64 start = get_time_seconds();
+    for (u32 v = 0; v < VIEW_COUNT; ++v)
+      singles[v] = render(cams[v], *scene.world, settings);
+    f64 single_time = get_time_seconds() - start;
+
+    FloatImage batch[VIEW_COUNT];
+    start = get_time_seconds();
+    render_views(cams.data, VIEW_COUNT, *scene.world, settings, batch);
+    f64 batch_time = get_time_seconds() - start;
+
+    // The same batch as one job on a shared renderer.
+    FloatImage pooled[VIEW_COUNT];
+    Renderer renderer;
+    RenderRequest request;
+    request.world = scene.world;
+    request.settings = settings;
+    start = get_time_seconds();
+    RenderJob* job = renderer.init() ? renderer.submit_views(request, cams.data, VIEW_COUNT, pooled) : nullptr;
+    bool pool_done = job && renderer.wait(job);
+    f64 pool_time = get_time_seconds() - start;
+    renderer.release();
+
+    u32 mismatches = 0;
+    for (u32 v = 0; v < VIEW_COUNT; ++v) {
+      if (!same_image(singles[v], batch[v]))
+        ++mismatches;
+      if (pool_done && !same_image(singles[v], pooled[v]))
+        ++mismatches;
+      singles[v].release();
+      batch[v].release();
+      pooled[v].release();
+    }
+    cams.release();
+
+    bool ok = !mismatches && pool_done;
+    if (!pool_done)
+      fprintf(stderr, "Multi-view: the renderer did not finish the views\n");
+    if (mismatches)
+      fprintf(stderr, "Multi-view: %u of %u views differ from rendering them one by one\n", mismatches, 2*VIEW_COUNT);
+    printf("  \"multi_view\": {\"views\": %u, \"threads\": %u, \"single_time\": %.6f, \"batch_time\": %.6f, "
+        "\"pool_time\": %.6f, \"speedup\": %.3f, \"mismatches\": %u},\n",
+        VIEW_COUNT, get_cpu_count(), single_time, batch_time, pool_time, single_time / batch_time, mismatches);
+    return ok;
+  }
+
+  const u32 RASTER_FEW_SAMPLES = MAX_GBUFFER_SUBSAMPLES;
+  const u32 RASTER_MANY_SAMPLES = 16*MAX_GBUFFER_SUBSAMPLES;
+  const f64 RASTER_MAX_ERROR_RATIO = 0.5;
+
+  // At depth 1 a pixel is only how much of it sees the sky, all primary
+  // visibility. Samples past the G-buffer's subsamples must still bring it
+  // closer to a traced render, not land on the same positions again.
+  bool check_raster_samples(const Hittable& world, const Camera& cam, const RenderSettings& base) {
+    RenderSettings settings = base;
+    settings.max_depth = 1;
+    settings.samples = REFERENCE_SAMPLES;
+    settings.seed = REFERENCE_SEED;
+    FloatImage ref = render(cam, world, settings);
+
+    settings.seed = RENDER_SEED;
+    settings.raster_primary = true;
+    settings.samples = RASTER_FEW_SAMPLES;
+    FloatImage few = render(cam, world, settings);
+    f64 few_error = compare_images(few, ref).relmse;
+    settings.samples = RASTER_MANY_SAMPLES;
+    FloatImage many = render(cam, world, settings);
+    f64 many_error = compare_images(many, ref).relmse;
+    few.release();
+    many.release();
+    ref.release();
+
+    bool ok = many_error < RASTER_MAX_ERROR_RATIO * few_error;
+    if (!ok)
+      fprintf(stderr, "Raster primary: relMSE %.3g at %u samples is not well below %.3g at %u\n",
+          many_error, RASTER_MANY_SAMPLES, few_error, RASTER_FEW_SAMPLES);
+    printf("  \"raster_samples\": {\"few_samples\": %u, \"few_relmse\": %.6g, \"many_samples\": %u, \"many_relmse\": %.6g},\n",
+        RASTER_FEW_SAMPLES, few_error, RASTER_MANY_SAMPLES, many_error);
+    return ok;
+  }
+
+  // The G-buffer must find the same primary hit as tracing the camera ray
+  // through the whole scene, for every subsample.
+  bool check_gbuffer(const Hittable& world, const Camera& cam, u32 img_w, u32 img_h) {
+    GBuffer gbuffer;
+    f64 start = get_time_seconds();
+    bool built = build_gbuffer(cam, world, img_w, img_h, MAX_GBUFFER_SUBSAMPLES, &gbuffer);
+    f64 build_time = get_time_seconds() - start;
+
+    u64 mismatches = 0;
+    start = get_time_seconds();
+    for (u32 y = 0; built && y < img_h; ++y) {
+      for (u32 x = 0; x < img_w; ++x) {
+        for (u32 i = 0; i < gbuffer.subsamples; ++i) {
+          f64 dx, dy;
+          get_subsample_offset(i, &dx, &dy);
+          Ray r = cam.cast_pinhole_ray(((f64)x + dx) / (img_w-1), ((f64)y + dy) / (img_h-1));
+          HitRecord traced;
+          HitRecord rasterized;
+          bool traced_hit = world.hit(r, 0.001, F64_INF, &traced);
+          bool rasterized_hit = gbuffer.get_hit(x, y, i, r, &rasterized);
+          if (traced_hit != rasterized_hit || (traced_hit && (traced.t != rasterized.t || traced.mat != rasterized.mat)))
+            ++mismatches;
+        }
+      }
+    }
+    f64 trace_time = get_time_seconds() - start;
+    if (!built)
+      fprintf(stderr, "G-buffer refused a pinhole camera\n");
+    else if (mismatches)
+      fprintf(stderr, "G-buffer: %llu subsamples differ from tracing\n", (unsigned long long)mismatches);
+
+    printf("  \"gbuffer\": {\"subsamples\": %u, \"build_time\": %.6f, \"trace_time\": %.6f, \"mismatches\": %llu}\n",
+        gbuffer.subsamples, build_time, trace_time, (unsigned long long)mismatches);
+    gbuffer.release();
+    return built && !mismatches;
+  }
+}
+
+int main(int argc, char** argv) {
+  using namespace sim;
+
+  if (argc == 3 && strcmp(argv[1], FARM_WORKER_ARG) == 0)
+    return run_farm_worker(argv[2]);
+
+  RenderSettings settings;
+  settings.img_w = 120;
+  settings.img_h = (u32)(settings.img_w / ASPECT_RATIO);
+  settings.max_depth = 8;
+  settings.show_progress = false;
+
+  Scene demo;
+  seed_random(SCENE_SEED);
+  build_scene(&demo);
+  u64 demo_hash = hash_scene_input(demo.objects.scene);
+  accelerate_scene(&demo, nullptr);
+
+  MaterialsScene materials;
+  materials.build();
+
+  TextureCache textures;
+  textures.init(SMALL_TEXTURE_CACHE);
+  Texture* texture = write_test_texture() ? textures.open(TEST_TEXTURE_PATH) : nullptr;
+  MaterialsScene textured;
+  textured.build(texture);
+
+  TestScene scenes[] = {
+    TestScene("demo", &demo.objects, demo_hash, make_camera(), settings),
+    TestScene(
+        "materials", &materials.objects, hash_scene_input(materials.objects.scene),
+        Camera(
+            Point3(-2.0, 2.0, 1.0), Point3(0.0, 0.0, -1.0), Vec3(0.0, 1.0, 0.0),
+            40.0, ASPECT_RATIO, 0.0, 1.0),
+        settings),
+    TestScene(
+        "textured", &textured.objects, hash_scene_input(textured.objects.scene),
+        Camera(
+            Point3(0.0, 0.5, 1.5), Point3(0.0, 0.0, -1.0), Vec3(0.0, 1.0, 0.0),
+            50.0, ASPECT_RATIO, 0.0, 1.0),
+        settings),
+  };
+
+  bool ok = true;
+  u32 scene_count = sizeof(scenes) / sizeof(scenes[0]);
+  printf("{\n");
+  printf("  \"reference_samples\": %u,\n", REFERENCE_SAMPLES);
+  printf("  \"scenes\": [\n");
+  for (u32 i = 0; i < scene_count; ++i)
+    ok = run_scene(scenes[i], i+1 == scene_count) && ok;
+  printf("  ],\n");
+  ok = check_denoiser(scenes[0]) && ok;
+  ok = check_tile_protocol() && ok;
+  ok = check_tile_farm() && ok;
+  ok = check_budget(scenes[0]) && ok;
+  ok = check_texture_cache(scenes[2], &textures) && ok;
+  ok = check_radiance_cache(scenes[0]) && ok;
+  ok = check_tiled_image(scenes[0]) && ok;
+  ok = check_tone_map() && ok;
+  ok = check_render_cost(scenes[1]) && ok;
+  ok = check_renderer(scenes[0]) && ok;
+  ok = check_bvh_refit() && ok;
+  ok = check_skewed_bvh() && ok;
+  ok = check_sequence(settings) && ok;
+  ok = check_sequence_cost(settings) && ok;
+  ok = check_isa_kernels(scenes[0]) && ok;
+  ok = check_specialized_kernels(scenes[0]) && ok;
+  ok = check_deep_hits() && ok;
+  ok = check_live_framebuffer(scenes[0]) && ok;
+  ok = check_multi_view(scenes[0]) && ok;
+  ok = check_raster_samples(demo.objects, make_camera(0.0), settings) && ok;
+  ok = check_gbuffer(demo.objects, make_camera(0.0), 300, 200) && ok;
+  printf("}\n");
+
+  demo.release();
+  materials.objects.release();
+  textured.objects.release();
+  textures.release();
+  return ok ? 0 : 1;
 }
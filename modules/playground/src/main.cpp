@@ -1,159 +1,632 @@
+#include <fcntl.h>
+#include <io.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include <simplay/platform/bvh.h>
 #include <simplay/platform/camera.h>
+#include <simplay/platform/clock.h>
 #include <simplay/platform/common.h>
 #include <simplay/platform/core.h>
+#include <simplay/platform/cpu.h>
+#include <simplay/platform/denoise.h>
 #include <simplay/platform/hittable.h>
 #include <simplay/platform/image.h>
-#include <simplay/platform/material.h>
+#include <simplay/platform/live_framebuffer.h>
+#include <simplay/platform/process.h>
+#include <simplay/platform/radiance_cache.h>
 #include <simplay/platform/random.h>
-#include <simplay/platform/ray.h>
+#include <simplay/platform/render.h>
+#include <simplay/platform/render_cost.h>
+#include <simplay/platform/renderer.h>
+#include <simplay/platform/scene.h>
+#include <simplay/platform/sequence.h>
+#include <simplay/platform/texture.h>
+#include <simplay/platform/tile_farm.h>
+#include <simplay/platform/tile_protocol.h>
+#include <simplay/platform/tiled_image.h>
+#include <simplay/platform/tone_map.h>
 #include <simplay/platform/vec3.h>
+#include <simplay/platform/vector.h>
 
 namespace sim {
-  struct Scene {
-    Hittable objects;
+  void write_color3(FILE* out, const Color3& c) {
+    // sqrt for gamma correction (gamma=2.0).
+    i32 ir = (i32)(256.0 * clamp(sqrt(c.x), 0.0, 0.999));
+    i32 ig = (i32)(256.0 * clamp(sqrt(c.y), 0.0, 0.999));
+    i32 ib = (i32)(256.0 * clamp(sqrt(c.z), 0.0, 0.999));
+    fprintf(out, "%d %d %d\n", ir, ig, ib);
+  }
+
+  struct TileContext {
+    const Camera* cam;
+    const Hittable* world;
+  };
 
-    Material ground_mat;
-    Material big1_mat;
-    Material big2_mat;
-    Material big3_mat;
-    Vector<Material> sphere_mats;
+  // Used by worker processes, and by the coordinator once they are all gone.
+  void render_tile(const TileJob& job, f32* pixels, void* arg) {
+    const TileContext& ctx = *(const TileContext*)arg;
 
-    void release() {
-      objects.release();
-      sphere_mats.release();
+    // Whoever renders the tile, it gets the same samples.
+    seed_random(job.seed ^ ((u64)job.id * 0x9E3779B97F4A7C15ull));
+    for (u32 y = 0; y < job.h; ++y) {
+      for (u32 x = 0; x < job.w; ++x) {
+        Color3 pixel = render_pixel(
+            *ctx.cam, *ctx.world, job.x0 + x, job.y0 + y,
+            job.img_w, job.img_h, job.samples, job.max_depth);
+        f32* out = pixels + ((usize)y*job.w + x)*3;
+        out[0] = (f32)pixel.x;
+        out[1] = (f32)pixel.y;
+        out[2] = (f32)pixel.z;
+      }
     }
+  }
+
+  void write_ppm(FILE* out, const FloatImage& img) {
+    fprintf(out, "P3\n%u %u\n255\n", img.w, img.h);
+    for (u32 y = img.h; y > 0; --y) {
+      for (u32 x = 0; x < img.w; ++x)
+        write_color3(out, img.get(x, y-1));
+    }
+  }
+
+  struct PpmRows {
+    FILE* out;
+    u32 w;
+    const ToneMapSettings* tone_map;
+    u8* packed;
   };
 
-  const f64 ASPECT_RATIO = 3.0 / 2.0;
-  const i32 IMG_W = 600;
-  const i32 IMG_H = (i32)(IMG_W / ASPECT_RATIO);
-  const i32 PIXEL_SAMPLES = 1;
-  const i32 MAX_DEPTH = 2;
+  bool write_ppm_row(u32 y, const f32* row, void* arg) {
+    const PpmRows& rows = *(const PpmRows*)arg;
+    if (rows.tone_map) {
+      tone_map_row(row, rows.w, y, *rows.tone_map, rows.packed);
+      usize size = (usize)rows.w * 3 * (rows.tone_map->bits > 8 ? 2 : 1);
+      return fwrite(rows.packed, 1, size, rows.out) == size;
+    }
+
+    for (u32 x = 0; x < rows.w; ++x)
+      write_color3(rows.out, Color3(row[x*3], row[x*3 + 1], row[x*3 + 2]));
+    return !ferror(rows.out);
+  }
 
-  void build_scene(Scene* world) {
-    if (!world)
+  // Same output as write_ppm(), or as a tone-mapped PackedImage, streamed
+  // from the tiles on disk.
+  bool write_ppm(FILE* out, const TiledImage& img, const ToneMapSettings* tone_map) {
+    PpmRows rows;
+    rows.out = out;
+    rows.w = img.w;
+    rows.tone_map = tone_map;
+    rows.packed = nullptr;
+    if (tone_map) {
+      fprintf(out, "P6\n%u %u\n%u\n", img.w, img.h, tone_map->bits > 8 ? 65535u : 255u);
+      rows.packed = (u8*)malloc((usize)img.w * 3 * 2);
+    } else {
+      fprintf(out, "P3\n%u %u\n255\n", img.w, img.h);
+    }
+    bool ok = img.for_each_row(true, write_ppm_row, &rows);
+    free(rows.packed);
+    return ok;
+  }
+
+  void describe_material(const Material* mat, char* out, usize size) {
+    if (!mat) {
+      snprintf(out, size, "sky");
       return;
+    }
+    switch (mat->type) {
+      case Material::LAMBERTIAN: {
+        const Color3& a = mat->lambertian.albedo;
+        snprintf(out, size, "lambertian (%.2f, %.2f, %.2f)%s", a.x, a.y, a.z, mat->lambertian.map.texture ? " textured" : "");
+        break;
+      }
+      case Material::METAL: {
+        const Color3& a = mat->metal.albedo;
+        snprintf(out, size, "metal (%.2f, %.2f, %.2f) fuzz %.2f", a.x, a.y, a.z, mat->metal.fuzz);
+        break;
+      }
+      case Material::DIELECTRIC:
+        snprintf(out, size, "dielectric ior %.2f", mat->dielectric.ior);
+        break;
+      case Material::NONE:
+      default:
+        snprintf(out, size, "none");
+        break;
+    }
+  }
 
-    world->release();
-    world->objects = Hittable::make_scene();
-
-    // Ground.
-    world->ground_mat = Material::make_lambertian(Color3(0.5, 0.5, 0.5));
-    world->objects.scene.push(Hittable::make_sphere(Point3(0.0, -1000.0, 0.0), 1000.0, &world->ground_mat));
-
-    // Small spheres.
-    // We need to pre-allocate to prevent material pointer invalidation.
-    world->sphere_mats.reserve(22 * 22);
-    for (i32 a = -11; a < 11; ++a) {
-      for (i32 b = -11; b < 11; ++b) {
-        Point3 center((f64)a + 0.9*random_f64(), 0.2, (f64)b + 0.9*random_f64());
-        if ((center - Point3(4.0, 0.2, 0.0)).mag() > 0.9) {
-          Material sphere_mat;
-
-          f64 choose_mat = random_f64();
-          if (choose_mat < 0.8) {
-            Color3 albedo = random_vec3() * random_vec3();
-            sphere_mat = Material::make_lambertian(albedo);
-          } else if (choose_mat < 0.95) {
-            Color3 albedo = random_vec3_in(0.5, 1.0);
-            f64 fuzz = random_f64_in(0.0, 0.5);
-            sphere_mat = Material::make_metal(albedo, fuzz);
-          } else {
-            sphere_mat = Material::make_dielectric(1.5);
-          }
-
-          world->sphere_mats.push(sphere_mat);
-          world->objects.scene.push(Hittable::make_sphere(center, 0.2, &world->sphere_mats.back()));
-        }
+  // Every buffer as raw floats and as a heatmap scaled to its 99th
+  // percentile, then the materials that took the most time.
+  bool write_costs(const char* prefix, const CostImages& costs) {
+    struct Buffer {
+      const char* name;
+      const FloatImage* img;
+    };
+    const Buffer buffers[] = {
+      {"cycles", &costs.cycles},
+      {"hit-calls", &costs.hit_calls},
+      {"prim-tests", &costs.prim_tests},
+      {"bounces", &costs.bounces},
+    };
+
+    bool ok = true;
+    char path[1100];
+    for (u32 i = 0; i < sizeof(buffers)/sizeof(buffers[0]) && ok; ++i) {
+      snprintf(path, sizeof(path), "%s-%s.pfm", prefix, buffers[i].name);
+      ok = buffers[i].img->save_pfm(path);
+      if (!ok)
+        break;
+
+      snprintf(path, sizeof(path), "%s-%s.ppm", prefix, buffers[i].name);
+      FILE* out = nullptr;
+      if (fopen_s(&out, path, "wb")) {
+        fprintf(stderr, "Failed to open file: \"%s\"\n", path);
+        ok = false;
+        break;
       }
+      PackedImage heatmap;
+      make_heatmap(*buffers[i].img, get_cost_percentile(*buffers[i].img, 0.99), &heatmap);
+      ok = heatmap.write_ppm(out);
+      heatmap.release();
+      fclose(out);
     }
 
-    // Big spheres.
-    world->big1_mat = Material::make_dielectric(1.5);
-    world->big2_mat = Material::make_lambertian(Color3(0.4, 0.2, 0.1));
-    world->big3_mat = Material::make_metal(Color3(0.7, 0.6, 0.5), 0.0);
-    world->objects.scene.push(Hittable::make_sphere(Point3(0.0, 1.0, 0.0), 1.0, &world->big1_mat));
-    world->objects.scene.push(Hittable::make_sphere(Point3(-4.0, 1.0, 0.0), 1.0, &world->big2_mat));
-    world->objects.scene.push(Hittable::make_sphere(Point3(4.0, 1.0, 0.0), 1.0, &world->big3_mat));
-  }
-
-  Camera make_camera() {
-    Vec3 up(0.0, 1.0, 0.0);
-    Vec3 lookfrom(13.0, 2.0, 3.0);
-    Vec3 lookat(0.0, 0.0, 0.0);
-
-    f64 focus_dist = 10.0;
-    f64 aperture = 0.1;
-    return Camera(lookfrom, lookat, up, 20.0, ASPECT_RATIO, aperture, focus_dist);
-  }
-  
-  Color3 ray_color(const Ray& r, const Hittable& world, i32 depth) {
-    if (depth <= 0)
-      return Color3(0.0, 0.0, 0.0);
-    
-    HitRecord hr;
-    if (!world.hit(r, 0.001, F64_INF, &hr)) {
-      // If no hit, return a background sky gradient.
-      Vec3 unit_dir = normalize(r.dir);
-      f64 t = 0.5 * (unit_dir.y + 1.0);
-      return (1.0-t)*Color3(1.0, 1.0, 1.0) + t*Color3(0.5, 0.7, 1.0);
-    }
-
-    Material* mat = hr.mat ? hr.mat : Material::get_default();
-    Ray scattered;
-    Color3 attenuation;
-    if (!mat->scatter(r, hr, &attenuation, &scattered))
-      return Color3(0.0, 0.0, 0.0);
-    return attenuation * ray_color(scattered, world, depth-1);
-  }
-  
-  void write_color3(FILE* out, const Color3& c) {
-    // sqrt for gamma correction (gamma=2.0).
-    i32 ir = (i32)(256.0 * clamp(sqrt(c.x), 0.0, 0.999));
-    i32 ig = (i32)(256.0 * clamp(sqrt(c.y), 0.0, 0.999));
-    i32 ib = (i32)(256.0 * clamp(sqrt(c.z), 0.0, 0.999));
-    fprintf(out, "%d %d %d\n", ir, ig, ib);
+    RenderCost total = costs.get_total();
+    fprintf(stderr, "Cost: %.3f Gcycles, %llu hit calls, %llu prim tests, %llu bounces\n",
+        (f64)total.cycles * 1e-9, (unsigned long long)total.hit_calls,
+        (unsigned long long)total.prim_tests, (unsigned long long)total.bounces);
+    const MaterialCosts& by_material = costs.by_material;
+    usize shown = by_material.entries.length < 10 ? by_material.entries.length : 10;
+    for (usize i = 0; i < shown; ++i) {
+      const MaterialCost& entry = by_material.entries[i];
+      char name[128];
+      describe_material(entry.mat, name, sizeof(name));
+      fprintf(stderr, "  %5.1f%% cycles, %7.0f cycles/sample, %5.2f bounces/sample: %s\n",
+          total.cycles ? (f64)entry.cost.cycles / (f64)total.cycles * 100.0 : 0.0,
+          (f64)entry.cost.cycles / (f64)entry.samples,
+          (f64)entry.cost.bounces / (f64)entry.samples, name);
+    }
+    if (by_material.entries.length > shown)
+      fprintf(stderr, "  ... %llu more materials\n", (unsigned long long)(by_material.entries.length - shown));
+    return ok;
   }
 
-  FloatImage render(const Camera& cam, const Hittable& world) {
-    FloatImage result;
-    result.init(IMG_W, IMG_H);
+  struct Turntable {
+    Point3 from;
+    f64 aperture;
+    u32 frame_count;
+  };
 
-    printf("P3\n%d %d\n255\n", IMG_W, IMG_H);
-    for (i32 y = IMG_H-1; y > 0; --y) {
-      fprintf(stderr, "\rRendering %.2f%%", (f64)(IMG_H-y) / (IMG_H-1) * 100.0);
-      fflush(stderr);
+  // One turn around the scene over the sequence, with the three big spheres
+  // bobbing out of step.
+  Camera get_turntable_camera(const Turntable& turntable, u32 frame) {
+    f64 angle = 2.0 * PI * frame / turntable.frame_count;
+    Point3 from = turntable.from;
+    Point3 orbit(from.x*cos(angle) - from.z*sin(angle), from.y, from.x*sin(angle) + from.z*cos(angle));
+    return Camera(orbit, Point3(0.0, 0.0, 0.0), Vec3(0.0, 1.0, 0.0), 20.0, ASPECT_RATIO, turntable.aperture, 10.0);
+  }
 
-      for (i32 x = 0; x < IMG_W; ++x) {
-        Color3 pixel(0.0, 0.0, 0.0);
-        for (i32 i = 0; i < PIXEL_SAMPLES; ++i) {
-          f64 u = ((f64)x + random_f64()) / (IMG_W-1);
-          f64 v = ((f64)y + random_f64()) / (IMG_H-1);
-          pixel += ray_color(cam.cast_ray(u, v), world, MAX_DEPTH);
-        }
-        pixel /= PIXEL_SAMPLES;
+  void animate_turntable(u32 frame, FrameState* state, void* arg) {
+    const Turntable& turntable = *(const Turntable*)arg;
+    f64 angle = 2.0 * PI * frame / turntable.frame_count;
+    *state->cam = get_turntable_camera(turntable, frame);
+    // The big spheres are the last objects build_scene() makes.
+    for (u32 k = 0; k < 3 && k < state->object_count; ++k) {
+      f64 bob = 0.25 * (1.0 - cos(2.0*angle + k * 2.0*PI/3.0));
+      state->offsets[state->object_count - 3 + k] = Vec3(0.0, bob, 0.0);
+    }
+  }
 
-        result.get(x, y) = pixel;
-        write_color3(stdout, pixel);
-      }
+  bool write_image(const char* path, const FloatImage& img, const ToneMapSettings* tone_map_settings) {
+    FILE* out = nullptr;
+    if (fopen_s(&out, path, "wb")) {
+      fprintf(stderr, "Failed to open file: \"%s\"\n", path);
+      return false;
     }
-    fprintf(stderr, "\n");
-    return result;
+
+    bool ok;
+    if (tone_map_settings) {
+      PackedImage packed;
+      tone_map(img, *tone_map_settings, &packed);
+      ok = packed.write_ppm(out);
+      packed.release();
+    } else {
+      write_ppm(out, img);
+      ok = !ferror(out);
+    }
+    fclose(out);
+    return ok;
   }
+
+  bool write_frame(u32 frame, const FloatImage& img, void* arg) {
+    char path[64];
+    snprintf(path, sizeof(path), "out/frame-%04u.ppm", frame);
+    return write_image(path, img, (const ToneMapSettings*)arg);
+  }
+
 }
 
-int main() {
+int main(int argc, char** argv) {
   using namespace sim;
 
+  RenderSettings settings;
+  f64 budget_ms = 0.0;
+  bool samples_given = false;
+  bool denoise_result = false;
+  bool worker = false;
+  u32 worker_count = 0;
+  const char* bvh_cache_dir = "out";
+  const char* texture_path = nullptr;
+  u32 texture_cache_mb = 64;
+  bool use_radiance_cache = false;
+  const char* out_of_core_path = nullptr;
+  const char* cost_prefix = nullptr;
+  u32 frame_count = 0;
+  bool reproject = true;
+  const char* live_name = nullptr;
+  u32 view_count = 0;
+  // Without any of the tone mapping options, the output stays a text PPM
+  // with gamma 2.
+  ToneMapSettings tone_map_settings;
+  bool tone_mapped = false;
+  f64 aperture = DEFAULT_APERTURE;
+  for (i32 i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--width") == 0 && i+1 < argc) {
+      settings.img_w = (u32)atoi(argv[++i]);
+      settings.img_h = (u32)(settings.img_w / ASPECT_RATIO);
+    } else if (strcmp(argv[i], "--samples") == 0 && i+1 < argc) {
+      settings.samples = (u32)atoi(argv[++i]);
+      samples_given = true;
+    } else if (strcmp(argv[i], "--depth") == 0 && i+1 < argc) {
+      settings.max_depth = (u32)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--budget-ms") == 0 && i+1 < argc) {
+      budget_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--bvh-cache") == 0 && i+1 < argc) {
+      bvh_cache_dir = argv[++i];
+    } else if (strcmp(argv[i], "--no-bvh-cache") == 0) {
+      bvh_cache_dir = nullptr;
+    } else if (strcmp(argv[i], "--texture") == 0 && i+1 < argc) {
+      texture_path = argv[++i];
+    } else if (strcmp(argv[i], "--texture-cache-mb") == 0 && i+1 < argc) {
+      texture_cache_mb = (u32)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--make-texture") == 0 && i+2 < argc) {
+      // Converts a PFM image into a tiled texture, then exits.
+      FloatImage img;
+      bool ok = img.load_pfm(argv[i+1]) && write_texture(argv[i+2], img);
+      img.release();
+      return ok ? 0 : 1;
+    } else if (strcmp(argv[i], "--pinhole") == 0) {
+      aperture = 0.0;
+    } else if (strcmp(argv[i], "--raster-primary") == 0) {
+      settings.raster_primary = true;
+    } else if (strcmp(argv[i], "--radiance-cache") == 0) {
+      use_radiance_cache = true;
+    } else if (strcmp(argv[i], "--out-of-core") == 0 && i+1 < argc) {
+      // Keeps the framebuffer in this file rather than in memory.
+      out_of_core_path = argv[++i];
+    } else if (strcmp(argv[i], "--cost") == 0 && i+1 < argc) {
+      // Writes the per-pixel cost buffers next to this path prefix.
+      cost_prefix = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0 && i+1 < argc) {
+      frame_count = (u32)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--no-reproject") == 0) {
+      reproject = false;
+    } else if (strcmp(argv[i], "--views") == 0 && i+1 < argc) {
+      // Renders this many turntable angles of the still scene in one batch.
+      view_count = (u32)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--live") == 0 && i+1 < argc) {
+      // Shares the framebuffer under this name as it renders, for the
+      // snapshot tool or a viewer to read.
+      live_name = argv[++i];
+    } else if (strcmp(argv[i], "--tonemap") == 0 && i+1 < argc) {
+      const char* curve = argv[++i];
+      if (strcmp(curve, "clamp") == 0) {
+        tone_map_settings.curve = ToneMapSettings::CLAMP;
+      } else if (strcmp(curve, "reinhard") == 0) {
+        tone_map_settings.curve = ToneMapSettings::REINHARD;
+      } else if (strcmp(curve, "aces") == 0) {
+        tone_map_settings.curve = ToneMapSettings::ACES;
+      } else {
+        fprintf(stderr, "Unknown tone curve: \"%s\"\n", curve);
+        return 1;
+      }
+      tone_mapped = true;
+    } else if (strcmp(argv[i], "--exposure") == 0 && i+1 < argc) {
+      tone_map_settings.exposure = (f32)atof(argv[++i]);
+      tone_mapped = true;
+    } else if (strcmp(argv[i], "--dither") == 0 && i+1 < argc) {
+      const char* dither = argv[++i];
+      if (strcmp(dither, "ordered") == 0) {
+        tone_map_settings.dither = ToneMapSettings::ORDERED;
+      } else if (strcmp(dither, "noise") == 0) {
+        tone_map_settings.dither = ToneMapSettings::NOISE;
+      } else {
+        fprintf(stderr, "Unknown dither: \"%s\"\n", dither);
+        return 1;
+      }
+      tone_mapped = true;
+    } else if (strcmp(argv[i], "--bits") == 0 && i+1 < argc) {
+      tone_map_settings.bits = (u32)atoi(argv[++i]);
+      if (tone_map_settings.bits != 8 && tone_map_settings.bits != 16) {
+        fprintf(stderr, "Only 8 or 16 bits per sample are supported\n");
+        return 1;
+      }
+      tone_mapped = true;
+    } else if (strcmp(argv[i], "--denoise") == 0) {
+      denoise_result = true;
+    } else if (strcmp(argv[i], "--isa") == 0 && i+1 < argc) {
+      const char* name = argv[++i];
+      Isa isa;
+      if (!parse_isa(name, &isa) || !set_isa(isa)) {
+        fprintf(stderr, "Unsupported instruction set: \"%s\" (up to %s here)\n",
+            name, get_isa_name(get_cpu_features().best_isa));
+        return 1;
+      }
+    } else if (strcmp(argv[i], "--worker") == 0) {
+      worker = true;
+    } else if (strcmp(argv[i], "--workers") == 0 && i+1 < argc) {
+      worker_count = (u32)atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "Unknown argument: \"%s\"\n", argv[i]);
+      return 1;
+    }
+  }
+  if (settings.img_w < 2 || settings.img_h < 2 || !settings.samples) {
+    fprintf(stderr, "Invalid render settings\n");
+    return 1;
+  }
+  if (denoise_result && (worker_count || budget_ms > 0.0)) {
+    fprintf(stderr, "--denoise is not supported with --workers or --budget-ms yet\n");
+    return 1;
+  }
+  if (settings.raster_primary && (worker_count || budget_ms > 0.0)) {
+    fprintf(stderr, "--raster-primary is not supported with --workers or --budget-ms yet\n");
+    return 1;
+  }
+  if (out_of_core_path && (worker_count || budget_ms > 0.0 || denoise_result || settings.raster_primary)) {
+    fprintf(stderr, "--out-of-core is not supported with --workers, --budget-ms, --denoise or --raster-primary yet\n");
+    return 1;
+  }
+  if (cost_prefix && (worker_count || budget_ms > 0.0 || out_of_core_path)) {
+    fprintf(stderr, "--cost is not supported with --workers, --budget-ms or --out-of-core yet\n");
+    return 1;
+  }
+  if (use_radiance_cache && worker_count) {
+    fprintf(stderr, "--radiance-cache is not supported with --workers yet\n");
+    return 1;
+  }
+  if (frame_count && (worker_count || budget_ms > 0.0 || out_of_core_path || cost_prefix || denoise_result || use_radiance_cache)) {
+    fprintf(stderr, "--frames is not supported with --workers, --budget-ms, --out-of-core, --cost, --denoise or --radiance-cache yet\n");
+    return 1;
+  }
+  if (live_name && (worker_count || budget_ms > 0.0 || out_of_core_path || frame_count)) {
+    fprintf(stderr, "--live is not supported with --workers, --budget-ms, --out-of-core or --frames yet\n");
+    return 1;
+  }
+  if (view_count && (worker_count || budget_ms > 0.0 || out_of_core_path || cost_prefix || denoise_result || frame_count || live_name)) {
+    fprintf(stderr, "--views is not supported with --workers, --budget-ms, --out-of-core, --cost, --denoise, --frames or --live yet\n");
+    return 1;
+  }
+  if (settings.raster_primary && aperture != 0.0)
+    fprintf(stderr, "Thin-lens camera, primary rays are traced (see --pinhole)\n");
+  // Binary PPM must not have its newlines translated.
+  if (tone_mapped)
+    _setmode(_fileno(stdout), _O_BINARY);
+  // Within a budget, the sample count is only a cap.
+  if (budget_ms > 0.0 && !samples_given)
+    settings.samples = 0xFFFFFFFF;
+
+  RadianceCache radiance;
+  if (use_radiance_cache) {
+    radiance.init(RadianceCacheSettings());
+    settings.radiance_cache = &radiance;
+  }
+
+  TextureCache textures;
+  Texture* texture = nullptr;
+  if (texture_path) {
+    textures.init((usize)texture_cache_mb << 20);
+    texture = textures.open(texture_path);
+    if (!texture)
+      return 1;
+  }
+
   Scene world;
-  build_scene(&world);
+  seed_random(SCENE_SEED);
+  build_scene(&world, texture);
+  if (frame_count) {
+    Turntable turntable;
+    turntable.from = make_camera(aperture).origin;
+    turntable.aperture = aperture;
+    turntable.frame_count = frame_count;
+    SequenceSettings sequence;
+    sequence.render = settings;
+    sequence.render.show_progress = false;
+    sequence.frame_count = frame_count;
+    sequence.reproject = reproject;
+    SequenceStats stats;
+    bool ok = render_sequence(
+        world.objects.scene, make_camera(aperture), sequence, animate_turntable, &turntable,
+        write_frame, tone_mapped ? &tone_map_settings : nullptr, &stats);
+    fprintf(stderr, "%u frames in %.3f s, %.1f ms per frame; setup %.3f ms per frame, %u refits, %u rebuilds, %.1f%% of pixels reused\n",
+        stats.frames, stats.elapsed, stats.elapsed / (stats.frames ? stats.frames : 1) * 1000.0,
+        stats.setup_time / (stats.frames ? stats.frames : 1) * 1000.0, stats.refits, stats.rebuilds, stats.reused * 100.0);
+    world.release();
+    textures.release();
+    return ok ? 0 : 1;
+  }
+  BvhStats bvh_stats = accelerate_scene(&world, bvh_cache_dir);
+  Camera cam = make_camera(aperture);
+
+  TileContext ctx;
+  ctx.cam = &cam;
+  ctx.world = &world.objects;
+  if (worker) {
+    // Our standard output is the channel to the coordinator.
+    Channel channel = Channel::make_std();
+    serve_tiles(&channel, render_tile, &ctx);
+    world.release();
+    textures.release();
+    return 0;
+  }
+
+  fprintf(stderr, "Kernels: %s\n", get_isa_name(get_isa()));
+  if (bvh_stats.from_cache) {
+    fprintf(stderr, "BVH: loaded %u nodes from cache in %.3f ms\n",
+        bvh_stats.node_count, bvh_stats.load_time * 1000.0);
+  } else {
+    fprintf(stderr, "BVH: built %u nodes in %.3f ms, saved in %.3f ms\n",
+        bvh_stats.node_count, bvh_stats.build_time * 1000.0, bvh_stats.save_time * 1000.0);
+  }
+
+  if (out_of_core_path) {
+    TiledImage tiled;
+    bool ok = tiled.init(out_of_core_path, settings.img_w, settings.img_h)
+        && render_tiled(cam, world.objects, settings, &tiled)
+        && write_ppm(stdout, tiled, tone_mapped ? &tone_map_settings : nullptr);
+    tiled.release();
+    world.release();
+    textures.release();
+    radiance.release();
+    return ok ? 0 : 1;
+  }
+
+  if (view_count) {
+    Turntable turntable;
+    turntable.from = cam.origin;
+    turntable.aperture = aperture;
+    turntable.frame_count = view_count;
+    Vector<Camera> cams;
+    for (u32 v = 0; v < view_count; ++v)
+      cams.push(get_turntable_camera(turntable, v));
+    FloatImage* views = (FloatImage*)malloc(view_count * sizeof(FloatImage));
+    for (u32 v = 0; v < view_count; ++v)
+      views[v] = FloatImage();
+    // The views share the renderer's workers as one job.
+    Renderer renderer;
+    RenderRequest request;
+    request.world = &world.objects;
+    request.settings = settings;
+    f64 start = get_time_seconds();
+    RenderJob* job = renderer.init() ? renderer.submit_views(request, cams.data, view_count, views) : nullptr;
+    bool rendered = job && renderer.wait(job);
+    f64 elapsed = get_time_seconds() - start;
+    renderer.release();
+    if (rendered)
+      fprintf(stderr, "%u views in %.3f s, %.1f ms per view\n", view_count, elapsed, elapsed / view_count * 1000.0);
+    else
+      fprintf(stderr, "Failed to render the views\n");
+
+    bool ok = rendered;
+    for (u32 v = 0; v < view_count; ++v) {
+      char path[64];
+      snprintf(path, sizeof(path), "out/view-%04u.ppm", v);
+      if (rendered)
+        ok = write_image(path, views[v], tone_mapped ? &tone_map_settings : nullptr) && ok;
+      views[v].release();
+    }
+    free(views);
+    cams.release();
+    world.release();
+    textures.release();
+    radiance.release();
+    return ok ? 0 : 1;
+  }
+
+  AovImages aovs;
+  CostImages costs;
+  FloatImage result;
+  if (worker_count) {
+    char exe_path[1024];
+    char cache_arg[1100];
+    char texture_arg[1100];
+    char cmdline[3300];
+    if (!get_executable_path(exe_path, sizeof(exe_path))) {
+      fprintf(stderr, "Failed to find the playground executable\n");
+      return 1;
+    }
+    if (bvh_cache_dir)
+      snprintf(cache_arg, sizeof(cache_arg), "--bvh-cache \"%s\"", bvh_cache_dir);
+    else
+      snprintf(cache_arg, sizeof(cache_arg), "--no-bvh-cache");
+    texture_arg[0] = '\0';
+    if (texture_path) {
+      snprintf(texture_arg, sizeof(texture_arg), " --texture \"%s\" --texture-cache-mb %u",
+          texture_path, texture_cache_mb);
+    }
+    // Workers run the kernels we do, so that a forced --isa holds for them.
+    snprintf(cmdline, sizeof(cmdline), "\"%s\" --worker --isa %s %s%s%s",
+        exe_path, get_isa_name(get_isa()), cache_arg, texture_arg, aperture == 0.0 ? " --pinhole" : "");
 
-  FloatImage result = render(make_camera(), world.objects);
+    TileFarmSettings farm;
+    farm.worker_cmdline = cmdline;
+    farm.worker_count = worker_count;
+    farm.samples = settings.samples;
+    farm.max_depth = settings.max_depth;
+    farm.seed = settings.seed;
+    result.init(settings.img_w, settings.img_h);
+    farm_tiles(farm, render_tile, &ctx, &result);
+  } else if (budget_ms > 0.0) {
+    BudgetReport report;
+    result = render_within_budget(cam, world.objects, settings, budget_ms / 1000.0, &report);
+    fprintf(stderr,
+        "%u passes in %.1f ms (budget %.1f ms), spp min %u avg %.2f max %u\n",
+        report.passes, report.elapsed * 1000.0, budget_ms,
+        report.min_spp, report.avg_spp, report.max_spp);
+  } else {
+    LiveFramebuffer live;
+    if (live_name) {
+      if (!live.create(live_name, settings.img_w, settings.img_h, settings.samples))
+        return 1;
+      settings.live = &live;
+    }
+    result = render(cam, world.objects, settings, denoise_result ? &aovs : nullptr, cost_prefix ? &costs : nullptr);
+    if (live_name) {
+      // Readers that have the segment open keep it after we let go.
+      live.finish();
+      settings.live = nullptr;
+    }
+    live.release();
+  }
+  // The breakdown names the materials, which go with the scene.
+  if (cost_prefix && !write_costs(cost_prefix, costs))
+    return 1;
+  costs.release();
   world.release();
 
+  if (texture) {
+    TextureCacheStats stats = textures.get_stats();
+    fprintf(stderr, "Texture cache: %.2f%% hits over %llu lookups, %llu tiles loaded, %llu evicted\n",
+        stats.get_hit_rate() * 100.0, (unsigned long long)stats.lookups,
+        (unsigned long long)stats.loads, (unsigned long long)stats.evictions);
+  }
+  textures.release();
+
+  if (use_radiance_cache) {
+    RadianceCacheStats stats = radiance.get_stats();
+    fprintf(stderr, "Radiance cache: %.2f%% hits over %llu lookups, %llu records\n",
+        stats.get_hit_rate() * 100.0, (unsigned long long)stats.lookups,
+        (unsigned long long)stats.records);
+  }
+  radiance.release();
+
+  if (denoise_result) {
+    FloatImage denoised;
+    denoise(result, aovs, DenoiseSettings(), &denoised);
+    result.release();
+    result = denoised;
+    aovs.release();
+  }
+
+  if (tone_mapped) {
+    PackedImage packed;
+    tone_map(result, tone_map_settings, &packed);
+    packed.write_ppm(stdout);
+    packed.release();
+  } else {
+    write_ppm(stdout, result);
+  }
   result.save_png("out/result.png");
   result.release();
 }
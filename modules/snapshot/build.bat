@@ -0,0 +1,23 @@
+@echo off
+
+rem This script should not be used directly, please use "build-snapshot.bat"
+rem in the source root instead.
+
+set "compiler_options="
+if "%~1" == "debug" (
+  set "compiler_options=/Zi"
+)
+
+echo snapshot
+
+mkdir build 2>NUL
+mkdir build\snapshot 2>NUL
+pushd build
+cl^
+ /nologo /W4 /WX /Fo"snapshot\\" %compiler_options%^
+ /I"..\include" "%~dp0src\main.cpp" platform.lib^
+ /Fe"snapshot.exe" /link /NOLOGO
+popd
+
+set "compiler_options="
+goto :eof
@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <simplay/platform/clock.h>
+#include <simplay/platform/core.h>
+#include <simplay/platform/file_map.h>
+#include <simplay/platform/image.h>
+#include <simplay/platform/live_framebuffer.h>
+
+// Reference reader for the live framebuffer of a render started with
+// `playground --live NAME`: maps it and writes what it shows to PFM files
+// every so often, until the render is over.
+
+namespace sim {
+  struct SnapshotSettings {
+    const char* name;
+    const char* out_prefix;
+    u32 interval_ms;
+    // 0 keeps going until the render is over.
+    u32 max_count;
+    // How long to wait for the render to create its framebuffer.
+    u32 wait_ms;
+
+    SnapshotSettings()
+        : name(nullptr), out_prefix("out/live"), interval_ms(1000), max_count(0), wait_ms(10000) {}
+  };
+
+  bool open_live(const SnapshotSettings& settings, LiveFramebuffer* live) {
+    f64 start = get_time_seconds();
+    while (!live->open(settings.name)) {
+      if ((get_time_seconds() - start) * 1000.0 >= settings.wait_ms) {
+        fprintf(stderr, "No live framebuffer \"%s\"\n", settings.name);
+        return false;
+      }
+      sleep_ms(50);
+    }
+    return true;
+  }
+}
+
+int main(int argc, char** argv) {
+  using namespace sim;
+
+  SnapshotSettings settings;
+  for (i32 i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--out") == 0 && i+1 < argc) {
+      settings.out_prefix = argv[++i];
+    } else if (strcmp(argv[i], "--interval-ms") == 0 && i+1 < argc) {
+      settings.interval_ms = (u32)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--count") == 0 && i+1 < argc) {
+      settings.max_count = (u32)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--wait-ms") == 0 && i+1 < argc) {
+      settings.wait_ms = (u32)atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && !settings.name) {
+      settings.name = argv[i];
+    } else {
+      fprintf(stderr, "Unknown argument: \"%s\"\n", argv[i]);
+      return 1;
+    }
+  }
+  if (!settings.name) {
+    fprintf(stderr, "Usage: snapshot NAME [--out PREFIX] [--interval-ms MS] [--count N] [--wait-ms MS]\n");
+    return 1;
+  }
+  if (strncmp(settings.out_prefix, "out/", 4) == 0 && !make_directory("out"))
+    return 1;
+
+  LiveFramebuffer live;
+  if (!open_live(settings, &live))
+    return 1;
+  fprintf(stderr, "Watching \"%s\": %ux%u, %u bands, %u spp\n", settings.name,
+      live.header->w, live.header->h, live.header->band_count, live.header->samples);
+
+  FloatImage img;
+  bool ok = true;
+  for (u32 count = 0; !settings.max_count || count < settings.max_count; ++count) {
+    f64 start = get_time_seconds();
+    LiveProgress progress;
+    live.read_snapshot(&img, &progress);
+    f64 read_time = get_time_seconds() - start;
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s-%04u.pfm", settings.out_prefix, count);
+    ok = img.save_pfm(path);
+    fprintf(stderr, "%s: %u of %u bands (%.1f%%), %u torn, read in %.3f ms%s\n",
+        path, progress.bands_done, progress.band_count, 100.0 * progress.bands_done / progress.band_count,
+        progress.torn_bands, read_time * 1000.0, progress.finished ? ", finished" : "");
+    if (!ok || (progress.finished && !progress.torn_bands))
+      break;
+    sleep_ms(settings.interval_ms);
+  }
+
+  img.release();
+  live.release();
+  return ok ? 0 : 1;
+}